@@ -45,6 +45,8 @@ int app_init(void)
 	/* Configure lun callbacks */
 	unit->rd         = scsi_rd;
 	unit->cmd_vendor = scsi_vendor;
+	/* Reads use mem_read(), can fill USB packet memory directly */
+	unit->perm      |= SCSI_PERM_RD_DIRECT;
 	/* Initialize lun format */
 	unit->capacity = 131072;
 	unit->state    = 1;
@@ -136,7 +138,7 @@ void (*log_print)(uint level, const char *s, ...);
 u32  (*time_now)(tm_t *timeval); 
 int  (*time_since)(u32 ref);
 int  (*mem_read) (uint nid, u32 addr, uint len, u8 *buffer);
-lun *(*scsi_lun_get)(int pos);
+lun *(*scsi_lun_get)(uint pos);
 
 /**
  * @brief Initialize API mapped functions
@@ -156,6 +158,6 @@ static void api_init(void)
 	t_addr = *(u32*)(API_BASE + 0x10);
 	mem_read = (int(*)(uint,u32,uint,u8*))(*(u32*)(t_addr+0x04));
 	t_addr = *(u32*)(API_BASE + 0x14);
-	scsi_lun_get = (lun*(*)(int))(*(u32*)(t_addr + 0x00));
+	scsi_lun_get = (lun*(*)(uint))(*(u32*)(t_addr + 0x00));
 }
 /* EOF */
@@ -24,6 +24,19 @@ typedef struct mem_node_s
 	u32   cache_addr;
 	u8    cache_buffer[4096];
 	uint  speed;
+	u8    read_cmd;
+	u8    read_dummy;
+	uint  read_speed;
+	/* Write planner statistics (see mem_write) */
+	u32   st_erase;      /* Sectors erased                            */
+	u32   st_erase_skip; /* Erases avoided (only 1 -> 0 bits changes)  */
+	u32   st_page;       /* Pages programmed                          */
+	u32   st_page_skip;  /* Pages not programmed (unchanged or blank) */
+	/* Pre-erase pool statistics (see mem_preerase) */
+	u32   st_pool;       /* Free sectors already erased (pool depth)  */
+	u32   st_pre_erase;  /* Sectors erased in background              */
+	u32   st_pool_hit;   /* Sector updates into a pre-erased sector   */
+	u32   st_pool_miss;  /* Sector updates that need read and compare */
 } mem_node;
 
 //mem_node *mem_get_node(uint nid);
@@ -17,22 +17,29 @@
 #define SCSI_H
 #include "types.h"
 
+#define SCSI_PERM_RD_DIRECT (1 << 27) /* rd() can fill a 32 bits only buffer */
+
 typedef struct lun_s
 {
 	uint state;
 	uint capacity; // Number of 512 bytes sectors
 	uint writable;
 	uint perm;     // Permission mask
-	/* LUN functions */
+	/* LUN functions (wr and flush return 1 when medium is busy) */
 	int  (*rd)(u32 addr, u32 len, u8 *data);
 	int  (*wr)(u32 addr, u32 len, u8 *data);
 	int  (*wr_complete)(void);
-	int  (*wr_preload)(u32 addr);
+	int  (*wr_preload)(u32 addr, u32 len);
 	/* LUN vendor extension */
 	int  (*cmd_vendor)(struct lun_s *unit, u32 *ctx, u8 *cb, uint len);
+	/* Write cached data to medium (SYNCHRONIZE CACHE) */
+	int  (*flush)(void);
+	/* Declare blocks as no more used (UNMAP), address and length in bytes */
+	int  (*unmap)(u32 addr, u32 len);
+	void *priv;    // Free for the LUN owner
 } lun;
 
-extern lun *(*scsi_lun_get)(int pos);
+extern lun *(*scsi_lun_get)(uint pos);
 
 #endif
 /* EOF */
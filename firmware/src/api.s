@@ -54,8 +54,8 @@ libc_tbl:
 	.long strncpy
 	.long atoi
 	.long itoa
-	.long 0 // Rfu    
-	.long 0 // Rfu
+	.long memmove
+	.long memcmp
 	.long 0 // Rfu
 
 /* Table of time functions */
@@ -79,9 +79,9 @@ log_tbl:
 /* Table of memory abstraction layer functions */
 mem_tbl:
 	.long mem_get_node
-	.long mem_read
-	.long mem_write
-	.long mem_erase
+	.long app_mem_read
+	.long app_mem_write
+	.long app_mem_erase
 
 /* Table of SCSI over MSC functions */
 msc_scsi_tbl:
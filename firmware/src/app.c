@@ -14,12 +14,47 @@
  * This program is distributed WITHOUT ANY WARRANTY.
  */
 #include "app.h"
+#include "ftl.h"
 #include "libc.h"
 #include "log.h"
 #include "mem.h"
+#include "rahead.h"
+#include "rcache.h"
 #include "scsi.h"
 #include "time.h"
 #include "types.h"
+#include "volume.h"
+#include "wcache.h"
+#include "work.h"
+
+/* Modified sectors are written to flash after this delay without write (ms),
+ * zero to keep them into cache until the host synchronize it */
+#ifndef APP_WCACHE_IDLE
+#define APP_WCACHE_IDLE 500
+#endif
+/* Free sectors are erased in background after this delay without host
+ * access (ms), zero to disable the pre-erase */
+#ifndef APP_PREERASE_IDLE
+#define APP_PREERASE_IDLE 200
+#endif
+/* Flash chips are used as one volume, striped by units of this size */
+#define APP_VOLUME_MODE VOLUME_STRIPE
+#define APP_VOLUME_UNIT VOLUME_UNIT_SZ
+/* Define this to expose each flash chip as a separate drive (one LUN) */
+#undef APP_LUN_PER_CHIP
+/* Define this to store data through the flash translation layer (see ftl.c),
+ * the LUN is smaller than the volume and the previous content is lost */
+#undef APP_FTL
+
+#if defined(APP_FTL) && defined(APP_LUN_PER_CHIP)
+#error "APP_FTL use the whole volume as one LUN"
+#endif
+
+#ifdef APP_LUN_PER_CHIP
+#define APP_LUN_COUNT MEM_NODE_COUNT
+#else
+#define APP_LUN_COUNT 1
+#endif
 
 /* Declaration of global custom app exposed functions */
 void (*app_periodic)(void);
@@ -29,8 +64,12 @@ static int  is_fct_valid(u32 addr);
 static void default_init(void);
 static void default_periodic(void);
 static void default_reset(void);
+static int  default_volume(void);
 static void dummy_periodic(void);
 
+static int app_flush_work = -1;
+static int app_preerase_work = -1;
+
 /**
  * @brief Initialize cutom app
  *
@@ -91,6 +130,50 @@ void app_init(void)
 	log_print(LOG_INF, "  Vector reset:    %8x\n", app_reset);
 }
 
+/**
+ * @brief Read memory, for custom apps (see mem_read)
+ *
+ * Custom apps call the memory functions from the main loop : deferred work
+ * (SCSI, memory jobs) is delayed during the access, see work_lock.
+ */
+int app_mem_read(uint nid, u32 addr, uint len, u8 *buffer)
+{
+	int result;
+
+	work_lock();
+	result = mem_read(nid, addr, len, buffer);
+	work_unlock();
+	return(result);
+}
+
+/**
+ * @brief Write memory, for custom apps (see mem_write and app_mem_read)
+ *
+ */
+int app_mem_write(uint nid, u32 addr, uint len, u8 *buffer)
+{
+	int result;
+
+	work_lock();
+	result = mem_write(nid, addr, len, buffer);
+	work_unlock();
+	return(result);
+}
+
+/**
+ * @brief Erase memory, for custom apps (see mem_erase and app_mem_read)
+ *
+ */
+int app_mem_erase(uint nid, u32 addr, uint len)
+{
+	int result;
+
+	work_lock();
+	result = mem_erase(nid, addr, len);
+	work_unlock();
+	return(result);
+}
+
 /**
  * @brief Stop the custom app and desactivate default LUN
  *
@@ -98,16 +181,26 @@ void app_init(void)
 int app_stop(void)
 {
 	lun *scsi_lun;
+	uint i;
 
 	app_periodic = dummy_periodic;
 
-	/* Disable default SCSI LUN */
-	scsi_lun = scsi_lun_get(0);
-	scsi_lun->state = 0;
-	scsi_lun->rd    = 0;
-	scsi_lun->wr    = 0;
-	scsi_lun->wr_complete = 0;
-	scsi_lun->wr_preload  = 0;
+	/* Disable default SCSI LUNs */
+	for (i = 0; i < APP_LUN_COUNT; i++)
+	{
+		scsi_lun = scsi_lun_get(i);
+		scsi_lun->state = 0;
+		scsi_lun->rd    = 0;
+		scsi_lun->wr    = 0;
+		scsi_lun->wr_complete = 0;
+		scsi_lun->wr_preload  = 0;
+		scsi_lun->flush       = 0;
+		scsi_lun->unmap       = 0;
+		scsi_lun->priv        = 0;
+	}
+
+	/* Write modified sectors still into cache */
+	work_post(app_flush_work);
 
 	log_print(LOG_WRN, "App: Custom application is stop stopped\n");
 
@@ -140,9 +233,20 @@ static int is_fct_valid(u32 addr)
 int default_lun_rd(u32 addr, u32 len, u8 *data);
 int default_lun_wr(u32 addr, u32 len, u8 *data);
 int default_lun_wr_complete(void);
-int default_lun_wr_preload(u32 addr);
+int default_lun_wr_preload(u32 addr, u32 len);
+int default_lun_flush(void);
+int default_lun_unmap(u32 addr, u32 len);
+static void default_flush(void);
+static void default_preerase(void);
+static u32  default_lun_base(void);
 
 static u32 app_tm_ref;
+static u32 app_wr_tm;  /* Time of the last write into cache */
+static u32 app_io_tm;  /* Time of the last host access (read or write) */
+static u32 app_pe_tm;  /* Time of the last pre-erase request */
+static vu8 app_wr_dirty;
+static vu8 app_flush_retry; /* Flush not complete (memory busy), run it again */
+static u8  app_vol_done; /* Volume already configured (or failed) */
 
 /**
  * @brief Default app initialization handler
@@ -154,16 +258,54 @@ static u32 app_tm_ref;
 static void default_init(void)
 {
 	lun *scsi_lun;
+	uint i;
 
 	app_tm_ref = time_now(0);
-
-	/* Configure default SCSI LUN */
-	scsi_lun = scsi_lun_get(0);
-	scsi_lun->state = 0;
-	scsi_lun->rd    = default_lun_rd;
-	scsi_lun->wr    = default_lun_wr;
-	scsi_lun->wr_complete = default_lun_wr_complete;
-	scsi_lun->wr_preload  = default_lun_wr_preload;
+	app_vol_done = 0;
+
+	/* Writes are merged into a cache of 4k lines */
+	wcache_init(0, WCACHE_WAYS);
+	wcache_map(volume_map);
+#ifdef APP_FTL
+	/* Lines are written at a new place each time */
+	wcache_backend(ftl_read, ftl_submit);
+#endif
+	/* Hot sectors (FAT, directories) are read from RAM, and sequential
+	 * reads (file data) are read in advance */
+#ifdef APP_FTL
+	rcache_init(ftl_read);
+	rahead_init(ftl_read_start, volume_read_wait);
+#else
+	rcache_init(volume_read);
+	rahead_init(volume_read_start, volume_read_wait);
+#endif
+	app_wr_dirty = 0;
+	/* Cache is flushed by deferred work, as accesses from SCSI */
+	if (app_flush_work < 0)
+		app_flush_work = work_register(default_flush, WORK_PRIO_LOW);
+	/* Pre-erase (or FTL garbage collection) only runs when nothing else has
+	 * to be done */
+	if (app_preerase_work < 0)
+		app_preerase_work = work_register(default_preerase, WORK_PRIO_IDLE);
+	app_io_tm = app_tm_ref;
+	app_pe_tm = app_tm_ref;
+
+	/* Configure default SCSI LUNs (medium inserted when volume is ready) */
+	for (i = 0; i < APP_LUN_COUNT; i++)
+	{
+		scsi_lun = scsi_lun_get(i);
+		scsi_lun->state = 0;
+		scsi_lun->rd    = default_lun_rd;
+		scsi_lun->wr    = default_lun_wr;
+		scsi_lun->wr_complete = default_lun_wr_complete;
+		scsi_lun->wr_preload  = default_lun_wr_preload;
+		scsi_lun->flush       = default_lun_flush;
+		scsi_lun->unmap       = default_lun_unmap;
+		scsi_lun->priv        = 0;
+		/* Reads use mem_read(), can fill USB packet memory directly */
+		scsi_lun->perm |= SCSI_PERM_RD_DIRECT;
+	}
+	scsi_lun_set_count(APP_LUN_COUNT);
 }
 
 /**
@@ -177,18 +319,48 @@ static void default_periodic(void)
 	lun *scsi_lun;
 
 	scsi_lun = scsi_lun_get(0);
-	if (scsi_lun->state == 0)
+	if ((scsi_lun->state == 0) && (app_vol_done == 0))
 	{
 		if (time_since(app_tm_ref) > 10000)
 		{
-			log_puts("Main: Mark SCSI medium as inserted\n");
-			// 131072 blocks (64MB)
-			scsi_lun->capacity = 131072;
-			scsi_lun->state = 1;
-			scsi_lun->writable = 1;
+			app_vol_done = 1;
+			/* Volume setup may read the memories (FTL mount) */
+			work_lock();
+			/* Without volume, medium stays not present */
+			if (default_volume() == 0)
+				log_puts("Main: Mark SCSI medium as inserted\n");
+			work_unlock();
 		}
 	}
 
+	/* No write since a while, flush the cache */
+	if (APP_WCACHE_IDLE && app_wr_dirty && (time_since(app_wr_tm) > APP_WCACHE_IDLE))
+	{
+		app_wr_dirty = 0;
+		work_post(app_flush_work);
+	}
+	/* Previous flush has been delayed by a busy memory */
+	if (app_flush_retry)
+	{
+		app_flush_retry = 0;
+		work_post(app_flush_work);
+	}
+	/* Host idle and cache written, prepare free sectors for next writes */
+	if (APP_PREERASE_IDLE && scsi_lun->state && (app_wr_dirty == 0) &&
+	    (time_since(app_io_tm) > APP_PREERASE_IDLE) &&
+	    (time_since(app_pe_tm) > 10))
+	{
+		app_pe_tm = time_now(0);
+		work_post(app_preerase_work);
+	}
+#ifdef APP_FTL
+	/* Free segments are missing, collect garbage even if host is busy */
+	else if (ftl_pending() && (time_since(app_pe_tm) > 10))
+	{
+		app_pe_tm = time_now(0);
+		work_post(app_preerase_work);
+	}
+#endif
 }
 
 /**
@@ -199,7 +371,77 @@ static void default_periodic(void)
  */
 static void default_reset(void)
 {
-	/* Do nothing */
+	/* Host may power off the device after a reset, write cached data */
+	work_post(app_flush_work);
+}
+
+/**
+ * @brief Build the volume of the default LUN from detected memories
+ *
+ * All the flash chips found by mem_detect are used, with their real size.
+ * When striped (RAID-0), sequential writes use all the chips together (the
+ * erase and program jobs of each node run at the same time). Reads are not
+ * faster : they are limited by USB and never span a unit (see
+ * volume_read). With APP_LUN_PER_CHIP, chips are spanned and the LUN with
+ * the identifier of a node use the extent of this node only.
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int default_volume(void)
+{
+	const volume_extent *ext;
+	mem_node *node;
+	lun  *scsi_lun;
+	u8   nids[MEM_NODE_COUNT];
+	uint i, count = 0;
+
+	for (i = 0; i < MEM_NODE_COUNT; i++)
+	{
+		node = mem_get_node(i);
+		if (node && (node->type == 1))
+			nids[count++] = (u8)i;
+	}
+#ifdef APP_LUN_PER_CHIP
+	if (volume_init(VOLUME_SPAN, nids, count, APP_VOLUME_UNIT))
+#else
+	if (volume_init(APP_VOLUME_MODE, nids, count, APP_VOLUME_UNIT))
+#endif
+	{
+		log_print(LOG_ERR, "APP: %{No flash chip for the volume%}\n", LOG_RED);
+		return(-1);
+	}
+
+	for (i = 0; (ext = volume_get_extent(i)) != 0; i++)
+	{
+		log_print(LOG_INF, "APP: Volume extent %d : %d kB on %d chip(s)\n",
+		          i, (ext->end - ext->start) / 1024, ext->count);
+#ifdef APP_LUN_PER_CHIP
+		scsi_lun = scsi_lun_get(ext->nids[0]);
+		scsi_lun->priv     = (void *)ext;
+		scsi_lun->capacity = (ext->end - ext->start) / 512;
+		scsi_lun->writable = 1;
+		scsi_lun->state    = 1;
+#endif
+	}
+	log_print(LOG_INF, "APP: Volume size %d kB\n", volume_size() / 1024);
+
+#ifdef APP_FTL
+	if (ftl_init())
+	{
+		log_print(LOG_ERR, "APP: %{Volume too small for FTL%}\n", LOG_RED);
+		return(-1);
+	}
+	scsi_lun = scsi_lun_get(0);
+	scsi_lun->capacity = ftl_size() / 512;
+	scsi_lun->writable = 1;
+	scsi_lun->state    = 1;
+#elif !defined(APP_LUN_PER_CHIP)
+	scsi_lun = scsi_lun_get(0);
+	scsi_lun->capacity = volume_size() / 512;
+	scsi_lun->writable = 1;
+	scsi_lun->state    = 1;
+#endif
+	return(0);
 }
 
 /**
@@ -227,18 +469,47 @@ static void dummy_periodic(void)
  * @param addr Address to read
  * @param len  Number of byte to read
  * @param data Pointer to a buffer where readed data can be stored
- * @return integer Number of readed bytes
+ * @return integer Number of readed bytes, -1 on read error
  */
 int default_lun_rd(u32 addr, u32 len, u8 *data)
 {
+	u32 done;
+	int n;
+
 	if (len > 512)
 		len = 512;
+	addr += default_lun_base();
+	app_io_tm = time_now(0);
 
 #ifdef LUN_DEBUG_READ
 	log_print(LOG_DBG, "LUN: Read %d bytes at 0x%32x\n", len, addr);
 #endif
+	rahead_access(addr, len);
 
-	mem_read(0, addr, len, data);
+	/* Sectors modified into write cache are more recent than flash */
+	for (done = 0; done < len; done += (u32)n)
+	{
+		n = wcache_read(addr + done, len - done, data + done);
+		if (n > 0)
+			continue;
+		n = rahead_read(addr + done, len - done, data + done);
+		if (n > 0)
+			continue;
+		n = rcache_read(addr + done, len - done, data + done);
+		if (n > 0)
+			continue;
+		/* Not into caches, read flash up to the end of sector */
+		n = (int)(512 - ((addr + done) & 511));
+		if ((u32)n > (len - done))
+			n = (int)(len - done);
+#ifdef APP_FTL
+		if (ftl_read(addr + done, (uint)n, data + done) != n)
+			return(-1);
+#else
+		if (volume_read(addr + done, (uint)n, data + done) != n)
+			return(-1);
+#endif
+	}
 
 	return((int)len);
 }
@@ -249,26 +520,29 @@ int default_lun_rd(u32 addr, u32 len, u8 *data)
  * @param addr Address to write
  * @param len  Number of bytes to write
  * @param data Pointer to a buffer with data to write
- * @return integer Zero is returned on success, other values are errors
+ * @return integer Zero on success, 1 if memory is busy (retry), negative on error
  */
 int default_lun_wr(u32 addr, u32 len, u8 *data)
 {
-	mem_node *node = mem_get_node(0);
+	int result;
 
 	(void)len;
+	addr += default_lun_base();
 
-	if ((addr & 0xFFFFF000) != node->cache_addr)
-	{
-#ifdef LUN_DEBUG_WRITE
-		log_print(LOG_INF, "LUN: Write, cache new page %32x\n", addr);
-#endif
-		mem_write(0, 0, 0, 0);
-		mem_read(0, addr, 512, 0);
-	}
 #ifdef LUN_DEBUG_WRITE
 	log_print(LOG_INF, "LUN: Write at %32x\n", addr);
 #endif
-	memcpy(node->cache_buffer + (addr & 0xFFF), data, 512);
+	result = wcache_write(addr, data);
+	if (result)
+		return(result);
+	/* Old content of the sector may be into read caches. Read-ahead lines
+	 * are all dropped : a line evicted from write cache is now into flash */
+	rcache_invalidate(addr, 512);
+	rahead_invalidate();
+
+	app_wr_tm = time_now(0);
+	app_io_tm = app_wr_tm;
+	app_wr_dirty = 1;
 	return(0);
 }
 
@@ -276,30 +550,134 @@ int default_lun_wr(u32 addr, u32 len, u8 *data)
  * @brief Write complete function for the default LUN
  *
  * This function is registered as handler for the SCSI lun 0 and called by
- * the SCSI layer when a write transaction is completed. This can be usefull
- * for example to flush the last written bytes.
+ * the SCSI layer when a write transaction is completed. Lines fully written
+ * (sequential data) are flushed now, partially modified lines stay into cache
+ * because next commands will probably update them again (FAT, directories).
  *
  * @return integer Zero is returned on success, other values are errors
  */
 int default_lun_wr_complete(void)
 {
-	mem_write(0, 0, 0, 0);
-	return(0);
+	wcache_prepare(0, 0);
+	return( wcache_flush(WCACHE_FLUSH_FULL) );
 }
 
 /**
  * @brief Write preload function for the default LUN
  *
  * This function is registered as handler for the SCSI lun 0 and called by
- * the SCSI layer at the begining of a write transaction. This can be used
- * for example to preload a cache.
+ * the SCSI layer at the begining of a write transaction. The 4k lines fully
+ * covered by the transaction are not loaded from flash before write.
  *
  * @param addr First accessed address of the write transaction
+ * @param len  Number of bytes of the write transaction
+ * @return integer Zero is returned on success, other values are errors
+ */
+int default_lun_wr_preload(u32 addr, u32 len)
+{
+	wcache_prepare(addr + default_lun_base(), len);
+	return(0);
+}
+
+/**
+ * @brief Flush function for the default LUN
+ *
+ * This function is registered as handler for the SCSI lun 0 and called by
+ * the SCSI layer when host request to synchronize cache (or write with FUA).
+ * As the cache is written in background, 1 is returned until all data have
+ * been written. A flush started without wait (IMMED) is completed later by
+ * the deferred work (see default_flush).
+ *
+ * @return integer Zero on success, 1 if flush is running, negative on error
+ */
+int default_lun_flush(void)
+{
+	int result;
+
+	app_wr_dirty = 0;
+	result = wcache_flush(WCACHE_FLUSH_ALL);
+	if (result == WCACHE_BUSY)
+		app_flush_retry = 1;
+	return(result);
+}
+
+/**
+ * @brief Unmap function for the default LUN
+ *
+ * This function is registered as handler for the SCSI lun 0 and called by
+ * the SCSI layer when host declare blocks as unused (UNMAP). Cached lines
+ * and sectors of the area are dropped, then complete flash sectors are
+ * marked free : they are read as zeros without flash access (see mem_trim).
+ *
+ * @param addr Address of the first unused byte
+ * @param len  Number of unused bytes
+ * @return integer Zero is returned on success, other values are errors
  */
-int default_lun_wr_preload(u32 addr)
+int default_lun_unmap(u32 addr, u32 len)
 {
-	mem_read(0, addr, 512, 0);
+	addr += default_lun_base();
+
+	wcache_discard(addr, len);
+	rcache_invalidate(addr, len);
+	rahead_invalidate();
+#ifdef APP_FTL
+	ftl_trim(addr, len);
+#else
+	volume_trim(addr, len);
+#endif
 	return(0);
 }
 
+/**
+ * @brief Deferred work used to flush the write cache
+ *
+ * Posted after a while without write (see default_periodic) or on reset.
+ */
+static void default_flush(void)
+{
+	/* Memory busy, some lines not written : retry on next periodic */
+	if (wcache_dirty() && (wcache_flush(WCACHE_FLUSH_ALL) == WCACHE_BUSY))
+		app_flush_retry = 1;
+}
+
+/**
+ * @brief Deferred work used to erase free sectors in background
+ *
+ * Posted when the host has not accessed the LUN since a while (see
+ * default_periodic). Each node with an empty queue erase one sector of
+ * its pool (see mem_preerase). With the FTL, one step of its background
+ * work is done instead, also posted when free segments are missing.
+ */
+static void default_preerase(void)
+{
+#ifdef APP_FTL
+	ftl_gc(time_since(app_io_tm) > APP_PREERASE_IDLE);
+#else
+	uint i;
+
+	/* Cache flush is more important than pool */
+	if (wcache_dirty())
+		return;
+	for (i = 0; i < MEM_NODE_COUNT; i++)
+		mem_preerase(i);
+#endif
+}
+
+/**
+ * @brief Get the volume address of the LUN used by the running command
+ *
+ * Each LUN use one extent of the volume (see default_volume), all LUNs share
+ * the same write cache.
+ *
+ * @return u32 Address of the first byte of the LUN into the volume
+ */
+static u32 default_lun_base(void)
+{
+	const volume_extent *ext;
+
+	ext = (const volume_extent *)scsi_lun_current()->priv;
+	if (ext == 0)
+		return(0);
+	return(ext->start);
+}
 /* EOF */
@@ -15,10 +15,16 @@
  */
 #ifndef APP_H
 #define APP_H
+#include "types.h"
 
 void app_init(void);
 int  app_stop(void);
 
+/* Memory access for custom apps (see api.s) */
+int  app_mem_read (uint nid, u32 addr, uint len, u8 *buffer);
+int  app_mem_write(uint nid, u32 addr, uint len, u8 *buffer);
+int  app_mem_erase(uint nid, u32 addr, uint len);
+
 extern void (*app_periodic)(void);
 extern void (*app_reset)(void);
 
@@ -0,0 +1,997 @@
+/**
+ * @file  ftl.c
+ * @brief Flash translation layer (log-structured, mapped by 4k pages)
+ *
+ * Without translation, each line of the write cache is rewritten at the same
+ * place : the sector is read, erased and programmed again, and hot sectors
+ * (FAT, directories) wear out quickly. This module stores logical pages (4k)
+ * into any sector of the volume. A modified page is appended to the log
+ * head, an already erased segment, and the previous copy becomes garbage.
+ *
+ * The volume is divided into segments of FTL_SEG_SECTORS sectors. The first
+ * sector of a segment is its summary : a header (magic, erase counter) is
+ * written after the erase, the sequence number when the segment becomes the
+ * log head, then one entry per data sector with the logical page it holds,
+ * programmed once the data are written. When a page is written elsewhere or
+ * unmapped, the entry of the old copy is cleared (programmed to zero), so
+ * the map is rebuilt on startup by reading the summaries only.
+ *
+ * Segments without valid page are erased in background. When free segments
+ * are missing, the segment with the fewest valid pages is collected : its
+ * pages are copied to the log head. The head is always the free segment
+ * with the lowest erase counter, and cold segments (much less erased than
+ * others) are collected when the host is idle (static wear leveling).
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include "ftl.h"
+#include "libc.h"
+#include "log.h"
+#include "mem.h"
+#include "types.h"
+#include "usb.h"
+#include "volume.h"
+
+#define FTL_MAGIC  0x314C5446 /* "FTL1" */
+#define FTL_NONE   0xFFFF
+#define FTL_SEG_SZ (FTL_SEG_SECTORS * MEM_SECTOR_SZ)
+/* Offsets into the summary sector */
+#define FTL_SEQ_OFFSET   8
+#define FTL_ENTRY_OFFSET 16
+
+/* Segment states */
+#define SEG_DIRTY 0 /* Must be erased before use (garbage or unknown)  */
+#define SEG_FREE  1 /* Erased and formatted, can become the log head   */
+#define SEG_USED  2 /* Contains data (or is the log head)              */
+#define SEG_BAD   3 /* Erase failed, never used again                  */
+#define SEG_NONE  FTL_SEG_MAX
+
+typedef struct ftl_summary_s
+{
+	u32 magic;
+	u32 erase; /* Number of erases of the segment                     */
+	u32 seq;   /* Order into the log (0xFFFFFFFF if not used yet)     */
+	u32 rsv;
+	u16 lpage[FTL_SEG_SLOTS]; /* Page + 1, 0xFFFF if empty, 0 if dead */
+} ftl_summary;
+
+typedef struct ftl_write_s
+{
+	mem_job *job;      /* Job of the caller (data of the page)        */
+	void   (*complete)(mem_job *job);
+	void    *priv;
+	u16      lpage;
+	u16      ppage;
+	u16      dead[2];  /* Old entries to clear after the write        */
+	u8       dead_count;
+	u8       used;
+	u8       drop;     /* Page unmapped while being written           */
+	u16      entry;    /* Value of the summary entry being programmed */
+	mem_job  ejob;     /* Job used to update summary entries          */
+} ftl_write;
+
+static u16  ftl_map[FTL_MAP_PAGES];
+static u8   seg_state[FTL_SEG_MAX];
+static u8   seg_valid[FTL_SEG_MAX];
+static u16  seg_erase[FTL_SEG_MAX];
+static ftl_write writes[FTL_INFLIGHT];
+static ftl_stats stats;
+static uint ftl_nseg;  /* Number of segments (0 if not mounted)         */
+static u32  ftl_pages; /* Number of logical pages                       */
+static u32  ftl_seq;   /* Sequence number of the next log head          */
+static uint ftl_free;  /* Number of free (erased) segments              */
+static uint head_seg;  /* Current log head                              */
+static uint head_slot; /* Next data sector of the head (1 to SLOTS)     */
+/* Garbage collection and erase in progress (see ftl_gc) */
+static uint gc_seg;
+static uint gc_slot;
+static uint er_seg;
+static uint er_sector;
+static mem_job er_job;
+static u8   gc_buffer[MEM_PAGE_SZ] __attribute__((aligned(4)));
+
+static int  erase_step(void);
+static int  gc_step(void);
+static void mount_dup(u32 lpage, u16 ppage, u32 seq);
+static int  page_move(u32 lpage, u16 ppage);
+static u16  head_alloc(int gc);
+static int  head_open(void);
+static int  entry_clear(u16 ppage);
+static int  entry_submit(ftl_write *w, u16 ppage, void (*complete)(mem_job *job));
+static void entry_done(mem_job *job);
+static void dead_next(mem_job *job);
+static void write_done(mem_job *job);
+static void write_end(ftl_write *w);
+static int  seg_busy(uint seg);
+static uint seg_find(uint state);
+static void seg_release(uint seg);
+static int  sum_program(uint seg, uint offset, void *data, uint len);
+static int  sum_read(uint seg, ftl_summary *sum);
+static uint victim_find(uint idle);
+
+/**
+ * @brief Mount the translation layer on the volume
+ *
+ * The summary of each segment is read to rebuild the map of logical pages.
+ * A segment without valid header (never used by the FTL, or erase not
+ * complete) must be erased before use : its content is lost. When two
+ * copies of a page are found (write interrupted before the old entry has
+ * been cleared) the most recent one is used and the other is cleared.
+ *
+ * @return integer Zero on success, other values are errors
+ */
+int ftl_init(void)
+{
+	ftl_summary sum;
+	u32  slots, l;
+	uint nseg, s, k;
+	u16  e;
+
+	ftl_nseg  = 0;
+	ftl_free  = 0;
+	ftl_seq   = 0;
+	head_seg  = SEG_NONE;
+	gc_seg    = SEG_NONE;
+	er_seg    = SEG_NONE;
+	er_job.state = MEM_JOB_DONE;
+	memset(&stats, 0, sizeof(ftl_stats));
+	for (k = 0; k < FTL_INFLIGHT; k++)
+		writes[k].used = 0;
+
+	nseg = (uint)(volume_size() / FTL_SEG_SZ);
+	if (nseg > FTL_SEG_MAX)
+		nseg = FTL_SEG_MAX;
+	if (nseg < (FTL_FREE_MIN + 2))
+		return(-1);
+	/* Keep free segments for GC, and one for the head */
+	slots = (nseg - FTL_FREE_MIN - 1) * FTL_SEG_SLOTS;
+	ftl_pages = slots - (slots / FTL_OP_RATIO);
+	if (ftl_pages > FTL_MAP_PAGES)
+		ftl_pages = FTL_MAP_PAGES;
+	for (l = 0; l < FTL_MAP_PAGES; l++)
+		ftl_map[l] = FTL_NONE;
+
+	for (s = 0; s < nseg; s++)
+	{
+		seg_state[s] = SEG_DIRTY;
+		seg_valid[s] = 0;
+		seg_erase[s] = 0;
+		if (sum_read(s, &sum) || (sum.magic != FTL_MAGIC))
+			continue;
+		seg_erase[s] = (sum.erase > 0xFFFF) ? 0xFFFF : (u16)sum.erase;
+		if (sum.seq == 0xFFFFFFFF)
+		{
+			seg_state[s] = SEG_FREE;
+			for (k = 0; k < FTL_SEG_SLOTS; k++)
+			{
+				if (sum.lpage[k] != 0xFFFF)
+					seg_state[s] = SEG_DIRTY;
+			}
+			if (seg_state[s] == SEG_FREE)
+				ftl_free++;
+			continue;
+		}
+		seg_state[s] = SEG_USED;
+		if (sum.seq >= ftl_seq)
+			ftl_seq = sum.seq + 1;
+		for (k = 0; k < FTL_SEG_SLOTS; k++)
+		{
+			e = sum.lpage[k];
+			if ((e == 0) || (e == 0xFFFF) || ((u32)(e - 1) >= ftl_pages))
+				continue;
+			l = (u32)(e - 1);
+			if (ftl_map[l] == FTL_NONE)
+			{
+				ftl_map[l] = (u16)((s * FTL_SEG_SECTORS) + k + 1);
+				seg_valid[s]++;
+			}
+			else
+				mount_dup(l, (u16)((s * FTL_SEG_SECTORS) + k + 1), sum.seq);
+		}
+	}
+	ftl_nseg = nseg;
+	/* Segments that only contain garbage can be erased */
+	for (s = 0; s < nseg; s++)
+		seg_release(s);
+
+	log_print(LOG_INF, "FTL: %d segments (%d free), %d kB\n",
+	          nseg, ftl_free, ftl_pages * (MEM_SECTOR_SZ / 1024));
+	return(0);
+}
+
+/**
+ * @brief Get the logical size of the translation layer
+ *
+ * @return u32 Size in bytes (zero if not mounted)
+ */
+u32 ftl_size(void)
+{
+	if (ftl_nseg == 0)
+		return(0);
+	return(ftl_pages * MEM_SECTOR_SZ);
+}
+
+/**
+ * @brief Read data from logical pages
+ *
+ * Pages never written (or unmapped) are read as zeros. Zeros are written
+ * with memset_pma, so this function can also fill the USB packet memory.
+ *
+ * @param addr Logical address of the first byte to read
+ * @param len  Number of bytes to read
+ * @param data Pointer to a buffer to store data
+ * @return integer Number of bytes read, -1 on error (data not valid)
+ */
+int ftl_read(u32 addr, uint len, u8 *data)
+{
+	uint done, n;
+	u32  l;
+	u16  p;
+
+	for (done = 0; done < len; done += n)
+	{
+		l = (addr + done) / MEM_SECTOR_SZ;
+		n = MEM_SECTOR_SZ - ((addr + done) % MEM_SECTOR_SZ);
+		if (n > (len - done))
+			n = (len - done);
+		p = (l < ftl_pages) ? ftl_map[l] : FTL_NONE;
+		if (p != FTL_NONE)
+		{
+			if (volume_read(((u32)p * MEM_SECTOR_SZ) + ((addr + done) % MEM_SECTOR_SZ),
+			                n, data + done) != (int)n)
+				return(-1);
+		}
+		/* Endpoint buffer (zero-copy read) accept 32 bits accesses only */
+		else
+			memset_pma(data + done, 0, n);
+	}
+	return((int)done);
+}
+
+/**
+ * @brief Start to read data of one logical page, without waiting the end
+ *
+ * The area must be into one page. A page never written is filled with zeros
+ * immediately, else the read of its sector is started into background and
+ * the data must not be used before volume_read_wait.
+ *
+ * @param addr Logical address of the first byte to read
+ * @param len  Number of bytes to read
+ * @param data Pointer to a buffer to store data (not USB packet memory)
+ * @return integer Zero if started (or done), negative value on error
+ */
+int ftl_read_start(u32 addr, uint len, u8 *data)
+{
+	u32 l = addr / MEM_SECTOR_SZ;
+	u16 p;
+
+	if (((addr % MEM_SECTOR_SZ) + len) > MEM_SECTOR_SZ)
+		return(-1);
+
+	p = (l < ftl_pages) ? ftl_map[l] : FTL_NONE;
+	if (p == FTL_NONE)
+	{
+		memset(data, 0, (int)len);
+		return(0);
+	}
+	return(volume_read_start(((u32)p * MEM_SECTOR_SZ) + (addr % MEM_SECTOR_SZ),
+	                         len, data));
+}
+
+/**
+ * @brief Write one logical page (asynchronous)
+ *
+ * The page is programmed into the next sector of the log head. The job of
+ * the caller (buffer and complete callback, as for mem_submit) is used to
+ * program the data, then the summary is updated and the map is changed.
+ * The complete callback of the caller is called at the end. When no sector
+ * is available now, one step of garbage collection is done and FTL_BUSY is
+ * returned : the caller must retry later.
+ *
+ * @param addr Logical address of the page (4k aligned)
+ * @param job  Pointer to a job with buffer, complete and priv set
+ * @return integer Zero on success, FTL_BUSY or negative value on error
+ */
+int ftl_submit(u32 addr, mem_job *job)
+{
+	ftl_write *w = 0;
+	u32  l = addr / MEM_SECTOR_SZ;
+	u32  maddr;
+	uint i, nid;
+	u16  p;
+
+	if ((ftl_nseg == 0) || (job == 0) || (l >= ftl_pages))
+		return(-1);
+
+	for (i = 0; i < FTL_INFLIGHT; i++)
+	{
+		if (writes[i].used == 0)
+		{
+			w = &writes[i];
+			break;
+		}
+	}
+	if (w == 0)
+	{
+		stats.busy++;
+		return(FTL_BUSY);
+	}
+	p = head_alloc(0);
+	if (p == FTL_NONE)
+	{
+		stats.busy++;
+		/* Make room now, caller will retry */
+		ftl_gc(0);
+		return(FTL_BUSY);
+	}
+
+	w->job      = job;
+	w->complete = job->complete;
+	w->priv     = job->priv;
+	w->lpage    = (u16)l;
+	w->ppage    = p;
+	w->dead[0]  = FTL_NONE;
+	w->dead[1]  = FTL_NONE;
+	w->dead_count = 0;
+	w->drop     = 0;
+	w->used     = 1;
+
+	volume_map((u32)p * MEM_SECTOR_SZ, &nid, &maddr);
+	job->type     = MEM_JOB_PROGRAM;
+	job->addr     = maddr;
+	job->len      = MEM_SECTOR_SZ;
+	job->complete = write_done;
+	job->priv     = w;
+	if (mem_submit(nid, job))
+	{
+		job->complete = w->complete;
+		job->priv     = w->priv;
+		w->used = 0;
+		return(-1);
+	}
+	stats.writes++;
+	return(0);
+}
+
+/**
+ * @brief Declare logical pages as unused
+ *
+ * Only the pages fully covered by the area are unmapped. The summary entry
+ * of their current copy is cleared, so they stay unmapped after a restart.
+ *
+ * @param addr Logical address of the first byte of the area
+ * @param len  Number of bytes of the area
+ * @return integer Number of pages unmapped
+ */
+int ftl_trim(u32 addr, u32 len)
+{
+	u32  l, end;
+	uint i;
+	u16  p;
+	int  count = 0;
+
+	if (ftl_nseg == 0)
+		return(0);
+
+	l   = (addr + MEM_SECTOR_SZ - 1) / MEM_SECTOR_SZ;
+	end = (addr + len) / MEM_SECTOR_SZ;
+	if (end > ftl_pages)
+		end = ftl_pages;
+	for ( ; l < end; l++)
+	{
+		/* A write in progress must not map the page again */
+		for (i = 0; i < FTL_INFLIGHT; i++)
+		{
+			if (writes[i].used && (writes[i].lpage == l))
+				writes[i].drop = 1;
+		}
+		p = ftl_map[l];
+		if (p == FTL_NONE)
+			continue;
+		ftl_map[l] = FTL_NONE;
+		seg_valid[p / FTL_SEG_SECTORS]--;
+		entry_clear(p);
+		seg_release(p / FTL_SEG_SECTORS);
+		count++;
+	}
+	return(count);
+}
+
+/**
+ * @brief Do one step of background work (erase, garbage collection)
+ *
+ * One step is the start of one sector erase or the copy of one valid page,
+ * so this function never blocks for long. Segments are erased when free
+ * segments are missing, or as soon as possible when the host is idle. When
+ * erasing garbage is not enough, a segment is collected. When the host is
+ * idle, cold segments are also collected (wear leveling).
+ *
+ * @param idle Set when the host has not accessed the volume since a while
+ * @return boolean True if something has been done (call again)
+ */
+int ftl_gc(uint idle)
+{
+	uint s;
+
+	if (ftl_nseg == 0)
+		return(0);
+
+	/* Erase in progress, continue with next sector */
+	if (er_seg != SEG_NONE)
+		return(erase_step());
+
+	s = seg_find(SEG_DIRTY);
+	if ((s != SEG_NONE) && (idle || (ftl_free < FTL_FREE_MIN)))
+	{
+		er_seg    = s;
+		er_sector = 0;
+		return(erase_step());
+	}
+
+	if (gc_seg == SEG_NONE)
+		gc_seg = victim_find(idle);
+	if (gc_seg == SEG_NONE)
+		return(0);
+	return(gc_step());
+}
+
+/**
+ * @brief Test if the translation layer needs background work now
+ *
+ * @return boolean True if an erase is running or free segments are missing
+ */
+int ftl_pending(void)
+{
+	if (ftl_nseg == 0)
+		return(0);
+	return((er_seg != SEG_NONE) || (ftl_free < FTL_FREE_MIN));
+}
+
+/**
+ * @brief Get the lowest and highest erase counters of segments
+ *
+ * @param min Pointer to a variable to store the lowest counter
+ * @param max Pointer to a variable to store the highest counter
+ */
+void ftl_erase_range(uint *min, uint *max)
+{
+	uint s;
+
+	*min = 0xFFFF;
+	*max = 0;
+	for (s = 0; s < ftl_nseg; s++)
+	{
+		if (seg_state[s] == SEG_BAD)
+			continue;
+		if (seg_erase[s] < *min)
+			*min = seg_erase[s];
+		if (seg_erase[s] > *max)
+			*max = seg_erase[s];
+	}
+}
+
+/**
+ * @brief Get access to the FTL statistics
+ *
+ * @return ftl_stats* Pointer to the statistics counters
+ */
+ftl_stats *ftl_get_stats(void)
+{
+	return(&stats);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                          Private  functions                          -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Erase the next sector of the segment being erased
+ *
+ * The summary sector is erased first, so a segment partially erased has no
+ * valid header on startup. When all sectors are erased, the header is
+ * written with the new erase counter and the segment becomes free.
+ *
+ * @return boolean True if something has been done
+ */
+static int erase_step(void)
+{
+	u32  hdr[2];
+	u32  maddr;
+	uint nid;
+
+	/* Previous sector erase still running */
+	if (er_job.state != MEM_JOB_DONE)
+		return(1);
+	if (er_sector && er_job.result)
+	{
+		log_print(LOG_ERR, "FTL: %{Erase of segment %d failed%}\n", LOG_RED, er_seg);
+		seg_state[er_seg] = SEG_BAD;
+		er_seg = SEG_NONE;
+		return(1);
+	}
+
+	if (er_sector < FTL_SEG_SECTORS)
+	{
+		volume_map((er_seg * FTL_SEG_SZ) + (er_sector * MEM_SECTOR_SZ), &nid, &maddr);
+		er_job.type     = MEM_JOB_ERASE;
+		er_job.addr     = maddr;
+		er_job.len      = MEM_SECTOR_SZ;
+		er_job.buffer   = 0;
+		er_job.complete = 0;
+		er_job.priv     = 0;
+		if (mem_submit(nid, &er_job))
+		{
+			er_seg = SEG_NONE;
+			return(0);
+		}
+		er_sector++;
+		return(1);
+	}
+
+	/* All sectors erased, write the header */
+	if (seg_erase[er_seg] < 0xFFFF)
+		seg_erase[er_seg]++;
+	hdr[0] = FTL_MAGIC;
+	hdr[1] = seg_erase[er_seg];
+	if (sum_program(er_seg, 0, hdr, sizeof(hdr)) == 0)
+	{
+		seg_state[er_seg] = SEG_FREE;
+		ftl_free++;
+		stats.erases++;
+	}
+	er_seg = SEG_NONE;
+	return(1);
+}
+
+/**
+ * @brief Copy the next valid page of the collected segment
+ *
+ * @return boolean True if something has been done
+ */
+static int gc_step(void)
+{
+	ftl_summary sum;
+	uint k;
+	u16  e, p;
+
+	if ((seg_state[gc_seg] != SEG_USED) || (gc_seg == head_seg) ||
+	    sum_read(gc_seg, &sum))
+	{
+		gc_seg = SEG_NONE;
+		return(1);
+	}
+
+	for (k = gc_slot; k < FTL_SEG_SLOTS; k++)
+	{
+		e = sum.lpage[k];
+		if ((e == 0) || (e == 0xFFFF) || ((u32)(e - 1) >= ftl_pages))
+			continue;
+		p = (u16)((gc_seg * FTL_SEG_SECTORS) + k + 1);
+		/* Entry of an old copy, not yet cleared */
+		if (ftl_map[e - 1] != p)
+			continue;
+		gc_slot = k;
+		return(page_move((u32)(e - 1), p) > 0);
+	}
+	/* All valid pages moved */
+	seg_release(gc_seg);
+	gc_seg = SEG_NONE;
+	return(1);
+}
+
+/**
+ * @brief Select the segment to collect
+ *
+ * When the host is idle and the coldest segment has been erased much less
+ * than the most used one, it is collected to put it back into the pool of
+ * free segments (wear leveling). Else, when free and garbage segments are
+ * missing, the segment with the fewest valid pages is collected.
+ *
+ * @param idle Set when the host is idle
+ * @return uint Index of the segment (SEG_NONE if nothing to collect)
+ */
+static uint victim_find(uint idle)
+{
+	uint best = SEG_NONE, cold = SEG_NONE;
+	uint s, dirty = 0;
+	u16  emax = 0;
+
+	for (s = 0; s < ftl_nseg; s++)
+	{
+		if (seg_state[s] == SEG_DIRTY)
+			dirty++;
+		if ((seg_state[s] != SEG_BAD) && (seg_erase[s] > emax))
+			emax = seg_erase[s];
+		if ((seg_state[s] != SEG_USED) || (s == head_seg) || seg_busy(s))
+			continue;
+		if ((best == SEG_NONE) || (seg_valid[s] < seg_valid[best]))
+			best = s;
+		if ((cold == SEG_NONE) || (seg_erase[s] < seg_erase[cold]))
+			cold = s;
+	}
+	gc_slot = 0;
+
+	if (idle && (cold != SEG_NONE) && ((uint)(emax - seg_erase[cold]) > FTL_WL_DELTA))
+	{
+		stats.wl_moves++;
+		return(cold);
+	}
+	/* When idle, prepare room for next writes */
+	if ((ftl_free + dirty) >= (idle ? (2 * FTL_FREE_MIN) : FTL_FREE_MIN))
+		return(SEG_NONE);
+	return(best);
+}
+
+/**
+ * @brief Copy a valid page to the log head (garbage collection)
+ *
+ * The page is copied by flash pages through a small buffer, then the new
+ * copy is referenced into the summary of the head before the old entry is
+ * cleared.
+ *
+ * @param lpage Logical page
+ * @param ppage Current physical page
+ * @return integer 1 if moved, 0 if no room, negative value on error
+ */
+static int page_move(u32 lpage, u16 ppage)
+{
+	u32  maddr;
+	uint i, nid;
+	u16  q, e;
+
+	q = head_alloc(1);
+	if (q == FTL_NONE)
+		return(0);
+
+	for (i = 0; i < MEM_SECTOR_SZ; i += MEM_PAGE_SZ)
+	{
+		if (volume_read(((u32)ppage * MEM_SECTOR_SZ) + i, MEM_PAGE_SZ, gc_buffer) != MEM_PAGE_SZ)
+			goto err_copy;
+		volume_map(((u32)q * MEM_SECTOR_SZ) + i, &nid, &maddr);
+		if (mem_program(nid, maddr, MEM_PAGE_SZ, gc_buffer))
+			goto err_copy;
+	}
+	e = (u16)(lpage + 1);
+	if (sum_program(q / FTL_SEG_SECTORS,
+	                FTL_ENTRY_OFFSET + ((uint)(q % FTL_SEG_SECTORS) - 1) * 2, &e, 2))
+		goto err_copy;
+
+	ftl_map[lpage] = q;
+	seg_valid[q / FTL_SEG_SECTORS]++;
+	seg_valid[ppage / FTL_SEG_SECTORS]--;
+	entry_clear(ppage);
+	stats.gc_copies++;
+	return(1);
+
+err_copy:
+	log_print(LOG_ERR, "FTL: %{Failed to move page %d%}\n", LOG_RED, lpage);
+	return(-1);
+}
+
+/**
+ * @brief Resolve two copies of a logical page found on startup
+ *
+ * @param lpage Logical page
+ * @param ppage Physical page of the copy found now
+ * @param seq   Sequence number of the segment of this copy
+ */
+static void mount_dup(u32 lpage, u16 ppage, u32 seq)
+{
+	ftl_summary sum;
+	uint s = ppage / FTL_SEG_SECTORS;
+	u16  q = ftl_map[lpage];
+	int  newer;
+
+	if ((q / FTL_SEG_SECTORS) == s)
+		newer = (ppage > q);
+	else
+		newer = (sum_read(q / FTL_SEG_SECTORS, &sum) == 0) && (seq > sum.seq);
+
+	if (newer)
+	{
+		ftl_map[lpage] = ppage;
+		seg_valid[s]++;
+		seg_valid[q / FTL_SEG_SECTORS]--;
+		entry_clear(q);
+	}
+	else
+		entry_clear(ppage);
+}
+
+/**
+ * @brief Get the next data sector of the log head
+ *
+ * @param gc Set when called by garbage collection (can use reserved segments)
+ * @return u16 Physical page (FTL_NONE if no free segment)
+ */
+static u16 head_alloc(int gc)
+{
+	/* Head may use reserved segments, GC must be able to finish first */
+	if ((gc == 0) && (ftl_free <= FTL_GC_RESERVE))
+		return(FTL_NONE);
+	if ((head_seg == SEG_NONE) || (head_slot > FTL_SEG_SLOTS))
+	{
+		if (head_open())
+			return(FTL_NONE);
+	}
+	return((u16)((head_seg * FTL_SEG_SECTORS) + head_slot++));
+}
+
+/**
+ * @brief Use a new free segment as log head
+ *
+ * The free segment with the lowest erase counter is selected, and its
+ * sequence number is written into its summary.
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int head_open(void)
+{
+	uint old = head_seg;
+	uint s;
+	u32  seq;
+
+	s = seg_find(SEG_FREE);
+	if (s == SEG_NONE)
+		return(-1);
+
+	ftl_free--;
+	seq = ftl_seq++;
+	if (sum_program(s, FTL_SEQ_OFFSET, &seq, 4))
+	{
+		seg_state[s] = SEG_DIRTY;
+		return(-1);
+	}
+	seg_state[s] = SEG_USED;
+	seg_valid[s] = 0;
+	head_seg  = s;
+	head_slot = 1;
+	if (old != SEG_NONE)
+		seg_release(old);
+	return(0);
+}
+
+/**
+ * @brief Clear the summary entry of a physical page (page no more valid)
+ *
+ * @param ppage Physical page
+ * @return integer Zero on success, other values are errors
+ */
+static int entry_clear(u16 ppage)
+{
+	u16 zero = 0;
+
+	return(sum_program(ppage / FTL_SEG_SECTORS,
+	                   FTL_ENTRY_OFFSET + ((uint)(ppage % FTL_SEG_SECTORS) - 1) * 2,
+	                   &zero, 2));
+}
+
+/**
+ * @brief Start the program of a summary entry (asynchronous)
+ *
+ * @param w        Pointer to the write in progress (entry value set)
+ * @param ppage    Physical page of the entry
+ * @param complete Function called at the end of the program
+ * @return integer Zero on success, other values are errors
+ */
+static int entry_submit(ftl_write *w, u16 ppage, void (*complete)(mem_job *job))
+{
+	u32  maddr;
+	uint nid;
+
+	volume_map((u32)(ppage / FTL_SEG_SECTORS) * FTL_SEG_SZ + FTL_ENTRY_OFFSET +
+	           ((u32)(ppage % FTL_SEG_SECTORS) - 1) * 2, &nid, &maddr);
+	w->ejob.type     = MEM_JOB_PROGRAM;
+	w->ejob.addr     = maddr;
+	w->ejob.len      = 2;
+	w->ejob.buffer   = (u8 *)&w->entry;
+	w->ejob.complete = complete;
+	w->ejob.priv     = w;
+	return(mem_submit(nid, &w->ejob));
+}
+
+/**
+ * @brief Called by mem when the data of a page have been programmed
+ *
+ * @param job Pointer to the job of the caller
+ */
+static void write_done(mem_job *job)
+{
+	ftl_write *w = (ftl_write *)job->priv;
+
+	if (job->result)
+	{
+		write_end(w);
+		return;
+	}
+	/* Data are into flash, the summary can reference them */
+	w->entry = (u16)(w->lpage + 1);
+	if (entry_submit(w, w->ppage, entry_done))
+	{
+		job->result = -1;
+		write_end(w);
+	}
+}
+
+/**
+ * @brief Called by mem when the summary entry of a page has been programmed
+ *
+ * @param job Pointer to the summary job of the write
+ */
+static void entry_done(mem_job *job)
+{
+	ftl_write *w = (ftl_write *)job->priv;
+	u16 old;
+
+	if (job->result)
+	{
+		w->job->result = -1;
+		write_end(w);
+		return;
+	}
+
+	/* Page unmapped during write, new copy is already garbage */
+	if (w->drop)
+		w->dead[w->dead_count++] = w->ppage;
+	else
+	{
+		old = ftl_map[w->lpage];
+		ftl_map[w->lpage] = w->ppage;
+		seg_valid[w->ppage / FTL_SEG_SECTORS]++;
+		if (old != FTL_NONE)
+		{
+			seg_valid[old / FTL_SEG_SECTORS]--;
+			w->dead[w->dead_count++] = old;
+		}
+	}
+	job->result = 0;
+	dead_next(job);
+}
+
+/**
+ * @brief Clear the next old summary entry of a write (or end it)
+ *
+ * Errors are ignored : an old copy not cleared is detected on startup.
+ *
+ * @param job Pointer to the summary job of the write
+ */
+static void dead_next(mem_job *job)
+{
+	ftl_write *w = (ftl_write *)job->priv;
+
+	if (w->dead_count == 0)
+	{
+		write_end(w);
+		return;
+	}
+	w->dead_count--;
+	w->entry = 0;
+	if (entry_submit(w, w->dead[w->dead_count], dead_next))
+		write_end(w);
+}
+
+/**
+ * @brief End a write : restore the job of the caller and notify it
+ *
+ * @param w Pointer to the write
+ */
+static void write_end(ftl_write *w)
+{
+	mem_job *job = w->job;
+	uint i;
+
+	job->complete = w->complete;
+	job->priv     = w->priv;
+	w->used = 0;
+	/* Segments of old copies may now contain only garbage */
+	seg_release(w->ppage / FTL_SEG_SECTORS);
+	for (i = 0; i < 2; i++)
+	{
+		if (w->dead[i] != FTL_NONE)
+			seg_release(w->dead[i] / FTL_SEG_SECTORS);
+	}
+	if (job->complete)
+		job->complete(job);
+}
+
+/**
+ * @brief Test if a write in progress use a segment
+ *
+ * @param seg Index of the segment
+ * @return boolean True if a data or summary program may target the segment
+ */
+static int seg_busy(uint seg)
+{
+	ftl_write *w;
+	uint i;
+
+	for (i = 0; i < FTL_INFLIGHT; i++)
+	{
+		w = &writes[i];
+		if (w->used == 0)
+			continue;
+		if (((w->ppage / FTL_SEG_SECTORS) == seg) ||
+		    ((w->dead[0] != FTL_NONE) && ((w->dead[0] / FTL_SEG_SECTORS) == seg)) ||
+		    ((w->dead[1] != FTL_NONE) && ((w->dead[1] / FTL_SEG_SECTORS) == seg)))
+			return(1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Find the segment with the lowest erase counter into a state
+ *
+ * @param state State of the segment to find
+ * @return uint Index of the segment (SEG_NONE if not found)
+ */
+static uint seg_find(uint state)
+{
+	uint best = SEG_NONE;
+	uint s;
+
+	for (s = 0; s < ftl_nseg; s++)
+	{
+		if (seg_state[s] != state)
+			continue;
+		if ((best == SEG_NONE) || (seg_erase[s] < seg_erase[best]))
+			best = s;
+	}
+	return(best);
+}
+
+/**
+ * @brief Mark a segment as garbage if it no more contains valid page
+ *
+ * @param seg Index of the segment
+ */
+static void seg_release(uint seg)
+{
+	if ((seg == head_seg) || (seg_state[seg] != SEG_USED) ||
+	    seg_valid[seg] || seg_busy(seg))
+		return;
+	seg_state[seg] = SEG_DIRTY;
+	if (gc_seg == seg)
+		gc_seg = SEG_NONE;
+}
+
+/**
+ * @brief Program a field of the summary of a segment
+ *
+ * @param seg    Index of the segment
+ * @param offset Offset of the field into the summary
+ * @param data   Pointer to the value of the field
+ * @param len    Size of the field in bytes
+ * @return integer Zero on success, other values are errors
+ */
+static int sum_program(uint seg, uint offset, void *data, uint len)
+{
+	u32  maddr;
+	uint nid;
+
+	volume_map((seg * FTL_SEG_SZ) + offset, &nid, &maddr);
+	return(mem_program(nid, maddr, len, (u8 *)data));
+}
+
+/**
+ * @brief Read the summary of a segment
+ *
+ * @param seg Index of the segment
+ * @param sum Pointer to a structure to store the summary
+ * @return integer Zero on success, other values are errors
+ */
+static int sum_read(uint seg, ftl_summary *sum)
+{
+	if (volume_read(seg * FTL_SEG_SZ, sizeof(ftl_summary), (u8 *)sum) != (int)sizeof(ftl_summary))
+		return(-1);
+	return(0);
+}
+/* EOF */
@@ -0,0 +1,70 @@
+/**
+ * @file  ftl.h
+ * @brief Headers and definitions for the flash translation layer
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef FTL_H
+#define FTL_H
+#include "mem.h"
+#include "types.h"
+
+/* Max number of logical 4k pages (2 bytes of RAM each into the map) */
+#ifndef FTL_MAP_PAGES
+#define FTL_MAP_PAGES 4096
+#endif
+/* Max number of segments used into the volume (4 bytes of RAM each) */
+#ifndef FTL_SEG_MAX
+#define FTL_SEG_MAX 512
+#endif
+/* Number of page writes in progress at the same time (one per cache line) */
+#ifndef FTL_INFLIGHT
+#define FTL_INFLIGHT 4
+#endif
+
+/* A segment is one summary sector followed by data sectors */
+#define FTL_SEG_SECTORS 16
+#define FTL_SEG_SLOTS   (FTL_SEG_SECTORS - 1)
+/* Free segments only used by garbage collection (not by host writes) */
+#define FTL_GC_RESERVE  2
+/* Garbage collection start when free segments are below this count */
+#define FTL_FREE_MIN    (FTL_GC_RESERVE + 2)
+/* Logical capacity is reduced by 1/FTL_OP_RATIO (over-provisioning) */
+#define FTL_OP_RATIO    8
+/* Cold data are moved when erase counters differ more than this */
+#define FTL_WL_DELTA    64
+
+/* Result of ftl_submit when there is no room now (same as WCACHE_BUSY) */
+#define FTL_BUSY 1
+
+typedef struct ftl_stats_s
+{
+	u32 writes;    /* Pages written by host (through the cache)      */
+	u32 gc_copies; /* Valid pages copied by garbage collection       */
+	u32 wl_moves;  /* Segments collected for wear leveling           */
+	u32 erases;    /* Segments erased                                */
+	u32 busy;      /* Writes delayed, no free segment or write slot  */
+} ftl_stats;
+
+int  ftl_init(void);
+u32  ftl_size(void);
+int  ftl_read(u32 addr, uint len, u8 *data);
+int  ftl_read_start(u32 addr, uint len, u8 *data);
+int  ftl_submit(u32 addr, mem_job *job);
+int  ftl_trim(u32 addr, u32 len);
+int  ftl_gc(uint idle);
+int  ftl_pending(void);
+void ftl_erase_range(uint *min, uint *max);
+ftl_stats *ftl_get_stats(void);
+
+#endif
+/* EOF */
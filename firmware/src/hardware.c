@@ -46,6 +46,43 @@ void hw_init(void)
 	_init_usb();
 }
 
+/**
+ * @brief Get the frequency of the APB clock (PCLK)
+ *
+ * The frequency is computed from the current RCC configuration : system
+ * clock source (HSISYS or PLLRCLK), then AHB and APB prescalers.
+ *
+ * @return u32 Frequency of PCLK (in Hz)
+ */
+u32 hw_get_pclk(void)
+{
+	u32 cfgr, pll, clk;
+	uint v;
+
+	cfgr = reg_rd(RCC_CFGR);
+	/* System clock : PLLRCLK or HSISYS (HSI16 / HSIDIV) */
+	if (((cfgr >> 3) & 7) == 2)
+	{
+		pll = reg_rd(RCC_PLL_CFGR);
+		clk = 16000000 / (((pll >> 4) & 7) + 1);  // M
+		clk = clk * ((pll >> 8) & 0x7F);          // N
+		clk = clk / (((pll >> 29) & 7) + 1);      // R
+	}
+	else
+		clk = 16000000 >> ((reg_rd(RCC_CR) >> 11) & 7);
+	/* AHB prescaler (HPRE) */
+	v = (cfgr >> 8) & 0xF;
+	if (v >= 12)
+		clk >>= (v - 6);  // 64 -> 512
+	else if (v >= 8)
+		clk >>= (v - 7);  // 2 -> 16
+	/* APB prescaler (PPRE) */
+	v = (cfgr >> 12) & 7;
+	if (v >= 4)
+		clk >>= (v - 3);
+	return(clk);
+}
+
 /**
  * @brief Configure clocks for main speed operations
  *
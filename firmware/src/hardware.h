@@ -20,6 +20,7 @@
 #define USE_PLL
 
 void hw_init(void);
+u32  hw_get_pclk(void);
 
 /* -------------------------------------------------------------------------- */
 /*                     STM32G0  memory mapped peripherals                     */
@@ -92,6 +93,7 @@ void hw_init(void);
 #define RCC_APBRSTR1  (RCC + 0x2C)
 #define RCC_APBRSTR2  (RCC + 0x30)
 #define RCC_IOPENR    (RCC + 0x34)
+#define RCC_AHBENR    (RCC + 0x38)
 #define RCC_APBENR1   (RCC + 0x3C)
 #define RCC_APBENR2   (RCC + 0x40)
 #define RCC_IOPSMENR  (RCC + 0x44)
@@ -103,6 +105,15 @@ void hw_init(void);
 #define RCC_BDCR      (RCC + 0x5C)
 #define RCC_CSR       (RCC + 0x60)
 
+#define DMA_ISR(x)      (x + 0x00)
+#define DMA_IFCR(x)     (x + 0x04)
+#define DMA_CCR(x, c)   (x + 0x08 + (20 * ((c) - 1)))
+#define DMA_CNDTR(x, c) (x + 0x0C + (20 * ((c) - 1)))
+#define DMA_CPAR(x, c)  (x + 0x10 + (20 * ((c) - 1)))
+#define DMA_CMAR(x, c)  (x + 0x14 + (20 * ((c) - 1)))
+
+#define DMAMUX_CCR(c)   (DMAMUX + (4 * ((c) - 1)))
+
 
 /* -------------------------------------------------------------------------- */
 /*                        Low level register functions                        */
@@ -16,27 +16,127 @@
 #include "libc.h"
 #include "types.h"
 
+/* Copies and fills smaller than this use bytes only (the alignment of the
+ * head would cost more than the words saved) */
+#define LIBC_WORD_MIN 12
+
+static uint copy_words(u8 *d, const u8 *s, uint n);
+static uint copy_shift(u8 *d, const u8 *s, uint n);
+
+/****************************** MEMORY functions ******************************/
+
+/**
+ * @brief Compare the 'n' first bytes of two buffers
+ *
+ * When the two buffers have the same alignment, bytes are compared by 32 bits
+ * words until a difference is found.
+ *
+ * @param s1 Pointer to the first buffer
+ * @param s2 Pointer to the second buffer
+ * @param n  Number of bytes to compare
+ * @return Zero if buffers are equal, else the difference of the first
+ *         different bytes (as unsigned char)
+ */
+int memcmp(const void *s1, const void *s2, int n)
+{
+	const u8 *p1 = (const u8 *)s1;
+	const u8 *p2 = (const u8 *)s2;
+
+	if ((n >= LIBC_WORD_MIN) && ((((u32)p1 ^ (u32)p2) & 3) == 0))
+	{
+		for ( ; (u32)p1 & 3; p1++, p2++, n--)
+		{
+			if (*p1 != *p2)
+				return(*p1 - *p2);
+		}
+		/* Stop on the first different word, bytes are compared below */
+		for ( ; n >= 4; p1 += 4, p2 += 4, n -= 4)
+		{
+			if (*(const uint *)p1 != *(const uint *)p2)
+				break;
+		}
+	}
+	for ( ; n > 0; p1++, p2++, n--)
+	{
+		if (*p1 != *p2)
+			return(*p1 - *p2);
+	}
+	return(0);
+}
+
 /**
  * @brief Copy 'n' bytes from a source buffer to a destination buffer
  *
+ * The destination is aligned first, then data are copied with 32 bits words
+ * (by blocks of 4 words, loaded and stored with ldm/stm). When the source
+ * has not the same alignment, aligned words are read and shifted. Buffers
+ * must not overlap (see memmove).
+ *
  * @param dst Pointer to the destination buffer
  * @param src Pointer to the source buffer
- * @param n   NUmber of bytes to copy
+ * @param n   Number of bytes to copy
+ * @return Pointer to the destination buffer
  */
 void *memcpy(void *dst, const void *src, int n)
 {
-        u8 *s;
-        u8 *d;
-        s = (u8*)src;
-        d = (u8*)dst;
-        while(n)
-        {
-                *d = *s;
-                s ++;
-                d ++;
-                n --;
-        }
-        return(dst);
+	const u8 *s = (const u8 *)src;
+	u8 *d = (u8 *)dst;
+	uint done;
+
+	if (n >= LIBC_WORD_MIN)
+	{
+		for ( ; (u32)d & 3; d++, s++, n--)
+			*d = *s;
+
+		if (((u32)s & 3) == 0)
+			done = copy_words(d, s, (uint)n);
+		else
+			done = copy_shift(d, s, (uint)n);
+		d += done;
+		s += done;
+		n -= (int)done;
+	}
+	for ( ; n > 0; d++, s++, n--)
+		*d = *s;
+	return(dst);
+}
+
+/**
+ * @brief Copy 'n' bytes from a source buffer to a destination buffer, the
+ *        two buffers may overlap
+ *
+ * @param dst Pointer to the destination buffer
+ * @param src Pointer to the source buffer
+ * @param n   Number of bytes to copy
+ * @return Pointer to the destination buffer
+ */
+void *memmove(void *dst, const void *src, int n)
+{
+	const u8 *s = (const u8 *)src;
+	u8 *d = (u8 *)dst;
+
+	/* A forward copy never overwrites source data not yet read when the
+	 * destination is before the source */
+	if ((d <= s) || (d >= (s + n)))
+		return(memcpy(dst, src, n));
+
+	/* Overlap with destination after source : copy from the end */
+	d += n;
+	s += n;
+	if ((n >= LIBC_WORD_MIN) && ((((u32)d ^ (u32)s) & 3) == 0))
+	{
+		for ( ; (u32)d & 3; n--)
+			*--d = *--s;
+		for ( ; n >= 4; n -= 4)
+		{
+			d -= 4;
+			s -= 4;
+			*(uint *)d = *(const uint *)s;
+		}
+	}
+	for ( ; n > 0; n--)
+		*--d = *--s;
+	return(dst);
 }
 
 /**
@@ -45,20 +145,106 @@ void *memcpy(void *dst, const void *src, int n)
  * @param dst   Pointer to the buffer to fill
  * @param value Value to set for each bytes
  * @param n     Number of bytes to fill
+ * @return Pointer to the buffer
  */
 void *memset(void *dst, int value, int n)
 {
-	u8 *d;
-	d = (u8 *)dst;
-	while(n)
+	u8 *d = (u8 *)dst;
+	uint v;
+
+	if (n >= LIBC_WORD_MIN)
 	{
-		*d  = (u8)value;
-		d++;
-		n--;
+		for ( ; (u32)d & 3; d++, n--)
+			*d = (u8)value;
+
+		v = (uint)(u8)value * 0x01010101;
+		/* Blocks of 4 words (stored with stm) */
+		for ( ; n >= 16; d += 16, n -= 16)
+		{
+			((uint *)d)[0] = v;
+			((uint *)d)[1] = v;
+			((uint *)d)[2] = v;
+			((uint *)d)[3] = v;
+		}
+		for ( ; n >= 4; d += 4, n -= 4)
+			*(uint *)d = v;
 	}
+	for ( ; n > 0; d++, n--)
+		*d = (u8)value;
 	return(dst);
 }
 
+/**
+ * @brief Copy 32 bits words between two aligned buffers
+ *
+ * @param d Pointer to the destination (word aligned)
+ * @param s Pointer to the source (word aligned)
+ * @param n Number of bytes available
+ * @return Number of bytes copied (multiple of 4)
+ */
+static uint copy_words(u8 *d, const u8 *s, uint n)
+{
+	uint *dw = (uint *)d;
+	const uint *sw = (const uint *)s;
+	uint a, b, c, e;
+	uint count;
+
+	/* Blocks of 4 words, all loaded before stored (ldm/stm) */
+	for (count = n >> 4; count; count--)
+	{
+		a = sw[0];
+		b = sw[1];
+		c = sw[2];
+		e = sw[3];
+		dw[0] = a;
+		dw[1] = b;
+		dw[2] = c;
+		dw[3] = e;
+		sw += 4;
+		dw += 4;
+	}
+	for (count = (n >> 2) & 3; count; count--)
+		*dw++ = *sw++;
+
+	return(n & ~3U);
+}
+
+/**
+ * @brief Copy 32 bits words from an unaligned source to an aligned buffer
+ *
+ * The Cortex-M0+ does not support unaligned accesses : the source is read
+ * with aligned words and each destination word is made of the end of one
+ * word and the start of the next one (little endian). Words read contain
+ * at least one byte to copy, nothing is read outside the aligned words of
+ * the source.
+ *
+ * @param d Pointer to the destination (word aligned)
+ * @param s Pointer to the source (not word aligned)
+ * @param n Number of bytes available
+ * @return Number of bytes copied (multiple of 4)
+ */
+static uint copy_shift(u8 *d, const u8 *s, uint n)
+{
+	uint *dw = (uint *)d;
+	const uint *sw;
+	uint lsh, rsh;
+	uint w, v;
+	uint count;
+
+	lsh = (uint)((u32)s & 3) * 8;
+	rsh = 32 - lsh;
+	sw  = (const uint *)(s - ((u32)s & 3));
+
+	w = *sw++;
+	for (count = n >> 2; count; count--)
+	{
+		v = *sw++;
+		*dw++ = (w >> lsh) | (v << rsh);
+		w = v;
+	}
+	return(n & ~3U);
+}
+
 /****************************** STRING functions ******************************/
 
 /**
@@ -17,7 +17,9 @@
 #define LIBC_H
 #include "types.h"
 
+int   memcmp (const void *s1, const void *s2, int n);
 void *memcpy (void *dst, const void *src, int n);
+void *memmove(void *dst, const void *src, int n);
 void *memset (void *dst, int value, int n);
 
 int   atoi(char *s);
@@ -24,6 +24,7 @@
 #include "uart.h"
 #include "usb.h"
 #include "usb_msc.h"
+#include "work.h"
 #include "driver/flash_mcu.h"
 
 void test_mem(void);
@@ -41,6 +42,7 @@ int main(void)
 	/* Initialize low-level hardware */
 	hw_init();
 	time_init();
+	work_init();
 	/* Initialize peripherals */
 	uart_init();
 	spi_init();
@@ -93,6 +95,9 @@ int main(void)
 	{
 		usb_periodic();
 
+		/* Make background erase/program progress */
+		mem_periodic();
+
 		app_periodic();
 
 		/* Blink led1 */
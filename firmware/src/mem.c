@@ -17,17 +17,68 @@
 #include "log.h"
 #include "mem.h"
 #include "spi.h"
+#include "time.h"
 #include "types.h"
+#include "usb.h"
+#include "work.h"
 
 //#define MEM_FLASH_INFO
 //#define MEM_FLASH_DEBUG
 
 static mem_node nodes[MEM_NODE_COUNT];
+/* Queue of asynchronous jobs of each node (head is the running one) */
+static mem_job *jobs[MEM_NODE_COUNT];
+/* Read started by mem_read_start and not yet finished (DMA running) */
+static u8       rd_pending[MEM_NODE_COUNT];
+/* Background read finished by another access and failed (see read_end) */
+static u8       rd_error[MEM_NODE_COUNT];
+/* Chip left selected after a polled read into USB packet memory, the next
+ * packet continues the read at rd_next without a new command (see read_end) */
+static u8       rd_open[MEM_NODE_COUNT];
+static u32      rd_next[MEM_NODE_COUNT];
+static u32      rd_tm[MEM_NODE_COUNT];   /* Time of the last packet read */
+static int      mem_work;
+/* Free (unmapped) sectors of each node, one bit per 4k sector (see mem_trim) */
+static u8       free_map[MEM_NODE_COUNT][MEM_FREE_MAP_SZ];
+/* Free sectors already erased (pre-erase pool), always a subset of free_map */
+static u8       erased_map[MEM_NODE_COUNT][MEM_FREE_MAP_SZ];
+static mem_job  pe_jobs[MEM_NODE_COUNT];
+static u32      pe_next[MEM_NODE_COUNT]; /* Next sector to test for pre-erase */
 
+static void job_end(uint nid, mem_job *job, int result);
+static int  job_run(uint nid, mem_job *job);
+static int  job_step(mem_node *node, uint channel, mem_job *job);
+static int  node_poll(uint nid);
+static void read_end (uint nid, u32 addr);
+
+static void free_clear(uint nid, u32 addr, uint len);
+static void free_erased(uint nid, u32 addr);
+static u32  free_next (uint nid);
+static void free_fill (u8 *buffer, uint len);
+static uint free_span (uint nid, u32 addr, uint len, int *is_free);
+
+static void flash_config(mem_node *node, uint channel);
+#if MEM_SPI_CALIBRATE
+static void flash_calibrate(mem_node *node, uint channel);
+#endif
 static const mem_flash_chip *flash_detect(uint channel);
-static int  flash_erase(uint channel, u32 addr);
-static int  flash_read(uint channel, u8 *buffer, u32 addr, uint len);
-static int  flash_write(uint channel, u8 *buffer, u32 addr, uint len);
+static int  flash_command(uint channel, spi_bus *bus, u8 cmd, u32 addr, uint dummy);
+static void flash_erase(uint channel, u32 addr);
+/* Nodes 0 and 1 share the same SPI port (see spi_dma_busy) */
+#define MEM_PORT(nid) (((nid) < 2) ? 0 : 1)
+/* No read to continue, open reads of the port are all closed (see read_end) */
+#define MEM_RD_NONE 0xFFFFFFFF
+/* An open read is closed after this delay without next packet (ms), the
+ * transfer may have been aborted (stall, bus reset) */
+#define MEM_RD_OPEN_MS 2
+
+static int  flash_plan(mem_node *node, uint channel, mem_job *job);
+static void flash_program(uint channel, u8 *buffer, u32 addr, uint len);
+static int  flash_read(mem_node *node, uint channel, u8 *buffer, u32 addr, uint len);
+static int  flash_read_start(mem_node *node, uint channel, u8 *buffer, u32 addr, uint len);
+static int  flash_read_end(uint channel);
+static u8   flash_status(uint channel);
+static int  flash_wait(uint channel);
 static void flash_write_enable(uint channel);
 
 /**
@@ -42,7 +93,19 @@ void mem_init(void)
 	int i;
 
 	for (i = 0; i < MEM_NODE_COUNT; i++)
+	{
 		memset(&nodes[i], 0, sizeof(mem_node));
+		jobs[i] = 0;
+		rd_pending[i] = 0;
+		rd_error[i]   = 0;
+		rd_open[i]    = 0;
+	}
+	/* State of sectors is unknown on startup, all are considered used */
+	memset(free_map,   0, sizeof(free_map));
+	memset(erased_map, 0, sizeof(erased_map));
+	memset(pe_next,    0, sizeof(pe_next));
+	/* Erase/program are processed as deferred work (see mem_poll) */
+	mem_work = work_register(mem_poll, WORK_PRIO_HIGH);
 }
 
 /**
@@ -58,6 +121,8 @@ int mem_detect(void)
 
 	for (i = 0; i < MEM_NODE_COUNT; i++)
 	{
+		/* Chip must not be left selected by a previous read */
+		read_end(i, MEM_RD_NONE);
 		// Reduce speed during chip detect (1MHz)
 		spi_set_speed(i+1, 1);
 
@@ -67,6 +132,12 @@ int mem_detect(void)
 			nodes[i].type  = 1; // Flash
 			nodes[i].chip  = (void *)fc;
 			nodes[i].speed = fc->speed;
+			flash_config(&nodes[i], i+1);
+#if MEM_SPI_CALIBRATE
+			flash_calibrate(&nodes[i], i+1);
+			/* Clock may have been limited, select the command again */
+			flash_config(&nodes[i], i+1);
+#endif
 			continue;
 		}
 
@@ -112,15 +183,16 @@ int mem_erase(uint nid, u32 addr, uint len)
 	if (node->type == 0)
 		return(0);
 
-	/* Update SPI speed */
-	spi_set_speed(nid+1, node->speed);
-
 	/* If the chip connected to this node is Flash */
 	if (node->type == 1)
 	{
 		if ((addr & 0xFFF) == 0)
 		{
-			flash_erase(nid + 1, addr);
+			mem_job job;
+			job.type = MEM_JOB_ERASE;
+			job.addr = addr;
+			job.len  = 4096;
+			job_run(nid, &job);
 			len = 4096;
 		}
 		else
@@ -153,11 +225,13 @@ int mem_erase(uint nid, u32 addr, uint len)
  * @param addr Address to read
  * @param len  Number of bytes to read
  * @param buffer Pointer to a buffer to store data (if null, use cache)
- * @return Number of readed bytes
+ * @return Number of readed bytes, -1 on SPI error
  */
 int mem_read(uint nid, u32 addr, uint len, u8 *buffer)
 {
 	mem_node *node;
+	uint done, n;
+	int  is_free;
 
 	// Sanity check
 	if (nid >= MEM_NODE_COUNT)
@@ -168,20 +242,55 @@ int mem_read(uint nid, u32 addr, uint len, u8 *buffer)
 	if (node->type == 0)
 		return(0);
 
-	/* Update SPI speed */
-	spi_set_speed(nid+1, node->speed);
+	/* Free sectors contain zeros, there is no need to access the chip */
+	if (buffer && (free_span(nid, addr, len, &is_free) == len) && is_free)
+	{
+		free_fill(buffer, len);
+		return((int)len);
+	}
+
+	/* A read may be still running on the same port (see read_end) */
+	read_end(nid, addr);
+
+	/* Chip does not accept read while an erase/program is running */
+	if (jobs[nid] && (jobs[nid]->state == MEM_JOB_BUSY))
+	{
+		read_end(nid, MEM_RD_NONE);
+		spi_set_speed(nid+1, node->speed);
+		flash_wait(nid + 1);
+	}
+
+	/* Update SPI speed (limited by the selected read command) */
+	spi_set_speed(nid+1, node->read_speed);
 
 	/* If the chip connected to this node is Flash */
 	if (node->type == 1)
 	{
 		if (buffer)
-			flash_read(nid + 1, buffer, addr, len);
+		{
+			/* Read used sectors, fill free ones with zeros */
+			for (done = 0; done < len; done += n)
+			{
+				n = free_span(nid, addr + done, len - done, &is_free);
+				if (is_free)
+					free_fill(buffer + done, n);
+				else if (flash_read(node, nid + 1, buffer + done, addr + done, n) < 0)
+					return(-1);
+			}
+		}
 		else
 		{
 			u32 addr_end, addr_tmp;
 			// Read into internal cache must be 4k aligned
 			node->cache_addr = (addr & 0xFFFFF000);
-			flash_read(nid + 1, node->cache_buffer, node->cache_addr, 4096);
+			if (mem_is_free(nid, node->cache_addr))
+				free_fill(node->cache_buffer, 4096);
+			else if (flash_read(node, nid + 1, node->cache_buffer, node->cache_addr, 4096) < 0)
+			{
+				/* Cache content is not valid */
+				node->cache_addr = 0xFFFFFFFF;
+				return(-1);
+			}
 			// Compute number of readed bytes into requested region
 			addr_end = (node->cache_addr + 4096);
 			addr_tmp = addr + len;
@@ -206,9 +315,113 @@ int mem_read(uint nid, u32 addr, uint len, u8 *buffer)
 	return((int)len);
 }
 
+/**
+ * @brief Start to read memory, without waiting the end of transfer
+ *
+ * Large reads are received by DMA, so reads on nodes connected to different
+ * SPI ports (SPI1 and SPI2) can run at the same time. A node can only have
+ * one read running, and nodes 0 and 1 share the same port. The transfer
+ * should be finished with mem_read_wait, but it can also be left running
+ * (read-ahead) : any other access to the port ends it first, then
+ * mem_read_wait does nothing. Reads into USB packet memory and small reads
+ * are polled, the data are received when this function returns.
+ *
+ * @param nid  Identifier of the memory node to read from
+ * @param addr Address to read
+ * @param len  Number of bytes to read
+ * @param buffer Pointer to a buffer to store data
+ * @return integer Zero if started (or done), -2 if SPI port is busy, -1 on error
+ */
+int mem_read_start(uint nid, u32 addr, uint len, u8 *buffer)
+{
+	mem_node *node;
+	uint n;
+	int  is_free;
+	int  result;
+
+	// Sanity check
+	if ((nid >= MEM_NODE_COUNT) || (buffer == 0))
+		return(-1);
+
+	node = &nodes[nid];
+
+	if (node->type != 1)
+		return(-1);
+
+	/* Reads still running on the port are finished first (see read_end) */
+	read_end(nid, addr);
+
+	/* Area with free sectors : zeros, or mixed area read without DMA */
+	n = free_span(nid, addr, len, &is_free);
+	if ((n != len) || is_free)
+	{
+		/* Some sectors must be read from chip, SPI port must be free */
+		if ((n != len) && spi_dma_busy(nid + 1))
+			return(-2);
+		if (mem_read(nid, addr, len, buffer) < 0)
+			return(-1);
+		return(0);
+	}
+
+	/* SPI port used by another transfer (DMA running) */
+	if (spi_dma_busy(nid + 1))
+		return(-2);
+
+	/* Chip does not accept read while an erase/program is running */
+	if (jobs[nid] && (jobs[nid]->state == MEM_JOB_BUSY))
+	{
+		read_end(nid, MEM_RD_NONE);
+		spi_set_speed(nid+1, node->speed);
+		flash_wait(nid + 1);
+	}
+
+	/* Update SPI speed (limited by the selected read command) */
+	spi_set_speed(nid+1, node->read_speed);
+
+	result = flash_read_start(node, nid + 1, buffer, addr, len);
+	if (result < 0)
+		return(-1);
+	rd_pending[nid] = (u8)result;
+	rd_error[nid]   = 0;
+	return(0);
+}
+
+/**
+ * @brief Wait the end of a read started by mem_read_start
+ *
+ * The read may have been finished before by another access to the SPI port
+ * (see read_end), its result is kept until this function is called.
+ *
+ * @param nid Identifier of the memory node
+ * @return integer Zero on success, -1 on error (data not valid)
+ */
+int mem_read_wait(uint nid)
+{
+	int result = 0;
+
+	if (nid >= MEM_NODE_COUNT)
+		return(0);
+	if (rd_pending[nid])
+	{
+		result = flash_read_end(nid + 1);
+		rd_pending[nid] = 0;
+	}
+	else if (rd_error[nid])
+		result = -1;
+	rd_error[nid] = 0;
+	return(result);
+}
+
 /**
  * @brief Write data to memory
  *
+ * When the address is aligned on a flash sector, the whole sector is
+ * rewritten : bytes after the specified length will be erased. The content
+ * of the sector is first compared with the new data, the erase is skipped
+ * when only 1 -> 0 bits changes are needed and only modified pages are
+ * programmed (see flash_plan). This function wait the end of the write,
+ * mem_submit can be used to write without waiting.
+ *
  * @param nid Identifier of the memory node to write to
  * @param addr Address to write
  * @param len  Number of bytes to write
@@ -228,25 +441,37 @@ int mem_write(uint nid, u32 addr, uint len, u8 *buffer)
 	if (node->type == 0)
 		return(0);
 
-	/* Update SPI speed */
-	spi_set_speed(nid+1, node->speed);
-
 	/* If the chip connected to this node is Flash */
 	if (node->type == 1)
 	{
+		mem_job job;
+
+		job.type   = MEM_JOB_UPDATE;
+		job.addr   = addr;
+		job.len    = len;
+		job.buffer = buffer;
 		if (buffer)
 		{
-			// If specified address is aligned to a sector, erase it first
-			if ((addr & 0xFFF) == 0)
-				flash_erase(nid + 1, addr);
-			flash_write(nid + 1, buffer, addr, len);
+			// If specified address is not aligned to a sector, erase and
+			// program it (or only program)
+			if (((addr & 0xFFF) != 0) || (len > MEM_SECTOR_SZ))
+			{
+				if ((addr & 0xFFF) == 0)
+				{
+					job.type = MEM_JOB_ERASE;
+					job_run(nid, &job);
+				}
+				job.type = MEM_JOB_PROGRAM;
+			}
 		}
 		else
 		{
-			flash_erase(nid + 1, node->cache_addr);
-			flash_write(nid + 1, node->cache_buffer, node->cache_addr, 4096);
+			job.addr   = node->cache_addr;
+			job.len    = 4096;
+			job.buffer = node->cache_buffer;
 			len = 4096;
 		}
+		job_run(nid, &job);
 	}
 	/* If the chip connected to this node is SRAM */
 	else if (node->type == 2)
@@ -264,16 +489,660 @@ int mem_write(uint nid, u32 addr, uint len, u8 *buffer)
 	return((int)len);
 }
 
+/**
+ * @brief Program data into an already erased area (blocking)
+ *
+ * Unlike mem_write, the sector is never compared nor erased : only 1 -> 0
+ * bits changes are done. This is used for small metadata updates, where
+ * fields are written (or cleared) one after the other into a sector erased
+ * once. The area must not cross a flash page.
+ *
+ * @param nid    Identifier of the memory node to write to
+ * @param addr   Address of the first byte to program
+ * @param len    Number of bytes to program
+ * @param buffer Pointer to a buffer with data to program
+ * @return integer Zero on success, other values are errors
+ */
+int mem_program(uint nid, u32 addr, uint len, u8 *buffer)
+{
+	mem_job job;
+
+	// Sanity check
+	if ((nid >= MEM_NODE_COUNT) || (buffer == 0))
+		return(-1);
+	if (nodes[nid].type != 1)
+		return(-1);
+
+	job.type   = MEM_JOB_PROGRAM;
+	job.addr   = addr;
+	job.len    = len;
+	job.buffer = buffer;
+	return(job_run(nid, &job));
+}
+
+/**
+ * @brief Queue an asynchronous erase or program job
+ *
+ * The job is processed in background by mem_poll : the CPU only send the
+ * commands and read the chip status, it does not wait the end of each
+ * erase/program. The job structure and the data buffer must not be modified
+ * until the job is done (state is MEM_JOB_DONE, complete callback called).
+ * The callback (if any) is called from mem_poll context.
+ *
+ * @param nid Identifier of the memory node to write to
+ * @param job Pointer to the job (type, addr, len, buffer and complete set)
+ * @return integer Zero on success, other values are errors
+ */
+int mem_submit(uint nid, mem_job *job)
+{
+	mem_job *last;
+	u32 s;
+
+	// Sanity check
+	if ((nid >= MEM_NODE_COUNT) || (job == 0))
+		return(-1);
+	if (nodes[nid].type != 1)
+		return(-1);
+
+	job->result = 0;
+	job->state  = MEM_JOB_PENDING;
+	job->pos    = 0;
+	job->todo   = 0;
+	job->erased = 0;
+	job->next   = 0;
+
+	/* A sector of the pre-erase pool can be programmed without compare */
+	if (job->type == MEM_JOB_UPDATE)
+	{
+		s = (job->addr / MEM_SECTOR_SZ);
+		if ((s < (MEM_FREE_MAP_SZ * 8)) && (erased_map[nid][s >> 3] & (1 << (s & 7))))
+		{
+			job->erased = 1;
+			nodes[nid].st_pool_hit++;
+		}
+		else
+			nodes[nid].st_pool_miss++;
+	}
+	/* Sectors with new data are used (an erased sector stays free) */
+	if (job->type != MEM_JOB_ERASE)
+		free_clear(nid, job->addr, job->len);
+
+	/* Insert job at the end of the queue */
+	if (jobs[nid] == 0)
+		jobs[nid] = job;
+	else
+	{
+		for (last = jobs[nid]; last->next; last = last->next)
+			;
+		last->next = job;
+	}
+	work_post(mem_work);
+	return(0);
+}
+
+/**
+ * @brief Declare an area of memory as free (data no more used)
+ *
+ * The host report unused blocks (UNMAP), sectors fully covered by the area
+ * are marked free into a small bitmap. Reading a free sector gives zeros
+ * without any access to the chip, and the sector is used again when data
+ * are written into it (see mem_submit). The bitmap is not saved, all the
+ * sectors are considered used on startup.
+ *
+ * @param nid  Identifier of the memory node
+ * @param addr Address of the first byte of the area
+ * @param len  Number of bytes of the area
+ * @return integer Number of sectors marked free
+ */
+int mem_trim(uint nid, u32 addr, uint len)
+{
+	u32 first, last, s;
+	int count = 0;
+
+	// Sanity check
+	if ((nid >= MEM_NODE_COUNT) || (nodes[nid].type != 1))
+		return(0);
+
+	/* Only complete sectors (and covered by bitmap) can be marked */
+	first = (addr + MEM_SECTOR_SZ - 1) / MEM_SECTOR_SZ;
+	last  = (addr + len) / MEM_SECTOR_SZ;
+	if (last > (MEM_FREE_MAP_SZ * 8))
+		last = (MEM_FREE_MAP_SZ * 8);
+	for (s = first; s < last; s++)
+	{
+		free_map[nid][s >> 3] |= (u8)(1 << (s & 7));
+		count++;
+	}
+	return(count);
+}
+
+/**
+ * @brief Test if the sector that contains an address is free
+ *
+ * @param nid  Identifier of the memory node
+ * @param addr Address to test
+ * @return boolean True if the sector is free (see mem_trim)
+ */
+int mem_is_free(uint nid, u32 addr)
+{
+	u32 s = (addr / MEM_SECTOR_SZ);
+
+	if ((nid >= MEM_NODE_COUNT) || (s >= (MEM_FREE_MAP_SZ * 8)))
+		return(0);
+	return((free_map[nid][s >> 3] >> (s & 7)) & 1);
+}
+
+/**
+ * @brief Erase one free sector in background (pre-erase pool)
+ *
+ * This function should be called when the host does not use the memory
+ * (idle time) : a free sector (see mem_trim) is erased, so a next write into
+ * it only need page programs. Nothing is done when the node is busy or when
+ * the pool already contains MEM_POOL_DEPTH sectors. An access to the node
+ * during the erase must wait the end of it (up to ~50ms).
+ *
+ * @param nid Identifier of the memory node
+ * @return boolean True if an erase has been started
+ */
+int mem_preerase(uint nid)
+{
+	mem_job *job;
+	u32 s;
+
+	// Sanity check
+	if ((nid >= MEM_NODE_COUNT) || (nodes[nid].type != 1))
+		return(0);
+	if (jobs[nid] || rd_pending[nid] || (nodes[nid].st_pool >= MEM_POOL_DEPTH))
+		return(0);
+
+	s = free_next(nid);
+	if (s >= (MEM_FREE_MAP_SZ * 8))
+		return(0);
+
+	job = &pe_jobs[nid];
+	job->type     = MEM_JOB_ERASE;
+	job->addr     = s * MEM_SECTOR_SZ;
+	job->len      = MEM_SECTOR_SZ;
+	job->buffer   = 0;
+	job->complete = 0;
+	if (mem_submit(nid, job))
+		return(0);
+	nodes[nid].st_pre_erase++;
+	return(1);
+}
+
+/**
+ * @brief Test if a memory node has jobs not yet done
+ *
+ * @param nid Identifier of the memory node
+ * @return boolean True if at least one job is queued or running
+ */
+int mem_busy(uint nid)
+{
+	if (nid >= MEM_NODE_COUNT)
+		return(0);
+	return(jobs[nid] != 0);
+}
+
+/**
+ * @brief Process queued jobs (never wait the chip)
+ *
+ * For each node, the status of the chip is read : if the current operation
+ * is still running, nothing more is done. Else the next operation of the
+ * job is started (one erase or one page program) or the job is completed.
+ * This function is registered as a deferred work item, so it is serialized
+ * with others SPI accesses (SCSI state machine, cache flush).
+ */
+void mem_poll(void)
+{
+	uint i;
+
+	for (i = 0; i < MEM_NODE_COUNT; i++)
+	{
+		/* Read left open and not continued, release the chip */
+		if (rd_open[i] && (time_since(rd_tm[i]) >= MEM_RD_OPEN_MS))
+			read_end(i, MEM_RD_NONE);
+		node_poll(i);
+	}
+}
+
+/**
+ * @brief Periodically called by the main loop to make jobs progress
+ *
+ */
+void mem_periodic(void)
+{
+	uint i;
+
+	for (i = 0; i < MEM_NODE_COUNT; i++)
+	{
+		if (jobs[i] ||
+		    (rd_open[i] && (time_since(rd_tm[i]) >= MEM_RD_OPEN_MS)))
+		{
+			work_post(mem_work);
+			break;
+		}
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                            Jobs functions                            -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Remove a job of a node from queue and notify completion
+ *
+ * @param nid    Identifier of the memory node
+ * @param job    Pointer to the job (the running one or a pending one)
+ * @param result Result of the job (zero on success)
+ */
+static void job_end(uint nid, mem_job *job, int result)
+{
+	mem_job **prev;
+
+	for (prev = &jobs[nid]; *prev && (*prev != job); prev = &(*prev)->next)
+		;
+	if ((job == 0) || (*prev == 0))
+		return;
+	*prev = job->next;
+	job->next = 0;
+	if (result)
+		job->result = result;
+	/* A free sector erased is added to the pre-erase pool */
+	if ((job->type == MEM_JOB_ERASE) && (job->result == 0))
+		free_erased(nid, job->addr);
+	job->state = MEM_JOB_DONE;
+	if (job->complete)
+		job->complete(job);
+}
+
+/**
+ * @brief Queue a job and wait until it is done (blocking)
+ *
+ * This is used by the synchronous API (mem_erase, mem_write). Jobs already
+ * into the queue are processed first.
+ *
+ * @param nid Identifier of the memory node
+ * @param job Pointer to the job to process
+ * @return integer Zero on success, other values are errors
+ */
+static int job_run(uint nid, mem_job *job)
+{
+	job->complete = 0;
+	if (mem_submit(nid, job))
+		return(-1);
+	while (job->state != MEM_JOB_DONE)
+	{
+		/* Wait end of the running operation. On timeout the chip does
+		 * not answer : the running job and the one of the caller (if
+		 * still pending behind it) are aborted */
+		if (node_poll(nid) && flash_wait(nid + 1))
+		{
+			if (jobs[nid] != job)
+				job_end(nid, jobs[nid], -1);
+			job_end(nid, job, -1);
+		}
+	}
+	return(job->result);
+}
+
+/**
+ * @brief Start the next operation of a job
+ *
+ * An update job (sector rewrite) start by a comparison of the current and new
+ * content (see flash_plan) then an erase (if needed) and one program per
+ * page to write. Other jobs are one erase or a list of page program.
+ *
+ * @param node    Pointer to the memory node
+ * @param channel Id of the (spi) channel to access
+ * @param job     Pointer to the job to process
+ * @return boolean True if an operation has been started, false when done
+ */
+static int job_step(mem_node *node, uint channel, mem_job *job)
+{
+	uint end, pos, count;
+
+	if (job->state == MEM_JOB_PENDING)
+	{
+		job->state = MEM_JOB_BUSY;
+		if (job->type == MEM_JOB_ERASE)
+		{
+			flash_erase(channel, job->addr);
+			job->pos = job->len;
+			return(1);
+		}
+		if (job->type == MEM_JOB_UPDATE)
+		{
+			if (flash_plan(node, channel, job))
+			{
+				flash_erase(channel, job->addr);
+				node->st_erase++;
+				return(1);
+			}
+			node->st_erase_skip++;
+		}
+	}
+
+	/* An update job always scan all pages of the sector (for stats) */
+	end = job->len;
+	if (job->type == MEM_JOB_UPDATE)
+		end = MEM_SECTOR_SZ;
+
+	while (job->pos < end)
+	{
+		pos = job->pos;
+		job->pos += MEM_PAGE_SZ;
+		if (job->type == MEM_JOB_UPDATE)
+		{
+			if (((job->todo & (1 << (pos / MEM_PAGE_SZ))) == 0) ||
+			    (pos >= job->len))
+			{
+				node->st_page_skip++;
+				continue;
+			}
+			node->st_page++;
+		}
+		count = job->len - pos;
+		if (count > MEM_PAGE_SZ)
+			count = MEM_PAGE_SZ;
+		flash_program(channel, job->buffer + pos, job->addr + pos, count);
+		return(1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Process the jobs of one node
+ *
+ * @param nid Identifier of the memory node
+ * @return boolean True if the chip is busy (operation running)
+ */
+static int node_poll(uint nid)
+{
+	mem_node *node = &nodes[nid];
+	mem_job  *job;
+	u8 status;
+
+	/* A read left running on this port is ended first (see read_end) */
+	if (jobs[nid])
+		read_end(nid, MEM_RD_NONE);
+
+	while ((job = jobs[nid]) != 0)
+	{
+		spi_set_speed(nid + 1, node->speed);
+		if (job->state == MEM_JOB_BUSY)
+		{
+			status = flash_status(nid + 1);
+			/* Previous operation still running */
+			if (status & 1)
+				return(1);
+			if (status & (1 << 5))
+			{
+				log_puts("FLASH: Erase/Write ERROR\n");
+				job->result = -1;
+			}
+		}
+		if (job_step(node, nid + 1, job))
+			return(1);
+		job_end(nid, job, 0);
+	}
+	return(0);
+}
+
+/**
+ * @brief End the reads still running on the SPI port of a node
+ *
+ * A read started by mem_read_start can be left running in background (for
+ * example a read-ahead while USB send previous data). The DMA and the chip
+ * select of such a read must be released before the port is used again.
+ * A polled read into USB packet memory is left open (chip still selected) :
+ * it is kept only when the next read of the same node continues it.
+ *
+ * @param nid  Identifier of the memory node
+ * @param addr Address of the next read of this node (or MEM_RD_NONE)
+ */
+static void read_end(uint nid, u32 addr)
+{
+	uint i;
+
+	for (i = 0; i < MEM_NODE_COUNT; i++)
+	{
+		if (MEM_PORT(i) != MEM_PORT(nid))
+			continue;
+		if (rd_pending[i])
+		{
+			if (flash_read_end(i + 1) < 0)
+				rd_error[i] = 1;
+			rd_pending[i] = 0;
+		}
+		if (rd_open[i] && ((i != nid) || (rd_next[i] != addr)))
+		{
+			spi_cs(i + 1, 0);
+			rd_open[i] = 0;
+		}
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                        Free sectors functions                        -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Mark as used all the sectors touched by an area
+ *
+ * @param nid  Identifier of the memory node
+ * @param addr Address of the first byte of the area
+ * @param len  Number of bytes of the area
+ */
+static void free_clear(uint nid, u32 addr, uint len)
+{
+	u32 s, last;
+
+	if (len == 0)
+		return;
+	last = (addr + len - 1) / MEM_SECTOR_SZ;
+	for (s = (addr / MEM_SECTOR_SZ); (s <= last) && (s < (MEM_FREE_MAP_SZ * 8)); s++)
+	{
+		free_map[nid][s >> 3] &= (u8)~(1 << (s & 7));
+		/* Sector removed from the pre-erase pool */
+		if (erased_map[nid][s >> 3] & (1 << (s & 7)))
+		{
+			erased_map[nid][s >> 3] &= (u8)~(1 << (s & 7));
+			nodes[nid].st_pool--;
+		}
+	}
+}
+
+/**
+ * @brief Add a sector to the pre-erase pool, after its erase
+ *
+ * Only free sectors are added : when data have been submitted for the
+ * sector during the erase, it is already used.
+ *
+ * @param nid  Identifier of the memory node
+ * @param addr Address of the erased sector
+ */
+static void free_erased(uint nid, u32 addr)
+{
+	u32 s = (addr / MEM_SECTOR_SZ);
+	u8  mask;
+
+	if ((s >= (MEM_FREE_MAP_SZ * 8)) || (mem_is_free(nid, addr) == 0))
+		return;
+	mask = (u8)(1 << (s & 7));
+	if (erased_map[nid][s >> 3] & mask)
+		return;
+	erased_map[nid][s >> 3] |= mask;
+	nodes[nid].st_pool++;
+}
+
+/**
+ * @brief Search the next free sector not yet erased
+ *
+ * The search starts after the last sector found, so sectors are erased in
+ * turn over the whole node.
+ *
+ * @param nid Identifier of the memory node
+ * @return u32 Index of the sector (MEM_FREE_MAP_SZ * 8 if none)
+ */
+static u32 free_next(uint nid)
+{
+	uint i, pos;
+	u8   m;
+
+	for (i = 0; i <= MEM_FREE_MAP_SZ; i++)
+	{
+		pos = (uint)(((pe_next[nid] >> 3) + i) % MEM_FREE_MAP_SZ);
+		m = (u8)(free_map[nid][pos] & ~erased_map[nid][pos]);
+		/* First byte tested from the current position only */
+		if (i == 0)
+			m &= (u8)(0xFF << (pe_next[nid] & 7));
+		if (m == 0)
+			continue;
+		for (pe_next[nid] = (pos * 8); (m & 1) == 0; m >>= 1)
+			pe_next[nid]++;
+		return(pe_next[nid]);
+	}
+	return(MEM_FREE_MAP_SZ * 8);
+}
+
+/**
+ * @brief Fill a buffer with the content of free sectors (zeros)
+ *
+ * @param buffer Pointer to the buffer to fill (RAM or USB packet memory)
+ * @param len    Number of bytes to fill
+ */
+static void free_fill(u8 *buffer, uint len)
+{
+	/* USB packet memory only accept 32 bits accesses (see memset_pma) */
+	memset_pma(buffer, 0, len);
+}
+
+/**
+ * @brief Get the length of an area with sectors of the same state
+ *
+ * @param nid     Identifier of the memory node
+ * @param addr    Address of the first byte of the area
+ * @param len     Maximum length of the area
+ * @param is_free Pointer to a variable to store the state of the sectors
+ * @return integer Number of bytes from addr with the same state (up to len)
+ */
+static uint free_span(uint nid, u32 addr, uint len, int *is_free)
+{
+	uint n;
+
+	*is_free = mem_is_free(nid, addr);
+	n = MEM_SECTOR_SZ - (addr & (MEM_SECTOR_SZ - 1));
+	while ((n < len) && (mem_is_free(nid, addr + n) == *is_free))
+		n += MEM_SECTOR_SZ;
+	if (n > len)
+		n = len;
+	return(n);
+}
+
 /* -------------------------------------------------------------------------- */
 /* --                       Private flash functions                        -- */
 /* -------------------------------------------------------------------------- */
 
 #define FLASH_CHIPS_COUNT 2
 const mem_flash_chip flash_chips[FLASH_CHIPS_COUNT] = {
-	{0xC2, 0x201A, 65536, 166, "MX25L51245G"}, // Macronix 512Mbits NOR
-	{0x9D, 0x6018, 16384, 166, "IS25LP128F"},  // ISSI 128Mbits NOR
+	// Macronix 512Mbits NOR
+	{0xC2, 0x201A, 65536, 166, 50,
+	 MEM_FLASH_FAST | MEM_FLASH_DUAL | MEM_FLASH_QUAD | MEM_FLASH_ADDR4, 8,
+	 "MX25L51245G"},
+	// ISSI 128Mbits NOR
+	{0x9D, 0x6018, 16384, 166, 50,
+	 MEM_FLASH_FAST | MEM_FLASH_DUAL | MEM_FLASH_QUAD, 8, "IS25LP128F"},
 };
 
+/**
+ * @brief Select the read command to use for a detected flash chip
+ *
+ * Read Data (0x03) has no dummy cycle but is limited to a low clock on most
+ * chips. Fast Read (0x0B) is only used when the SPI port really runs faster
+ * than this limit (the clock is a divisor of PCLK, see spi_set_speed) :
+ * otherwise the dummy cycles are lost time. Dual and Quad output reads are
+ * not used : the board only wire one data line in each direction (IO2/IO3
+ * are used as WP/HOLD).
+ *
+ * @param node    Pointer to the memory node (chip detected, speed set)
+ * @param channel Id of the (spi) channel of the node
+ */
+static void flash_config(mem_node *node, uint channel)
+{
+	const mem_flash_chip *fc = node->chip;
+
+	node->read_cmd   = 0x03;
+	node->read_dummy = 0;
+	node->read_speed = fc->read_speed;
+	if (node->read_speed > node->speed)
+		node->read_speed = node->speed;
+
+	/* Clock really used for the commands, in kHz */
+	spi_set_speed(channel, node->speed);
+	if ((fc->flags & MEM_FLASH_FAST) &&
+	    (spi_get_speed(channel) > (fc->read_speed * 1000)))
+	{
+		node->read_cmd   = 0x0B;
+		// SPI frames are 8 bits, dummy cycles are sent as bytes
+		node->read_dummy = (u8)((fc->dummy + 7) >> 3);
+		node->read_speed = node->speed;
+	}
+#ifdef MEM_FLASH_INFO
+	log_print(LOG_INF, "FLASH: Use read command %8x (%d MHz)\n",
+	          node->read_cmd, node->read_speed);
+#endif
+}
+
+#if MEM_SPI_CALIBRATE
+/**
+ * @brief Limit the SPI clock of a node to the speed that works on the board
+ *
+ * The limits of the chip may not be reachable on a board (long traces,
+ * level shifters). A reference block is read at low speed (1MHz), then the
+ * clock is stepped up (one divisor at a time) up to the read speed of the
+ * chip : at each step the JEDEC-ID and the same block must be read. The
+ * speeds of the node are limited to the last step that works.
+ *
+ * @param node    Pointer to the memory node (chip detected and configured)
+ * @param channel Id of the (spi) channel to access
+ */
+static void flash_calibrate(mem_node *node, uint channel)
+{
+	u8   ref[MEM_CAL_SZ];
+	u8   data[MEM_CAL_SZ];
+	uint speed, best, i;
+
+	spi_set_speed(channel, 1);
+	flash_read(node, channel, ref, 0, MEM_CAL_SZ);
+
+	best = 1;
+	for (speed = 2; speed <= node->read_speed; speed <<= 1)
+	{
+		spi_set_speed(channel, speed);
+		if (flash_detect(channel) != node->chip)
+			break;
+		flash_read(node, channel, data, 0, MEM_CAL_SZ);
+		for (i = 0; i < MEM_CAL_SZ; i++)
+			if (data[i] != ref[i])
+				break;
+		if (i != MEM_CAL_SZ)
+			break;
+		best = speed;
+	}
+	/* A step failed, use the last one that works */
+	if (speed <= node->read_speed)
+	{
+		node->read_speed = best;
+		if (node->speed > best)
+			node->speed = best;
+	}
+#ifdef MEM_FLASH_INFO
+	log_print(LOG_INF, "FLASH: Clock limited to %d MHz\n", node->read_speed);
+#endif
+}
+#endif
+
 /**
  * @brief Try to detect a flash chip connected to one memory slot
  *
@@ -283,24 +1152,21 @@ const mem_flash_chip flash_chips[FLASH_CHIPS_COUNT] = {
 static const mem_flash_chip *flash_detect(uint channel)
 {
 	const mem_flash_chip *chip = 0;
+	spi_bus *bus;
+	u8  id[4] = {0x9F, 0x00, 0x00, 0x00}; /* Read JEDEC-ID command */
 	u8  vendor_id;
 	u16 device_id;
-	u32 r;
 	int i;
 
+	bus = spi_bus_get(channel);
 	/* Enable selected chip (CS) */
 	spi_cs(channel, 1);
-	/* Read JEDEC-ID command */
-	spi_rw(channel, 0x9F);
-	/* First data byte : Manufacturer ID */
-	vendor_id = spi_rw(channel, 0x00);
-	/* Second data byte : Device ID (1) */
-	r = spi_rw(channel, 0x00);
-	device_id = (u16)(r << 8);
-	/* Third data byte : Device ID (2) */
-	device_id |= (u16)spi_rw(channel, 0x00);
+	/* Send command, receive Manufacturer ID and Device ID (2 bytes) */
+	spi_xfer(bus, id, id, 4);
 	/* Disable chip (CS) */
 	spi_cs(channel, 0);
+	vendor_id = id[1];
+	device_id = (u16)((id[2] << 8) | id[3]);
 
 	if ((vendor_id == 0) || (vendor_id == 0xFF))
 		return(0);
@@ -326,90 +1192,171 @@ static const mem_flash_chip *flash_detect(uint channel)
 }
 
 /**
- * @brief Erase one (4k) block
+ * @brief Send a command with an address (and dummy bytes) to the flash
+ *
+ * The chip must be selected (CS) before, the data phase (if any) follows.
+ * Chips larger than 16MB can not be addressed with 24 bits : for them the
+ * command is replaced by its 4 bytes address version (the chip stay into
+ * its default 3 bytes mode, there is no state to restore).
+ *
+ * @param channel Id of the (spi) channel, to get the detected chip
+ * @param bus     Pointer to the SPI bus handle
+ * @param cmd     Command code (3 bytes address version)
+ * @param addr    Address
+ * @param dummy   Number of dummy bytes (up to 4)
+ * @return integer Zero on success, -1 on SPI error (see spi_xfer)
+ */
+static int flash_command(uint channel, spi_bus *bus, u8 cmd, u32 addr, uint dummy)
+{
+	const mem_flash_chip *fc = nodes[channel - 1].chip;
+	u8   hdr[9] = {0};
+	uint n = 1;
+
+	if (fc && (fc->flags & MEM_FLASH_ADDR4))
+	{
+		switch (cmd)
+		{
+			case 0x03: cmd = 0x13; break; // Read Data
+			case 0x0B: cmd = 0x0C; break; // Fast Read
+			case 0x02: cmd = 0x12; break; // Page Program
+			case 0x20: cmd = 0x21; break; // Sector Erase (4k)
+		}
+		hdr[n++] = (u8)(addr >> 24);
+	}
+	hdr[0]   = cmd;
+	hdr[n++] = (u8)(addr >> 16);
+	hdr[n++] = (u8)(addr >>  8);
+	hdr[n++] = (u8)(addr >>  0);
+	if (dummy > 4)
+		dummy = 4;
+	return(spi_write_block(bus, hdr, n + dummy));
+}
+
+/**
+ * @brief Start the erase of one (4k) block
+ *
+ * This function only send the command, the chip is busy during the erase
+ * (see flash_status).
  *
  * @param channel Id of the (spi) channel to access
  * @param addr    Address of the block to erase
- * @return integer Zero is returned on success, other values are errors
  */
-static int flash_erase(uint channel, u32 addr)
+static void flash_erase(uint channel, u32 addr)
 {
-	u8  status;
-	int i;
+	spi_bus *bus;
+
 #ifdef MEM_FLASH_INFO
 	log_print(LOG_INF, "FLASH: Erase 4k sector at address %24x\n", addr);
 #endif
 	flash_write_enable(channel);
 
+	bus = spi_bus_get(channel);
 	/* Enable selected chip (CS) */
 	spi_cs(channel, 1);
 	/* Send command: Block Erase (4k) */
-	spi_rw(channel, 0x20);
-	/* Send address */
-	spi_rw(channel, (addr >> 16) & 0xFF);
-	spi_rw(channel, (addr >>  8) & 0xFF);
-	spi_rw(channel, (addr >>  0) & 0xFF);
-	/* Disable chip (CS) */
-	spi_cs(channel, 0);
-
-	/* Enable selected chip (CS) */
-	spi_cs(channel, 1);
-	/* Send command: Read Status Register */
-	spi_rw(channel, 0x05);
-	/* Poll on busy cleared or error detected */
-	for (i = 0; i < 100000; i++) // 0x10000
-	{
-		status = spi_rw(channel, 0x00);
-		if (status & (1 << 5))
-		{
-			log_puts("FLASH: Erase ERROR\n");
-			break;
-		}
-		else if ((status & 1) == 0)
-			break;
-	}
+	flash_command(channel, bus, 0x20, addr, 0);
 	/* Disable chip (CS) */
 	spi_cs(channel, 0);
+}
 
-#ifdef MEM_FLASH_DEBUG
-	log_print(LOG_INF, "  - status %8x (%d)\n", status, i);
-#endif
-	// TODO Handle error ...
+/**
+ * @brief Read an array of bytes from flash memory
+ *
+ * @param node    Pointer to the memory node (for read command)
+ * @param channel Id of the (spi) channel to access
+ * @param buffer  Pointer to a buffer for output
+ * @param addr    Address of the first byte to read
+ * @param len     Number of bytes to read
+ * @return integer Zero on success, -1 on SPI error (data not valid)
+ */
+static int flash_read(mem_node *node, uint channel, u8 *buffer, u32 addr, uint len)
+{
+	int result;
 
+	result = flash_read_start(node, channel, buffer, addr, len);
+	if (result < 0)
+		return(-1);
+	/* Transfer continue in background (DMA), wait for the end */
+	if (result)
+		return(flash_read_end(channel));
 	return(0);
 }
 
 /**
- * @brief Read an array of bytes from flash memory
+ * @brief Start to read an array of bytes from flash memory
+ *
+ * Large blocks are received by DMA : the function returns as soon as the
+ * transfer is started, the chip stay selected until flash_read_end. Reads
+ * into USB packet memory come one packet at a time (zero-copy SCSI reads) :
+ * the chip is left selected, the next packet only clocks the data.
  *
- * @param buffer Pointer to a buffer for output
- * @param addr   Address of the first byte to read
- * @param len    Number of bytes to read
+ * @param node    Pointer to the memory node (for read command)
+ * @param channel Id of the (spi) channel to access
+ * @param buffer  Pointer to a buffer for output
+ * @param addr    Address of the first byte to read
+ * @param len     Number of bytes to read
+ * @return integer 1 if a DMA transfer is running (see flash_read_end), zero
+ *                 if done, -1 on SPI error (chip released, data not valid)
  */
-static int flash_read(uint channel, u8 *buffer, u32 addr, uint len)
+static int flash_read_start(mem_node *node, uint channel, u8 *buffer, u32 addr, uint len)
 {
-	u8 *p;
-	uint i;
+	spi_bus *bus;
+	uint nid = channel - 1;
+	int  result = 0;
 
 #ifdef MEM_FLASH_INFO
 	log_print(LOG_INF, "FLASH: Read %d bytes from 0x%24x ... ", len, addr);
 #endif
-	/* Enable selected chip (CS) */
-	spi_cs(channel, 1);
-	/* Read Data command (low speed) */
-	spi_rw(channel, 0x03);
-	/* Send address */
-	spi_rw(channel, (addr >> 16) & 0xFF);
-	spi_rw(channel, (addr >>  8) & 0xFF);
-	spi_rw(channel, (addr >>  0) & 0xFF);
+	bus = spi_bus_get(channel);
+	/* Previous read left open at this address, continue it */
+	if (rd_open[nid] && (rd_next[nid] == addr))
+		rd_open[nid] = 0;
+	else
+	{
+		/* Previous read left open elsewhere, close it */
+		if (rd_open[nid])
+		{
+			spi_cs(channel, 0);
+			rd_open[nid] = 0;
+		}
+		/* Enable selected chip (CS) */
+		spi_cs(channel, 1);
+		/* Read command (Read Data or Fast Read), address and dummy bytes */
+		result = flash_command(channel, bus, node->read_cmd, addr, node->read_dummy);
+		if (result < 0)
+			goto end;
+	}
 
-	p = buffer;
-	for (i = 0; i < len; i++)
-		*p++ = spi_rw(channel, 0x00);
+	/* USB packet memory (32 bits accesses only) : bytes are packed and
+	 * written by words, without copy (see spi_read_words) */
+	if (USB_IS_PMA(buffer))
+	{
+		result = spi_read_words(bus, buffer, len);
+		/* Keep chip selected, next packet may continue (see read_end) */
+		if (result == 0)
+		{
+			rd_open[nid] = 1;
+			rd_next[nid] = addr + len;
+			rd_tm[nid]   = time_now(0);
+			return(0);
+		}
+	}
+	/* For large blocks, let DMA move data while CPU do something else */
+	else if ((len >= MEM_DMA_THRESHOLD) &&
+	    (spi_dma_read(channel, buffer, len, 0) == 0))
+		return(1);
+	else
+		result = spi_read_block(bus, buffer, len);
 
+end:
 	/* Disable chip (CS) */
 	spi_cs(channel, 0);
 
+	if (result < 0)
+	{
+		log_puts("FLASH: Read SPI timeout\n");
+		return(-1);
+	}
 #ifdef MEM_FLASH_INFO
 	log_print(LOG_INF, "done.\n");
 #endif
@@ -418,73 +1365,179 @@ static int flash_read(uint channel, u8 *buffer, u32 addr, uint len)
 }
 
 /**
- * @brief Write datas into flash memory
+ * @brief Wait the end of a read started by flash_read_start
  *
  * @param channel Id of the (spi) channel to access
- * @param buffer  Pointer to a buffer with data to write
- * @param addr    Address of the first byte to write
- * @param len     Number of bytes to write
+ * @return integer Zero on success, -1 on DMA timeout (data not valid)
  */
-static int flash_write(uint channel, u8 *buffer, u32 addr, uint len)
+static int flash_read_end(uint channel)
 {
-	u8 status;
-	u8 *p;
-	uint i;
+	int result = 0;
+
+	if (spi_dma_wait(channel) != 0)
+	{
+		log_puts("FLASH: Read DMA timeout\n");
+		result = -1;
+	}
+
+	/* Disable chip (CS) */
+	spi_cs(channel, 0);
 
 #ifdef MEM_FLASH_INFO
-	log_print(LOG_INF, "FLASH: Write %d bytes to 0x%24x\n", len, addr);
+	if (result == 0)
+		log_print(LOG_INF, "done.\n");
 #endif
+	return(result);
+}
 
-	p    = buffer;
+/**
+ * @brief Compare the content of a flash sector with the data of a job
+ *
+ * The current content of the sector is read page by page and compared with
+ * the new data (bytes after len must be erased, 0xFF). A program operation
+ * can only clear bits : if no bit must go from 0 to 1 the erase is skipped
+ * and only modified pages are programmed. Else the sector must be erased and
+ * only pages with data (not blank) are programmed. Reading a sector (~1ms)
+ * is cheap compared to an erase (~45ms). A sector of the pre-erase pool is
+ * known blank, it is not read. If the current content can not be read, the
+ * sector is erased.
+ *
+ * @param node    Pointer to the memory node
+ * @param channel Id of the (spi) channel to access
+ * @param job     Pointer to the update job (todo bitmap is set)
+ * @return boolean True if the sector must be erased
+ */
+static int flash_plan(mem_node *node, uint channel, mem_job *job)
+{
+	u8   old[MEM_PAGE_SZ];
+	u32  changed = 0; /* Bitmap of modified pages */
+	u32  blank   = 0; /* Bitmap of pages with only 0xFF */
+	uint page, pos, i;
+	int  erase = 0;
+	u8   v;
+
+	/* Sector of the pre-erase pool, no need to read it */
+	if (job->erased)
+		memset(old, 0xFF, MEM_PAGE_SZ);
 
-	while(len)
+	/* Compare current and new content, until an erase is needed */
+	spi_set_speed(channel, node->read_speed);
+	for (page = 0; page < (MEM_SECTOR_SZ / MEM_PAGE_SZ); page++)
 	{
-		if (len > 256)
-			i = 256;
-		else
-			i = len;
+		pos = page * MEM_PAGE_SZ;
+		/* Current content unknown (read error), erase to be safe */
+		if ((erase == 0) && (job->erased == 0) &&
+		    (flash_read(node, channel, old, job->addr + pos, MEM_PAGE_SZ) < 0))
+			erase = 1;
+		blank |= (1 << page);
+		for (i = 0; i < MEM_PAGE_SZ; i++, pos++)
+		{
+			v = (pos < job->len) ? job->buffer[pos] : 0xFF;
+			if (v != 0xFF)
+				blank &= ~(u32)(1 << page);
+			if (erase || (old[i] == v))
+				continue;
+			changed |= (1 << page);
+			/* A bit must be set, only possible with erase */
+			if ((old[i] & v) != v)
+				erase = 1;
+		}
+	}
+	spi_set_speed(channel, node->speed);
+
+	/* After erase, all pages with data must be programmed */
+	if (erase)
+		changed = ~blank;
+	job->todo = changed;
+	return(erase);
+}
+
+/**
+ * @brief Start the program of one page
+ *
+ * This function only send the command and data, the chip is busy during the
+ * program (see flash_status).
+ *
+ * @param channel Id of the (spi) channel to access
+ * @param buffer  Pointer to a buffer with data to write
+ * @param addr    Address of the first byte to write
+ * @param len     Number of bytes to write (up to 256, into one page)
+ */
+static void flash_program(uint channel, u8 *buffer, u32 addr, uint len)
+{
+	spi_bus *bus;
+
 #ifdef MEM_FLASH_DEBUG
-		log_print(LOG_INF, "FLASH: Write page (%d bytes) to %24x\n", i, addr);
+	log_print(LOG_INF, "FLASH: Write page (%d bytes) to %24x\n", len, addr);
 #endif
-		flash_write_enable(channel);
+	flash_write_enable(channel);
 
-		/* Enable selected chip (CS) */
-		spi_cs(channel, 1);
-		/* Page Program command (low speed) */
-		spi_rw(channel, 0x02);
-		/* Send address */
-		spi_rw(channel, (addr >> 16) & 0xFF);
-		spi_rw(channel, (addr >>  8) & 0xFF);
-		spi_rw(channel, (addr >>  0) & 0xFF);
-		/* Send data to write */
-		addr += i;
-		len  -= i;
-		for (; i > 0; i--)
-			/* Write one byte */
-			spi_rw(channel, *p++);
-		/* Disable chip (CS) */
-		spi_cs(channel, 0);
+	bus = spi_bus_get(channel);
+	/* Enable selected chip (CS) */
+	spi_cs(channel, 1);
+	/* Page Program command (low speed) */
+	flash_command(channel, bus, 0x02, addr, 0);
+	/* Send data to write */
+	spi_write_block(bus, buffer, len);
+	/* Disable chip (CS) */
+	spi_cs(channel, 0);
+}
 
-		/* Enable selected chip (CS) */
-		spi_cs(channel, 1);
-		/* Send command: Read Status Register */
-		spi_rw(channel, 0x05);
-		/* Poll on busy cleared or error detected */
-		for (i = 0; i < 100000; i++) // 10000
-		{
-			status = spi_rw(channel, 0x00);
-			if (status & (1 << 5))
-			{
-				log_puts("FLASH: Write ERROR\n");
-				break;
-			}
-			else if ((status & 1) == 0)
-				break;
-		}
-		/* Disable chip (CS) */
-		spi_cs(channel, 0);
+/**
+ * @brief Read the status register of the flash
+ *
+ * @param channel Id of the (spi) channel to access
+ * @return u8 Value of the status register (bit 0 is set when busy)
+ */
+static u8 flash_status(uint channel)
+{
+	spi_bus *bus;
+	u8 status;
+
+	bus = spi_bus_get(channel);
+	/* Enable selected chip (CS) */
+	spi_cs(channel, 1);
+	/* Send command: Read Status Register */
+	spi_bus_rw(bus, 0x05);
+	status = spi_bus_rw(bus, 0x00);
+	/* Disable chip (CS) */
+	spi_cs(channel, 0);
+
+	return(status);
+}
+
+/**
+ * @brief Wait the end of the running erase or program (blocking)
+ *
+ * @param channel Id of the (spi) channel to access
+ * @return integer Zero on success, other values are errors (timeout)
+ */
+static int flash_wait(uint channel)
+{
+	spi_bus *bus;
+	u8  status;
+	int i;
+
+	bus = spi_bus_get(channel);
+	/* Enable selected chip (CS) */
+	spi_cs(channel, 1);
+	/* Send command: Read Status Register */
+	spi_bus_rw(bus, 0x05);
+	/* Poll on busy cleared */
+	for (i = 0; i < 100000; i++)
+	{
+		status = spi_bus_rw(bus, 0x00);
+		if ((status & 1) == 0)
+			break;
 	}
+	/* Disable chip (CS) */
+	spi_cs(channel, 0);
 
+	if (i == 100000)
+	{
+		log_puts("FLASH: Timeout\n");
+		return(-1);
+	}
 	return(0);
 }
 
@@ -496,13 +1549,16 @@ static int flash_write(uint channel, u8 *buffer, u32 addr, uint len)
  */
 static void flash_write_enable(uint channel)
 {
+	spi_bus *bus;
+
 #ifdef MEM_FLASH_DEBUG
 	log_print(LOG_INF, "FLASH: Set Write Enable bit");
 #endif
+	bus = spi_bus_get(channel);
 	/* Enable selected chip (CS) */
 	spi_cs(channel, 1);
 	/* Write Enable command */
-	spi_rw(channel, 0x06);
+	spi_bus_rw(bus, 0x06);
 	/* Disable chip (CS) */
 	spi_cs(channel, 0);
 
@@ -510,10 +1566,10 @@ static void flash_write_enable(uint channel)
 	/* Enable selected chip (CS) */
 	spi_cs(channel, 1);
 	/* Send command: Read Status Register */
-	spi_rw(channel, 0x05);
+	spi_bus_rw(bus, 0x05);
 	/* Log current status */
 	log_print(LOG_INF, ", status=%8x\n",
-	    spi_rw(channel, 0x00) );
+	    spi_bus_rw(bus, 0x00) );
 	/* Disable chip (CS) */
 	spi_cs(channel, 0);
 #endif
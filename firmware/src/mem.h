@@ -18,6 +18,43 @@
 #include "types.h"
 
 #define MEM_NODE_COUNT 3
+/* Read transfers of (at least) this size use DMA instead of polled SPI */
+#define MEM_DMA_THRESHOLD 64
+/* Size of flash program page and erase sector */
+#define MEM_PAGE_SZ   256
+#define MEM_SECTOR_SZ 4096
+/* Size of the free sectors bitmap of each node (bytes), sectors after the
+ * covered area (MEM_FREE_MAP_SZ * 8 sectors) are always considered used */
+#ifndef MEM_FREE_MAP_SZ
+#define MEM_FREE_MAP_SZ 512
+#endif
+/* Number of free sectors kept erased on each node (see mem_preerase) */
+#ifndef MEM_POOL_DEPTH
+#define MEM_POOL_DEPTH 16
+#endif
+
+/* Verify the SPI clock of each node on detect (see flash_calibrate), for
+ * boards that can not reach the limits of the chips */
+#ifndef MEM_SPI_CALIBRATE
+#define MEM_SPI_CALIBRATE 0
+#endif
+/* Size of the block read to verify the clock */
+#define MEM_CAL_SZ 32
+
+/* Flash chips capabilities */
+#define MEM_FLASH_FAST 0x01 /* Fast Read (0x0B) with dummy cycles  */
+#define MEM_FLASH_DUAL 0x02 /* Dual Output Read (0x3B)             */
+#define MEM_FLASH_QUAD 0x04 /* Quad Output Read (0x6B)             */
+#define MEM_FLASH_ADDR4 0x08 /* Larger than 16MB, 4 bytes address  */
+
+/* Asynchronous job types (see mem_submit) */
+#define MEM_JOB_ERASE   1 /* Erase one 4k sector                        */
+#define MEM_JOB_PROGRAM 2 /* Program data (sector must be already erased) */
+#define MEM_JOB_UPDATE  3 /* Rewrite one sector (see mem_write)          */
+/* Asynchronous job states */
+#define MEM_JOB_DONE    0
+#define MEM_JOB_PENDING 1 /* Queued, no operation started yet           */
+#define MEM_JOB_BUSY    2 /* An erase/program is running into the chip  */
 
 typedef struct mem_node_s
 {
@@ -26,6 +63,20 @@ typedef struct mem_node_s
 	u32   cache_addr;
 	u8    cache_buffer[4096];
 	uint  speed;
+	/* Read command selected for the detected chip */
+	u8    read_cmd;
+	u8    read_dummy;
+	uint  read_speed;
+	/* Write planner statistics (see mem_write) */
+	u32   st_erase;      /* Sectors erased                            */
+	u32   st_erase_skip; /* Erases avoided (only 1 -> 0 bits changes)  */
+	u32   st_page;       /* Pages programmed                          */
+	u32   st_page_skip;  /* Pages not programmed (unchanged or blank) */
+	/* Pre-erase pool statistics (see mem_preerase) */
+	u32   st_pool;       /* Free sectors already erased (pool depth)  */
+	u32   st_pre_erase;  /* Sectors erased in background              */
+	u32   st_pool_hit;   /* Sector updates into a pre-erased sector   */
+	u32   st_pool_miss;  /* Sector updates that need read and compare */
 } mem_node;
 
 typedef struct mem_flash_chip_s
@@ -33,15 +84,45 @@ typedef struct mem_flash_chip_s
 	u8   vendor;
 	u16  device_id;
 	uint size;
-	uint speed;
+	uint speed;      /* Max clock for fast commands (MHz)      */
+	uint read_speed; /* Max clock for Read Data (0x03) (MHz)   */
+	uint flags;
+	uint dummy;      /* Dummy cycles of Fast Read              */
 	char *name;
 } mem_flash_chip;
 
+typedef struct mem_job_s
+{
+	uint  type;
+	u32   addr;
+	uint  len;
+	u8   *buffer;  /* Must not be modified until the job is done    */
+	void (*complete)(struct mem_job_s *job);
+	void *priv;    /* Free for the caller (not used by mem)        */
+	int   result;  /* Zero on success, negative value on error     */
+	vu32  state;
+	/* Private, used by mem during processing */
+	uint  pos;     /* Offset of the next page to program           */
+	u32   todo;    /* Bitmap of pages to program (MEM_JOB_UPDATE)  */
+	u8    erased;  /* Sector known erased, content not compared    */
+	struct mem_job_s *next;
+} mem_job;
+
 void mem_init(void);
 int  mem_detect(void);
 mem_node *mem_get_node(uint nid);
 int       mem_erase(uint nid, u32 addr, uint len);
 int       mem_read (uint nid, u32 addr, uint len, u8 *buffer);
+int       mem_read_start(uint nid, u32 addr, uint len, u8 *buffer);
+int       mem_read_wait (uint nid);
 int       mem_write(uint nid, u32 addr, uint len, u8 *buffer);
+int       mem_program(uint nid, u32 addr, uint len, u8 *buffer);
+int       mem_submit(uint nid, mem_job *job);
+int       mem_trim (uint nid, u32 addr, uint len);
+int       mem_is_free(uint nid, u32 addr);
+int       mem_preerase(uint nid);
+int       mem_busy(uint nid);
+void      mem_poll(void);
+void      mem_periodic(void);
 
 #endif
@@ -0,0 +1,288 @@
+/**
+ * @file  rahead.c
+ * @brief Read-ahead of sequential streams (file data) for the LUN
+ *
+ * Hosts read files with long sequences of READ commands on consecutive
+ * blocks, and the SCSI layer asks data by small chunks (one USB packet) each
+ * time the IN endpoint has a free buffer. Reading each chunk from flash
+ * costs a complete SPI command (polled, as the packet memory does not accept
+ * DMA) while the endpoint waits.
+ *
+ * This module watches the addresses of the reads. When a stream is detected
+ * (more than RAHEAD_TRIGGER bytes read sequentially), data are read by lines
+ * into RAM with DMA, and the read of the next line is started while the
+ * current one is sent to host. A random access stops the stream : lines
+ * are dropped and nothing is read until a new stream is detected.
+ *
+ * The lines are a snapshot of memory, they must be dropped when the memory
+ * is modified (see rahead_invalidate).
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include "libc.h"
+#include "rahead.h"
+#include "types.h"
+#include "usb.h"
+
+#if (RAHEAD_LINES < 2)
+#error "Read-ahead needs at least two lines (one sent, one read)"
+#endif
+
+static rahead_line  lines[RAHEAD_LINES];
+static rahead_stats stats;
+static int  (*rh_start)(u32 addr, uint len, u8 *data);
+static int  (*rh_wait)(void);
+static rahead_line *rh_pending; /* Line with a read running (only one) */
+static u32  rh_next; /* Address after the last read (next of the stream) */
+static u32  rh_run;  /* Number of bytes read sequentially                */
+
+static rahead_line *line_find(u32 addr);
+static rahead_line *line_free(rahead_line *keep);
+static int  line_start(rahead_line *line, u32 addr);
+static int  line_wait(void);
+
+/**
+ * @brief Initialize the read-ahead
+ *
+ * The start function begins a read of one line into background (see
+ * volume_read_start), the wait function waits the end of this read and
+ * returns a negative value when the data are not valid.
+ *
+ * @param start Pointer to the function used to start a read (or NULL)
+ * @param wait  Pointer to the function used to wait the end of a read
+ */
+void rahead_init(int (*start)(u32 addr, uint len, u8 *data), int (*wait)(void))
+{
+	uint i;
+
+	/* Buffer of a previous read may still be written */
+	(void)line_wait();
+
+	for (i = 0; i < RAHEAD_LINES; i++)
+	{
+		lines[i].addr  = 0;
+		lines[i].state = RAHEAD_EMPTY;
+		lines[i].valid = 0;
+	}
+	memset(&stats, 0, sizeof(rahead_stats));
+
+	rh_start = start;
+	rh_wait  = wait;
+	rh_next  = 0xFFFFFFFF;
+	rh_run   = 0;
+}
+
+/**
+ * @brief Declare a read request (stream detection)
+ *
+ * This function must be called for each read, even when data are found
+ * into another cache, to follow the stream.
+ *
+ * @param addr Address of the first byte read
+ * @param len  Number of bytes read
+ */
+void rahead_access(u32 addr, u32 len)
+{
+	if (addr == rh_next)
+		rh_run += len;
+	else
+	{
+		/* Random access, lines would not be used */
+		if (rh_run > RAHEAD_TRIGGER)
+			stats.stops++;
+		rh_run = 0;
+		rahead_invalidate();
+	}
+	rh_next = addr + len;
+}
+
+/**
+ * @brief Read data from the read-ahead lines
+ *
+ * When a stream is running, the line that contains the address is used (or
+ * loaded now) and the read of the next line is started. Data are copied with
+ * 32 bits words when possible (USB packet memory).
+ *
+ * @param addr Address of the first byte to read
+ * @param len  Number of bytes to read (limited to the end of line)
+ * @param data Pointer to a buffer where data are copied
+ * @return integer Number of bytes copied, zero if data must be read elsewhere
+ */
+int rahead_read(u32 addr, uint len, u8 *data)
+{
+	rahead_line *line;
+	uint offset;
+	u32  next;
+
+	if (rh_start == 0)
+		return(0);
+
+	line = line_find(addr);
+	if (line == 0)
+	{
+		/* Not a sequential stream (yet) */
+		if (rh_run <= RAHEAD_TRIGGER)
+			return(0);
+		line = line_free(0);
+		if (line_start(line, addr & ~(u32)(RAHEAD_LINE_SZ - 1)))
+			return(0);
+		stats.loads++;
+	}
+	else if (line->state == RAHEAD_READING)
+		stats.waits++;
+	/* Data must be received before use, a failed read is done elsewhere */
+	if ((line->state == RAHEAD_READING) && (line_wait() < 0))
+		return(0);
+
+	offset = (uint)(addr - line->addr);
+	if ((offset + len) > RAHEAD_LINE_SZ)
+		len = (RAHEAD_LINE_SZ - offset);
+
+	/* Buffer may be an endpoint buffer (zero-copy read) */
+	memcpy_pma(data, line->data + offset, len);
+	stats.hits++;
+
+	/* Read the next line while this one is sent */
+	next = line->addr + RAHEAD_LINE_SZ;
+	if (line_find(next) == 0)
+	{
+		if (line_start(line_free(line), next) == 0)
+			stats.prefetch++;
+	}
+	return((int)len);
+}
+
+/**
+ * @brief Drop all the lines (memory modified)
+ *
+ * A read running into background continues, its line is only reused when
+ * finished. The stream detection is not reset.
+ */
+void rahead_invalidate(void)
+{
+	uint i;
+
+	for (i = 0; i < RAHEAD_LINES; i++)
+		lines[i].valid = 0;
+}
+
+/**
+ * @brief Get a pointer to the read-ahead statistics
+ *
+ * @return rahead_stats* Pointer to the statistics structure
+ */
+rahead_stats *rahead_get_stats(void)
+{
+	return(&stats);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                                                                      -- */
+/* --                          Private  functions                          -- */
+/* --                                                                      -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Search the line that contains an address
+ *
+ * @param addr Address to search
+ * @return rahead_line* Pointer to the line, or NULL if not found
+ */
+static rahead_line *line_find(u32 addr)
+{
+	uint i;
+
+	for (i = 0; i < RAHEAD_LINES; i++)
+	{
+		if ((lines[i].valid == 0) || (lines[i].state == RAHEAD_EMPTY))
+			continue;
+		if ((addr - lines[i].addr) < RAHEAD_LINE_SZ)
+			return(&lines[i]);
+	}
+	return(0);
+}
+
+/**
+ * @brief Select a line to load
+ *
+ * A dropped line is used first, else the line with the lowest address
+ * (already sent for a forward stream).
+ *
+ * @param keep Pointer to a line that must not be selected (or NULL)
+ * @return rahead_line* Pointer to the selected line
+ */
+static rahead_line *line_free(rahead_line *keep)
+{
+	rahead_line *line = 0;
+	uint i;
+
+	for (i = 0; i < RAHEAD_LINES; i++)
+	{
+		if (&lines[i] == keep)
+			continue;
+		if ((lines[i].valid == 0) || (lines[i].state == RAHEAD_EMPTY))
+			return(&lines[i]);
+		if ((line == 0) || (lines[i].addr < line->addr))
+			line = &lines[i];
+	}
+	return(line);
+}
+
+/**
+ * @brief Start to read a line into background
+ *
+ * @param line Pointer to the line to load
+ * @param addr Address of the first byte of the line
+ * @return integer Zero if started, other values are errors
+ */
+static int line_start(rahead_line *line, u32 addr)
+{
+	/* Only one read can be running */
+	(void)line_wait();
+
+	line->addr  = addr;
+	line->valid = 1;
+	if (rh_start(addr, RAHEAD_LINE_SZ, line->data) != 0)
+	{
+		line->state = RAHEAD_EMPTY;
+		line->valid = 0;
+		return(-1);
+	}
+	line->state = RAHEAD_READING;
+	rh_pending  = line;
+	return(0);
+}
+
+/**
+ * @brief Wait the end of the read running into background (if any)
+ *
+ * When the read failed, the line is dropped.
+ *
+ * @return integer Zero on success (or nothing to wait), -1 on error
+ */
+static int line_wait(void)
+{
+	rahead_line *line = rh_pending;
+
+	if (line == 0)
+		return(0);
+	rh_pending = 0;
+	if (rh_wait && (rh_wait() < 0))
+	{
+		line->state = RAHEAD_EMPTY;
+		line->valid = 0;
+		return(-1);
+	}
+	line->state = RAHEAD_READY;
+	return(0);
+}
+/* EOF */
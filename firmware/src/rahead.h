@@ -0,0 +1,63 @@
+/**
+ * @file  rahead.h
+ * @brief Definitions and prototypes for the sequential read-ahead
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef RAHEAD_H
+#define RAHEAD_H
+#include "types.h"
+
+/* Number of lines and size of a line (must divide a 4k unit), each line
+ * use its size of RAM */
+#ifndef RAHEAD_LINES
+#define RAHEAD_LINES 2
+#endif
+#ifndef RAHEAD_LINE_SZ
+#define RAHEAD_LINE_SZ 1024
+#endif
+/* Read-ahead start when more than this number of bytes are read
+ * sequentially (a random read of one 4k cluster is not a stream) */
+#ifndef RAHEAD_TRIGGER
+#define RAHEAD_TRIGGER 4096
+#endif
+
+/* Line states */
+#define RAHEAD_EMPTY   0
+#define RAHEAD_READING 1 /* Read started, data not yet available */
+#define RAHEAD_READY   2
+
+typedef struct rahead_line_s
+{
+	u32 addr;  /* Address of the first byte (RAHEAD_LINE_SZ aligned)  */
+	u8  state; /* See RAHEAD_xx states                                */
+	u8  valid; /* Data can be used (cleared by rahead_invalidate)     */
+	u8  data[RAHEAD_LINE_SZ] __attribute__((aligned(4)));
+} rahead_line;
+
+typedef struct rahead_stats_s
+{
+	u32 hits;     /* Reads served from a line                       */
+	u32 prefetch; /* Lines read in background                       */
+	u32 loads;    /* Lines read on demand (start of stream)         */
+	u32 waits;    /* Reads that waited the end of a background read */
+	u32 stops;    /* Streams stopped by a random access             */
+} rahead_stats;
+
+void rahead_init(int (*start)(u32 addr, uint len, u8 *data), int (*wait)(void));
+void rahead_access(u32 addr, u32 len);
+int  rahead_read(u32 addr, uint len, u8 *data);
+void rahead_invalidate(void);
+rahead_stats *rahead_get_stats(void);
+
+#endif
+/* EOF */
@@ -0,0 +1,275 @@
+/**
+ * @file  rcache.c
+ * @brief Read cache of 512 bytes sectors (boot sector, FAT, directories)
+ *
+ * Hosts read the same few sectors again and again (boot sector and FAT on
+ * mount, directories on each listing) and each read costs a SPI flash access.
+ * This module keeps some sectors into RAM, into a small set-associative cache
+ * keyed by address (LBA * 512). The set of a sector is selected by the low
+ * bits of its LBA, so consecutive sectors (FAT) use different sets, mixed
+ * with upper bits so the first sectors of clusters do not all use the same.
+ *
+ * Long sequential reads (file data) would evict the hot sectors without any
+ * later hit : after RCACHE_SEQ consecutive missed sectors, the next ones are
+ * not cached. Into a set, an entry already read twice (hot) is kept before
+ * the ones loaded once, and is never replaced directly : when all entries
+ * of a set are hot, the oldest one is marked cold and the missed sector is
+ * not cached (second chance).
+ *
+ * The cache does not know writes : the caller must drop modified sectors
+ * (see rcache_invalidate) before they can be read again from memory.
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include "libc.h"
+#include "rcache.h"
+#include "types.h"
+#include "usb.h"
+
+#if (RCACHE_SETS & (RCACHE_SETS - 1))
+#error "RCACHE_SETS must be a power of two"
+#endif
+
+static rcache_entry entries[RCACHE_SETS][RCACHE_WAYS];
+static rcache_stats stats;
+static int (*rc_rd)(u32 addr, uint len, u8 *data);
+static u32  rc_clock;
+/* Sequential read detection */
+static u32  rc_next; /* Address of the sector after the last missed one */
+static uint rc_run;  /* Number of consecutive missed sectors            */
+
+static rcache_entry *entry_find(u32 addr);
+static rcache_entry *entry_victim(u32 addr);
+static inline uint   set_index(u32 addr);
+
+/**
+ * @brief Initialize the read cache
+ *
+ * All entries are dropped. The read function is used to load the missed
+ * sectors, it must return the number of readed bytes (like volume_read).
+ *
+ * @param rd Pointer to the function used to read memory (or NULL to disable)
+ */
+void rcache_init(int (*rd)(u32 addr, uint len, u8 *data))
+{
+	uint i, j;
+
+	for (i = 0; i < RCACHE_SETS; i++)
+	{
+		for (j = 0; j < RCACHE_WAYS; j++)
+		{
+			entries[i][j].addr  = 0;
+			entries[i][j].valid = 0;
+			entries[i][j].hot   = 0;
+			entries[i][j].age   = 0;
+		}
+	}
+	memset(&stats, 0, sizeof(rcache_stats));
+
+	rc_rd    = rd;
+	rc_clock = 0;
+	rc_next  = 0xFFFFFFFF;
+	rc_run   = 0;
+}
+
+/**
+ * @brief Read data of one sector from the cache
+ *
+ * When the sector is not into cache and the read start at the begining of
+ * the sector, the whole sector is loaded (except for long sequential reads).
+ * Data are copied with 32 bits words when possible (USB packet memory).
+ *
+ * @param addr Address of the first byte to read
+ * @param len  Number of bytes to read (limited to the end of sector)
+ * @param data Pointer to a buffer where data are copied
+ * @return integer Number of bytes copied, zero if data must be read elsewhere
+ */
+int rcache_read(u32 addr, uint len, u8 *data)
+{
+	rcache_entry *entry;
+	u32  sector;
+	uint offset;
+
+	sector = (addr & ~(u32)(RCACHE_SECTOR_SZ - 1));
+	offset = (addr &  (RCACHE_SECTOR_SZ - 1));
+	if ((offset + len) > RCACHE_SECTOR_SZ)
+		len = (RCACHE_SECTOR_SZ - offset);
+
+	entry = entry_find(sector);
+	if (entry)
+	{
+		/* Counters are updated once per sector (reads may be chunked) */
+		if (offset == 0)
+		{
+			entry->hot = 1;
+			stats.hits++;
+		}
+	}
+	else
+	{
+		/* Next chunks of a sector not cached are not cached too */
+		if ((offset != 0) || (rc_rd == 0))
+			return(0);
+		stats.misses++;
+
+		if (sector == rc_next)
+			rc_run++;
+		else
+			rc_run = 0;
+		rc_next = sector + RCACHE_SECTOR_SZ;
+		/* Sequential data are probably read only once */
+		if (rc_run >= RCACHE_SEQ)
+		{
+			stats.bypass++;
+			return(0);
+		}
+
+		entry = entry_victim(sector);
+		/* Next sectors of a multi-sectors read only use free entries */
+		if (entry->valid && rc_run)
+		{
+			stats.bypass++;
+			return(0);
+		}
+		/* All entries of the set are hot : the oldest one get a second
+		 * chance (it can be replaced by the next miss if not read before) */
+		if (entry->valid && entry->hot)
+		{
+			entry->hot = 0;
+			stats.bypass++;
+			return(0);
+		}
+		entry->valid = 0;
+		if (rc_rd(sector, RCACHE_SECTOR_SZ, entry->data) != RCACHE_SECTOR_SZ)
+			return(0);
+		entry->addr  = sector;
+		entry->valid = 1;
+		entry->hot   = 0;
+		stats.fills++;
+	}
+	entry->age = ++rc_clock;
+
+	/* Buffer may be an endpoint buffer (zero-copy read) */
+	memcpy_pma(data, entry->data + offset, len);
+
+	return((int)len);
+}
+
+/**
+ * @brief Drop the cached sectors that overlap an area (modified or unused)
+ *
+ * @param addr Address of the first byte of the area
+ * @param len  Number of bytes of the area
+ * @return integer Number of entries dropped
+ */
+int rcache_invalidate(u32 addr, u32 len)
+{
+	rcache_entry *entry;
+	uint i, j;
+	int  count = 0;
+
+	for (i = 0; i < RCACHE_SETS; i++)
+	{
+		for (j = 0; j < RCACHE_WAYS; j++)
+		{
+			entry = &entries[i][j];
+			if (entry->valid == 0)
+				continue;
+			if (entry->addr >= addr ? ((entry->addr - addr) >= len) :
+			                          ((addr - entry->addr) >= RCACHE_SECTOR_SZ))
+				continue;
+			entry->valid = 0;
+			count++;
+		}
+	}
+	stats.invalid += (u32)count;
+	return(count);
+}
+
+/**
+ * @brief Get a pointer to the cache statistics
+ *
+ * @return rcache_stats* Pointer to the statistics structure
+ */
+rcache_stats *rcache_get_stats(void)
+{
+	return(&stats);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                                                                      -- */
+/* --                          Private  functions                          -- */
+/* --                                                                      -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Search the entry that contains a sector
+ *
+ * @param addr Address of the sector (512 bytes aligned)
+ * @return rcache_entry* Pointer to the entry, or NULL if not into cache
+ */
+static rcache_entry *entry_find(u32 addr)
+{
+	rcache_entry *set;
+	uint i;
+
+	set = entries[set_index(addr)];
+	for (i = 0; i < RCACHE_WAYS; i++)
+	{
+		if (set[i].valid && (set[i].addr == addr))
+			return(&set[i]);
+	}
+	return(0);
+}
+
+/**
+ * @brief Select the entry used to load a sector
+ *
+ * A free entry is used first, else the least recently used entry of the set
+ * that has not been read again since loaded, else the least recently used.
+ *
+ * @param addr Address of the sector (512 bytes aligned)
+ * @return rcache_entry* Pointer to the selected entry
+ */
+static rcache_entry *entry_victim(u32 addr)
+{
+	rcache_entry *set, *victim;
+	uint i;
+
+	set = entries[set_index(addr)];
+	victim = &set[0];
+	for (i = 0; i < RCACHE_WAYS; i++)
+	{
+		if (set[i].valid == 0)
+			return(&set[i]);
+		/* Cold entries first, then the oldest one */
+		if ((set[i].hot < victim->hot) ||
+		    ((set[i].hot == victim->hot) && (set[i].age < victim->age)))
+			victim = &set[i];
+	}
+	return(victim);
+}
+
+/**
+ * @brief Get the index of the set used by a sector
+ *
+ * @param addr Address of the sector
+ * @return uint Index of the set
+ */
+static inline uint set_index(u32 addr)
+{
+	u32 lba = (addr / RCACHE_SECTOR_SZ);
+
+	/* Clusters are (at least) 4k, 8 sectors aligned */
+	return((uint)((lba ^ (lba >> 3)) & (RCACHE_SETS - 1)));
+}
+/* EOF */
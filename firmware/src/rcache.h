@@ -0,0 +1,58 @@
+/**
+ * @file  rcache.h
+ * @brief Definitions and prototypes for the sector read cache
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef RCACHE_H
+#define RCACHE_H
+#include "types.h"
+
+/* Number of sets (power of two) and entries per set, each entry use 512
+ * bytes of RAM */
+#ifndef RCACHE_SETS
+#define RCACHE_SETS 4
+#endif
+#ifndef RCACHE_WAYS
+#define RCACHE_WAYS 2
+#endif
+/* Sectors missed after this number of consecutive ones are not cached */
+#ifndef RCACHE_SEQ
+#define RCACHE_SEQ 8
+#endif
+#define RCACHE_SECTOR_SZ 512
+
+typedef struct rcache_entry_s
+{
+	u32 addr;  /* Address of the first byte of the sector (LBA * 512) */
+	u8  valid; /* Entry contains data                                 */
+	u8  hot;   /* Entry has been read again since loaded              */
+	u32 age;   /* Value of the LRU clock on last access               */
+	u8  data[RCACHE_SECTOR_SZ] __attribute__((aligned(4)));
+} rcache_entry;
+
+typedef struct rcache_stats_s
+{
+	u32 hits;     /* Sector reads served from cache                */
+	u32 misses;   /* Sector reads not found into cache             */
+	u32 fills;    /* Sectors loaded into cache                     */
+	u32 bypass;   /* Missed sectors not cached (sequential read)   */
+	u32 invalid;  /* Entries dropped by a write or an unmap        */
+} rcache_stats;
+
+void rcache_init(int (*rd)(u32 addr, uint len, u8 *data));
+int  rcache_read(u32 addr, uint len, u8 *data);
+int  rcache_invalidate(u32 addr, u32 len);
+rcache_stats *rcache_get_stats(void);
+
+#endif
+/* EOF */
@@ -23,14 +23,33 @@
 static inline int cmd0_vendor(lun *unit, u8 *cb, uint len);
 static inline int cmd6(u8 *cb, uint len);
 static inline int cmd10(lun *unit, scsi_context *ctx);
-
-static lun  scsi_lun;
-static u8   scsi_data[512];
+static inline int cmd12(lun *unit, scsi_context *ctx);
+static inline int cmd16(lun *unit, scsi_context *ctx);
+static inline int lba_check(lun *lun, u32 lba, u32 count);
+static inline int lba_error(u32 lba);
+static inline int rw_read (lun *lun, u32 lba, u32 count);
+static inline int rw_write(lun *lun, u32 lba, u32 count, u8 fua);
+
+/* State of one logical unit */
+typedef struct scsi_unit_s
+{
+	lun  lun;
+	u32  ctx;   /* Step of the running command (see scsi_command) */
+	scsi_request_sense sense;
+} scsi_unit;
+
+static scsi_unit  scsi_units[SCSI_LUN_COUNT];
+static scsi_unit  scsi_none; /* Used for commands to an unknown LUN */
+static scsi_unit *scsi_cur;  /* Unit of the running command          */
+static uint scsi_lun_nb;
+static u8   scsi_buffer[SCSI_BUFFER_COUNT][SCSI_BUFFER_SZ];
+static u8  *scsi_data;
+static uint scsi_depth;
 static uint scsi_len;
-static u32  scsi_ctx;
 static u32  scsi_log;
-
-static scsi_request_sense request_sense;
+/* Buffer given by transport for the next READ step (zero-copy) */
+static u8  *scsi_target;
+static uint scsi_target_len;
 
 /**
  * @brief Initialize SCSI disk driver
@@ -40,12 +59,19 @@ static scsi_request_sense request_sense;
  */
 void scsi_init(void)
 {
+	uint i;
+
 	scsi_log = SCSI_LOG_ERR | SCSI_LOG_SENSE;
 
-	/* Clear LUN */
-	memset(&scsi_lun, 0, sizeof(lun));
-	// TODO Dev only, default value should not allow buffer r/w
-	scsi_lun.perm = SCSI_PERM_RDBUFFER | SCSI_PERM_WRBUFFER;
+	/* Clear LUNs, only the first one is reported until app set count */
+	memset(scsi_units, 0, sizeof(scsi_units));
+	memset(&scsi_none, 0, sizeof(scsi_unit));
+	for (i = 0; i < SCSI_LUN_COUNT; i++)
+	{
+		// TODO Dev only, default value should not allow buffer r/w
+		scsi_units[i].lun.perm = SCSI_PERM_RDBUFFER | SCSI_PERM_WRBUFFER;
+	}
+	scsi_lun_nb = 1;
 
 	scsi_reset();
 
@@ -54,12 +80,23 @@ void scsi_init(void)
 
 void scsi_reset(void)
 {
-	scsi_ctx = 0;
+	scsi_unit *unit;
+	uint i;
 
-	/* Initialize SENSE */
-	memset(&request_sense, 0, sizeof(scsi_request_sense));
-	request_sense.code = 0x70;
-	request_sense.length = 10;
+	scsi_cur   = &scsi_units[0];
+	scsi_data  = scsi_buffer[0];
+	scsi_depth = 1;
+	scsi_target = 0;
+
+	for (i = 0; i <= SCSI_LUN_COUNT; i++)
+	{
+		unit = (i < SCSI_LUN_COUNT) ? &scsi_units[i] : &scsi_none;
+		unit->ctx = 0;
+		/* Initialize SENSE */
+		memset(&unit->sense, 0, sizeof(scsi_request_sense));
+		unit->sense.code = 0x70;
+		unit->sense.length = 10;
+	}
 
 	log_puts("SCSI: Reset\n");
 }
@@ -70,14 +107,19 @@ void scsi_reset(void)
  * This function process an SCSI command. Some commands can be fully processed
  * in one single call (small data buffers) and some other need multiple steps.
  * To achieve all cases, this function can be called multiple times with the
- * same command block, an internal "scsi_ctx" variable i used to track states.
+ * same command block, an internal context of the LUN is used to track states.
+ * Each LUN has its own context and sense data, a command to an unknown LUN
+ * is rejected (only REQUEST SENSE is accepted to report this error).
  * The end of a command is notified using the function scsi_complete (see below)
+ * When the medium is busy (background erase/program) the value 5 is returned,
+ * the same step must be called again later with the same data.
  *
+ * @param pos Identifier of the addressed LUN
  * @param cb  Pointer to an array of bytes with received CDB
  * @param len Number of bytes into the CDB
  * @return integer Result of command processing (positive value for success)
  */
-int scsi_command(u8 *cb, uint len)
+int scsi_command(uint pos, u8 *cb, uint len)
 {
 	scsi_context context;
 	int result = -1;
@@ -87,6 +129,19 @@ int scsi_command(u8 *cb, uint len)
 	if ((cb == 0) || (len == 0))
 		return(-1);
 
+	/* Select the unit addressed by the command */
+	if (pos < scsi_lun_nb)
+		scsi_cur = &scsi_units[pos];
+	else
+	{
+		scsi_cur = &scsi_none;
+		scsi_none.sense.key  = 0x05; // Illegal Request
+		scsi_none.sense.asc  = 0x25; // Logical unit not supported
+		scsi_none.sense.ascq = 0x00;
+		if (cb[0] != SCSI_CMD6_REQUEST_SENSE)
+			return(-1);
+	}
+
 	group = ((cb[0] >> 5) & 7);
 
 	// Initialize transaction context structure
@@ -94,8 +149,8 @@ int scsi_command(u8 *cb, uint len)
 	context.cb_len  = len;
 	context.io_data = scsi_data;
 	context.io_len  = scsi_len;
-	context.flags   = scsi_ctx;
-	context.sense   = &request_sense;
+	context.flags   = scsi_cur->ctx;
+	context.sense   = &scsi_cur->sense;
 
 	switch(group)
 	{
@@ -106,31 +161,34 @@ int scsi_command(u8 *cb, uint len)
 		// If packet contains a 10-bytes CBD command
 		case 1:
 		case 2:
-			result = cmd10(&scsi_lun, &context);
+			result = cmd10(&scsi_cur->lun, &context);
 			break;
 		// If packet contains a 16-bytes CBD command
 		case 4:
-			log_puts("SCSI: CBD-16 commands not supported yet\n");
-			goto err_illegal;
+			result = cmd16(&scsi_cur->lun, &context);
+			break;
 		// If packet contains a 12-bytes CBD command
 		case 5:
-			log_puts("SCSI: CBD-12 commands not supported yet\n");
-			goto err_illegal;
+			result = cmd12(&scsi_cur->lun, &context);
+			break;
 		// If packet contains a vendor specific CBD command
 		case 6:
 		case 7:
-			result = cmd0_vendor(&scsi_lun, cb, len);
+			result = cmd0_vendor(&scsi_cur->lun, cb, len);
 			break;
 		default:
 			log_puts("SCSI: Unknown CBD format\n");
 			goto err_illegal;
 	}
 
+	/* Target buffer is only valid for one step */
+	scsi_target = 0;
 	return(result);
 
 err_illegal:
-	request_sense.key = 0x05; // Illegal Request
-	request_sense.asc = 0x20; // Invalid Command
+	scsi_target = 0;
+	scsi_cur->sense.key = 0x05; // Illegal Request
+	scsi_cur->sense.asc = 0x20; // Invalid Command
 	return(-1);
 }
 
@@ -142,7 +200,10 @@ err_illegal:
  */
 void scsi_complete(void)
 {
-	scsi_ctx = 0;
+	scsi_cur->ctx = 0;
+	scsi_data  = scsi_buffer[0];
+	scsi_depth = 1;
+	scsi_target = 0;
 }
 
 /**
@@ -152,7 +213,25 @@ void scsi_complete(void)
  */
 uint scsi_lun_count(void)
 {
-	return(1);
+	return(scsi_lun_nb);
+}
+
+/**
+ * @brief Set the number of LUNs reported to the host
+ *
+ * All the LUN structures are always available (see scsi_lun_get) but only
+ * the first "count" ones are reported (Get Max LUN) and can be addressed
+ * by commands. This should be set before USB enumeration.
+ *
+ * @param count Number of LUNs (1 to SCSI_LUN_COUNT)
+ */
+void scsi_lun_set_count(uint count)
+{
+	if (count == 0)
+		count = 1;
+	if (count > SCSI_LUN_COUNT)
+		count = SCSI_LUN_COUNT;
+	scsi_lun_nb = count;
 }
 
 /**
@@ -161,16 +240,29 @@ uint scsi_lun_count(void)
  * @param pos Identifier for the requested LUN
  * @return lun* Pointer to the selected LUN structure (or NULL for error)
  */
-lun *scsi_lun_get(int pos)
+lun *scsi_lun_get(uint pos)
 {
 	lun *result = 0;
 
-	if (pos == 0)
-		result = &scsi_lun;
+	if (pos < SCSI_LUN_COUNT)
+		result = &scsi_units[pos].lun;
 
 	return(result);
 }
 
+/**
+ * @brief Get the LUN addressed by the running command
+ *
+ * LUN functions (rd, wr, ...) have no LUN argument, when the same function
+ * is registered for many LUNs it can use this to find its context (priv).
+ *
+ * @return lun* Pointer to the LUN structure of the running command
+ */
+lun *scsi_lun_current(void)
+{
+	return(&scsi_cur->lun);
+}
+
 /**
  * @brief Get access to the SCSI readed data
  *
@@ -185,6 +277,20 @@ u8 *scsi_get_response(uint *len)
 	return(scsi_data);
 }
 
+/**
+ * @brief Get the number of data buffers used by the current command
+ *
+ * Commands that return data in multiple steps can use one buffer (each step
+ * overwrite the previous data) or rotate over many buffers. In this case, the
+ * caller can prepare the next step while the previous buffers are sent.
+ *
+ * @return integer Number of responses that can be pending at the same time
+ */
+uint scsi_get_depth(void)
+{
+	return(scsi_depth);
+}
+
 /**
  * @brief Get access to the SCSI buffer for writing data
  *
@@ -208,6 +314,24 @@ u8 *scsi_set_data(u8 *data, uint *len)
 	return(d);
 }
 
+/**
+ * @brief Give a buffer where the next READ step can store data directly
+ *
+ * The transport layer can use this function to avoid a copy : when the next
+ * command step is a READ and the LUN allow it (SCSI_PERM_RD_DIRECT), up to
+ * "len" bytes are read directly into this buffer (for example an USB packet
+ * memory). In this case scsi_get_response() return this buffer. The LUN must
+ * write it only with 32 bits words. This is valid for one scsi_command().
+ *
+ * @param data Pointer to the target buffer (32 bits aligned)
+ * @param len  Size of the target buffer (multiple of 4)
+ */
+void scsi_set_target(u8 *data, uint len)
+{
+	scsi_target     = data;
+	scsi_target_len = len;
+}
+
 /* -------------------------------------------------------------------------- */
 /* --                                                                      -- */
 /* --                          Private  functions                          -- */
@@ -238,7 +362,7 @@ static inline int cmd0_vendor(lun *unit, u8 *cb, uint len)
 	}
 
 	if (unit->cmd_vendor)
-		result = unit->cmd_vendor(unit, &scsi_ctx, cb, len);
+		result = unit->cmd_vendor(unit, &scsi_cur->ctx, cb, len);
 
 	return(result);
 }
@@ -283,15 +407,15 @@ static inline int cmd6(u8 *cb, uint len)
 		case SCSI_CMD6_PA_MEDIA_REMOVAL:
 			return( cmd6_prevent_media_removal(cb) );
 		default:
-			request_sense.key = 0x05; // Illegal Request
-			request_sense.asc = 0x20; // Invalid Command
+			scsi_cur->sense.key = 0x05; // Illegal Request
+			scsi_cur->sense.asc = 0x20; // Invalid Command
 			log_print(LOG_WRN, "SCSI: Unknown CMD6 %8x\n", cb[0]);
 	}
 	return(-1);
 
 err_illegal:
-	request_sense.key = 0x05; // Illegal Request
-	request_sense.asc = 0x20; // Invalid Command
+	scsi_cur->sense.key = 0x05; // Illegal Request
+	scsi_cur->sense.asc = 0x20; // Invalid Command
 	return(-1);
 }
 
@@ -314,7 +438,7 @@ static inline int cmd6_inquiry(u8 *cb, uint len)
 		'd','e','v','0'
 	};
 	/* VPD 0x00 : Supported Vital Product Data pages */
-	const u8 pg00[] = {0, 0x00, 0x00,  3,  0,0x80,0x83};
+	const u8 pg00[] = {0, 0x00, 0x00,  5,  0,0x80,0x83,0xB0,0xB2};
 	/* VPD 0x80 : Unit Serial Number */
 	const u8 pg80[] = {0, 0x80, 0x00, 16,
 		'7','0','B','3','D','5','4','C',
@@ -326,6 +450,7 @@ static inline int cmd6_inquiry(u8 *cb, uint len)
 		/* EUI-64 */
 		0x01, 0x02, 0x00, 0x08, 0x70, 0xB3, 0xD5, 0x4C, 0xE8, 0x01, 0x00, 0x00
 	};
+	lun *unit = &scsi_cur->lun;
 	(void)len;
 
 	log_print(LOG_INF, "%{SCSI: Inquiry%} %8x %8x %8x%8x\n",
@@ -340,8 +465,8 @@ static inline int cmd6_inquiry(u8 *cb, uint len)
 		{
 			/* Supported Vital Product Data pages */
 			case 0x00:
-				memcpy(scsi_data, pg00, 6);
-				scsi_len = 6;
+				memcpy(scsi_data, pg00, sizeof(pg00));
+				scsi_len = sizeof(pg00);
 				break;
 			/* Unit Serial Number */
 			case 0x80:
@@ -353,6 +478,38 @@ static inline int cmd6_inquiry(u8 *cb, uint len)
 				memcpy(scsi_data, pg83, sizeof(pg83));
 				scsi_len = sizeof(pg83);
 				break;
+			/* Block Limits : UNMAP parameters */
+			case 0xB0:
+				memset(scsi_data, 0, 64);
+				scsi_data[1] = 0xB0;
+				scsi_data[3] = 0x3C;
+				if (unit->unmap)
+				{
+					/* Max LBA count (no limit) and max descriptors */
+					memset(scsi_data + 20, 0xFF, 4);
+					scsi_data[27] = SCSI_UNMAP_DESC_MAX;
+					/* Optimal granularity : one flash sector (8 blocks) */
+					scsi_data[31] = 8;
+					scsi_data[32] = 0x80; // UGAVALID, alignment 0
+				}
+				scsi_len = 64;
+				break;
+			/* Logical Block Provisioning */
+			case 0xB2:
+				memset(scsi_data, 0, 8);
+				scsi_data[1] = 0xB2;
+				scsi_data[3] = 0x04;
+				/* UNMAP supported (LBPU). Unmapped blocks are not
+				 * reported to read zero (no LBPRZ) : free sectors are
+				 * only known in RAM, for whole 4k sectors and until
+				 * the next reset (see mem_trim) */
+				if (unit->unmap)
+				{
+					scsi_data[5] = (1 << 7);
+					scsi_data[6] = 0x01; // Resource provisioned
+				}
+				scsi_len = 8;
+				break;
 			default:
 				log_print(LOG_WRN, " - Unknown page %8x\n", cb[2]);
 				goto err_invalid_field;
@@ -370,10 +527,10 @@ static inline int cmd6_inquiry(u8 *cb, uint len)
 
 err_invalid_field:
 	/* Sense key = ILLEGAL REQUEST */
-	request_sense.key = 0x05;
+	scsi_cur->sense.key = 0x05;
 	/* Additional sense : INVALID FIELD IN CDB */
-	request_sense.asc  = 0x24;
-	request_sense.ascq = 0x00;
+	scsi_cur->sense.asc  = 0x24;
+	scsi_cur->sense.ascq = 0x00;
 	return(-1);
 }
 
@@ -386,7 +543,7 @@ static inline int cmd6_mode_sense(u8 *cb)
 {
 #ifdef SCSI_USE_CACHE
 	// Cache page
-	const u8 cache_page[] = {0x08, 0x12,
+	u8 cache_page[] = {0x08, 0x12,
 		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 		0x00, 0x00};
@@ -407,11 +564,16 @@ static inline int cmd6_mode_sense(u8 *cb)
 	scsi_data[2] =  0; // Specific parameter
 	scsi_data[3] =  0; // Block descriptor length
 	scsi_len = 4;
-	// Cache page
+	// Cache page : LUN with a flush function use write-back (WCE)
+	if (scsi_cur->lun.flush)
+	{
+		cache_page[2] |= (1 << 2); // WCE
+		scsi_data[2]  |= (1 << 4); // DPOFUA, FUA bit of WRITE is supported
+	}
 	memcpy(scsi_data + scsi_len, cache_page, sizeof(cache_page));
 	scsi_len += sizeof(cache_page);
 	// Control mode page
-	if (scsi_lun.writable == 0)
+	if (scsi_cur->lun.writable == 0)
 	{
 		scsi_data[2] |= 0x80;
 		ctrl_page[4] |= (1 << 3); // SWP
@@ -467,20 +629,20 @@ static inline int cmd6_request_sense(void)
 	if (scsi_log & SCSI_LOG_SENSE)
 	{
 		log_print(LOG_INF, "%{SCSI: Request Sense", LOG_YLW);
-		log_print(LOG_INF, " key=%8x",  request_sense.key);
-		log_print(LOG_INF, " code=%8x", request_sense.asc);
-		log_print(LOG_INF, " qual=%8x", request_sense.ascq);
+		log_print(LOG_INF, " key=%8x",  scsi_cur->sense.key);
+		log_print(LOG_INF, " code=%8x", scsi_cur->sense.asc);
+		log_print(LOG_INF, " qual=%8x", scsi_cur->sense.ascq);
 		log_print(LOG_INF, "%}\n");
 	}
 
 	len = sizeof(scsi_request_sense);
-	memcpy(scsi_data, &request_sense, (int)len);
+	memcpy(scsi_data, &scsi_cur->sense, (int)len);
 	scsi_len = len;
 
 	// After returning SENSE data, clear it
-	request_sense.key  = 0x00;
-	request_sense.asc  = 0x00;
-	request_sense.ascq = 0x00;
+	scsi_cur->sense.key  = 0x00;
+	scsi_cur->sense.asc  = 0x00;
+	scsi_cur->sense.ascq = 0x00;
 
 	return(1);
 }
@@ -511,11 +673,11 @@ static inline int cmd6_test_ready(void)
 	if (scsi_log & SCSI_LOG_TEST_READY)
 		log_print(LOG_INF, "%{SCSI: Test Unit Ready%}\n", LOG_YLW);
 
-	if (scsi_lun.state == 0)
+	if (scsi_cur->lun.state == 0)
 	{
-		request_sense.key  = 0x02; // NOT READY
-		request_sense.asc  = 0x3A; // MEDIUM NOT PRESENT
-		request_sense.ascq = 0x00;
+		scsi_cur->sense.key  = 0x02; // NOT READY
+		scsi_cur->sense.asc  = 0x3A; // MEDIUM NOT PRESENT
+		scsi_cur->sense.ascq = 0x00;
 		return(-3);
 	}
 
@@ -527,8 +689,10 @@ static inline int cmd6_test_ready(void)
 /* -------------------------------------------------------------------------- */
 
 static inline int cmd10_read(lun *lun, u8 *cb, uint len);
-static inline int cmd10_read_capacity(void);
-static inline int cmd10_read_format_capacities(void);
+static inline int cmd10_read_capacity(lun *lun);
+static inline int cmd10_read_format_capacities(lun *lun);
+static inline int cmd10_sync_cache(lun *lun, u8 *cb);
+static inline int cmd10_unmap(lun *lun, u8 *cb);
 static inline int cmd10_write(lun *lun, u8 *cb, uint len);
 
 /**
@@ -544,43 +708,45 @@ static inline int cmd10(lun *unit, scsi_context *ctx)
 {
 	int result;
 
-	(void)unit;
-
 	if ((ctx == 0) || (ctx->cb_len < 10))
 		goto err_illegal;
 
 	switch(ctx->cb[0])
 	{
 		case SCSI_CMD10_READ_FORMAT_CAPACITIES:
-			return( cmd10_read_format_capacities() );
+			return( cmd10_read_format_capacities(unit) );
 		case SCSI_CMD10_READ_CAPACITY:
-			return( cmd10_read_capacity() );
+			return( cmd10_read_capacity(unit) );
 		case SCSI_CMD10_READ:
-			return( cmd10_read(&scsi_lun, ctx->cb, ctx->cb_len) );
+			return( cmd10_read(unit, ctx->cb, ctx->cb_len) );
 		case SCSI_CMD10_WRITE:
-			return( cmd10_write(&scsi_lun, ctx->cb, ctx->cb_len) );
+			return( cmd10_write(unit, ctx->cb, ctx->cb_len) );
+		case SCSI_CMD10_SYNC_CACHE:
+			return( cmd10_sync_cache(unit, ctx->cb) );
+		case SCSI_CMD10_UNMAP:
+			return( cmd10_unmap(unit, ctx->cb) );
 #ifdef SCSI_USE_RW_BUFFER
 		case SCSI_CMD10_READ_BUFFER:
-			result = cmd10_read_buffer(&scsi_lun, ctx);
+			result = cmd10_read_buffer(unit, ctx);
 			scsi_len = ctx->io_len;
-			scsi_ctx = ctx->flags;
+			scsi_cur->ctx = ctx->flags;
 			return(result);
 		case SCSI_CMD10_WRITE_BUFFER:
-			result = cmd10_write_buffer(&scsi_lun, ctx);
+			result = cmd10_write_buffer(unit, ctx);
 			scsi_len = ctx->io_len;
-			scsi_ctx = ctx->flags;
+			scsi_cur->ctx = ctx->flags;
 			return(result);
 #endif
 		default:
-			request_sense.key = 0x05; // Illegal Request
-			request_sense.asc = 0x20; // Invalid Command
+			scsi_cur->sense.key = 0x05; // Illegal Request
+			scsi_cur->sense.asc = 0x20; // Invalid Command
 			log_print(LOG_WRN, "SCSI: Unknown CMD10 %8x\n", ctx->cb[0]);
 	}
 	return(-1);
 
 err_illegal:
-	request_sense.key = 0x05; // Illegal Request
-	request_sense.asc = 0x20; // Invalid Command
+	scsi_cur->sense.key = 0x05; // Illegal Request
+	scsi_cur->sense.asc = 0x20; // Invalid Command
 	return(-1);
 }
 
@@ -594,8 +760,6 @@ err_illegal:
  */
 static inline int cmd10_read(lun *lun, u8 *cb, uint len)
 {
-	u16 transfer_length;
-	u32 addr;
 	struct __attribute__((packed)) packet {
 		u8  opcode;
 		u8  flags;
@@ -605,43 +769,15 @@ static inline int cmd10_read(lun *lun, u8 *cb, uint len)
 		u8  control;
 	} *pkt;
 
-	// Sanity check
-	if ((lun == 0) || (lun->rd == 0))
-		goto err_lun;
-
-	pkt = (struct packet *)cb;
-
 	(void)len;
+	pkt = (struct packet *)cb;
 
-	transfer_length = htons(pkt->length);
-
-	if ((scsi_log & SCSI_LOG_READ) && (scsi_ctx == 0))
-	{
-		log_print(LOG_INF, "%{SCSI: Read block %32x", LOG_YLW, htonl(pkt->lba));
-		log_print(LOG_INF, " count=%d",   htons(pkt->length));
-		log_print(LOG_INF, " current=%d", scsi_ctx);
-		log_print(LOG_INF, "%}\n");
-	}
-
-	addr = (htonl(pkt->lba) + scsi_ctx) * 512;
-	scsi_len = (uint)lun->rd(addr, 512, scsi_data);
-
-	scsi_ctx++;
-	if (scsi_ctx < transfer_length)
-		return(2);
-	return(1);
-
-err_lun:
-	if (scsi_log & SCSI_LOG_ERR)
-		log_print(LOG_ERR, "SCSI: %{Read error, invalid LUN %32x%}\n", LOG_RED, lun->rd);
-	request_sense.key = 0x04; // Hardware error
-	request_sense.asc = 0x01; // No Index/Logical Block signal
-	return(-1);
+	return( rw_read(lun, htonl(pkt->lba), htons(pkt->length)) );
 }
 
 
 
-static inline int cmd10_read_capacity(void)
+static inline int cmd10_read_capacity(lun *lun)
 {
 	struct __attribute__((packed)) response {
 		u32 lba;
@@ -651,16 +787,17 @@ static inline int cmd10_read_capacity(void)
 	if (scsi_log & SCSI_LOG_CAPACITY)
 		log_print(LOG_INF, "%{SCSI: Read Capacity%}\n", LOG_YLW);
 
-	rsp = (struct response *)&scsi_data;
+	rsp = (struct response *)scsi_data;
 	scsi_len = sizeof(struct response);
 
-	rsp->lba          = htonl(scsi_lun.capacity);
+	/* Address of the last block */
+	rsp->lba          = htonl(lun->capacity ? (lun->capacity - 1) : 0);
 	rsp->block_length = htonl(512);
 
 	return(1);
 }
 
-static inline int cmd10_read_format_capacities(void)
+static inline int cmd10_read_format_capacities(lun *lun)
 {
 	struct __attribute__((packed)) response {
 		uint           : 24; // Reserved
@@ -674,21 +811,161 @@ static inline int cmd10_read_format_capacities(void)
 	if (scsi_log & SCSI_LOG_CAPACITY)
 		log_print(LOG_INF, "%{SCSI: Read Format Capacities%}\n", LOG_YLW);
 
-	rsp = (struct response *)&scsi_data;
+	rsp = (struct response *)scsi_data;
 	scsi_len = sizeof(struct response);
 
 	rsp->length = 8;
-	rsp->nb_blocks = htonl(16384);
-	rsp->type      = 2;
+	rsp->nb_blocks = htonl(lun->capacity);
+	/* Formatted media, or no media present (maximum capacity unknown) */
+	rsp->type      = (lun->state && lun->capacity) ? 2 : 3;
 	rsp->block_len = (htonl(512) & 0xFFFFFF);
 
 	return(1);
 }
 
+/**
+ * @brief This command ask device to write cached data to the medium
+ *
+ * This function handle SYNCHRONIZE CACHE (10) and (16), both have the IMMED
+ * bit at the same place. The LBA range of the request is ignored, all cached
+ * data are written. When IMMED is set, the flush is only started and status
+ * is returned immediately.
+ *
+ * @param lun Pointer to the LUN to use for this request
+ * @param cb  Pointer to the received command block
+ * @return integer Zero on success, 5 while busy, negative value on error
+ */
+static inline int cmd10_sync_cache(lun *lun, u8 *cb)
+{
+	int result;
+
+	if ((scsi_log & SCSI_LOG_WRITE) && (scsi_cur->ctx == 0))
+		log_print(LOG_INF, "%{SCSI: Synchronize cache%}\n", LOG_YLW);
+
+	/* No flush function, data are written immediately */
+	if (lun->flush == 0)
+		return(0);
+
+	result = lun->flush();
+	/* Flush is running, wait for the end (unless IMMED) */
+	if (result > 0)
+	{
+		if (cb[1] & 0x02)
+			return(0);
+		scsi_cur->ctx = 1;
+		return(5);
+	}
+	if (result)
+	{
+		if (scsi_log & SCSI_LOG_ERR)
+			log_print(LOG_ERR, "SCSI: %{Synchronize cache failed%}\n", LOG_RED);
+		scsi_cur->sense.key = 0x03; // Medium error
+		scsi_cur->sense.asc = 0x0C; // Write error
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * @brief This command declare blocks as no more used by the host
+ *
+ * The parameter list (header and block descriptors) is received in one data
+ * step, then each range is given to the LUN (see lun->unmap). The LUN can
+ * ignore a part of the ranges : blocks are then kept as they are.
+ *
+ * @param lun Pointer to the LUN to use for this request
+ * @param cb  Pointer to the received command block
+ * @return integer Zero on success, 3 to receive data, negative on error
+ */
+static inline int cmd10_unmap(lun *lun, u8 *cb)
+{
+	struct __attribute__((packed)) header {
+		u16 data_len;
+		u16 desc_len;
+		u32 reserved;
+	} *hdr;
+	struct __attribute__((packed)) descriptor {
+		u32 lba_hi;
+		u32 lba;
+		u32 count;
+		u32 reserved;
+	} *desc;
+	uint len, pos;
+	u32  lba, count;
+
+	if (lun->unmap == 0)
+		goto err_illegal;
+	if (lun->writable == 0)
+	{
+		scsi_cur->sense.key  = 0x07; // Data protect
+		scsi_cur->sense.asc  = 0x27; // Write protected
+		return(-3);
+	}
+
+	len = (uint)((cb[7] << 8) | cb[8]);
+	if (scsi_cur->ctx == 0)
+	{
+		if (scsi_log & SCSI_LOG_WRITE)
+			log_print(LOG_INF, "%{SCSI: Unmap%} %d bytes\n", LOG_YLW, len);
+		if (len == 0)
+			return(0);
+		if ((len < 8) || (len > SCSI_BUFFER_SZ))
+			goto err_invalid_field;
+		/* Receive the parameter list */
+		scsi_len = 0;
+		scsi_cur->ctx = 1;
+		return(3);
+	}
+
+	hdr = (struct header *)scsi_data;
+	len = htons(hdr->desc_len);
+	if ((scsi_len < 8) || (len > (scsi_len - 8)))
+		goto err_param;
+	/* Check all descriptors before any data is discarded */
+	for (pos = 8; (pos + 16) <= (8 + len); pos += 16)
+	{
+		desc = (struct descriptor *)(scsi_data + pos);
+		if (desc->lba_hi)
+			return( lba_error(htonl(desc->lba_hi)) );
+		if (lba_check(lun, htonl(desc->lba), htonl(desc->count)))
+			return(-1);
+	}
+	for (pos = 8; (pos + 16) <= (8 + len); pos += 16)
+	{
+		desc = (struct descriptor *)(scsi_data + pos);
+		lba   = htonl(desc->lba);
+		count = htonl(desc->count);
+		if (count)
+			lun->unmap(lba * 512, count * 512);
+	}
+	return(0);
+
+err_param:
+	scsi_cur->sense.key  = 0x05; // Illegal Request
+	scsi_cur->sense.asc  = 0x26; // Invalid field in parameter list
+	scsi_cur->sense.ascq = 0x00;
+	return(-1);
+err_invalid_field:
+	scsi_cur->sense.key  = 0x05; // Illegal Request
+	scsi_cur->sense.asc  = 0x24; // Invalid field in CDB
+	scsi_cur->sense.ascq = 0x00;
+	return(-1);
+err_illegal:
+	scsi_cur->sense.key = 0x05; // Illegal Request
+	scsi_cur->sense.asc = 0x20; // Invalid Command
+	return(-1);
+}
+
+/**
+ * @brief This command ask device to receive data and write them
+ *
+ * @param lun Pointer to the LUN to use for this request
+ * @param cb  Pointer to the received packet structure
+ * @param len Length of the received packet
+ * @return integer Positive value on success, negative value on error
+ */
 static inline int cmd10_write(lun *lun, u8 *cb, uint len)
 {
-	u16 transfer_length;
-	u32 addr;
 	struct __attribute__((packed)) packet {
 		u8  opcode;
 		u8  flags;
@@ -698,56 +975,330 @@ static inline int cmd10_write(lun *lun, u8 *cb, uint len)
 		u8  control;
 	} *req;
 
+	(void)len;
+	req = (struct packet *)cb;
+
+	return( rw_write(lun, htonl(req->lba), htons(req->length), req->flags & 0x08) );
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                           CDB-12  Commands                           -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Decode and dispatch a CMD12 command to dedicated functions
+ *
+ * This function is called by the scsi_command when the received CDB contains
+ * a twelve bytes command (CMD12). READ(12) and WRITE(12) use the same engine
+ * than the CMD10 version, with a 32 bits transfer length.
+ *
+ * @return integer Result returned by dedicated functions (-1 if unsupported)
+ */
+static inline int cmd12(lun *unit, scsi_context *ctx)
+{
+	struct __attribute__((packed)) packet {
+		u8  opcode;
+		u8  flags;
+		u32 lba;
+		u32 length;
+		u8  group;
+		u8  control;
+	} *pkt;
+
+	if ((ctx == 0) || (ctx->cb_len < 12))
+		goto err_illegal;
+
+	pkt = (struct packet *)ctx->cb;
+
+	switch(ctx->cb[0])
+	{
+		case SCSI_CMD12_READ:
+			return( rw_read(unit, htonl(pkt->lba), htonl(pkt->length)) );
+		case SCSI_CMD12_WRITE:
+			return( rw_write(unit, htonl(pkt->lba), htonl(pkt->length), pkt->flags & 0x08) );
+		default:
+			log_print(LOG_WRN, "SCSI: Unknown CMD12 %8x\n", ctx->cb[0]);
+	}
+
+err_illegal:
+	scsi_cur->sense.key = 0x05; // Illegal Request
+	scsi_cur->sense.asc = 0x20; // Invalid Command
+	return(-1);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                           CDB-16  Commands                           -- */
+/* -------------------------------------------------------------------------- */
+
+static inline int cmd16_read_capacity(lun *lun);
+
+/**
+ * @brief Decode and dispatch a CMD16 command to dedicated functions
+ *
+ * This function is called by the scsi_command when the received CDB contains
+ * a sixteen bytes command (CMD16). Medium is always smaller than 2TB, a 64
+ * bits LBA with upper bits set is out of range.
+ *
+ * @return integer Result returned by dedicated functions (-1 if unsupported)
+ */
+static inline int cmd16(lun *unit, scsi_context *ctx)
+{
+	struct __attribute__((packed)) packet {
+		u8  opcode;
+		u8  flags;
+		u32 lba_hi;
+		u32 lba;
+		u32 length;
+		u8  group;
+		u8  control;
+	} *pkt;
+
+	if ((ctx == 0) || (ctx->cb_len < 16))
+		goto err_illegal;
+
+	pkt = (struct packet *)ctx->cb;
+
+	switch(ctx->cb[0])
+	{
+		case SCSI_CMD16_READ:
+			if (pkt->lba_hi)
+				return( lba_error(htonl(pkt->lba_hi)) );
+			return( rw_read(unit, htonl(pkt->lba), htonl(pkt->length)) );
+		case SCSI_CMD16_WRITE:
+			if (pkt->lba_hi)
+				return( lba_error(htonl(pkt->lba_hi)) );
+			return( rw_write(unit, htonl(pkt->lba), htonl(pkt->length), pkt->flags & 0x08) );
+		case SCSI_CMD16_SYNC_CACHE:
+			if (pkt->lba_hi)
+				return( lba_error(htonl(pkt->lba_hi)) );
+			return( cmd10_sync_cache(unit, ctx->cb) );
+		case SCSI_CMD16_SERVICE_IN:
+			if ((ctx->cb[1] & 0x1F) == SCSI_SA_READ_CAPACITY16)
+				return( cmd16_read_capacity(unit) );
+			log_print(LOG_WRN, "SCSI: Unknown service action %8x\n", ctx->cb[1]);
+			break;
+		default:
+			log_print(LOG_WRN, "SCSI: Unknown CMD16 %8x\n", ctx->cb[0]);
+	}
+
+err_illegal:
+	scsi_cur->sense.key = 0x05; // Illegal Request
+	scsi_cur->sense.asc = 0x20; // Invalid Command
+	return(-1);
+}
+
+/**
+ * @brief READ CAPACITY (16) report the size and provisioning of the medium
+ *
+ * In addition to the (10) version, this report the physical block size
+ * (one 4k flash sector) and if UNMAP can be used (LBPME). LBPRZ is not set,
+ * the content of unmapped blocks is not guaranteed (see cmd6_inquiry).
+ *
+ * @param lun Pointer to the LUN to use for this request
+ * @return integer Positive value on success
+ */
+static inline int cmd16_read_capacity(lun *lun)
+{
+	struct __attribute__((packed)) response {
+		u32 lba_hi;
+		u32 lba;
+		u32 block_length;
+		u8  prot;
+		u8  exponent;  /* Logical blocks per physical block (log2) */
+		u16 lowest;    /* LBPME, LBPRZ and lowest aligned LBA      */
+		u8  reserved[16];
+	} *rsp;
+
+	if (scsi_log & SCSI_LOG_CAPACITY)
+		log_print(LOG_INF, "%{SCSI: Read Capacity (16)%}\n", LOG_YLW);
+
+	rsp = (struct response *)scsi_data;
+	scsi_len = sizeof(struct response);
+	memset(rsp, 0, sizeof(struct response));
+
+	rsp->lba          = htonl(lun->capacity ? (lun->capacity - 1) : 0);
+	rsp->block_length = htonl(512);
+	rsp->exponent     = 3;
+	if (lun->unmap)
+		rsp->lowest = htons(1 << 15);
+
+	return(1);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                      Read and Write data engine                      -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Read engine, common to all READ commands
+ *
+ * Data are read sector by sector, one step of the command each time this
+ * function is called (see scsi_command).
+ *
+ * @param lun   Pointer to the LUN to use for this request
+ * @param lba   Address of the first block to read
+ * @param count Number of blocks to read (transfer length)
+ * @return integer Positive value on success, negative value on error
+ */
+static inline int rw_read(lun *lun, u32 lba, u32 count)
+{
+	u32 addr, total, chunk;
+	int result;
+
 	// Sanity check
-	if (lun == 0)
+	if ((lun == 0) || (lun->rd == 0))
 		goto err_lun;
 
-	(void)len;
-	req = (struct packet *)cb;
-	transfer_length = htons(req->length);
+	if ((scsi_cur->ctx == 0) && lba_check(lun, lba, count))
+		return(-1);
+	/* Transfer length of zero : success, no data (SBC) */
+	if (count == 0)
+	{
+		scsi_len = 0;
+		return(0);
+	}
+
+	if ((scsi_log & SCSI_LOG_READ) && (scsi_cur->ctx == 0))
+	{
+		log_print(LOG_INF, "%{SCSI: Read block %32x", LOG_YLW, lba);
+		log_print(LOG_INF, " count=%d",   count);
+		log_print(LOG_INF, " current=%d", scsi_cur->ctx);
+		log_print(LOG_INF, "%}\n");
+	}
+
+	/* Zero-copy : read a chunk of data into the buffer given by transport */
+	if (scsi_target && (lun->perm & SCSI_PERM_RD_DIRECT))
+	{
+		/* In this mode, context is the offset (in bytes) of the next chunk */
+		total = (u32)count * 512;
+		chunk = scsi_target_len;
+		if ((scsi_cur->ctx + chunk) > total)
+			chunk = (total - scsi_cur->ctx);
+		addr = (lba * 512) + scsi_cur->ctx;
+		scsi_data = scsi_target;
+		scsi_len  = 0;
+		if (chunk)
+		{
+			result = lun->rd(addr, chunk, scsi_data);
+			if (result != (int)chunk)
+				goto err_read;
+			scsi_len = (uint)result;
+		}
+		scsi_cur->ctx += chunk;
+		if (scsi_cur->ctx < total)
+			return(2);
+		return(1);
+	}
+
+	/* Each sector is read into the next buffer, previous may still be sent */
+	scsi_depth = SCSI_BUFFER_COUNT;
+	scsi_data  = scsi_buffer[scsi_cur->ctx & (SCSI_BUFFER_COUNT - 1)];
+
+	addr = (lba + scsi_cur->ctx) * 512;
+	result = lun->rd(addr, 512, scsi_data);
+	/* Data not (fully) read, buffer content must not be sent as valid */
+	if (result != 512)
+		goto err_read;
+	scsi_len = 512;
+
+	scsi_cur->ctx++;
+	if (scsi_cur->ctx < count)
+		return(2);
+	return(1);
+
+err_lun:
+	if (scsi_log & SCSI_LOG_ERR)
+		log_print(LOG_ERR, "SCSI: %{Read error, invalid LUN %32x%}\n", LOG_RED, lun->rd);
+	scsi_cur->sense.key = 0x04; // Hardware error
+	scsi_cur->sense.asc = 0x01; // No Index/Logical Block signal
+	return(-1);
+
+err_read:
+	if (scsi_log & SCSI_LOG_ERR)
+		log_print(LOG_ERR, "SCSI: %{Read error at %32x%}\n", LOG_RED, addr);
+	scsi_len = 0;
+	scsi_cur->sense.key  = 0x03; // Medium error
+	scsi_cur->sense.asc  = 0x11; // Unrecovered read error
+	scsi_cur->sense.ascq = 0x00;
+	return(-1);
+}
+
+/**
+ * @brief Write engine, common to all WRITE commands
+ *
+ * Data are received sector by sector, one step of the command each time
+ * this function is called (see scsi_command). When Force Unit Access is
+ * requested, the status is returned only when the LUN cache has been
+ * written to the medium (flush).
+ *
+ * @param lun   Pointer to the LUN to use for this request
+ * @param lba   Address of the first block to write
+ * @param count Number of blocks to write (transfer length)
+ * @param fua   Set to non-zero for Force Unit Access
+ * @return integer Positive value on success, negative value on error
+ */
+static inline int rw_write(lun *lun, u32 lba, u32 count, u8 fua)
+{
+	u32 addr;
+	int result;
+
+	// Sanity check
+	if (lun == 0)
+		goto err_lun;
 
 	if (scsi_log & SCSI_LOG_WRITE)
 	{
-		log_print(LOG_INF, "%{SCSI: Write block %32x", LOG_YLW, htonl(req->lba));
-		log_print(LOG_INF, " count=%d", transfer_length);
-		log_print(LOG_INF, " current=%d", scsi_ctx);
+		log_print(LOG_INF, "%{SCSI: Write block %32x", LOG_YLW, lba);
+		log_print(LOG_INF, " count=%d", count);
+		log_print(LOG_INF, " current=%d", scsi_cur->ctx);
 		log_print(LOG_INF, "%}\n");
 	}
 
 	/* Verify if LUN is writable ... or not */
-	if (scsi_lun.writable == 0)
+	if (lun->writable == 0)
 	{
 		log_print(LOG_WRN, "SCSI: Write protected\n");
-		request_sense.key  = 0x07; // Data protect
-		request_sense.asc  = 0x27; // Write protected
+		scsi_cur->sense.key  = 0x07; // Data protect
+		scsi_cur->sense.asc  = 0x27; // Write protected
 		return(-3);
 	}
 
-	if (scsi_ctx == 0)
+	addr = lba * 512;
+	/* All data received, waiting end of flush (FUA) */
+	if (scsi_cur->ctx > count)
+		goto sync;
+
+	if (scsi_cur->ctx == 0)
 	{
-		addr = htonl(req->lba) * 512;
+		if (lba_check(lun, lba, count))
+			return(-1);
+		addr = lba * 512;
 		// If a preload function is defined for the LUN, call it
 		if (lun->wr_preload)
 		{
-			if( lun->wr_preload(addr) )
+			if( lun->wr_preload(addr, count * 512) )
 				goto err_preload;
 		}
 	}
-	else if (scsi_ctx > 0)
+	else if (scsi_cur->ctx > 0)
 	{
-		addr = (htonl(req->lba) + scsi_ctx - 1) * 512;
+		addr = (lba + scsi_cur->ctx - 1) * 512;
 		if (scsi_log & SCSI_LOG_WRITE)
 			log_print(LOG_INF, "SCSI: Write at %32x\n", addr);
 		if (lun->wr)
 		{
-			if ( lun->wr(addr, 512, scsi_data) )
+			result = lun->wr(addr, 512, scsi_data);
+			/* Medium busy, keep data and retry this step later */
+			if (result > 0)
+				return(5);
+			if (result)
 				goto err_write;
 		}
 	}
 	scsi_len = 0;
 
-	scsi_ctx++;
-	if (scsi_ctx <= transfer_length)
+	scsi_cur->ctx++;
+	if (scsi_cur->ctx <= count)
 		return(3);
 	// After last write, if a callback function is defined, call it
 	if (lun->wr_complete)
@@ -755,27 +1306,69 @@ static inline int cmd10_write(lun *lun, u8 *cb, uint len)
 		if ( lun->wr_complete() )
 			goto err_write;
 	}
+sync:
+	/* Force Unit Access : data must be into medium, not only into cache */
+	if (fua && lun->flush)
+	{
+		result = lun->flush();
+		if (result > 0)
+			return(5);
+		if (result)
+			goto err_write;
+	}
 	return(0);
 
 err_write:
 	if (scsi_log & SCSI_LOG_ERR)
 		log_print(LOG_ERR, "SCSI: %{Write error at %32x%}\n", LOG_RED, addr);
-	request_sense.key = 0x03; // Medium error
-	request_sense.asc = 0x0C; // Write error
+	scsi_cur->sense.key = 0x03; // Medium error
+	scsi_cur->sense.asc = 0x0C; // Write error
 	return(-1);
 
 err_preload:
 	if (scsi_log & SCSI_LOG_ERR)
 		log_print(LOG_ERR, "SCSI: %{Write error, preload rejected%}\n", LOG_RED);
-	request_sense.key = 0x03; // Medium error
-	request_sense.asc = 0x0C; // Write error
+	scsi_cur->sense.key = 0x03; // Medium error
+	scsi_cur->sense.asc = 0x0C; // Write error
 	return(-1);
 
 err_lun:
 	if (scsi_log & SCSI_LOG_ERR)
 		log_print(LOG_ERR, "SCSI: %{Write error, invalid LUN%}\n", LOG_RED);
-	request_sense.key = 0x04; // Hardware error
-	request_sense.asc = 0x01; // No Index/Logical Block signal
+	scsi_cur->sense.key = 0x04; // Hardware error
+	scsi_cur->sense.asc = 0x01; // No Index/Logical Block signal
+	return(-1);
+}
+
+/**
+ * @brief Verify that a range of blocks is inside the medium of a LUN
+ *
+ * @param lun   Pointer to the LUN to use for this request
+ * @param lba   Address of the first block
+ * @param count Number of blocks
+ * @return integer Zero if the range is valid, -1 if not (sense updated)
+ */
+static inline int lba_check(lun *lun, u32 lba, u32 count)
+{
+	if ((lba <= lun->capacity) && (count <= (lun->capacity - lba)))
+		return(0);
+
+	return( lba_error(lba) );
+}
+
+/**
+ * @brief Report a block address out of the medium
+ *
+ * @param lba Address of the block (for log)
+ * @return integer Always -1 (sense updated)
+ */
+static inline int lba_error(u32 lba)
+{
+	if (scsi_log & SCSI_LOG_ERR)
+		log_print(LOG_ERR, "SCSI: %{Block %32x out of range%}\n", LOG_RED, lba);
+	scsi_cur->sense.key  = 0x05; // Illegal Request
+	scsi_cur->sense.asc  = 0x21; // Logical block address out of range
+	scsi_cur->sense.ascq = 0x00;
 	return(-1);
 }
 /* EOF */
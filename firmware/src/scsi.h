@@ -22,6 +22,13 @@
 #define SCSI_SANITY_EXTRA  /* Activate more sanity checks */
 
 #define SCSI_BUFFER_SZ 512
+#define SCSI_BUFFER_COUNT 2 /* Data buffers for READ pipeline (power of 2) */
+/* UNMAP parameter list is received into one buffer : header + descriptors */
+#define SCSI_UNMAP_DESC_MAX ((SCSI_BUFFER_SZ - 8) / 16)
+/* Number of logical units available (see scsi_lun_set_count) */
+#ifndef SCSI_LUN_COUNT
+#define SCSI_LUN_COUNT 4
+#endif
 
 #define SCSI_CMD6_TEST_READY       0x00
 #define SCSI_CMD6_REQUEST_SENSE    0x03
@@ -33,8 +40,17 @@
 #define SCSI_CMD10_READ_CAPACITY 0x25
 #define SCSI_CMD10_READ          0x28
 #define SCSI_CMD10_WRITE         0x2A
+#define SCSI_CMD10_SYNC_CACHE    0x35
 #define SCSI_CMD10_WRITE_BUFFER  0x3B
 #define SCSI_CMD10_READ_BUFFER   0x3C
+#define SCSI_CMD10_UNMAP         0x42
+#define SCSI_CMD12_READ          0xA8
+#define SCSI_CMD12_WRITE         0xAA
+#define SCSI_CMD16_READ          0x88
+#define SCSI_CMD16_WRITE         0x8A
+#define SCSI_CMD16_SYNC_CACHE    0x91
+#define SCSI_CMD16_SERVICE_IN    0x9E
+#define SCSI_SA_READ_CAPACITY16  0x10
 
 #define SCSI_LOG_ERR        (1 << 0)
 #define SCSI_LOG_WRN        (1 << 1)
@@ -47,6 +63,7 @@
 #define SCSI_LOG_CAPACITY   (1 << 12)
 #define SCSI_LOG_MEDIUM     (1 << 15)
 
+#define SCSI_PERM_RD_DIRECT (1 << 27) /* rd() can fill a 32 bits only buffer */
 #define SCSI_PERM_RDBUFFER (1 << 28)
 #define SCSI_PERM_WRBUFFER (1 << 29)
 
@@ -56,13 +73,18 @@ typedef struct lun_s
 	uint capacity; // Number of 512 bytes sectors
 	uint writable;
 	uint perm;     // Permission mask
-	/* LUN functions */
+	/* LUN functions (wr and flush return 1 when medium is busy) */
 	int  (*rd)(u32 addr, u32 len, u8 *data);
 	int  (*wr)(u32 addr, u32 len, u8 *data);
 	int  (*wr_complete)(void);
-	int  (*wr_preload)(u32 addr);
+	int  (*wr_preload)(u32 addr, u32 len);
 	/* LUN vendor extension */
 	int  (*cmd_vendor)(struct lun_s *unit, u32 *ctx, u8 *cb, uint len);
+	/* Write cached data to medium (SYNCHRONIZE CACHE) */
+	int  (*flush)(void);
+	/* Declare blocks as no more used (UNMAP), address and length in bytes */
+	int  (*unmap)(u32 addr, u32 len);
+	void *priv;    // Free for the LUN owner (see scsi_lun_current)
 } lun;
 
 typedef struct __attribute__((packed))
@@ -94,12 +116,16 @@ typedef struct scsi_context_s
 
 void scsi_init(void);
 void scsi_reset(void);
-int  scsi_command(u8 *cb, uint len);
+int  scsi_command(uint pos, u8 *cb, uint len);
 void scsi_complete(void);
 uint scsi_lun_count(void);
-lun *scsi_lun_get(int pos);
+void scsi_lun_set_count(uint count);
+lun *scsi_lun_get(uint pos);
+lun *scsi_lun_current(void);
 u8  *scsi_get_response(uint *len);
+uint scsi_get_depth(void);
 u8  *scsi_set_data(u8 *data, uint *len);
+void scsi_set_target(u8 *data, uint len);
 
 #endif
 /* EOF */
@@ -18,6 +18,7 @@
 #include "scsi_rw_buffer.h"
 #include "libc.h"
 #include "log.h"
+#include "mem.h"
 #include "uart.h"
 #ifdef SCSI_USE_RW_BUFFER
 
@@ -43,7 +44,8 @@ static u8   scsi_echo[1024];
 static int echo_read (scsi_context *ctx, read10_req *req);
 static int echo_write(scsi_context *ctx, write10_req *req);
 static int mem_desc  (scsi_context *ctx, read10_req *req);
-static int mem_read  (scsi_context *ctx, read10_req *req);
+static int mem_stats (scsi_context *ctx, read10_req *req);
+static int raw_read  (scsi_context *ctx, read10_req *req);
 static int microcode_write(scsi_context *ctx, write10_req *req);
 
 /**
@@ -72,9 +74,12 @@ int cmd10_read_buffer(lun *lun, scsi_context *ctx)
 
 	switch(req->mode)
 	{
-		// Mode Data: read data buffer
+		// Mode Data: read data buffer (or statistics)
 		case 2:
-			result = mem_read(ctx, req);
+			if (req->buffer_id == RWBUF_ID_MEM_STATS)
+				result = mem_stats(ctx, req);
+			else
+				result = raw_read(ctx, req);
 			break;
 		// Mode Descriptor: read only header of buffer descriptor
 		case 3:
@@ -300,6 +305,10 @@ static int mem_desc(scsi_context *ctx, read10_req *req)
 		case 1:
 			rsp->buffer_capacity = (64 * 1024) - 0x2000;
 			break;
+		// Memory nodes statistics
+		case RWBUF_ID_MEM_STATS:
+			rsp->buffer_capacity = (MEM_NODE_COUNT * 16);
+			break;
 		default:
 			goto err_buffer_id;
 	}
@@ -314,6 +323,53 @@ err_buffer_id:
 	return(-3);
 }
 
+/**
+ * @brief Process a READ_BUFFER on memory nodes statistics
+ *
+ * For each node, 16 bytes are returned (four 32 bits big-endian values) :
+ * depth of the pre-erase pool, number of sectors erased in background,
+ * number of sector updates into a pre-erased sector (hit) and into a sector
+ * that must be compared and may be erased (miss).
+ *
+ * The free and erased sectors maps are kept into RAM only : they are empty
+ * after each reset (the pool is refilled as the host trims sectors again).
+ * Each map covers MEM_FREE_MAP_SZ * 8 sectors of a node (16MB with the
+ * default size), sectors above are never pre-erased and are always counted
+ * as miss.
+ *
+ * @param ctx Pointer to a context structure for this transaction
+ * @param req Pointer to the request structure
+ * @return integer Positive value on success, negative value on error
+ */
+static int mem_stats(scsi_context *ctx, read10_req *req)
+{
+	struct __attribute__((packed)) rsp_node {
+		u32 pool;
+		u32 pre_erase;
+		u32 hit;
+		u32 miss;
+	} *rsp;
+	mem_node *node;
+	uint i, dlen;
+
+	log_print(LOG_DBG, "SCSI: READ_BUFFER (mem stats) length=%d\n", hton3(req->length));
+
+	rsp = (struct rsp_node *)ctx->io_data;
+	for (i = 0; i < MEM_NODE_COUNT; i++)
+	{
+		node = mem_get_node(i);
+		rsp[i].pool      = htonl(node->st_pool);
+		rsp[i].pre_erase = htonl(node->st_pre_erase);
+		rsp[i].hit       = htonl(node->st_pool_hit);
+		rsp[i].miss      = htonl(node->st_pool_miss);
+	}
+	dlen = hton3(req->length);
+	if (dlen > (MEM_NODE_COUNT * 16))
+		dlen = (MEM_NODE_COUNT * 16);
+	ctx->io_len = dlen;
+	return(1);
+}
+
 /**
  * @brief Process a READ_BUFFER on raw memory
  *
@@ -321,7 +377,7 @@ err_buffer_id:
  * @param req Pointer to the request structure
  * @return integer Positive value on success, negative value on error
  */
-static int mem_read(scsi_context *ctx, read10_req *req)
+static int raw_read(scsi_context *ctx, read10_req *req)
 {
 	uint dlen;
 	u32 addr;
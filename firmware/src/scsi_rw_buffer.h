@@ -18,6 +18,9 @@
 #include "scsi.h"
 #include "types.h"
 
+/* READ BUFFER identifier of the memory nodes statistics (pre-erase pool) */
+#define RWBUF_ID_MEM_STATS 0x20
+
 #ifdef SCSI_USE_RW_BUFFER
 int cmd10_read_buffer (lun *lun, scsi_context *ctx);
 int cmd10_write_buffer(lun *lun, scsi_context *ctx);
@@ -13,9 +13,32 @@
  * program, see LICENSE.md file for more details.
  * This program is distributed WITHOUT ANY WARRANTY.
  */
+#include "libc.h"
 #include "types.h"
 #include "spi.h"
 
+#define SPI_SR_RXNE    (1 << 0)
+#define SPI_SR_TXE     (1 << 1)
+#define SPI_CR2_FRXTH  (1 << 12)
+/* RX and TX FIFOs have 32 bits (4 frames of 8 bits) */
+#define SPI_FIFO_SIZE  4
+
+typedef struct spi_dma_s
+{
+	uint channel; /* SPI channel that own the transfer (0 when idle) */
+	void (*complete)(uint channel);
+} spi_dma;
+
+static spi_bus bus_ports[2];
+static u8      bus_div[4]; /* Baudrate divisor (CR1 BR) of each channel */
+static u32     bus_pclk;   /* Kernel clock of the ports (Hz)            */
+static spi_dma dma_ctx[2];
+static u8      dma_dummy;
+
+static spi_bus *bus_find(uint channel);
+static void bus_config(spi_bus *bus, uint channel);
+static void dma_release(uint id);
+
 /**
  * @brief Initialize SPI interfaces
  *
@@ -24,12 +47,15 @@
  */
 void spi_init(void)
 {
-	u16 val;
+	u16 val, cr1, cr2;
+	uint i;
 
 	/* Activate SPI1 */
 	reg_set((u32)RCC_APBENR2, (1 << 12));
 	/* Activate SPI2 */
 	reg_set((u32)RCC_APBENR1, (1 << 14));
+	/* Activate DMA1 (used for block transfers) */
+	reg_set((u32)RCC_AHBENR, (1 << 0));
 
 	/* Configure SPI to work as master */
 	val  = (7 << 3); // Baudrate = f/256 (slowest)
@@ -38,18 +64,45 @@ void spi_init(void)
 	val |= (1 << 2); // Master mode
 	reg16_wr(SPI_CR1(SPI1), val);
 	reg16_wr(SPI_CR1(SPI2), val);
+	cr1 = val;
 
 	/* Configure format for external memory communication */
 	val =  (7 <<  8); // Data Size: 8 bits
 	val |= (1 << 12); // FRXTH: Reception threshold (1 byte)
 	reg16_wr(SPI_CR2(SPI1), val);
 	reg16_wr(SPI_CR2(SPI2), val);
+	cr2 = val;
 
 	/* Enable SPI1 */
 	reg16_set(SPI_CR1(SPI1), (1 << 6));
 	/* Enable SPI2 */
 	reg16_set(SPI_CR1(SPI2), (1 << 6));
 
+	/* Initialize bus handles with the current configuration */
+	bus_ports[0].port = SPI1;
+	bus_ports[1].port = SPI2;
+	for (i = 0; i < 2; i++)
+	{
+		bus_ports[i].id    = i;
+		bus_ports[i].owner = 0;
+		bus_ports[i].cr1   = (u16)(cr1 | (1 << 6));
+		bus_ports[i].cr2   = cr2;
+	}
+	for (i = 0; i < 4; i++)
+		bus_div[i] = 7;
+	/* Dividers are computed for the real clock of the ports */
+	bus_pclk = hw_get_pclk();
+
+	/* Route SPI requests to DMA1 channels (see DMAMUX request table) */
+	reg_wr(DMAMUX_CCR(1), 16); // Channel 1 : SPI1_RX
+	reg_wr(DMAMUX_CCR(2), 17); // Channel 2 : SPI1_TX
+	reg_wr(DMAMUX_CCR(3), 18); // Channel 3 : SPI2_RX
+	reg_wr(DMAMUX_CCR(4), 19); // Channel 4 : SPI2_TX
+	memset(dma_ctx, 0, sizeof(dma_ctx));
+	dma_dummy = 0x00;
+	/* Enable DMA1 channel 1 and channels 2-3 interrupts into NVIC */
+	reg_wr(CM0_NVIC, (1 << 9) | (1 << 10));
+
 	/* Disable Hold signals (allow devices to communicate) */
 	reg_wr(GPIO_BSRR(GPIOA), (1 << 8)); // SPI1 Hold = 1
 	reg_wr(GPIO_BSRR(GPIOB), (1 << 3)); // SPI2 Hold = 1
@@ -58,11 +111,17 @@ void spi_init(void)
 /**
  * @brief Enable or disable SPI channel
  *
+ * When a channel is enabled, its port is configured for it first (see
+ * spi_bus_get).
+ *
  * @param channel SPI channel
  * @param state   Disable or enable
  */
 void spi_cs(uint channel, int state)
 {
+	if (state)
+		(void)spi_bus_get(channel);
+
 	switch (channel)
 	{
 		/* SPI1 channel 1 */
@@ -96,56 +155,571 @@ void spi_cs(uint channel, int state)
 /**
  * @brief Set the speed of one SPI channel
  *
+ * The fastest divisor of PCLK (2 to 256) that does not exceed the speed
+ * is used, or the slowest one if none. The speed is saved for the channel,
+ * the port is only updated when it is configured for this channel (else on
+ * next spi_bus_get) and if the divisor has changed.
+ *
  * @param channel ID of the channel to configure (1->3)
- * @param speed   New speed to set (in MHz)
+ * @param speed   New speed to set, maximum clock (in MHz)
  */
 void spi_set_speed(uint channel, uint speed)
 {
-	u32 port;
-	u16 val;
+	spi_bus *bus;
+	u8 div;
 
-	if ((channel == 1) || (channel == 2))
-		port = SPI1;
-	else if (channel == 3)
-		port = SPI2;
-	else
+	bus = bus_find(channel);
+	if (bus == 0)
 		return;
 
-	/* Read the current port configuration */
-	val = reg16_rd(SPI_CR1(port));
-	/* Update the BaudRate divisor according to required speed */
-	val &= (u16)~(7 << 3);
-	if (speed >= 32)
-		val |= (u32)(0 << 3); // fPCLK/2
-	else if (speed >= 16)
-		val |= (u32)(1 << 3); // fPCLK/4
-	else if (speed >=  1)
-		val |= (u32)(5 << 3); // fPCLK/64
-	else
-		val |= (u32)(7 << 3); // fPCLK/256
-	/* Write back the control register */
-	reg16_wr(SPI_CR1(port), val);
+	/* Select the BaudRate divisor : fPCLK / (2 << div) */
+	for (div = 0; div < 7; div++)
+	{
+		if (((bus_pclk / 1000) >> (div + 1)) <= (speed * 1000))
+			break;
+	}
+	bus_div[channel] = div;
+
+	if (bus->owner == channel)
+		bus_config(bus, channel);
+}
+
+/**
+ * @brief Get the real clock of one SPI channel
+ *
+ * @param channel ID of the channel (1->3)
+ * @return uint Clock used for the channel (in kHz), zero for invalid channel
+ */
+uint spi_get_speed(uint channel)
+{
+	if (bus_find(channel) == 0)
+		return(0);
+	return((uint)((bus_pclk >> (bus_div[channel] + 1)) / 1000));
 }
 
+/**
+ * @brief Send and receive one byte on a SPI channel
+ *
+ * @param channel ID of the channel to use (1->3)
+ * @param out     Byte to send
+ * @return u8 Received byte
+ */
 u8 spi_rw(uint channel, u8 out)
 {
-	u32 port;
-	int i;
+	spi_bus *bus;
 
-	if ((channel == 1) || (channel == 2))
-		port = SPI1;
-	else if (channel == 3)
-		port = SPI2;
-	else
+	bus = bus_find(channel);
+	if (bus == 0)
 		return(0);
+	return(spi_bus_rw(bus, out));
+}
+
+/**
+ * @brief Get the bus handle of a SPI channel
+ *
+ * Channels 1 and 2 share the same port (SPI1) with their own speed. The
+ * port registers are only written when the port has been used by another
+ * channel since the last call (or when the speed of the channel changed).
+ * The handle can then be used for all the transfers of a transaction.
+ *
+ * @param channel ID of the channel to use (1->3)
+ * @return spi_bus* Pointer to the bus handle (or NULL for invalid channel)
+ */
+spi_bus *spi_bus_get(uint channel)
+{
+	spi_bus *bus;
+
+	bus = bus_find(channel);
+	if ((bus != 0) && (bus->owner != channel))
+		bus_config(bus, channel);
+	return(bus);
+}
+
+/**
+ * @brief Send and receive one byte on a SPI port
+ *
+ * @param bus Pointer to the bus handle (see spi_bus_get)
+ * @param out Byte to send
+ * @return u8 Received byte
+ */
+u8 spi_bus_rw(spi_bus *bus, u8 out)
+{
+	int i;
 
-	reg8_wr(SPI_DR(port), out);
+	reg8_wr(SPI_DR(bus->port), out);
 	/* Wait for RX */
 	for (i = 0; i < 0x100000; i++)
 	{
-		if (reg16_rd(SPI_SR(port)) & (1 << 0))
+		if (reg16_rd(SPI_SR(bus->port)) & (1 << 0))
+			break;
+	}
+	return(reg8_rd(SPI_DR(bus->port)));
+}
+
+/**
+ * @brief Send and receive a block of bytes (polled)
+ *
+ * The TX FIFO is kept filled while the RX FIFO is drained, so the port
+ * shift bytes without gap while the CPU moves the previous ones. Bytes are
+ * moved by pairs with 16 bits accesses (data packing), the RX threshold is
+ * set to 8 bits only for the last byte of an odd length. No more than the
+ * size of the RX FIFO is sent ahead, so the RX FIFO can not overrun.
+ *
+ * @param bus Pointer to the bus handle (see spi_bus_get)
+ * @param tx  Pointer to the bytes to send (or NULL to send zeros)
+ * @param rx  Pointer to a buffer for received bytes (or NULL to drop them)
+ * @param len Number of bytes to transfer
+ * @return integer Zero on success, -1 if the port stopped (timeout)
+ */
+int spi_xfer(spi_bus *bus, const u8 *tx, u8 *rx, uint len)
+{
+	u32  port = bus->port;
+	uint sent = 0;
+	uint recv = 0;
+	u16  cr2  = bus->cr2;
+	u16  sr, v;
+	int  i;
+
+	/* RXNE is set when 16 bits are received */
+	if (len > 1)
+	{
+		cr2 = (u16)(bus->cr2 & ~SPI_CR2_FRXTH);
+		reg16_wr(SPI_CR2(port), cr2);
+	}
+
+	for (i = 0; (recv < len) && (i < 0x100000); i++)
+	{
+		sr = reg16_rd(SPI_SR(port));
+		if (sr & SPI_SR_RXNE)
+		{
+			if ((len - recv) > 1)
+			{
+				v = reg16_rd(SPI_DR(port));
+				if (rx)
+				{
+					rx[recv]     = (u8)(v >> 0);
+					rx[recv + 1] = (u8)(v >> 8);
+				}
+				recv += 2;
+				/* Last byte of an odd length, RXNE on 8 bits */
+				if ((len - recv) == 1)
+				{
+					cr2 = bus->cr2;
+					reg16_wr(SPI_CR2(port), cr2);
+				}
+			}
+			else
+			{
+				v = reg8_rd(SPI_DR(port));
+				if (rx)
+					rx[recv] = (u8)v;
+				recv++;
+			}
+			i = 0;
+		}
+		/* Fill TX FIFO, with no more bytes in flight than RX FIFO size */
+		if ((sent < len) && (sr & SPI_SR_TXE) &&
+		    ((sent - recv) <= (SPI_FIFO_SIZE - 2)))
+		{
+			if ((len - sent) > 1)
+			{
+				v = tx ? (u16)(tx[sent] | (tx[sent + 1] << 8)) : 0;
+				reg16_wr(SPI_DR(port), v);
+				sent += 2;
+			}
+			else
+			{
+				reg8_wr(SPI_DR(port), tx ? tx[sent] : 0x00);
+				sent++;
+			}
+			i = 0;
+		}
+	}
+
+	/* Restore the 8 bits RX threshold (used by single transfers) */
+	if (cr2 != bus->cr2)
+		reg16_wr(SPI_CR2(port), bus->cr2);
+
+	/* Bytes missing, received ones (if any) can not be trusted */
+	if (recv < len)
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Receive a block of bytes (polled, zeros are sent)
+ *
+ * @param bus    Pointer to the bus handle (see spi_bus_get)
+ * @param buffer Pointer to a buffer where received bytes are stored
+ * @param len    Number of bytes to receive
+ * @return integer Zero on success, -1 on timeout (see spi_xfer)
+ */
+int spi_read_block(spi_bus *bus, u8 *buffer, uint len)
+{
+	return(spi_xfer(bus, 0, buffer, len));
+}
+
+/**
+ * @brief Receive a block of bytes into 32 bits words (polled, zeros are sent)
+ *
+ * Some memories only accept 32 bits accesses (USB packet memory). Received
+ * bytes are packed into a word (little endian) written once when complete,
+ * without intermediate buffer. The bytes of the first and last words that
+ * are outside of the block are read and written back unchanged.
+ *
+ * @param bus    Pointer to the bus handle (see spi_bus_get)
+ * @param buffer Pointer to the destination (any alignment)
+ * @param len    Number of bytes to receive
+ * @return integer Zero on success, -1 on timeout (see spi_xfer)
+ */
+int spi_read_words(spi_bus *bus, u8 *buffer, uint len)
+{
+	u32  port = bus->port;
+	u32  dst  = ((u32)buffer & ~3UL);
+	uint sh   = ((u32)buffer & 3) * 8;
+	uint sent = 0;
+	uint recv = 0;
+	u16  cr2  = bus->cr2;
+	u16  sr, v;
+	uint n;
+	u32  w;
+	int  i;
+
+	if (len == 0)
+		return(0);
+	/* Bytes of the first word before the block are kept */
+	w = sh ? (reg_rd(dst) & ((1UL << sh) - 1)) : 0;
+
+	/* RXNE is set when 16 bits are received */
+	if (len > 1)
+	{
+		cr2 = (u16)(bus->cr2 & ~SPI_CR2_FRXTH);
+		reg16_wr(SPI_CR2(port), cr2);
+	}
+
+	for (i = 0; (recv < len) && (i < 0x100000); i++)
+	{
+		sr = reg16_rd(SPI_SR(port));
+		if (sr & SPI_SR_RXNE)
+		{
+			if ((len - recv) > 1)
+			{
+				v = reg16_rd(SPI_DR(port));
+				n = 2;
+			}
+			else
+			{
+				v = reg8_rd(SPI_DR(port));
+				n = 1;
+			}
+			recv += n;
+			/* Last byte of an odd length, RXNE on 8 bits */
+			if ((len - recv) == 1)
+			{
+				cr2 = bus->cr2;
+				reg16_wr(SPI_CR2(port), cr2);
+			}
+			/* Bytes are packed, each word is written when complete */
+			for ( ; n; n--, v >>= 8)
+			{
+				w |= (u32)(v & 0xFF) << sh;
+				sh += 8;
+				if (sh == 32)
+				{
+					reg_wr(dst, w);
+					dst += 4;
+					w  = 0;
+					sh = 0;
+				}
+			}
+			i = 0;
+		}
+		/* Fill TX FIFO, with no more bytes in flight than RX FIFO size */
+		if ((sent < len) && (sr & SPI_SR_TXE) &&
+		    ((sent - recv) <= (SPI_FIFO_SIZE - 2)))
+		{
+			if ((len - sent) > 1)
+			{
+				reg16_wr(SPI_DR(port), 0);
+				sent += 2;
+			}
+			else
+			{
+				reg8_wr(SPI_DR(port), 0x00);
+				sent++;
+			}
+			i = 0;
+		}
+	}
+
+	/* Restore the 8 bits RX threshold (used by single transfers) */
+	if (cr2 != bus->cr2)
+		reg16_wr(SPI_CR2(port), bus->cr2);
+
+	/* Bytes missing, received ones (if any) can not be trusted */
+	if (recv < len)
+		return(-1);
+	/* Bytes of the last word after the block are kept */
+	if (sh)
+		reg_wr(dst, w | (reg_rd(dst) & ~((1UL << sh) - 1)));
+	return(0);
+}
+
+/**
+ * @brief Send a block of bytes (polled, received bytes are dropped)
+ *
+ * @param bus    Pointer to the bus handle (see spi_bus_get)
+ * @param buffer Pointer to the bytes to send
+ * @param len    Number of bytes to send
+ * @return integer Zero on success, -1 on timeout (see spi_xfer)
+ */
+int spi_write_block(spi_bus *bus, const u8 *buffer, uint len)
+{
+	return(spi_xfer(bus, buffer, 0, len));
+}
+
+/**
+ * @brief Start a DMA read on one SPI channel
+ *
+ * This function start a block read using two DMA channels : the RX channel
+ * store received bytes into the buffer and the TX channel send a dummy byte
+ * for each byte to receive. The caller must select the device (CS) and send
+ * any command before, then wait the end of transfer using spi_dma_wait() or
+ * the (optional) completion callback called from the DMA interrupt.
+ *
+ * @param channel  SPI channel to use (1->3)
+ * @param buffer   Pointer to a buffer where received bytes are stored
+ * @param len      Number of bytes to read (1 -> 65535)
+ * @param complete Function called when transfer is complete (may be null)
+ * @return integer Zero on success, negative value on error or if busy
+ */
+int spi_dma_read(uint channel, u8 *buffer, uint len, void (*complete)(uint channel))
+{
+	spi_bus *bus;
+	spi_dma *ctx;
+	u32  port;
+	uint rx, tx;
+	u32  v;
+
+	bus = bus_find(channel);
+	if (bus == 0)
+		return(-1);
+	port = bus->port;
+	ctx  = &dma_ctx[bus->id];
+	rx   = (bus->id << 1) + 1;
+	tx   = rx + 1;
+
+	// Sanity check
+	if ((len == 0) || (len > 0xFFFF))
+		return(-1);
+	// A transfer is already in progress on this port
+	if (ctx->channel)
+		return(-2);
+
+	ctx->channel  = channel;
+	ctx->complete = complete;
+
+	/* Flush any byte remaining into RX FIFO */
+	while (reg16_rd(SPI_SR(port)) & (1 << 0))
+		(void)reg8_rd(SPI_DR(port));
+
+	/* Clear all flags of both channels */
+	reg_wr(DMA_IFCR(DMA1), (0xFUL << ((rx - 1) * 4)) | (0xFUL << ((tx - 1) * 4)));
+
+	/* Configure RX channel : peripheral to memory */
+	reg_wr(DMA_CPAR(DMA1, rx), SPI_DR(port));
+	reg_wr(DMA_CMAR(DMA1, rx), (u32)buffer);
+	reg_wr(DMA_CNDTR(DMA1, rx), len);
+	v  = (1 <<  7); // MINC: Memory increment
+	v |= (2 << 12); // PL: Priority high (RX must never overrun)
+	if (complete)
+		v |= (1 << 1); // TCIE: Transfer Complete interrupt
+	reg_wr(DMA_CCR(DMA1, rx), v);
+
+	/* Configure TX channel : memory to peripheral, always same dummy byte */
+	reg_wr(DMA_CPAR(DMA1, tx), SPI_DR(port));
+	reg_wr(DMA_CMAR(DMA1, tx), (u32)&dma_dummy);
+	reg_wr(DMA_CNDTR(DMA1, tx), len);
+	v  = (1 <<  4); // DIR: Read from memory
+	v |= (1 << 12); // PL: Priority medium
+	reg_wr(DMA_CCR(DMA1, tx), v);
+
+	/* Start transfer : RXDMAEN, enable channels, then TXDMAEN */
+	reg16_set(SPI_CR2(port), (1 << 0));
+	reg_set(DMA_CCR(DMA1, rx), (1 << 0));
+	reg_set(DMA_CCR(DMA1, tx), (1 << 0));
+	reg16_set(SPI_CR2(port), (1 << 1));
+
+	return(0);
+}
+
+/**
+ * @brief Get the status of a DMA transfer
+ *
+ * @param channel SPI channel to test (1->3)
+ * @return integer Number of bytes still to receive (0 if idle or complete)
+ */
+uint spi_dma_status(uint channel)
+{
+	spi_bus *bus;
+
+	bus = bus_find(channel);
+	if ((bus == 0) || (dma_ctx[bus->id].channel != channel))
+		return(0);
+
+	return((uint)reg_rd(DMA_CNDTR(DMA1, (bus->id << 1) + 1)));
+}
+
+/**
+ * @brief Test if the SPI port used by a channel has a DMA transfer running
+ *
+ * Channels 1 and 2 share the same port (SPI1) so only one of them can use
+ * DMA at a time, channel 3 (SPI2) is independent.
+ *
+ * @param channel SPI channel to test (1->3)
+ * @return boolean True if the port is used by a transfer (any channel)
+ */
+int spi_dma_busy(uint channel)
+{
+	spi_bus *bus;
+
+	bus = bus_find(channel);
+	if (bus == 0)
+		return(0);
+	return(dma_ctx[bus->id].channel != 0);
+}
+
+/**
+ * @brief Wait the end of a DMA transfer and release SPI port
+ *
+ * @param channel SPI channel to wait (1->3)
+ * @return integer Zero on success, -1 on timeout
+ */
+int spi_dma_wait(uint channel)
+{
+	spi_bus *bus;
+	uint id, rx;
+	int  i;
+
+	bus = bus_find(channel);
+	if (bus == 0)
+		return(-1);
+	id = bus->id;
+	rx = (id << 1) + 1;
+
+	/* Transfer already complete (and released by interrupt) */
+	if (dma_ctx[id].channel != channel)
+		return(0);
+
+	/* Wait for the last byte received (RX channel) */
+	for (i = 0; i < 0x1000000; i++)
+	{
+		if (reg_rd(DMA_CNDTR(DMA1, rx)) == 0)
 			break;
 	}
-	return(reg8_rd(SPI_DR(port)));
+	dma_release(id);
+
+	return((i < 0x1000000) ? 0 : -1);
+}
+
+/**
+ * @brief Get the bus handle of the port used by a channel
+ *
+ * @param channel ID of the channel (1->3)
+ * @return spi_bus* Pointer to the bus handle (or NULL for invalid channel)
+ */
+static spi_bus *bus_find(uint channel)
+{
+	if ((channel == 1) || (channel == 2))
+		return(&bus_ports[0]);
+	else if (channel == 3)
+		return(&bus_ports[1]);
+	return(0);
+}
+
+/**
+ * @brief Configure a SPI port for one channel (speed)
+ *
+ * The control register is written from its copy, and only if modified.
+ *
+ * @param bus     Pointer to the bus handle
+ * @param channel ID of the channel that use the port
+ */
+static void bus_config(spi_bus *bus, uint channel)
+{
+	u16 cr1;
+
+	cr1  = (u16)(bus->cr1 & ~(7 << 3));
+	cr1 |= (u16)(bus_div[channel] << 3);
+	if (cr1 != bus->cr1)
+	{
+		reg16_wr(SPI_CR1(bus->port), cr1);
+		bus->cr1 = cr1;
+	}
+	bus->owner = channel;
+}
+
+/**
+ * @brief Stop DMA channels used by one SPI port and mark it as idle
+ *
+ * @param id Index of the SPI port (0 for SPI1, 1 for SPI2)
+ */
+static void dma_release(uint id)
+{
+	u32  port;
+	uint rx, tx;
+
+	port = bus_ports[id].port;
+	rx   = (id << 1) + 1;
+	tx   = rx + 1;
+
+	/* Disable DMA requests */
+	reg16_clr(SPI_CR2(port), (1 << 1) | (1 << 0));
+	/* Disable both channels and clear flags */
+	reg_clr(DMA_CCR(DMA1, tx), (1 << 0));
+	reg_clr(DMA_CCR(DMA1, rx), (1 << 0));
+	reg_wr(DMA_IFCR(DMA1), (0xFUL << ((rx - 1) * 4)) | (0xFUL << ((tx - 1) * 4)));
+
+	dma_ctx[id].channel = 0;
+}
+
+/**
+ * @brief Process an end-of-transfer interrupt of a RX DMA channel
+ *
+ * @param id Index of the SPI port (0 for SPI1, 1 for SPI2)
+ */
+static void dma_irq(uint id)
+{
+	void (*complete)(uint channel);
+	uint channel, rx;
+
+	rx = (id << 1) + 1;
+
+	/* Test Transfer Complete flag of RX channel */
+	if ((reg_rd(DMA_ISR(DMA1)) & (2UL << ((rx - 1) * 4))) == 0)
+		return;
+
+	channel  = dma_ctx[id].channel;
+	complete = dma_ctx[id].complete;
+	dma_release(id);
+
+	if (complete && channel)
+		complete(channel);
+}
+
+/**
+ * @brief Interrupt handler for DMA1 channel 1 (SPI1 RX)
+ */
+void DMA1C1_Handler(void)
+{
+	dma_irq(0);
+}
+
+/**
+ * @brief Interrupt handler for DMA1 channels 2 and 3 (SPI2 RX)
+ */
+void DMA1C2C3_Handler(void)
+{
+	dma_irq(1);
 }
 /* EOF */
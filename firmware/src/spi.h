@@ -27,10 +27,34 @@
 #define SPI_I2SCFGR(x) (x + 0x1C)
 #define SPI_I2SPR(x)   (x + 0x20)
 
+typedef struct spi_bus_s
+{
+	u32  port;  /* Base address of the port registers (SPI1 or SPI2) */
+	uint id;    /* Index of the port (0 for SPI1, 1 for SPI2)        */
+	uint owner; /* Channel the port is configured for (0 if none)    */
+	u16  cr1;   /* Copy of CR1 register (no read-modify-write)       */
+	u16  cr2;   /* Copy of CR2 register (8 bits RX threshold)        */
+} spi_bus;
+
 void spi_init(void);
 void spi_cs(uint channel, int state);
 u8   spi_rw(uint channel, u8 out);
 
 void spi_set_speed(uint channel, uint speed);
+uint spi_get_speed(uint channel);
+
+/* Transfers on a bus handle (port resolved once per transaction) */
+spi_bus *spi_bus_get(uint channel);
+u8   spi_bus_rw     (spi_bus *bus, u8 out);
+int  spi_xfer       (spi_bus *bus, const u8 *tx, u8 *rx, uint len);
+int  spi_read_block (spi_bus *bus, u8 *buffer, uint len);
+int  spi_read_words (spi_bus *bus, u8 *buffer, uint len);
+int  spi_write_block(spi_bus *bus, const u8 *buffer, uint len);
+
+/* Block transfers using DMA1 */
+int  spi_dma_read  (uint channel, u8 *buffer, uint len, void (*complete)(uint channel));
+uint spi_dma_status(uint channel);
+int  spi_dma_busy  (uint channel);
+int  spi_dma_wait  (uint channel);
 
 #endif
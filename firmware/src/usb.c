@@ -46,11 +46,15 @@ static usb_ctrl_request ep0_req;
 
 static usb_if_drv if_drv[USB_IF_COUNT];
 static usb_ep_def ep_defs[USB_EP_COUNT];
+/* Double-buffered IN endpoints */
+static u8          ep_dbl;      // Bitmask of endpoints using ping-pong buffers
+static volatile u8 ep_pend[8];  // Number of buffers given to hardware
 
 static void ep0_config(void);
+static int  ep_dbl_send(u8 ep, const u8 *data, unsigned int len);
+static void ep_dbl_swbuf(u8 ep);
 static void ep0_send(const u8 *data, unsigned int len);
 static void ep0_stall(void);
-void memcpy_to_pma(u8 *dst, const u8 *src, unsigned int len);
 
 /**
  * @brief Initialize USB device interface
@@ -72,6 +76,7 @@ void usb_init(void)
 	memset(&if_drv,  0, sizeof(usb_if_drv) * USB_IF_COUNT);
 	/* Clear endpoint description table */
 	memset(&ep_defs, 0, sizeof(usb_ep_def) * USB_EP_COUNT);
+	ep_dbl = 0;
 
 	/* Activate USB */
 	reg_set(RCC_APBENR1, (1 << 13));
@@ -148,8 +153,10 @@ void usb_periodic(void)
  * @param ep   Endpoint number (1 -> 7)
  * @param data Pointer to a buffer with data to send (may be null)
  * @param len  Number of byte to send during IN transfer
+ * @return integer Zero on success, -1 if the packet has not been queued (no
+ *                 free buffer, see usb_ep_tx_free)
  */
-void usb_send(const u8 ep, const u8 *data, unsigned int len)
+int usb_send(const u8 ep, const u8 *data, unsigned int len)
 {
 	u8 *pma = (u8 *)USB_RAM;
 	u32 offset;
@@ -157,7 +164,11 @@ void usb_send(const u8 ep, const u8 *data, unsigned int len)
 
 	/* Sanity check */
 	if (/*(ep == 0) || */(ep > 7))
-		return;
+		return(-1);
+
+	/* Double-buffered endpoint use dedicated function */
+	if (ep_dbl & (1 << ep))
+		return(ep_dbl_send(ep, data, len));
 
 	/* Read current EP TX buffer address */
 	offset = (*(volatile u32*)(pma + (ep << 3)) & 0xFFFF);
@@ -178,6 +189,7 @@ void usb_send(const u8 ep, const u8 *data, unsigned int len)
 	ep_r &= ~(u32)(1 << 7);  // Clear VTTX
 	ep_r ^=  (u32)(3 << 4);  // STATTX : Valid
 	reg_wr(USB_CHEPxR(ep), ep_r);
+	return(0);
 }
 
 /**
@@ -188,8 +200,13 @@ void usb_send(const u8 ep, const u8 *data, unsigned int len)
  * presence of callbacks function pointers into the "def" argument. Offset of
  * endpoint buffers into pma memory is configured into the usb_desc.h file.
  *
+ * For IN bulk endpoints, the USB_EP_DBL_BUF flag can be added to the type to
+ * use the double-buffer mode. In this mode, the RX buffer of the endpoint is
+ * used as second TX buffer and two packets can be queued with usb_send() :
+ * one is sent by hardware while the next one is filled.
+ *
  * @param ep   Endpoint number (1 -> 7)
- * @param type Endpoint type (Bulk, Iso, Interrupt)
+ * @param type Endpoint type (Bulk, Iso, Interrupt) and flags
  * @param def  Pointer to an endpoint definition (for callbacks)
  */
 void usb_ep_configure(u8 ep, u8 type, usb_ep_def *def)
@@ -197,6 +214,7 @@ void usb_ep_configure(u8 ep, u8 type, usb_ep_def *def)
 	usb_ep_def *ep_def;
 	u8 *pma = (u8 *)USB_RAM;
 	u32 cur, v;
+	int dbl;
 
 	/* Sanity check */
 	if ((ep == 0) || (ep > 7) || (def == 0))
@@ -204,6 +222,18 @@ void usb_ep_configure(u8 ep, u8 type, usb_ep_def *def)
 
 	ep_def = &ep_defs[ep - 1];
 
+	/* Double-buffer is only supported for IN bulk endpoints */
+	dbl = 0;
+	if ((type & USB_EP_DBL_BUF) && ((type & 3) == USB_EP_BULK) &&
+	    def->tx_complete && (def->rx == 0))
+		dbl = 1;
+	type &= 3;
+	ep_pend[ep] = 0;
+	if (dbl)
+		ep_dbl |= (u8)(1 << ep);
+	else
+		ep_dbl &= (u8)~(1 << ep);
+
 	ep_def->release = def->release;
 
 	pma += (ep << 3);
@@ -216,22 +246,30 @@ void usb_ep_configure(u8 ep, u8 type, usb_ep_def *def)
 	/* Configure RX descriptor for selected endpoint */
 	if (def->rx)
 		*(u32*)(pma + 4) = (u32)((1 << 31) | (1 << 26) | (0 << 16) | ep_offsets[ep][1]);
+	else if (dbl)
+		*(u32*)(pma + 4) = (u32)((0 << 16) | ep_offsets[ep][1]); // TX buffer 1
 	else
 		*(u32*)(pma + 4) = (u32)0x00000000;
 	ep_def->rx = def->rx;
 
 	cur = reg_rd(USB_CHEPxR(ep));
-	v  = (type << 9); // UTYPE (bulk, iso, int, ...)
-	v  = (ep   << 0); // Endpoint Address
+	v  = (u32)(type << 9); // UTYPE (bulk, iso, int, ...)
+	v |= (u32)(ep   << 0); // Endpoint Address
+	if (dbl)
+		v |= (1 << 8);  // EP_KIND: DBL_BUF
 	// Configure endpoint RX flags
 	if (def->rx)
 		v |=  (u32)(3 << 12); // STATRX: Valid (wait for rx)
 	else
 		v &= ~(u32)(3 << 12); // STATTX: Disabled
 	if (cur & (1 << 14))
-		v |= (1 << 14);  // Clear DTOGRX
+		v |= (1 << 14);  // Clear DTOGRX (SW_BUF for double-buffer)
+	if (cur & (1 << 6))
+		v |= (1 <<  6);  // Clear DTOGTX
 	// Configure endpoint TX flags
-	if (def->tx_complete)
+	if (dbl)
+		v |=  (u32)(3 << 4); // STATTX: Valid (flow controlled by SW_BUF)
+	else if (def->tx_complete)
 		v |=  (u32)(2 << 4); // STATTX: NAK
 	else
 		v &= ~(u32)(3 << 4); // STATTX: Disabled
@@ -277,6 +315,17 @@ void usb_ep_set_state(u8 ep, u8 state)
 
 	ep_r = reg_rd(USB_CHEPxR(ep));
 	ep_r |= (u32)(0x8080);  // Keep VTxX (1 has no effect)
+
+	/* Double-buffered IN : restart with both buffers owned by software */
+	if (dir && (ep_dbl & (1 << ep)) && (state != USB_EP_STALL))
+	{
+		ep_pend[ep] = 0;
+		prev_state = ((ep_r >> 4) & 3);
+		ep_r &= ~(u32)(0x3030);  // Preserve STATRX
+		ep_r ^=  (u32)((prev_state ^ USB_EP_VALID) << 4);
+		reg_wr(USB_CHEPxR(ep), ep_r); // DTOGTX and SW_BUF cleared
+		return;
+	}
 	/* Modify the state of TX (IN) direction */
 	if (dir)
 	{
@@ -305,6 +354,61 @@ void usb_ep_set_state(u8 ep, u8 state)
 		reg_wr(USB_CHEPxR(ep), ep_r);
 }
 
+/**
+ * @brief Get the number of free TX buffers of an endpoint
+ *
+ * A class driver can call usb_send() as long as this function report a free
+ * buffer. A single-buffered endpoint has one buffer, a double-buffered has
+ * two : one can be filled while the other is sent.
+ *
+ * @param ep Endpoint number (1 -> 7)
+ * @return integer Number of buffers that can be filled
+ */
+int usb_ep_tx_free(u8 ep)
+{
+	u32 ep_r;
+
+	// Sanity check
+	if ((ep == 0) || (ep > 7))
+		return(0);
+
+	if (ep_dbl & (1 << ep))
+		return(2 - ep_pend[ep]);
+
+	/* Single buffer is busy while STATTX is valid */
+	ep_r = reg_rd(USB_CHEPxR(ep));
+	if (((ep_r >> 4) & 3) == USB_EP_VALID)
+		return(0);
+	return(1);
+}
+
+/**
+ * @brief Get direct access to the next TX buffer of an endpoint (into PMA)
+ *
+ * A class driver can store the content of the next packet directly into the
+ * packet memory, then send it with usb_send(ep, 0, len). The returned buffer
+ * is 32 bits aligned and must be written only with 32 bits words. It remains
+ * valid until the next call to usb_send() for this endpoint.
+ *
+ * @param ep Endpoint number (1 -> 7)
+ * @return u8* Pointer to the buffer, or NULL if no buffer is free
+ */
+u8 *usb_ep_tx_buffer(u8 ep)
+{
+	u8 *pma = (u8 *)USB_RAM;
+	u32 desc;
+
+	if (usb_ep_tx_free(ep) == 0)
+		return(0);
+
+	desc = (u32)(ep << 3);
+	/* Double-buffered : SW_BUF (DTOGRX) select the buffer of software */
+	if ((ep_dbl & (1 << ep)) && (reg_rd(USB_CHEPxR(ep)) & (1 << 14)))
+		desc += 4;
+
+	return(pma + (*(volatile u32*)(pma + desc) & 0xFFFF));
+}
+
 /**
  * @brief Register a driver for an interface
  *
@@ -330,31 +434,200 @@ int usb_if_register(uint num, usb_if_drv *new_if)
 }
 
 /**
- * @brief Copy date to USB packet memory array
+ * @brief Copy data from USB packet memory to a buffer
+ *
+ * The packet memory must be read only with 32 bits words. Words are copied
+ * by blocks of four when the destination is aligned, else each word is
+ * stored by bytes. Only "len" bytes are written into the destination, the
+ * last word is split when len is not a multiple of 4.
+ *
+ * @param dst Pointer to the destination buffer (into sram)
+ * @param src Pointer to the data into packet memory (32 bits aligned)
+ * @param len Number of bytes to copy
+ */
+void memcpy_from_pma(u8 *dst, const u8 *src, unsigned int len)
+{
+	u32 addr = (u32)src;
+	u32 *dw;
+	u32 a, b, c, d;
+
+	if (((u32)dst & 3) == 0)
+	{
+		dw = (u32 *)dst;
+		for ( ; len >= 16; len -= 16, addr += 16, dw += 4)
+		{
+			a = reg_rd(addr +  0);
+			b = reg_rd(addr +  4);
+			c = reg_rd(addr +  8);
+			d = reg_rd(addr + 12);
+			dw[0] = a;
+			dw[1] = b;
+			dw[2] = c;
+			dw[3] = d;
+		}
+		for ( ; len >= 4; len -= 4, addr += 4, dw++)
+			*dw = reg_rd(addr);
+		dst = (u8 *)dw;
+	}
+	else
+	{
+		for ( ; len >= 4; len -= 4, addr += 4, dst += 4)
+		{
+			a = reg_rd(addr);
+			dst[0] = (u8)(a      );
+			dst[1] = (u8)(a >>  8);
+			dst[2] = (u8)(a >> 16);
+			dst[3] = (u8)(a >> 24);
+		}
+	}
+
+	if (len > 0)
+	{
+		a = reg_rd(addr);
+		for ( ; len > 0; len--, dst++, a >>= 8)
+			*dst = (u8)a;
+	}
+}
+
+/**
+ * @brief Copy data to USB packet memory
  *
  * The memory used by USB must be written only with 32bits words. As buffer of
  * data to send are mainly byte arrays into main sram, they must be copied to
- * usb ram. This function can be called to do a copy to usb memory.
+ * usb ram. Words are copied by blocks of four. When the source is not
+ * aligned, aligned words are read and assembled (Cortex-M0+ does not support
+ * unaligned accesses). The last word is padded when len is not a multiple
+ * of 4 (buffers into packet memory are allocated by words).
+ *
+ * @param dst Pointer to the destination into packet memory (32 bits aligned)
+ * @param src Pointer to the data to copy (into sram)
+ * @param len Number of bytes to copy
  */
 void memcpy_to_pma(u8 *dst, const u8 *src, unsigned int len)
 {
-	int i;
-	u32 v;
+	u32 addr = (u32)dst;
+	const u32 *sw;
+	uint lsh, rsh;
+	u32 a, b, c, d;
+	u32 w;
 
-	for (i = 0; len >= 4; i+=4, len -= 4)
-		*(volatile u32*)(dst + i) = *(u32 *)(src + i);
+	if (((u32)src & 3) == 0)
+	{
+		sw = (const u32 *)src;
+		for ( ; len >= 16; len -= 16, addr += 16, sw += 4)
+		{
+			a = sw[0];
+			b = sw[1];
+			c = sw[2];
+			d = sw[3];
+			reg_wr(addr +  0, a);
+			reg_wr(addr +  4, b);
+			reg_wr(addr +  8, c);
+			reg_wr(addr + 12, d);
+		}
+		for ( ; len >= 4; len -= 4, addr += 4, sw++)
+			reg_wr(addr, *sw);
+		src = (const u8 *)sw;
+	}
+	else if (len >= 4)
+	{
+		/* Each word is the end of an aligned word and the start of the
+		 * next one (little endian). Words read contain at least one byte
+		 * to copy, nothing is read outside the source buffer words. */
+		lsh = (uint)((u32)src & 3) * 8;
+		rsh = 32 - lsh;
+		sw  = (const u32 *)(src - ((u32)src & 3));
+		src += (len & ~3U);
+
+		w = *sw++;
+		for ( ; len >= 16; len -= 16, addr += 16, sw += 4)
+		{
+			a = sw[0];
+			b = sw[1];
+			c = sw[2];
+			d = sw[3];
+			reg_wr(addr +  0, (w >> lsh) | (a << rsh));
+			reg_wr(addr +  4, (a >> lsh) | (b << rsh));
+			reg_wr(addr +  8, (b >> lsh) | (c << rsh));
+			reg_wr(addr + 12, (c >> lsh) | (d << rsh));
+			w = d;
+		}
+		for ( ; len >= 4; len -= 4, addr += 4)
+		{
+			a = *sw++;
+			reg_wr(addr, (w >> lsh) | (a << rsh));
+			w = a;
+		}
+	}
 
 	if (len > 0)
 	{
-		v = 0;
-		if (len > 3)
-			v |= (*(src + i + 3) << 24);
+		w = 0;
 		if (len > 2)
-			v |= (*(src + i + 2) << 16);
+			w |= ((u32)src[2] << 16);
 		if (len > 1)
-			v |= (*(src + i + 1) <<  8);
-		v |= *(src + i);
-		*(volatile u32*)(dst + i) = v;
+			w |= ((u32)src[1] <<  8);
+		w |= src[0];
+		reg_wr(addr, w);
+	}
+}
+
+/**
+ * @brief Copy data to a buffer into sram or into USB packet memory
+ *
+ * The data path (caches, see rcache_read) fills the buffers given by the SCSI
+ * layer, they may be endpoint buffers (see usb_ep_tx_buffer). Packet memory
+ * is written by 32 bits words (see memcpy_to_pma), sram with memcpy.
+ *
+ * @param dst Pointer to the destination buffer (sram or packet memory)
+ * @param src Pointer to the data to copy (into sram)
+ * @param len Number of bytes to copy
+ */
+void memcpy_pma(u8 *dst, const u8 *src, unsigned int len)
+{
+	if (USB_IS_PMA(dst))
+		memcpy_to_pma(dst, src, len);
+	else
+		memcpy(dst, src, (int)len);
+}
+
+/**
+ * @brief Fill a buffer into sram or into USB packet memory
+ *
+ * Packet memory is written by 32 bits words. When the area does not start
+ * or end on a word boundary, the first and last words are read and only
+ * the bytes of the area are modified.
+ *
+ * @param dst   Pointer to the buffer to fill (sram or packet memory)
+ * @param value Value of each byte
+ * @param len   Number of bytes to fill
+ */
+void memset_pma(u8 *dst, int value, unsigned int len)
+{
+	u32  addr = ((u32)dst & ~3UL);
+	uint sh   = ((u32)dst & 3) * 8;
+	uint n;
+	u32  w, mask;
+
+	if ( ! USB_IS_PMA(dst))
+	{
+		memset(dst, value, (int)len);
+		return;
+	}
+
+	w = (u32)(value & 0xFF) * 0x01010101;
+	for ( ; len > 0; len -= n, addr += 4, sh = 0)
+	{
+		n = (32 - sh) / 8;
+		if (n > len)
+			n = len;
+		if (n == 4)
+			reg_wr(addr, w);
+		else
+		{
+			mask = ((1UL << (n * 8)) - 1) << sh;
+			reg_wr(addr, (reg_rd(addr) & ~mask) | (w & mask));
+		}
 	}
 }
 
@@ -364,6 +637,72 @@ void memcpy_to_pma(u8 *dst, const u8 *src, unsigned int len)
 /* --                                                                      -- */
 /* -------------------------------------------------------------------------- */
 
+/**
+ * @brief Queue a packet on a double-buffered IN endpoint
+ *
+ * Data are copied into the buffer owned by software (pointed by SW_BUF). If
+ * the hardware is idle, the buffer is released immediately, else it will be
+ * released by ep_tx() at the end of the current transmission. When both
+ * buffers are already given to hardware, the packet is not queued.
+ *
+ * @param ep   Endpoint number (1 -> 7)
+ * @param data Pointer to a buffer with data to send (may be null)
+ * @param len  Number of byte to send
+ * @return integer Zero on success, -1 if no buffer is free
+ */
+static int ep_dbl_send(u8 ep, const u8 *data, unsigned int len)
+{
+	u8 *pma = (u8 *)USB_RAM;
+	u32 desc, offset;
+	u32 irq;
+	int result = -1;
+
+	/* Mask USB interrupt, ep_pend is shared with ep_tx() (may be called
+	 * with interrupt already masked, previous state is restored) */
+	irq = reg_rd(0xE000E100) & (1 << 8); /* USB */
+	reg_wr(0xE000E180, (1 << 8));
+
+	if (ep_pend[ep] < 2)
+	{
+		/* SW_BUF (DTOGRX) select the TX buffer owned by software */
+		desc = (u32)(ep << 3);
+		if (reg_rd(USB_CHEPxR(ep)) & (1 << 14))
+			desc += 4;
+		offset = (*(volatile u32*)(pma + desc) & 0xFFFF);
+
+		if (data)
+			memcpy_to_pma(pma + offset, data, len);
+		*(volatile u32*)(pma + desc) = (len << 16) | offset;
+
+		/* Hardware is idle, give this buffer now */
+		if (ep_pend[ep] == 0)
+			ep_dbl_swbuf(ep);
+		ep_pend[ep]++;
+		result = 0;
+	}
+
+	/* Re-activate USB interrupt (if it was enabled) */
+	if (irq)
+		reg_wr(0xE000E100, irq);
+	return(result);
+}
+
+/**
+ * @brief Give the buffer owned by software to the hardware (toggle SW_BUF)
+ *
+ * @param ep Endpoint number (1 -> 7)
+ */
+static void ep_dbl_swbuf(u8 ep)
+{
+	u32 ep_r;
+
+	ep_r = reg_rd(USB_CHEPxR(ep));
+	ep_r &= ~(u32)(0x7070);  // Keep toggle bits
+	ep_r |=  (u32)(0x8080);  // Keep VTxX (1 has no effect)
+	ep_r |=  (u32)(1 << 14); // Toggle SW_BUF (DTOGRX)
+	reg_wr(USB_CHEPxR(ep), ep_r);
+}
+
 static inline void ep0_feature_clear(usb_ctrl_request *req);
 static inline void ep0_feature_set(usb_ctrl_request *req);
 static inline void ep0_get_descriptor(usb_ctrl_request *req);
@@ -459,6 +798,18 @@ static inline void ep_tx(unsigned char ep)
 	ep_r &= ~(u32)(1 << 7);  // Clear VTTX
 	reg_wr(USB_CHEPxR(ep), ep_r);
 
+	/* Double-buffered : first give the next buffer (if any) to hardware */
+	if (ep_dbl & (1 << ep))
+	{
+		if (ep_pend[ep])
+			ep_pend[ep]--;
+		if (ep_pend[ep])
+			ep_dbl_swbuf(ep);
+		if (ep_defs[ep - 1].tx_complete != 0)
+			ep_defs[ep - 1].tx_complete();
+		return;
+	}
+
 	if (ep_defs[ep - 1].tx_complete != 0)
 		result = ep_defs[ep - 1].tx_complete();
 #ifdef USB_INFO
@@ -1156,6 +1507,7 @@ void USB_Handler(void)
 	if (v & (1 << 10))
 	{
 		state = USB_ST_DEFAULT;
+		ep_dbl = 0;
 		/* Reset device address */
 		reg_wr(USB_DADDR, (1 << 7));
 		ep0_config();
@@ -23,7 +23,10 @@
 #define USB_ST_ADDRESS    2
 #define USB_ST_CONFIGURED 3
 
-#define USB_RAM (USB_R1)
+#define USB_RAM    (USB_R1)
+#define USB_RAM_SZ 0x800
+/* Buffer into packet memory : only 32 bits accesses (see memcpy_to_pma) */
+#define USB_IS_PMA(p) (((u32)(p) >= USB_RAM) && ((u32)(p) < (USB_RAM + USB_RAM_SZ)))
 /* USB peripheral registers */
 #define USB_CHEPxR(x) (u32)(USB + (x*4))
 #define USB_CNTR      (u32)(USB + 0x40)
@@ -38,6 +41,7 @@
 #define USB_EP_CONTROL 1
 #define USB_EP_ISO     2
 #define USB_EP_INT     3
+#define USB_EP_DBL_BUF 0x10 /* Flag: double-buffered bulk endpoint */
 /* Endpoint states */
 #define USB_EP_STALL   1
 #define USB_EP_NAK     2
@@ -77,9 +81,16 @@ void usb_init(void);
 void usb_start(void);
 void usb_periodic(void);
 
-void usb_send(const u8 ep, const u8 *data, unsigned int len);
+int  usb_send(const u8 ep, const u8 *data, unsigned int len);
 void usb_ep_configure(u8 ep, u8 type, usb_ep_def *def);
 void usb_ep_set_state(u8 ep, u8 state);
+int  usb_ep_tx_free(u8 ep);
+u8  *usb_ep_tx_buffer(u8 ep);
 int  usb_if_register(uint num, usb_if_drv *new_if);
 
+void memcpy_from_pma(u8 *dst, const u8 *src, unsigned int len);
+void memcpy_to_pma  (u8 *dst, const u8 *src, unsigned int len);
+void memcpy_pma     (u8 *dst, const u8 *src, unsigned int len);
+void memset_pma     (u8 *dst, int value, unsigned int len);
+
 #endif
@@ -13,16 +13,20 @@
  * program, see LICENSE.md file for more details.
  * This program is distributed WITHOUT ANY WARRANTY.
  */
+#include "hardware.h"
 #include "libc.h"
 #include "log.h"
 #include "scsi.h"
+#include "time.h"
 #include "types.h"
 #include "usb.h"
 #include "usb_msc.h"
+#include "work.h"
 
-static void _periodic(void);
+static void fsm_process(void);
 static int  usb_if_ctrl(usb_ctrl_request *req, uint len, u8 *data);
 static void usb_if_enable(int cfg_id);
+static void usb_if_periodic(void);
 static void usb_if_reset(void);
 static int usb_ep_release(const u8 ep);
 static int usb_ep_rx(u8 *data, uint len);
@@ -32,11 +36,33 @@ static usb_if_drv msc_if;
 
 static vu32    fsm_state, data_more;
 static vu32    rx_flag, tx_flag, err_flag, rst_flag;
+static vu32    media_wait; /* SCSI step delayed, medium is busy */
+static u32     media_tm;   /* Tick of the last retry of a delayed step */
+static int     fsm_work;
 static msc_cbw cbw __attribute__((aligned(4)));
 static msc_csw csw;
 
 static uint data_len, data_offset;
 
+/* Data IN pipeline : responses prepared by SCSI and waiting to be sent */
+static u8  *in_buf[SCSI_BUFFER_COUNT];
+static uint in_len[SCSI_BUFFER_COUNT];
+static vu32 in_head; // Incremented by fsm when a buffer is queued
+static vu32 in_tail; // Incremented by IN endpoint when a buffer is sent
+static vu32 in_idle; // Set by IN endpoint when no more buffer to send
+static uint in_total;
+static vu32 in_sent; // Number of packets queued into the IN endpoint
+static vu32 in_done; // Number of packets sent (incremented by IN endpoint)
+static uint in_zlp;  // Set when a zero-length packet has been queued
+static uint in_direct; // Data are read directly into endpoint buffers
+static uint in_retry;  // Length of a direct packet not queued (endpoint busy)
+
+static void in_push(u8 *data, uint len);
+static void in_push_direct(uint len);
+static int  in_send_direct(void);
+static void in_reset(void);
+static uint in_send(void);
+
 /**
  * @brief Initialize generic BULK module
  *
@@ -51,9 +77,14 @@ void usb_msc_init(void)
 	tx_flag     = 0;
 	err_flag    = 0;
 	rst_flag    = 0;
+	media_wait  = 0;
+	in_reset();
+
+	/* State machine is processed as deferred work, posted by USB events */
+	fsm_work = work_register(fsm_process, WORK_PRIO_HIGH);
 
 	/* Configure and register USB interface */
-	msc_if.periodic = _periodic;
+	msc_if.periodic = usb_if_periodic;
 	msc_if.reset    = usb_if_reset;
 	msc_if.enable   = usb_if_enable;
 	msc_if.ctrl_req = usb_if_ctrl;
@@ -76,15 +107,20 @@ static inline void fsm_data_out(void);
 static inline void fsm_error(void);
 
 /**
- * @brief Process periodically MSC state machine
+ * @brief Process MSC state machine
  *
- * This function is registered into USB core as periodic handler for the MSC
- * interface. When bus is active (enumeration complete, interface enabled) USB
- * will call this function periodically. MSC use a state machine to process
- * requests : wait CBW, data phase, send CSW.
+ * This function is registered as a deferred work item (see work.c). It is
+ * posted by the endpoint handlers when an USB event occurs (CBW or data
+ * received, packet sent, endpoint released, reset) and run just after the USB
+ * interrupt, whatever the main loop is doing. MSC use a state machine to
+ * process requests : wait CBW, data phase, send CSW. When a state change, the
+ * new state is processed immediately (for example, CSW is sent as soon as the
+ * data phase ends).
  */
-static void _periodic(void)
+static void fsm_process(void)
 {
+	u32 state;
+
 	/* Process device ResetRecovery request */
 	if (rst_flag)
 	{
@@ -94,6 +130,8 @@ static void _periodic(void)
 		rx_flag     = 0;
 		tx_flag     = 0;
 		err_flag    = 0;
+		media_wait  = 0;
+		in_reset();
 		if (rst_flag == 1)
 		{
 			rst_flag = 0;
@@ -105,31 +143,35 @@ static void _periodic(void)
 	}
 
 	/* Dispatch to functions dedicated to each state */
-	switch(fsm_state)
+	do
 	{
-		case MSC_ST_CBW:
-			fsm_cbw();
-			break;
+		state = fsm_state;
+		switch(state)
+		{
+			case MSC_ST_CBW:
+				fsm_cbw();
+				break;
 
-		case MSC_ST_DATA_IN:
-			fsm_data_in();
-			break;
+			case MSC_ST_DATA_IN:
+				fsm_data_in();
+				break;
 
-		case MSC_ST_DATA_OUT:
-			fsm_data_out();
-			break;
+			case MSC_ST_DATA_OUT:
+				fsm_data_out();
+				break;
 
-		case MSC_ST_CSW:
-			fsm_csw();
-			break;
+			case MSC_ST_CSW:
+				fsm_csw();
+				break;
 
-		case MSC_ST_ERROR:
-			fsm_error();
-			break;
+			case MSC_ST_ERROR:
+				fsm_error();
+				break;
 
-		default:
-			fsm_state = MSC_ST_CBW;
-	}
+			default:
+				fsm_state = MSC_ST_CBW;
+		}
+	} while (fsm_state != state);
 }
 
 /**
@@ -178,7 +220,11 @@ static inline void fsm_cbw(void)
 	/* Clear response structure */
 	memset(&csw, 0, sizeof(msc_csw));
 
-	result = scsi_command(cbw.cb, cbw.cb_len);
+	/* Host expect data : first READ step can use the IN endpoint buffer */
+	if ((cbw.flags & 0x80) && (cbw.data_length > 0))
+		scsi_set_target(usb_ep_tx_buffer(1), 64);
+
+	result = scsi_command(cbw.lun & 0x0F, cbw.cb, cbw.cb_len);
 	switch(result)
 	{
 		/* Success and response available */
@@ -221,7 +267,6 @@ static inline void fsm_cbw(void)
 				break;
 			}
 
-			data_offset = 0;
 			csw.residue = cbw.data_length;
 
 			data = scsi_get_response(&data_len);
@@ -233,20 +278,15 @@ static inline void fsm_cbw(void)
 				else
 					data_more = 1;
 
-				/* If host request _less_ data than returned by this command */
-				if (data_len > cbw.data_length)
-					data_len = cbw.data_length;
-
-				if (data_len > 64)
+				in_reset();
+				/* Data already into endpoint buffer (zero-copy) */
+				if (data == usb_ep_tx_buffer(1))
 				{
-					data_offset = 64;
-					usb_send(1, data, 64);
+					in_direct = 1;
+					in_push_direct(data_len);
 				}
 				else
-				{
-					data_offset = data_len;
-					usb_send(1, data, data_len);
-				}
+					in_push(data, data_len);
 			}
 			else
 			{
@@ -298,6 +338,12 @@ static inline void fsm_cbw(void)
 			break;
 		}
 
+		/* Medium busy (SYNCHRONIZE CACHE), process CBW again later */
+		case 5:
+			rx_flag    = 1;
+			media_wait = 1;
+			return;
+
 		/* Error into SCSI layer, reject this request */
 		case -1:
 		case -2:
@@ -307,6 +353,7 @@ static inline void fsm_cbw(void)
 		case -3:
 			goto err;
 	}
+	media_wait = 0;
 	return;
 
 err:
@@ -337,8 +384,9 @@ err:
  * Sending a CSW packet is the last step of an MSC transaction after CBW and
  * data (see fsm_cbw). This packet report to the host a status code for the
  * last transaction (success or error) and an optional length of remaining
- * data (residue). When this packet is sent, the state machine go back to his
- * initial state (CBW) and a new transaction can be started.
+ * data (residue). When this packet is sent, the IN endpoint interrupt move
+ * the state machine back to his initial state (CBW) and a new transaction can
+ * be started (see usb_ep_tx).
  */
 static inline void fsm_csw(void)
 {
@@ -365,17 +413,6 @@ static inline void fsm_csw(void)
 		csw.tag = cbw.tag;
 		usb_send(1, (u8*)&csw, 13);
 	}
-
-	/* When CSW has been transmited, wait TX complete */
-	if (tx_flag == 1)
-	{
-		tx_flag  = 0;
-		rx_flag  = 0;
-		err_flag = 0;
-		fsm_state = MSC_ST_CBW;
-		/* Re-activate OUT endpoint to receive next request */
-		usb_ep_set_state(2, USB_EP_VALID);
-	}
 }
 
 /**
@@ -385,81 +422,87 @@ static inline void fsm_csw(void)
  * (IN). The length of the payload transmited during data phase can have more
  * or less any length. As USB endpoint buffers are small (~64B in HS) the
  * payload is split into intermediate buffers of 512 bytes by SCSI and sent
- * with multiple chunks of 64 bytes.
+ * with multiple chunks of 64 bytes. When SCSI use more than one buffer (see
+ * scsi_get_depth) the next buffer is prepared while previous are sent.
  */
 static void fsm_data_in(void)
 {
+	u8 *target = 0;
 	int result;
 
-	if (tx_flag == 0)
+	/* Previous direct packet not queued (endpoint was busy), retry */
+	if (in_send_direct() < 0)
 		return;
-	tx_flag = 0;
 
-	/* Update residue with length of data sent */
-	if (csw.residue >= data_offset)
-		csw.residue -= data_offset;
-	else
+	/* Prepare next buffer(s) while the IN endpoint send the previous */
+	while (data_more)
 	{
-		// TODO Handle this error !!!!
-		csw.residue = 0;
-	}
-
-	/* If there is no more data to send, transition to CSW */
-	if (data_more == 0)
-	{
-		fsm_state = MSC_ST_CSW;
-		return;
-	}
-
-	result = scsi_command(cbw.cb, cbw.cb_len);
-	switch(result)
-	{
-		/* Success and no more data to send */
-		case 0:
-			fsm_state = MSC_ST_CSW;
+		/* Zero-copy : next chunk is read into a free endpoint buffer */
+		if (in_direct)
+		{
+			/* Endpoint buffer still hold a packet not queued */
+			if (in_retry)
+				break;
+			target = usb_ep_tx_buffer(1);
+			if (target == 0)
+				break;
+			scsi_set_target(target, 64);
+		}
+		else if ((in_head - in_tail) >= scsi_get_depth())
 			break;
-		/* Success and IN data phase needed */
-		case 1:
-		case 2:
+
+		result = scsi_command(cbw.lun & 0x0F, cbw.cb, cbw.cb_len);
+		switch(result)
 		{
-			u8  *data;
-			data_offset = 0;
-			data = scsi_get_response(&data_len);
-			/* If host request _less_ data than returned by this command */
-			if (data_len > csw.residue)
-				data_len = csw.residue;
-			if (data)
+			/* Success and no more data to send */
+			case 0:
+				data_more = 0;
+				break;
+			/* Success and IN data phase needed */
+			case 1:
+			case 2:
 			{
-				if (result == 1)
-					data_more = 0;
-				else
-					data_more = 1;
-
-				if (data_len > 64)
+				u8  *data;
+				data = scsi_get_response(&data_len);
+				if (data == 0)
 				{
-					data_offset = 64;
-					usb_send(1, data, 64);
+					log_puts("USB_MSC: SCSI error, Data IN early ends\n");
+					goto err;
 				}
+				if (result == 1)
+					data_more = 0;
+				if (in_direct == 0)
+					in_push(data, data_len);
+				else if (data == target)
+					in_push_direct(data_len);
 				else
 				{
-					data_offset = data_len;
-					usb_send(1, data, data_len);
+					log_puts("USB_MSC: SCSI error, Data IN not into target\n");
+					goto err;
 				}
+				break;
 			}
-			else
-			{
-				log_puts("USB_MSC: SCSI error, Data IN early ends\n");
+			/* Error into SCSI layer (read error), sense is set */
+			case -1:
+				goto err;
+			default:
+				log_puts("USB_MSC: Unknown SCSI result during Data IN\n");
 				goto err;
-			}
-			break;
 		}
-		default:
-			log_puts("USB_MSC: Unknown SCSI result during Data IN\n");
-			goto err;
+	}
+
+	/* If all data has been sent, transition to CSW */
+	if ((data_more == 0) && in_idle && (in_head == in_tail) &&
+	    (in_retry == 0) && (in_sent == in_done))
+	{
+		tx_flag = 0;
+		fsm_state = MSC_ST_CSW;
 	}
 	return;
 
 err:
+	data_more = 0;
+	csw.status = 0x01;
 	fsm_state = MSC_ST_ERROR;
 	usb_ep_set_state(0x80 | 1, USB_EP_STALL);
 }
@@ -481,15 +524,17 @@ static void fsm_data_out(void)
 		return;
 	rx_flag = 0;
 
-	/* Update length of processed data */
-	csw.residue -= data_offset;
+	/* Update length of processed data (only once if step is retried) */
+	if (media_wait == 0)
+		csw.residue -= data_offset;
+	media_wait = 0;
 
 #ifdef MSC_DEBUG_USB
 	log_print(LOG_DBG, "USB_MSC: DATA_OUT, %d more bytes to receive\n",
 	    csw.residue);
 #endif
 
-	result = scsi_command(cbw.cb, cbw.cb_len);
+	result = scsi_command(cbw.lun & 0x0F, cbw.cb, cbw.cb_len);
 	switch(result)
 	{
 		/* Success and no more data to send */
@@ -520,6 +565,24 @@ static void fsm_data_out(void)
 			usb_ep_set_state(2, USB_EP_VALID);
 			break;
 		}
+		/* Medium busy : keep OUT endpoint NAK, retry later */
+		case 5:
+			rx_flag    = 1;
+			media_wait = 1;
+			break;
+		/* Error into SCSI layer (sense updated), report a failed command */
+		case -1:
+		case -2:
+		case -3:
+			csw.status = 0x01;
+			if (csw.residue > 0)
+			{
+				fsm_state = MSC_ST_ERROR;
+				usb_ep_set_state(2, USB_EP_STALL);
+			}
+			else
+				fsm_state = MSC_ST_CSW;
+			break;
 	}
 }
 
@@ -560,6 +623,7 @@ static int usb_ep_release(const u8 ep)
 		err_flag = 1;
 	else if (fsm_state == MSC_ST_CSW)
 		err_flag = 1;
+	work_post(fsm_work);
 
 	if ((fsm_state == MSC_ST_CBW) && (ep == 2))
 		return(0);
@@ -598,16 +662,15 @@ static int usb_ep_rx(u8 *data, uint len)
 #endif
 		if (avail < len)
 			len = avail;
-		for (i = 0; i < len; i += 4)
-		{
-			*(vu32 *)dout = *(vu32 *)data;
-			data += 4;
-			dout += 4;
-		}
+		memcpy_from_pma(dout, data, len);
+		i = len;
 		scsi_set_data(0, &i);
 		data_offset += len;
 		if (data_offset >= data_len)
+		{
 			rx_flag = 1;
+			work_post(fsm_work);
+		}
 		else
 			return(1);
 	}
@@ -619,14 +682,9 @@ static int usb_ep_rx(u8 *data, uint len)
 			len = sizeof(msc_cbw);
 		}
 
-		dout = (u8 *)&cbw;
-		for (i = 0; i < len; i += 4)
-		{
-			*(vu32 *)dout = *(vu32 *)data;
-			data += 4;
-			dout += 4;
-		}
+		memcpy_from_pma((u8 *)&cbw, data, len);
 		rx_flag = 1;
+		work_post(fsm_work);
 	}
 
 	return(0);
@@ -643,36 +701,193 @@ static int usb_ep_rx(u8 *data, uint len)
  */
 static int usb_ep_tx(void)
 {
-	uint remains;
-	u8   *data;
-
 	if (fsm_state == MSC_ST_DATA_IN)
 	{
-		if (data_offset == data_len)
-			tx_flag = 1;
-		else
-		{
-			remains = (data_len - data_offset);
-			data = scsi_get_response(0);
-			if (remains > 64)
-			{
-				usb_send(1, data + data_offset, 64);
-				data_offset += 64;
-			}
-			else
-			{
-				usb_send(1, data + data_offset, remains);
-				data_offset += remains;
-			}
+		in_done++;
+		/* A buffer has been released, state machine can prepare next one */
+		work_post(fsm_work);
+		/* Refill the endpoint buffer(s) released by this completion */
+		if (in_send())
 			return(1);
+		/* Nothing more on the wire and no buffer left */
+		if (in_sent == in_done)
+		{
+			in_idle = 1;
+			tx_flag = 1;
 		}
 	}
+	/* CSW has been sent, transaction is complete */
 	else if (fsm_state == MSC_ST_CSW)
-		tx_flag = 1;
+	{
+		tx_flag  = 0;
+		rx_flag  = 0;
+		err_flag = 0;
+		fsm_state = MSC_ST_CBW;
+		/* Re-activate OUT endpoint to receive next request */
+		usb_ep_set_state(2, USB_EP_VALID);
+	}
+
+	return(0);
+}
+
+/**
+ * @brief Queue a buffer of data to send during Data IN phase
+ *
+ * The length of data is limited to the length expected by host. If the IN
+ * endpoint is idle (previous buffers already sent) transmission is started.
+ *
+ * @param data Pointer to the buffer to send
+ * @param len  Number of bytes into the buffer
+ */
+static void in_push(u8 *data, uint len)
+{
+	uint idx;
+	u32  irq;
+
+	/* If host request _less_ data than returned by this command */
+	if ((in_total + len) > cbw.data_length)
+	{
+		len = cbw.data_length - in_total;
+		data_more = 0;
+	}
+	in_total += len;
+
+	idx = (in_head & (SCSI_BUFFER_COUNT - 1));
+	in_buf[idx] = data;
+	in_len[idx] = len;
+	in_head++;
+
+	/* Mask USB interrupt : once a packet is queued its completion may call
+	 * in_send() (see usb_ep_tx), data_offset and in_tail must not be
+	 * updated by both (previous state is restored) */
+	irq = reg_rd(0xE000E100) & (1 << 8); /* USB */
+	reg_wr(0xE000E180, (1 << 8));
+
+	/* IN endpoint is idle : start transmission */
+	if (in_idle)
+	{
+		in_idle = 0;
+		in_send();
+	}
+
+	/* Re-activate USB interrupt (if it was enabled) */
+	if (irq)
+		reg_wr(0xE000E100, irq);
+}
+
+/**
+ * @brief Send a packet already stored into the IN endpoint buffer
+ *
+ * This function is used when SCSI has read data directly into the endpoint
+ * buffer (see usb_ep_tx_buffer). The packet is sent from main loop, the
+ * completion is only counted by IN endpoint interrupt.
+ *
+ * @param len Number of bytes into the endpoint buffer
+ */
+static void in_push_direct(uint len)
+{
+	/* If host request _less_ data than returned by this command */
+	if ((in_total + len) > cbw.data_length)
+	{
+		len = cbw.data_length - in_total;
+		data_more = 0;
+	}
+	in_total += len;
+	if (len == 0)
+		return;
+
+	in_retry = len;
+	(void)in_send_direct();
+}
 
+/**
+ * @brief Queue the packet stored into the IN endpoint buffer (if any)
+ *
+ * If the endpoint does not accept the packet (no free buffer) it is kept
+ * into the endpoint buffer and sent by a next call, after a completion
+ * (see fsm_data_in).
+ *
+ * @return integer Zero on success (or nothing to send), -1 if not queued
+ */
+static int in_send_direct(void)
+{
+	if (in_retry == 0)
+		return(0);
+	if (usb_send(1, 0, in_retry) < 0)
+		return(-1);
+	in_sent++;
+	csw.residue -= in_retry;
+	in_retry = 0;
 	return(0);
 }
 
+/**
+ * @brief Clear the Data IN pipeline
+ *
+ */
+static void in_reset(void)
+{
+	in_head  = 0;
+	in_tail  = 0;
+	in_idle  = 1;
+	in_total = 0;
+	in_sent  = 0;
+	in_done  = 0;
+	in_zlp   = 0;
+	in_direct = 0;
+	in_retry  = 0;
+	data_offset = 0;
+}
+
+/**
+ * @brief Queue packets of the pending Data IN buffers to the endpoint
+ *
+ * Packets are copied into endpoint buffers as long as the USB core report a
+ * free one (two when the endpoint is double-buffered). As the data are
+ * copied, a buffer is released (and residue updated) as soon as its last
+ * packet has been queued. It is called by the IN endpoint interrupt, or
+ * with this interrupt masked (see in_push).
+ *
+ * @return integer Number of packets queued
+ */
+static uint in_send(void)
+{
+	uint idx, remains;
+	uint count = 0;
+
+	while (in_tail != in_head)
+	{
+		idx = (in_tail & (SCSI_BUFFER_COUNT - 1));
+		/* Current buffer fully queued, update residue and release it */
+		if ((data_offset >= in_len[idx]) && (in_len[idx] || in_zlp))
+		{
+			if (csw.residue >= in_len[idx])
+				csw.residue -= in_len[idx];
+			else
+				csw.residue = 0;
+			data_offset = 0;
+			in_zlp = 0;
+			in_tail++;
+			continue;
+		}
+		if (usb_ep_tx_free(1) == 0)
+			break;
+
+		remains = (in_len[idx] - data_offset);
+		if (remains > 64)
+			remains = 64;
+		/* Not queued, retried on next completion (see usb_ep_tx) */
+		if (usb_send(1, in_buf[idx] + data_offset, remains) < 0)
+			break;
+		data_offset += remains;
+		if (remains == 0)
+			in_zlp = 1;
+		in_sent++;
+		count++;
+	}
+	return(count);
+}
+
 /**
  * @brief Process a control request sent to the MSC interface
  *
@@ -704,6 +919,7 @@ static int usb_if_ctrl(usb_ctrl_request *req, uint len, u8 *data)
 	{
 		/* To avoid race condition, reset sequence */
 		rst_flag = 1;
+		work_post(fsm_work);
 
 		log_print(LOG_INF, "USB_MSC: Class RESET\n");
 		return(1);
@@ -748,13 +964,35 @@ static void usb_if_enable(int cfg_id)
 	ep_def.release = usb_ep_release;
 	ep_def.rx      = 0;
 	ep_def.tx_complete = usb_ep_tx;
-	usb_ep_configure(1, USB_EP_BULK, &ep_def);
+	usb_ep_configure(1, USB_EP_BULK | USB_EP_DBL_BUF, &ep_def);
 
 #ifdef MSC_INFO
 	log_print(LOG_DBG, "USB_MSC: Enabled\n");
 #endif
 }
 
+/**
+ * @brief Periodic function of the MSC interface
+ *
+ * This function is called by the main loop (see usb_periodic). When the last
+ * SCSI step has been delayed because the medium is busy, the host is held
+ * (OUT endpoint NAK) and the state machine is posted to try again. The medium
+ * is busy for an erase or a program (ms), so the step is retried once per
+ * tick only : the main loop is not spent into the SCSI layer meanwhile.
+ */
+static void usb_if_periodic(void)
+{
+	u32 now;
+
+	if (media_wait == 0)
+		return;
+	now = time_now(0);
+	if (now == media_tm)
+		return;
+	media_tm = now;
+	work_post(fsm_work);
+}
+
 /**
  * @brief Reset MSC interface
  *
@@ -770,5 +1008,6 @@ static void usb_if_reset(void)
 	rst_flag = 2;
 
 	scsi_reset();
+	work_post(fsm_work);
 }
 /* EOF */
@@ -0,0 +1,378 @@
+/**
+ * @file  volume.c
+ * @brief Volumes made of many memory nodes (spanned or striped)
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include "mem.h"
+#include "types.h"
+#include "volume.h"
+
+static volume_extent vol_ext[VOLUME_EXTENT_COUNT];
+static uint vol_count; /* Number of extents (0 if volume not set)         */
+static uint vol_last;  /* Index of the last used extent                   */
+static uint vol_shift; /* Size of a unit (log2)                           */
+static u32  vol_size;  /* Size of the volume (in bytes)                   */
+static uint vol_rd_nid; /* Node of the background read (see volume_read_start) */
+static u8   vol_rd_run;
+static u8   vol_rd_err; /* Background read ended by volume_read and failed */
+
+static const volume_extent *extent_find(u32 addr);
+
+/**
+ * @brief Configure the volume
+ *
+ * The volume is described by a table of extents, computed here from the
+ * real size of the chips. A spanned volume use one extent per node, in the
+ * order of the array. A striped volume store consecutive units on
+ * consecutive nodes : the first extent use all nodes up to the size of the
+ * smallest one, next extents use the space left on larger nodes.
+ *
+ * The unit must be a multiple of the flash sector, so a sector of a node
+ * contains data of only one unit and can be rewritten without touching
+ * others.
+ *
+ * @param mode  Volume mode (VOLUME_SPAN or VOLUME_STRIPE)
+ * @param nids  Pointer to an array of memory node identifiers
+ * @param count Number of nodes into the array
+ * @param unit  Size of a unit in bytes (power of 2, >= 4096)
+ * @return integer Zero on success, other values are errors
+ */
+int volume_init(uint mode, const u8 *nids, uint count, uint unit)
+{
+	const mem_flash_chip *fc;
+	volume_extent *ext;
+	mem_node *node;
+	u32  sizes[MEM_NODE_COUNT];
+	u32  base, next;
+	uint i;
+
+	(void)volume_read_wait();
+	vol_count = 0;
+	vol_last  = 0;
+	vol_size  = 0;
+
+	// Sanity check
+	if ((mode > VOLUME_STRIPE) || (nids == 0))
+		return(-1);
+	if ((count == 0) || (count > MEM_NODE_COUNT))
+		return(-1);
+	if ((unit < MEM_SECTOR_SZ) || (unit & (unit - 1)))
+		return(-1);
+
+	for (vol_shift = 0; (1UL << vol_shift) < unit; vol_shift++)
+		;
+
+	for (i = 0; i < count; i++)
+	{
+		node = mem_get_node(nids[i]);
+		if ((node == 0) || (node->type != 1))
+			goto err_node;
+		fc = (const mem_flash_chip *)node->chip;
+		/* Chip size is in kB, only complete units are used */
+		sizes[i] = (((u32)fc->size * 1024) >> vol_shift) << vol_shift;
+		if (sizes[i] == 0)
+			goto err_node;
+	}
+
+	if (mode == VOLUME_SPAN)
+	{
+		for (i = 0; i < count; i++)
+		{
+			ext = &vol_ext[i];
+			ext->start   = vol_size;
+			ext->base    = 0;
+			ext->count   = 1;
+			ext->nids[0] = nids[i];
+			vol_size += sizes[i];
+			ext->end     = vol_size;
+		}
+		vol_count = count;
+		return(0);
+	}
+
+	/* Each extent use all nodes larger than the previous one */
+	for (base = 0; vol_count < VOLUME_EXTENT_COUNT; base = next)
+	{
+		ext = &vol_ext[vol_count];
+		ext->count = 0;
+		next = 0;
+		for (i = 0; i < count; i++)
+		{
+			if (sizes[i] <= base)
+				continue;
+			ext->nids[ext->count++] = nids[i];
+			if ((next == 0) || (sizes[i] < next))
+				next = sizes[i];
+		}
+		if (ext->count == 0)
+			break;
+		ext->start = vol_size;
+		ext->base  = base;
+		vol_size += (next - base) * ext->count;
+		ext->end   = vol_size;
+		vol_count++;
+	}
+	return(0);
+
+err_node:
+	vol_size = 0;
+	return(-1);
+}
+
+/**
+ * @brief Translate a volume address into a node address
+ *
+ * When the volume is not configured, addresses are used as-is on node 0.
+ * An address after the end of the volume gives an invalid node identifier
+ * (MEM_NODE_COUNT).
+ *
+ * @param addr  Address into the volume
+ * @param nid   Pointer to a variable to store the node identifier
+ * @param maddr Pointer to a variable to store the address into the node
+ * @return integer Number of bytes from addr to the end of the unit
+ */
+uint volume_map(u32 addr, uint *nid, u32 *maddr)
+{
+	const volume_extent *ext;
+	u32  mask = ((u32)1 << vol_shift) - 1;
+	u32  unit, row;
+	uint col;
+
+	if (vol_count == 0)
+	{
+		*nid   = 0;
+		*maddr = addr;
+	}
+	else if ((ext = extent_find(addr)) == 0)
+	{
+		*nid   = MEM_NODE_COUNT;
+		*maddr = 0;
+	}
+	else
+	{
+		/* Extents start on a unit boundary */
+		unit = ((addr - ext->start) >> vol_shift);
+		row  = unit;
+		col  = 0;
+		if (ext->count > 1)
+		{
+			row = unit / ext->count;
+			col = (uint)(unit - (row * ext->count));
+		}
+		*nid   = ext->nids[col];
+		*maddr = ext->base + (row << vol_shift) + (addr & mask);
+	}
+	return((uint)((mask + 1) - (addr & mask)));
+}
+
+/**
+ * @brief Read data from the volume
+ *
+ * The request is split at units boundaries. Reads of nodes connected to
+ * different SPI ports are started together and run at the same time (DMA),
+ * a read is only delayed when its port is already used. Reads into USB
+ * packet memory (zero-copy) are polled by mem_read_start, so their parts
+ * are read one after the other : stripes do not speed them up. These reads
+ * are one aligned packet (64 bytes) and never cross a unit boundary, so
+ * there is only one part to read.
+ *
+ * The LUN does not read more than one unit at a time (zero-copy packets,
+ * read cache sectors, write cache and read-ahead lines), and a single port
+ * already reads faster than USB sends : stripes speed up writes (jobs of
+ * each node run together), not the READ commands of the host.
+ *
+ * @param addr Address of the first byte to read
+ * @param len  Number of bytes to read
+ * @param data Pointer to a buffer to store data
+ * @return integer Number of bytes read, -1 on error (data not valid)
+ */
+int volume_read(u32 addr, uint len, u8 *data)
+{
+	u8   running[MEM_NODE_COUNT]; /* Nodes with a read in progress (FIFO) */
+	uint first = 0, count = 0;
+	u32  maddr;
+	uint done, nid, n;
+	int  result = 0;
+	int  err = 0;
+
+	for (done = 0; done < len; done += n)
+	{
+		n = volume_map(addr + done, &nid, &maddr);
+		if (n > (len - done))
+			n = (len - done);
+		/* Background read of this node is ended first, keep its result */
+		if (vol_rd_run && (vol_rd_nid == nid))
+		{
+			vol_rd_err = (mem_read_wait(nid) < 0);
+			vol_rd_run = 0;
+		}
+		result = mem_read_start(nid, maddr, n, data + done);
+		/* Port used by a previous part, wait the oldest one then retry */
+		if ((result == -2) && count)
+		{
+			if (mem_read_wait(running[first]) < 0)
+				err = -1;
+			first = (first + 1) % MEM_NODE_COUNT;
+			count--;
+			n = 0;
+			continue;
+		}
+		if (result < 0)
+			break;
+		running[(first + count) % MEM_NODE_COUNT] = (u8)nid;
+		count++;
+	}
+	/* Wait the end of all running reads */
+	for ( ; count; count--)
+	{
+		if (mem_read_wait(running[first]) < 0)
+			err = -1;
+		first = (first + 1) % MEM_NODE_COUNT;
+	}
+
+	if ((result < 0) || err)
+		return(-1);
+	return((int)done);
+}
+
+/**
+ * @brief Start to read data from the volume, without waiting the end
+ *
+ * Only one background read can be running, a previous one is finished
+ * first. The area must be stored into one unit (one node). The data must
+ * not be used before volume_read_wait.
+ *
+ * @param addr Address of the first byte to read
+ * @param len  Number of bytes to read
+ * @param data Pointer to a buffer to store data (not USB packet memory)
+ * @return integer Zero if started (or done), negative value on error
+ */
+int volume_read_start(u32 addr, uint len, u8 *data)
+{
+	u32  maddr;
+	uint nid;
+
+	(void)volume_read_wait();
+
+	if (volume_map(addr, &nid, &maddr) < len)
+		return(-1);
+	if (mem_read_start(nid, maddr, len, data) != 0)
+		return(-1);
+	vol_rd_nid = nid;
+	vol_rd_run = 1;
+	vol_rd_err = 0;
+	return(0);
+}
+
+/**
+ * @brief Wait the end of the read started by volume_read_start
+ *
+ * @return integer Zero on success (or nothing to wait), -1 on error
+ */
+int volume_read_wait(void)
+{
+	int result = 0;
+
+	if (vol_rd_run)
+		result = mem_read_wait(vol_rd_nid);
+	else if (vol_rd_err)
+		result = -1;
+	vol_rd_run = 0;
+	vol_rd_err = 0;
+	return(result);
+}
+
+/**
+ * @brief Declare an area of the volume as free (see mem_trim)
+ *
+ * The area is split at units boundaries, each part is given to the node
+ * that stores it. Only complete flash sectors can be marked free.
+ *
+ * @param addr Address of the first byte of the area
+ * @param len  Number of bytes of the area
+ * @return integer Number of sectors marked free
+ */
+int volume_trim(u32 addr, u32 len)
+{
+	u32  maddr;
+	uint nid, n;
+	u32  done;
+	int  count = 0;
+
+	for (done = 0; done < len; done += n)
+	{
+		n = volume_map(addr + done, &nid, &maddr);
+		if (n > (len - done))
+			n = (uint)(len - done);
+		count += mem_trim(nid, maddr, n);
+	}
+	return(count);
+}
+
+/**
+ * @brief Get the size of the volume
+ *
+ * @return u32 Size in bytes (zero if not configured)
+ */
+u32 volume_size(void)
+{
+	return(vol_size);
+}
+
+/**
+ * @brief Get one extent of the volume
+ *
+ * @param index Index of the extent
+ * @return volume_extent* Pointer to the extent (NULL if not available)
+ */
+const volume_extent *volume_get_extent(uint index)
+{
+	if (index >= vol_count)
+		return(0);
+	return(&vol_ext[index]);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                          Private  functions                          -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Find the extent that contains an address
+ *
+ * The table has at most one extent per node and accesses are mostly
+ * sequential, so the last used extent is tested first.
+ *
+ * @param addr Address into the volume
+ * @return volume_extent* Pointer to the extent (NULL if out of volume)
+ */
+static const volume_extent *extent_find(u32 addr)
+{
+	const volume_extent *ext;
+	uint i;
+
+	ext = &vol_ext[vol_last];
+	if ((addr >= ext->start) && (addr < ext->end))
+		return(ext);
+
+	for (i = 0; i < vol_count; i++)
+	{
+		ext = &vol_ext[i];
+		if ((addr >= ext->start) && (addr < ext->end))
+		{
+			vol_last = i;
+			return(ext);
+		}
+	}
+	return(0);
+}
+/* EOF */
@@ -0,0 +1,50 @@
+/**
+ * @file  volume.h
+ * @brief Headers and definitions for volumes made of many memory nodes
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef VOLUME_H
+#define VOLUME_H
+#include "mem.h"
+#include "types.h"
+
+/* Volume modes */
+#define VOLUME_SPAN   0 /* Nodes are concatenated, one after the other    */
+#define VOLUME_STRIPE 1 /* Consecutive units on consecutive nodes (RAID-0) */
+
+/* Default unit : one flash sector, so a 4k cache line use one node */
+#define VOLUME_UNIT_SZ MEM_SECTOR_SZ
+
+/* A volume use at most one extent per node */
+#define VOLUME_EXTENT_COUNT MEM_NODE_COUNT
+
+typedef struct volume_extent_s
+{
+	u32  start; /* First volume address of the extent             */
+	u32  end;   /* First volume address after the extent          */
+	u32  base;  /* Address of the extent into each of its nodes   */
+	uint count; /* Number of nodes used by the extent             */
+	u8   nids[MEM_NODE_COUNT];
+} volume_extent;
+
+int  volume_init(uint mode, const u8 *nids, uint count, uint unit);
+uint volume_map (u32 addr, uint *nid, u32 *maddr);
+int  volume_read(u32 addr, uint len, u8 *data);
+int  volume_read_start(u32 addr, uint len, u8 *data);
+int  volume_read_wait (void);
+int  volume_trim(u32 addr, u32 len);
+u32  volume_size(void);
+const volume_extent *volume_get_extent(uint index);
+
+#endif
+/* EOF */
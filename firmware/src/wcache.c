@@ -0,0 +1,537 @@
+/**
+ * @file  wcache.c
+ * @brief Write-back cache of 512 bytes sectors above a flash memory node
+ *
+ * Flash memories can only be erased by 4k sectors. To write one 512 bytes
+ * block, the whole 4k sector must be read, erased and programmed again. This
+ * module keeps a few 4k lines into RAM, each with a bitmap of the modified
+ * blocks, so interleaved writes (for example FAT updates mixed with data
+ * clusters) are merged before the flash is erased. When all lines are used,
+ * the least recently written one is flushed to make room.
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include "libc.h"
+#include "mem.h"
+#include "types.h"
+#include "usb.h"
+#include "wcache.h"
+
+static wcache_line  lines[WCACHE_WAYS];
+static wcache_stats stats;
+static uint wc_nid;
+static uint (*wc_map)(u32 addr, uint *nid, u32 *maddr);
+/* Translation layer (see wcache_backend) */
+static int (*wc_rd)(u32 addr, uint len, u8 *data);
+static int (*wc_submit)(u32 addr, mem_job *job);
+static uint wc_ways;
+static u32  wc_clock;
+static int  wc_error; /* A background flush has failed */
+/* Range of the current write transaction (see wcache_prepare) */
+static u32  wc_wr_start;
+static u32  wc_wr_end;
+
+static uint line_class(wcache_line *line);
+static wcache_line *line_find(u32 addr);
+static int line_flush(wcache_line *line);
+static void line_node(wcache_line *line, uint *nid, u32 *maddr);
+static void line_flushed(mem_job *job);
+
+/**
+ * @brief Initialize the write cache
+ *
+ * @param nid  Identifier of the memory node behind the cache
+ * @param ways Number of lines to use (limited to WCACHE_WAYS)
+ */
+void wcache_init(uint nid, uint ways)
+{
+	uint i;
+
+	for (i = 0; i < WCACHE_WAYS; i++)
+	{
+		lines[i].addr  = 0;
+		lines[i].valid = 0;
+		lines[i].dirty = 0;
+		lines[i].avail = 0;
+		lines[i].age   = 0;
+		lines[i].busy  = 0;
+	}
+	wc_wr_start = 0;
+	wc_wr_end   = 0;
+	memset(&stats, 0, sizeof(wcache_stats));
+
+	if ((ways == 0) || (ways > WCACHE_WAYS))
+		ways = WCACHE_WAYS;
+	wc_nid   = nid;
+	wc_map   = 0;
+	wc_rd    = 0;
+	wc_submit = 0;
+	wc_ways  = ways;
+	wc_clock = 0;
+	wc_error = 0;
+}
+
+/**
+ * @brief Set the function used to translate addresses into node addresses
+ *
+ * By default the cache use the node given to wcache_init with the same
+ * addresses. A volume made of many nodes (see volume_map) can set a
+ * translation function : a line must always be stored into one node.
+ *
+ * @param map Pointer to the translation function (or NULL)
+ */
+void wcache_map(uint (*map)(u32 addr, uint *nid, u32 *maddr))
+{
+	wc_map = map;
+}
+
+/**
+ * @brief Set the functions used to access a translation layer (FTL)
+ *
+ * When set, lines are not stored at a fixed place into a node : they are
+ * loaded with the read function (it returns the number of bytes read, like
+ * ftl_read) and given to the submit function when modified, with the cache
+ * address and a job ready for mem_submit. The submit function may return
+ * WCACHE_BUSY when the line can not be written now (no room), the line then
+ * stays modified into cache.
+ *
+ * @param rd     Pointer to the read function (or NULL)
+ * @param submit Pointer to the write function (or NULL)
+ */
+void wcache_backend(int (*rd)(u32 addr, uint len, u8 *data),
+                    int (*submit)(u32 addr, mem_job *job))
+{
+	wc_rd     = rd;
+	wc_submit = submit;
+}
+
+/**
+ * @brief Declare the range of the next written sectors
+ *
+ * This function is called at the begining of a write transaction. A line
+ * fully covered by this range will be entirely written, so there is no need
+ * to load it from memory before the first sector is written.
+ *
+ * @param addr Address of the first byte of the transaction
+ * @param len  Number of bytes of the transaction (0 to clear range)
+ */
+void wcache_prepare(u32 addr, u32 len)
+{
+	wc_wr_start = addr;
+	wc_wr_end   = addr + len;
+}
+
+/**
+ * @brief Write one sector into the cache
+ *
+ * If the line that contains this sector is not into cache, a line is
+ * allocated : a free one if any, else the least recently written line of
+ * the first non-empty class : clean, fully modified (sequential data, would
+ * be flushed at end of command anyway) then partially modified. A modified
+ * line is flushed before reuse. The new line is then loaded from memory,
+ * except when the current transaction will write it entirely (see
+ * wcache_prepare), and the sector is updated.
+ *
+ * Lines are written to memory in background (see mem_submit). A line being
+ * written can not be modified or reused, in this case WCACHE_BUSY is
+ * returned and the write must be retried later. When a line becomes fully
+ * modified, its flush is started immediately so memory is busy while the
+ * next lines are received.
+ *
+ * @param addr Address of the sector (512 bytes aligned)
+ * @param data Pointer to a buffer with 512 bytes to write
+ * @return integer Zero on success, WCACHE_BUSY or negative value on error
+ */
+int wcache_write(u32 addr, const u8 *data)
+{
+	wcache_line *line;
+	uint inflight = 0;
+	uint i, nid;
+	u32  maddr;
+	int  result;
+
+	line = line_find(addr);
+	if (line && line->busy)
+		goto busy;
+	if (line)
+		stats.hits++;
+	else
+	{
+		/* Select a way : free one, else the oldest of the lower class */
+		line = 0;
+		for (i = 0; i < wc_ways; i++)
+		{
+			/* Line being written to memory, not available */
+			if (lines[i].busy)
+			{
+				inflight++;
+				continue;
+			}
+			if (lines[i].valid == 0)
+			{
+				line = &lines[i];
+				break;
+			}
+			if (line == 0)
+				line = &lines[i];
+			else if (line_class(&lines[i]) < line_class(line))
+				line = &lines[i];
+			else if ((line_class(&lines[i]) == line_class(line)) &&
+			         (lines[i].age < line->age))
+				line = &lines[i];
+		}
+		if (line == 0)
+			goto busy;
+		if (line->dirty)
+		{
+			/* Wait end of running flush(es) before starting another */
+			if (inflight)
+				goto busy;
+			stats.evictions++;
+			result = line_flush(line);
+			if (result < 0)
+				return(-1);
+			if (result || line->busy)
+				goto busy;
+		}
+		line->addr  = (addr & ~(u32)(WCACHE_LINE_SZ - 1));
+		line->valid = 1;
+		line->dirty = 0;
+		/* Line will be entirely written by current transaction */
+		if ((line->addr >= wc_wr_start) &&
+		    ((line->addr + WCACHE_LINE_SZ) <= wc_wr_end))
+		{
+			line->avail = 0;
+			stats.fill_skip++;
+		}
+		/* Load the new line */
+		else if (wc_rd)
+		{
+			if (wc_rd(line->addr, WCACHE_LINE_SZ, line->data) != WCACHE_LINE_SZ)
+			{
+				line->valid = 0;
+				return(-1);
+			}
+			line->avail = 0xFF;
+			stats.fills++;
+		}
+		else
+		{
+			line_node(line, &nid, &maddr);
+			if (mem_read(nid, maddr, WCACHE_LINE_SZ, line->data) < 0)
+			{
+				line->valid = 0;
+				return(-1);
+			}
+			line->avail = 0xFF;
+			stats.fills++;
+		}
+	}
+
+	memcpy(line->data + (addr & (WCACHE_LINE_SZ - 1)), data, 512);
+	line->dirty |= (u8)(1 << ((addr >> 9) & 7));
+	line->avail |= (u8)(1 << ((addr >> 9) & 7));
+	line->age = ++wc_clock;
+	stats.writes++;
+
+	/* Line fully modified, write it while next sectors are received */
+	if (line->dirty == 0xFF)
+	{
+		/* If busy, line stays into cache and is written later */
+		if (line_flush(line) < 0)
+			return(-1);
+	}
+	return(0);
+
+busy:
+	stats.busy++;
+	return(WCACHE_BUSY);
+}
+
+/**
+ * @brief Read data from cache (if available)
+ *
+ * The data are copied from cache only if the line is present and contains
+ * the first sector, then as long as next sectors are available. When address,
+ * buffer and length are 32 bits aligned the copy use words, so this function
+ * can fill the USB packet memory.
+ *
+ * @param addr Address of the first byte to read
+ * @param len  Number of bytes to read
+ * @param data Pointer to a buffer to store data
+ * @return integer Number of bytes copied (zero if line not into cache)
+ */
+int wcache_read(u32 addr, uint len, u8 *data)
+{
+	wcache_line *line;
+	uint offset, i;
+
+	line = line_find(addr);
+	if (line == 0)
+		return(0);
+
+	offset = (addr & (WCACHE_LINE_SZ - 1));
+	if ((offset + len) > WCACHE_LINE_SZ)
+		len = (WCACHE_LINE_SZ - offset);
+	/* Limit to the available sectors (a line may be partially loaded) */
+	for (i = (offset >> 9); i < 8; i++)
+	{
+		if ((line->avail & (1 << i)) == 0)
+			break;
+	}
+	if ((i * 512) <= offset)
+		return(0);
+	if ((offset + len) > (i * 512))
+		len = (i * 512) - offset;
+
+	/* Buffer may be an endpoint buffer (zero-copy read) */
+	memcpy_pma(data, line->data + offset, len);
+	stats.rd_hits++;
+
+	return((int)len);
+}
+
+/**
+ * @brief Write modified lines to memory
+ *
+ * The writes are started in background, this function does not wait the
+ * end of them. With WCACHE_FLUSH_ALL, WCACHE_BUSY is returned until all the
+ * lines have been written : the caller can call it again to wait the end of
+ * the flush.
+ *
+ * @param mode Select the lines to flush (see WCACHE_FLUSH_xx)
+ * @return integer Zero on success, WCACHE_BUSY or negative value on error
+ */
+int wcache_flush(uint mode)
+{
+	int result = 0;
+	uint pending = 0;
+	uint i;
+	int  r;
+
+	for (i = 0; i < wc_ways; i++)
+	{
+		if ((lines[i].dirty == 0) ||
+		    ((mode == WCACHE_FLUSH_FULL) && (lines[i].dirty != 0xFF)))
+		{
+			pending |= lines[i].busy;
+			continue;
+		}
+		r = line_flush(&lines[i]);
+		if (r < 0)
+			result = -1;
+		/* Not written (no room into memory), still pending */
+		else if (r)
+			pending = 1;
+		pending |= lines[i].busy;
+	}
+	/* Report errors of background writes */
+	if (wc_error)
+	{
+		wc_error = 0;
+		result = -1;
+	}
+	if ((result == 0) && pending && (mode == WCACHE_FLUSH_ALL))
+		result = WCACHE_BUSY;
+	return(result);
+}
+
+/**
+ * @brief Drop the lines fully covered by an area (data no more used)
+ *
+ * Modified sectors of these lines are not written to memory. A line being
+ * written is only removed from cache, its write continues.
+ *
+ * @param addr Address of the first byte of the area
+ * @param len  Number of bytes of the area
+ * @return integer Number of lines dropped
+ */
+int wcache_discard(u32 addr, u32 len)
+{
+	uint i;
+	int  count = 0;
+
+	for (i = 0; i < wc_ways; i++)
+	{
+		if ((lines[i].valid == 0) || (lines[i].addr < addr) ||
+		    ((lines[i].addr - addr + WCACHE_LINE_SZ) > len))
+			continue;
+		lines[i].valid = 0;
+		lines[i].dirty = 0;
+		lines[i].avail = 0;
+		count++;
+	}
+	return(count);
+}
+
+/**
+ * @brief Test if the cache contains modified data
+ *
+ * @return boolean True if at least one line must be (or is being) written
+ */
+int wcache_dirty(void)
+{
+	uint i;
+
+	for (i = 0; i < wc_ways; i++)
+	{
+		if (lines[i].dirty || lines[i].busy)
+			return(1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Get access to the cache statistics
+ *
+ * @return wcache_stats* Pointer to the statistics counters
+ */
+wcache_stats *wcache_get_stats(void)
+{
+	return(&stats);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                          Private  functions                          -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Search the line that contains an address
+ *
+ * @param addr Address to search
+ * @return wcache_line* Pointer to the line (or NULL if not into cache)
+ */
+static wcache_line *line_find(u32 addr)
+{
+	uint i;
+
+	addr &= ~(u32)(WCACHE_LINE_SZ - 1);
+	for (i = 0; i < wc_ways; i++)
+	{
+		if (lines[i].valid && (lines[i].addr == addr))
+			return(&lines[i]);
+	}
+	return(0);
+}
+
+/**
+ * @brief Get the eviction class of a line (lower is evicted first)
+ *
+ * @param line Pointer to the line
+ * @return integer 0 for clean, 1 for fully modified, 2 for partially modified
+ */
+static uint line_class(wcache_line *line)
+{
+	if (line->dirty == 0)
+		return(0);
+	if (line->dirty == 0xFF)
+		return(1);
+	return(2);
+}
+
+/**
+ * @brief Start the write of one line to memory (erase + program)
+ *
+ * When the line has not been loaded (see wcache_prepare) and the transaction
+ * has been interrupted, the sectors not written are read before erase. The
+ * line is then written in background, it stay busy until the end of the
+ * write (see line_flushed).
+ *
+ * @param line Pointer to the line to write
+ * @return integer Zero on success, WCACHE_BUSY or negative value on error
+ */
+static int line_flush(wcache_line *line)
+{
+	uint i, nid;
+	u32  maddr;
+	u8   dirty;
+	int  result;
+
+	line_node(line, &nid, &maddr);
+
+	/* Load sectors not written (transaction ended before end of line) */
+	for (i = 0; (line->avail != 0xFF) && (i < 8); i++)
+	{
+		if (line->avail & (1 << i))
+			continue;
+		if (wc_rd)
+		{
+			if (wc_rd(line->addr + (i * 512), 512, line->data + (i * 512)) != 512)
+				return(-1);
+		}
+		else if (mem_read(nid, maddr + (i * 512), 512, line->data + (i * 512)) < 0)
+			return(-1);
+		line->avail |= (u8)(1 << i);
+		stats.late_rd++;
+	}
+
+	/* Rewrite the whole flash sector (see mem_write) */
+	line->job.type     = MEM_JOB_UPDATE;
+	line->job.addr     = maddr;
+	line->job.len      = WCACHE_LINE_SZ;
+	line->job.buffer   = line->data;
+	line->job.complete = line_flushed;
+	line->job.priv     = line;
+	dirty = line->dirty;
+	line->dirty = 0;
+	line->busy  = 1;
+	if (wc_submit)
+		result = wc_submit(line->addr, &line->job);
+	else
+		result = mem_submit(nid, &line->job);
+	if (result)
+	{
+		line->busy = 0;
+		/* Translation layer has no room, keep data into cache */
+		if (result == WCACHE_BUSY)
+		{
+			line->dirty = dirty;
+			return(WCACHE_BUSY);
+		}
+		return(-1);
+	}
+	stats.flushes++;
+	return(0);
+}
+
+/**
+ * @brief Get the memory node and address where a line is stored
+ *
+ * @param line  Pointer to the line
+ * @param nid   Pointer to a variable to store the node identifier
+ * @param maddr Pointer to a variable to store the address into the node
+ */
+static void line_node(wcache_line *line, uint *nid, u32 *maddr)
+{
+	if (wc_map)
+		wc_map(line->addr, nid, maddr);
+	else
+	{
+		*nid   = wc_nid;
+		*maddr = line->addr;
+	}
+}
+
+/**
+ * @brief Called by mem when the write of a line is complete
+ *
+ * @param job Pointer to the job of the line
+ */
+static void line_flushed(mem_job *job)
+{
+	wcache_line *line = (wcache_line *)job->priv;
+
+	line->busy = 0;
+	if (job->result)
+		wc_error = 1;
+}
+/* EOF */
@@ -0,0 +1,72 @@
+/**
+ * @file  wcache.h
+ * @brief Definitions and prototypes for the sector write-back cache
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef WCACHE_H
+#define WCACHE_H
+#include "mem.h"
+#include "types.h"
+
+/* Number of 4k lines (each line use 4k of RAM) */
+#ifndef WCACHE_WAYS
+#define WCACHE_WAYS 4
+#endif
+#define WCACHE_LINE_SZ 4096
+
+/* Flush modes */
+#define WCACHE_FLUSH_ALL  0 /* Write all dirty lines                       */
+#define WCACHE_FLUSH_FULL 1 /* Write only lines with all sectors modified  */
+
+/* Result of wcache_write/wcache_flush when memory is busy (call it again) */
+#define WCACHE_BUSY 1
+
+typedef struct wcache_line_s
+{
+	u32  addr;  /* Address of the first byte of the line (4k aligned)    */
+	u8   valid; /* Line is used                                          */
+	u8   dirty; /* Bitmap of modified sectors (one bit per 512 bytes)    */
+	u8   avail; /* Bitmap of sectors with data (loaded or modified)      */
+	u32  age;   /* Value of the LRU clock on last write                  */
+	u8   busy;  /* Line is being written to memory (see line_flush)      */
+	mem_job job;
+	u8   data[WCACHE_LINE_SZ] __attribute__((aligned(4)));
+} wcache_line;
+
+typedef struct wcache_stats_s
+{
+	u32 writes;    /* Sectors written into the cache               */
+	u32 hits;      /* Sectors written into an already cached line  */
+	u32 fills;     /* Lines loaded from memory                     */
+	u32 fill_skip; /* Lines not loaded (fully covered by a write)  */
+	u32 late_rd;   /* Sectors loaded before flush of partial line  */
+	u32 evictions; /* Dirty lines written to free a way            */
+	u32 flushes;   /* Lines written to memory (erase + program)    */
+	u32 rd_hits;   /* Read requests served from cache              */
+	u32 busy;      /* Writes delayed, memory busy with a flush     */
+} wcache_stats;
+
+void wcache_init(uint nid, uint ways);
+void wcache_map(uint (*map)(u32 addr, uint *nid, u32 *maddr));
+void wcache_backend(int (*rd)(u32 addr, uint len, u8 *data),
+                    int (*submit)(u32 addr, mem_job *job));
+void wcache_prepare(u32 addr, u32 len);
+int  wcache_write(u32 addr, const u8 *data);
+int  wcache_read(u32 addr, uint len, u8 *data);
+int  wcache_flush(uint mode);
+int  wcache_discard(u32 addr, u32 len);
+int  wcache_dirty(void);
+wcache_stats *wcache_get_stats(void);
+
+#endif
+/* EOF */
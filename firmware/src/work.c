@@ -0,0 +1,183 @@
+/**
+ * @file  work.c
+ * @brief Deferred work queue (run from PendSV, below all interrupts)
+ *
+ * Interrupt handlers must be short, but some events need long processing (for
+ * example a flash access to answer a SCSI command). A handler can post a work
+ * item : it will be processed by the PendSV exception, with the lowest
+ * priority. So work items preempt the main loop (a slow application does not
+ * delay them) but are interrupted by all peripherals.
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include "hardware.h"
+#include "types.h"
+#include "work.h"
+
+typedef struct work_item_s
+{
+	void (*fn)(void);
+	uint prio;
+	vu8  pending;
+} work_item;
+
+static work_item items[WORK_COUNT];
+static uint      items_count;
+/* Main loop code using the SPI memories (see work_lock) */
+static vu32      lock_count;
+
+/**
+ * @brief Initialize the deferred work queue
+ *
+ * PendSV is configured with the lowest priority, so the USB (and all other)
+ * interrupts can preempt a running work item.
+ */
+void work_init(void)
+{
+	uint i;
+
+	for (i = 0; i < WORK_COUNT; i++)
+	{
+		items[i].fn      = 0;
+		items[i].prio    = WORK_PRIO_IDLE;
+		items[i].pending = 0;
+	}
+	items_count = 0;
+	lock_count  = 0;
+
+	/* PendSV priority : 3 (lowest) */
+	reg_wr(SCB_SHPR3, (reg_rd(SCB_SHPR3) & 0xFF00FFFF) | (0xC0 << 16));
+}
+
+/**
+ * @brief Register a work item
+ *
+ * @param fn   Function called to process the work
+ * @param prio Priority of this work (see WORK_PRIO_xx)
+ * @return integer Identifier of the work item, or negative value on error
+ */
+int work_register(void (*fn)(void), uint prio)
+{
+	int id;
+
+	if ((fn == 0) || (items_count >= WORK_COUNT))
+		return(-1);
+
+	id = (int)items_count;
+	items[id].fn      = fn;
+	items[id].prio    = (prio > WORK_PRIO_IDLE) ? WORK_PRIO_IDLE : prio;
+	items[id].pending = 0;
+	items_count++;
+
+	return(id);
+}
+
+/**
+ * @brief Request processing of a work item
+ *
+ * This function can be called from interrupt handlers or from main loop. If
+ * the item is already pending, it will be processed only once.
+ *
+ * @param id Identifier of the work item (see work_register)
+ */
+void work_post(int id)
+{
+	if ((id < 0) || (id >= (int)items_count))
+		return;
+
+	/* A byte store is atomic, no need to lock interrupts */
+	items[id].pending = 1;
+	/* Set PendSV */
+	reg_wr(SCB_ICSR, (1 << 28));
+}
+
+/**
+ * @brief Delay work items while the main loop use the SPI memories
+ *
+ * All work items access the SPI memories (SCSI state machine, jobs, cache
+ * flush, pre-erase). A main loop function that use them too (a custom app
+ * calling mem_read for example) must hold the lock : a work item would
+ * preempt it in the middle of a transfer. Items posted while locked stay
+ * pending and are processed on work_unlock. Calls can be nested.
+ */
+void work_lock(void)
+{
+	lock_count++;
+}
+
+/**
+ * @brief Release the lock taken by work_lock, run delayed items
+ *
+ */
+void work_unlock(void)
+{
+	uint i;
+
+	if (lock_count == 0)
+		return;
+	lock_count--;
+	if (lock_count)
+		return;
+	/* Items posted while locked have been delayed, run them now */
+	for (i = 0; i < items_count; i++)
+	{
+		if (items[i].pending)
+		{
+			reg_wr(SCB_ICSR, (1 << 28));
+			break;
+		}
+	}
+}
+
+/**
+ * @brief Process all pending work items, highest priority first
+ *
+ * The pending flag is cleared before calling the item, so an event posted
+ * while it is running (from an interrupt) is not lost. Nothing is done while
+ * the main loop hold the lock (see work_lock).
+ */
+void work_run(void)
+{
+	uint prio, i;
+
+	/* Items stay pending, PendSV is set again by work_unlock */
+	if (lock_count)
+		return;
+
+	prio = 0;
+	while (prio <= WORK_PRIO_IDLE)
+	{
+		for (i = 0; i < items_count; i++)
+		{
+			if ((items[i].prio != prio) || (items[i].pending == 0))
+				continue;
+			items[i].pending = 0;
+			items[i].fn();
+			break;
+		}
+		/* An item has been processed, restart with highest priority */
+		if (i < items_count)
+			prio = 0;
+		else
+			prio++;
+	}
+}
+
+/**
+ * @brief PendSV exception handler
+ *
+ */
+void PendSV_Handler(void)
+{
+	work_run();
+}
+/* EOF */
@@ -0,0 +1,40 @@
+/**
+ * @file  work.h
+ * @brief Definitions and prototypes for the deferred work queue
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef WORK_H
+#define WORK_H
+#include "hardware.h"
+#include "types.h"
+
+#define SCB_ICSR  ((u32)(CM0_SCB + 0x04))
+#define SCB_SHPR3 ((u32)(CM0_SCB + 0x20))
+
+/* Maximum number of registered work items */
+#define WORK_COUNT 8
+/* Work priorities (lower value run first) */
+#define WORK_PRIO_HIGH   0
+#define WORK_PRIO_NORMAL 1
+#define WORK_PRIO_LOW    2
+#define WORK_PRIO_IDLE   3
+
+void work_init(void);
+int  work_register(void (*fn)(void), uint prio);
+void work_post(int id);
+void work_lock(void);
+void work_unlock(void);
+void work_run(void);
+
+#endif
+/* EOF */
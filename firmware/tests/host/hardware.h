@@ -0,0 +1,26 @@
+/**
+ * @file  tests/host/hardware.h
+ * @brief Hardware definitions for unit-tests without peripheral access
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef HARDWARE_H
+#define HARDWARE_H
+#include "types.h"
+
+/* This file is forced (-include) in place of the firmware one, that define
+ * inline register accessors (pointers built from 32 bits addresses). Only
+ * the address of the USB packet memory is used (see USB_IS_PMA) */
+#define USB_R1 0x40009800
+
+#endif
+/* EOF */
@@ -0,0 +1,36 @@
+/**
+ * @file  tests/host/types.h
+ * @brief Alternative types definition with 32 bits "u32" on 64 bits hosts
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef TYPES_H
+#define TYPES_H
+
+/* This file is forced (-include) before firmware sources of unit-tests :
+ * data copied by 32 bits words (USB packet memory), packed structures and
+ * PMA descriptors need 32 bits wide u32 */
+typedef unsigned int   u32;
+typedef unsigned short u16;
+typedef unsigned char  u8;
+typedef signed   char  s8;
+typedef signed   short s16;
+typedef signed   int   s32;
+typedef volatile unsigned int   vu32;
+typedef volatile unsigned short vu16;
+typedef volatile unsigned char  vu8;
+typedef volatile signed   short vs16;
+
+typedef unsigned int uint;
+
+#endif
+/* EOF */
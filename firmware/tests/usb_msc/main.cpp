@@ -38,6 +38,7 @@ int test_HoDi(UsbIf *usbdev);
 int test_HoDo_eq(UsbIf *usbdev);
 int test_HoDo_gt(UsbIf *usbdev);
 int test_HoDo_lt(UsbIf *usbdev);
+int test_lun(UsbIf *usbdev);
 int test_recovery(UsbIf *usbdev);
 
 int main(int argc, char **argv)
@@ -90,6 +91,10 @@ int main(int argc, char **argv)
 		// Case #13 : Ho < Do
 		usbdev.reset();
 		err_count += test_HoDo_lt(&usbdev);
+
+		// Commands interleaved on LUN 0 and LUN 1
+		usbdev.reset();
+		err_count += test_lun(&usbdev);
 	} catch (std::exception &e) {
 		std::cout << e.what() << std::endl;
 	};
@@ -994,6 +999,149 @@ int test_HoDo_lt(UsbIf *usbdev)
 	return(0);
 }
 
+/**
+ * @brief Send a command with Data IN phase to one LUN
+ *
+ * A STALL of the data phase (command refused) is accepted, then the CSW is
+ * read and verified.
+ *
+ * @param usbdev Pointer to the USB interface of the device
+ * @param lun    Logical unit number
+ * @param tag    Tag of the CBW (must be found into the CSW)
+ * @param cb     Pointer to the command block
+ * @param cb_len Length of the command block
+ * @param data   Pointer to a buffer for the data (1024 bytes)
+ * @param len    Length of data expected (in), received (out)
+ * @return integer Status of the CSW
+ */
+static int lun_command(UsbIf *usbdev, uint8_t lun, uint32_t tag,
+                       const char *cb, int cb_len, uint8_t *data, int *len)
+{
+	uint8_t buffer[1024];
+	int read_len;
+	int result;
+
+	Cbw c(0x80, *len);
+	c.setLun(lun);
+	c.setTag(tag);
+	c.setCB((uint8_t *)cb, cb_len);
+
+	result = usbdev->write(c.buffer(), 31);
+	if (result)
+		throw std::runtime_error("Write CBW failed");
+
+	read_len = 1024;
+	result = usbdev->read(data, &read_len);
+	if (result == -9)
+	{
+		read_len = 1024;
+		result = usbdev->read(buffer, &read_len);
+		*len = 0;
+	}
+	else if ((result == 0) && (read_len != 13))
+	{
+		*len = read_len;
+		read_len = 1024;
+		result = usbdev->read(buffer, &read_len);
+		if (result == -9)
+		{
+			read_len = 1024;
+			result = usbdev->read(buffer, &read_len);
+		}
+	}
+	else
+	{
+		memcpy(buffer, data, 13);
+		*len = 0;
+	}
+	if (result < 0)
+		throw std::runtime_error("Read CSW failed");
+
+	Csw csw(buffer, read_len);
+	if ( ! csw.checkSignature())
+		throw std::runtime_error("Bad CSW signature");
+	if (csw.getTag() != tag)
+		throw std::runtime_error("Bad tag response (CSW of another LUN ?)");
+	if (csw.getStatus() == 2)
+		throw std::runtime_error("Device report a 0x02 status");
+	return(csw.getStatus());
+}
+
+int test_lun(UsbIf *usbdev)
+{
+	uint8_t data[1024];
+	uint8_t cap0[8];
+	int status1, status, len;
+
+	std::cout << std::endl << "\x1B[1;36m"
+	          << "Test commands interleaved on LUN 0 and LUN 1"
+	          << "\x1B[0m" << std::endl;
+
+	try
+	{
+		// Clear the sense of LUN 0 (errors of previous tests)
+		len = 18;
+		lun_command(usbdev, 0, 0xBABE0100,
+		            "\x03\x00\x00\x00\x12\x00", 6, data, &len);
+
+		// TEST UNIT READY on LUN 1 : failure when device has one LUN
+		len = 0;
+		status1 = lun_command(usbdev, 1, 0xBABE0101,
+		                      "\x00\x00\x00\x00\x00\x00", 6, data, &len);
+		if (status1)
+			printf(" - LUN 1 not ready or not supported\n");
+
+		// READ CAPACITY(10) on LUN 0, then on LUN 1
+		len = 8;
+		status = lun_command(usbdev, 0, 0xBABE0102,
+		        "\x25\x00\x00\x00\x00\x00\x00\x00\x00\x00", 10, data, &len);
+		if (status || (len != 8))
+			throw std::runtime_error("READ CAPACITY of LUN 0 failed");
+		memcpy(cap0, data, 8);
+
+		len = 8;
+		status = lun_command(usbdev, 1, 0xBABE0103,
+		        "\x25\x00\x00\x00\x00\x00\x00\x00\x00\x00", 10, data, &len);
+		if ((status1 == 0) && (status || (len != 8)))
+			throw std::runtime_error("READ CAPACITY of LUN 1 failed");
+		if ((status1 != 0) && (status == 0))
+			throw std::runtime_error("READ CAPACITY of missing LUN 1 success");
+
+		// REQUEST SENSE on LUN 0 : error of LUN 1 must not be reported
+		len = 18;
+		status = lun_command(usbdev, 0, 0xBABE0104,
+		        "\x03\x00\x00\x00\x12\x00", 6, data, &len);
+		if (status || (len < 14))
+			throw std::runtime_error("REQUEST SENSE of LUN 0 failed");
+		if ((data[2] & 0x0F) != 0)
+			throw std::runtime_error("Sense of LUN 1 reported by LUN 0");
+
+		// REQUEST SENSE on LUN 1 : sense of the READ CAPACITY above
+		len = 18;
+		status = lun_command(usbdev, 1, 0xBABE0105,
+		        "\x03\x00\x00\x00\x12\x00", 6, data, &len);
+		if ((status1 != 0) && (len >= 14) && (data[12] != 0x25))
+			printf(" - LUN 1 sense ASC %.2X (LOGICAL UNIT NOT SUPPORTED expected)\n",
+			       data[12]);
+
+		// LUN 0 still answers the same capacity
+		len = 8;
+		status = lun_command(usbdev, 0, 0xBABE0106,
+		        "\x25\x00\x00\x00\x00\x00\x00\x00\x00\x00", 10, data, &len);
+		if (status || (len != 8) || memcmp(cap0, data, 8))
+			throw std::runtime_error("LUN 0 modified by commands of LUN 1");
+	}
+	catch(std::exception &e)
+	{
+		std::cout << "\x1B[1;31m" << e.what() << "\x1B[0m" << std::endl;
+		recovery(usbdev);
+		return(1);
+	}
+	std::cout << "\x1B[1;32m" << "Test LUN interleaving success"
+	          << "\x1B[0m" << std::endl;
+
+	return(0);
+}
 
 int test_recovery(UsbIf *usbdev)
 {
@@ -0,0 +1,1060 @@
+/**
+ * @file  tests/ut_ftl/main.c
+ * @brief Replay LBA traces through the flash translation layer
+ *
+ * Without argument, the FTL is tested (restart, unmap, power loss, garbage
+ * collection, wear leveling and read errors) then some traces are generated (FAT file
+ * copy, sequential and random writes). Trace files can also be given on
+ * command line, one command per line :
+ *   W <lba> <count>  WRITE(10) of <count> sectors
+ *   T <lba> <count>  UNMAP of <count> sectors
+ *   S                SYNCHRONIZE CACHE
+ *   I                Host idle (cache flushed, background work done)
+ *   # ...            Comment
+ *
+ * Each trace is replayed through the write cache with direct storage (each
+ * line rewritten at its place, see mem_write) and with the FTL. The write
+ * amplification (bytes programmed into flash for each byte written by the
+ * host), the erases and the throughput are reported. The flash is modeled
+ * with its busy time : erase and program run while next sectors are
+ * received, the host only waits when the cache or the FTL is busy.
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include <stdio.h>
+#include "types.h"
+#include "ftl.h"
+#include "mem.h"
+#include "volume.h"
+#include "wcache.h"
+
+#define SIM_SIZE    (8 * 1024 * 1024)
+#define SIM_SECTORS (SIM_SIZE / 4096)
+/* Traces must fit into the FTL (smaller than the volume) */
+#define SIM_LBA_MAX (6 * 1024 * 2)
+#define MAX_OPS     65536
+#define MAX_QUEUE   64
+
+/* Flash timings (typical values of MX25L51245G, SPI at 32MHz) */
+#define T_READ_BYTE   250      /* Read one byte           */
+#define T_ERASE       45000000 /* Erase one 4k sector     */
+#define T_PROGRAM     750000   /* Program one 256B page   */
+/* Time to receive one sector from host (Full-Speed bulk) */
+#define T_HOST_SECTOR 450000
+/* Period of the background work when the FTL needs room (10ms) */
+#define T_GC_PERIOD   10000000
+
+typedef unsigned long long sim_time;
+
+typedef struct trace_op_s
+{
+	char type;
+	u32  lba;
+	u32  count;
+} trace_op;
+
+typedef struct sim_report_s
+{
+	unsigned long erases;
+	unsigned long erase_max; /* Max erases of one flash sector */
+	unsigned long long programmed; /* Bytes programmed   */
+	unsigned long sectors;   /* Sectors written by host        */
+	unsigned long gc_copies;
+	sim_time ns;             /* Time seen by the host          */
+} sim_report;
+
+static u8  flash[SIM_SIZE];
+static u8  image[SIM_SIZE];
+static u16 erase_count[SIM_SECTORS];
+static u8  sector[512] __attribute__((aligned(4)));
+static u8  rd[4096] __attribute__((aligned(4)));
+static trace_op ops[MAX_OPS];
+static uint ops_count;
+static sim_report rep;
+static u32 seed;
+static int use_ftl;
+static mem_node       node;
+static mem_flash_chip chip;
+/* Queue of the flash chip, the first job is running */
+static mem_job  *queue[MAX_QUEUE];
+static uint      q_first, q_count;
+static sim_time  q_end;   /* End of the running job */
+static sim_time  now;
+static sim_time  gc_tm;   /* Time of the last background work */
+static int       cut;     /* Jobs done before power loss (-1 never) */
+static int       rd_fail; /* When set, flash reads fail */
+
+static int  run_trace(const char *name);
+static int  replay(int ftl, sim_report *report);
+static int  t_mount(void);
+static int  t_trim(void);
+static int  t_power(void);
+static int  t_gc(void);
+static int  t_wear(void);
+static int  t_read_error(void);
+static int  host_write(u32 lba, u32 count, uint seq);
+static int  host_sync(void);
+static void host_idle(void);
+static int  host_trim(u32 lba, u32 count);
+static int  verify(void);
+static int  sim_reset(int ftl);
+static void sim_restart(void);
+static void sim_poll(void);
+static void sim_wait(void);
+static void sim_cut(void);
+static sim_time job_time(mem_job *job);
+static void job_exec(mem_job *job);
+static int  load(const char *filename);
+static void gen_fat_copy(void);
+static void gen_sequential(void);
+static void gen_random(void);
+static void op_add(char type, u32 lba, u32 count);
+static u32  rnd(void);
+
+/**
+ * @brief Entry point of the program
+ *
+ * @param argc Number of arguments
+ * @param argv Array of arguments (trace files)
+ * @return integer Execution result returned to OS :p
+ */
+int main(int argc, char **argv)
+{
+	int i;
+
+	printf("--=={ Flash translation layer simulation }==--\n");
+
+	/* Replay trace files given on command line */
+	if (argc > 1)
+	{
+		for (i = 1; i < argc; i++)
+		{
+			if (load(argv[i]))
+				return(-1);
+			if (run_trace(argv[i]))
+				return(-1);
+		}
+		return(0);
+	}
+
+	if (t_mount())
+		return(-1);
+	if (t_trim())
+		return(-1);
+	if (t_power())
+		return(-1);
+	if (t_gc())
+		return(-1);
+	if (t_wear())
+		return(-1);
+	if (t_read_error())
+		return(-1);
+
+	gen_fat_copy();
+	if (run_trace("FAT copy (24 files of 24k)"))
+		return(-1);
+	gen_sequential();
+	if (run_trace("Sequential write (1MB)"))
+		return(-1);
+	gen_random();
+	if (run_trace("Random writes (4k and 512B)"))
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Replay the current trace with and without FTL and report results
+ *
+ * @param name Name of the trace
+ * @return integer Zero on success, other values are errors
+ */
+static int run_trace(const char *name)
+{
+	sim_report ref, ftl;
+	const sim_report *r;
+	uint i;
+
+	printf(" * Test trace \"%s\" (%d commands)\n", name, ops_count);
+
+	if (replay(0, &ref))
+		return(-1);
+	if (replay(1, &ftl))
+		return(-1);
+
+	for (i = 0; i < 2; i++)
+	{
+		r = i ? &ftl : &ref;
+		printf("    - %s : %5lu erases (max %lu per sector), WA %.2f, %.1f ms, %.1f kB/s\n",
+		       i ? "FTL   " : "Direct", r->erases, r->erase_max,
+		       (double)r->programmed / ((double)r->sectors * 512.0),
+		       (double)r->ns / 1000000.0,
+		       (double)r->sectors * 512.0 / ((double)r->ns / 1000000.0));
+	}
+	printf("    - FTL copied %lu pages during garbage collection\n", ftl.gc_copies);
+
+	/* Rewrites of metadata must not wear the same sectors */
+	if (ftl.erase_max > ref.erase_max)
+	{
+		printf("    - FTL increase the wear of flash sectors\n");
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Replay the current trace
+ *
+ * @param ftl    Use the FTL (else lines are rewritten at their place)
+ * @param report Pointer to a structure to store results
+ * @return integer Zero on success, other values are errors
+ */
+static int replay(int ftl, sim_report *report)
+{
+	uint i;
+
+	if (sim_reset(ftl))
+		return(-1);
+
+	for (i = 0; i < ops_count; i++)
+	{
+		if (ops[i].type == 'W')
+		{
+			if (host_write(ops[i].lba, ops[i].count, i))
+				return(-1);
+		}
+		else if (ops[i].type == 'T')
+		{
+			if (host_trim(ops[i].lba, ops[i].count))
+				return(-1);
+		}
+		else if (ops[i].type == 'S')
+		{
+			if (host_sync())
+				return(-1);
+		}
+		else
+			host_idle();
+	}
+	/* End of trace, cache flushed */
+	if (host_sync())
+		return(-1);
+	rep.ns = now;
+
+	if (verify())
+		return(-1);
+	rep.erase_max = 0;
+	for (i = 0; i < SIM_SECTORS; i++)
+	{
+		if (erase_count[i] > rep.erase_max)
+			rep.erase_max = erase_count[i];
+	}
+	if (ftl)
+		rep.gc_copies = ftl_get_stats()->gc_copies;
+	*report = rep;
+	return(0);
+}
+
+/**
+ * @brief Test that the map is rebuilt from flash on startup
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_mount(void)
+{
+	printf(" * Test restart (map rebuilt from segment summaries)\n");
+
+	if (sim_reset(1))
+		return(-1);
+	/* Some pages written twice : only the last copy is valid */
+	if (host_write(0, 64, 1) || host_write(8, 8, 2) || host_write(1003, 21, 3))
+		return(-1);
+	if (host_sync() || host_write(8, 3, 4) || host_sync())
+		return(-1);
+	printf("    - %lu pages written, ", (unsigned long)ftl_get_stats()->writes);
+
+	sim_restart();
+	printf("%d kB mounted\n", ftl_size() / 1024);
+	return(verify());
+}
+
+/**
+ * @brief Test that unmapped pages are read as zeros, even after restart
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_trim(void)
+{
+	printf(" * Test unmap of pages (also after restart)\n");
+
+	if (sim_reset(1))
+		return(-1);
+	if (host_write(0, 128, 1) || host_sync())
+		return(-1);
+	/* Partial pages at both ends stay mapped */
+	if (host_trim(4, 100))
+		return(-1);
+	if (verify())
+		return(-1);
+
+	sim_restart();
+	if (ftl_read(8 * 512, 4096, rd) != 4096)
+		return(-1);
+	printf("    - %d pages unmapped, first byte of unmapped page : %02x\n",
+	       (int)((100 - 4) / 8), rd[0]);
+	if (rd[0] != 0)
+		return(-1);
+	return(verify());
+}
+
+/**
+ * @brief Test power losses during the write of a page
+ *
+ * The write of a page is the program of data, then of its summary entry,
+ * then the clear of the entry of the old copy. After a power loss at each
+ * of these steps, the restart must give the old or the new data, never a
+ * mix of them.
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_power(void)
+{
+	const char *step[3] = {"data", "new entry", "old entry clear"};
+	uint i, k;
+
+	printf(" * Test power loss during page writes\n");
+
+	for (i = 0; i < 3; i++)
+	{
+		if (sim_reset(1))
+			return(-1);
+		if (host_write(16, 8, 1) || host_sync())
+			return(-1);
+		/* A full line is written without waiting (see wcache_write) */
+		if (host_write(16, 8, 2))
+			return(-1);
+		cut = (int)i + 1;
+		while (q_count)
+			sim_wait();
+		sim_cut();
+
+		sim_restart();
+		if (ftl_read(16 * 512, 4096, rd) != 4096)
+			return(-1);
+		/* Only the data of the new copy have been written */
+		if (i == 0)
+		{
+			for (k = 0; k < 4096; k++)
+				image[(16 * 512) + k] = (u8)(1 + ((16 * 512 + k) >> 9) * 7 + (k & 511));
+		}
+		printf("    - Power loss after %-15s : %s data\n", step[i], i ? "new" : "old");
+		if (verify())
+			return(-1);
+		/* Next writes must still work */
+		if (host_write(16, 8, 3) || host_sync() || verify())
+			return(-1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Test garbage collection with random overwrites of a full volume
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_gc(void)
+{
+	ftl_stats *st;
+	u32 pages;
+	uint i;
+
+	printf(" * Test garbage collection (random 4k writes, volume full)\n");
+
+	if (sim_reset(1))
+		return(-1);
+	st = ftl_get_stats();
+	pages = ftl_size() / 4096;
+	for (i = 0; i < pages; i++)
+	{
+		if (host_write(i * 8, 8, 1))
+			return(-1);
+	}
+	seed = 7;
+	for (i = 0; i < (pages * 3); i++)
+	{
+		if (host_write((rnd() % pages) * 8, 8, 2 + i))
+			return(-1);
+	}
+	if (host_sync())
+		return(-1);
+	printf("    - %lu writes, %lu pages copied, %lu segments erased, %lu delayed\n",
+	       (unsigned long)st->writes, (unsigned long)st->gc_copies,
+	       (unsigned long)st->erases, (unsigned long)st->busy);
+	if (st->gc_copies == 0)
+		return(-1);
+	if (verify())
+		return(-1);
+	/* And the map is still valid after restart */
+	sim_restart();
+	return(verify());
+}
+
+/**
+ * @brief Test static wear leveling (a few hot pages, volume mostly cold)
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_wear(void)
+{
+	uint emin, emax, i;
+	u32 pages;
+
+	printf(" * Test wear leveling (hot pages into a cold volume)\n");
+
+	if (sim_reset(1))
+		return(-1);
+	pages = ftl_size() / 4096;
+	for (i = 0; i < (pages * 9 / 10); i++)
+	{
+		if (host_write(i * 8, 8, 1))
+			return(-1);
+	}
+	for (i = 0; i < 40000; i++)
+	{
+		if (host_write((i % 4) * 8, 8, 2 + i))
+			return(-1);
+		if ((i % 64) == 63)
+			host_idle();
+	}
+	if (host_sync())
+		return(-1);
+	ftl_erase_range(&emin, &emax);
+	printf("    - Erases per segment from %d to %d, %lu segments moved\n",
+	       emin, emax, (unsigned long)ftl_get_stats()->wl_moves);
+	if ((ftl_get_stats()->wl_moves == 0) || ((emax - emin) > (2 * FTL_WL_DELTA)))
+		return(-1);
+	return(verify());
+}
+
+/**
+ * @brief Test that a line not loaded (read error) is never written
+ *
+ * A sector written into a new line needs the other sectors of the page
+ * (line fill), a transaction ended before the end of the line needs the
+ * sectors not written (late read). When these reads fail, the write must
+ * fail and the content of the page must not change.
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_read_error(void)
+{
+	u32 addr;
+	uint k;
+
+	printf(" * Test read errors of the FTL backend\n");
+
+	if (sim_reset(1))
+		return(-1);
+	if (host_write(0, 64, 1) || host_sync())
+		return(-1);
+
+	/* Line fill : one sector into a page already written */
+	addr = 9 * 512;
+	for (k = 0; k < 512; k++)
+		sector[k] = (u8)(0xA5 ^ k);
+	rd_fail = 1;
+	wcache_prepare(addr, 512);
+	if (wcache_write(addr, sector) != -1)
+		goto err_write;
+	wcache_prepare(0, 0);
+	rd_fail = 0;
+	if (host_sync() || verify())
+		return(-1);
+
+	/* Late read : transaction of a full line ended after one sector */
+	addr = 16 * 512;
+	wcache_prepare(addr, 4096);
+	if (wcache_write(addr, sector))
+		goto err_write;
+	wcache_prepare(0, 0);
+	rd_fail = 1;
+	if (wcache_flush(WCACHE_FLUSH_ALL) != -1)
+		goto err_write;
+	rd_fail = 0;
+	for (k = 0; k < 512; k++)
+		image[addr + k] = sector[k];
+	if (host_sync() || verify())
+		return(-1);
+	printf("    - Lines with read errors rejected, not written (ok)\n");
+	return(0);
+
+err_write:
+	rd_fail = 0;
+	printf("    - Write accepted with a read error\n");
+	return(-1);
+}
+
+/**
+ * @brief Write sectors, as the default LUN for a WRITE command
+ *
+ * @param lba   Address of the first sector
+ * @param count Number of sectors
+ * @param seq   Sequence number of the command (used for data pattern)
+ * @return integer Zero on success, other values are errors
+ */
+static int host_write(u32 lba, u32 count, uint seq)
+{
+	u32 addr;
+	uint j, k;
+	int result;
+
+	wcache_prepare(lba * 512, count * 512);
+	for (j = 0; j < count; j++)
+	{
+		addr = (lba + j) * 512;
+		for (k = 0; k < 512; k++)
+		{
+			sector[k] = (u8)(seq + (addr >> 9) * 7 + k);
+			image[addr + k] = sector[k];
+		}
+		now += T_HOST_SECTOR;
+		sim_poll();
+		/* Background work posted by periodic (see default_periodic) */
+		if (use_ftl && ftl_pending() && ((now - gc_tm) > T_GC_PERIOD))
+		{
+			gc_tm = now;
+			ftl_gc(0);
+		}
+		/* Cache or FTL busy, the host wait */
+		while ((result = wcache_write(addr, sector)) == WCACHE_BUSY)
+		{
+			if (q_count)
+				sim_wait();
+			else if ((use_ftl == 0) || (ftl_gc(0) == 0))
+			{
+				printf("    - Write blocked at %08x\n", addr);
+				return(-1);
+			}
+		}
+		if (result)
+		{
+			printf("    - Write error at %08x\n", addr);
+			return(-1);
+		}
+		rep.sectors++;
+	}
+	/* End of command (see default_lun_wr_complete) */
+	wcache_prepare(0, 0);
+	wcache_flush(WCACHE_FLUSH_FULL);
+	return(0);
+}
+
+/**
+ * @brief Write all the modified lines and wait the end of writes
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int host_sync(void)
+{
+	int result;
+
+	while ((result = wcache_flush(WCACHE_FLUSH_ALL)) == WCACHE_BUSY)
+	{
+		if (q_count)
+			sim_wait();
+		else if ((use_ftl == 0) || (ftl_gc(0) == 0))
+		{
+			printf("    - Flush blocked\n");
+			return(-1);
+		}
+	}
+	while (q_count)
+		sim_wait();
+	return(result);
+}
+
+/**
+ * @brief Host idle : cache written then FTL background work
+ *
+ * The time of idle periods is not counted into the host time.
+ */
+static void host_idle(void)
+{
+	sim_time t;
+	uint i;
+
+	host_sync();
+	t = now;
+	for (i = 0; use_ftl && (i < 4096); i++)
+	{
+		if (ftl_gc(1) == 0)
+			break;
+		while (q_count)
+			sim_wait();
+	}
+	now = t;
+	q_end = t;
+}
+
+/**
+ * @brief Unmap sectors, as the default LUN for an UNMAP command
+ *
+ * Without FTL, the free sectors map of mem is not simulated : the cache is
+ * only written so the content stays the same.
+ *
+ * @param lba   Address of the first sector
+ * @param count Number of sectors
+ * @return integer Zero on success, other values are errors
+ */
+static int host_trim(u32 lba, u32 count)
+{
+	u32 first, end, i;
+
+	if (use_ftl == 0)
+		return(host_sync());
+
+	wcache_discard(lba * 512, count * 512);
+	ftl_trim(lba * 512, count * 512);
+	/* Only complete pages are unmapped */
+	first = ((lba * 512) + 4095) & ~(u32)4095;
+	end   = ((lba + count) * 512) & ~(u32)4095;
+	for (i = first; i < end; i++)
+		image[i] = 0;
+	return(0);
+}
+
+/**
+ * @brief Verify that data read (cache then flash or FTL) are the host image
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int verify(void)
+{
+	u32 addr, end;
+	uint k;
+	int n;
+
+	end = use_ftl ? ftl_size() : SIM_SIZE;
+	for (addr = 0; addr < end; addr += 4096)
+	{
+		n = wcache_read(addr, 4096, rd);
+		if (n < 0)
+			n = 0;
+		if (use_ftl)
+			ftl_read(addr + (u32)n, 4096 - (uint)n, rd + n);
+		else
+			mem_read(0, addr + (u32)n, 4096 - (uint)n, rd + n);
+		for (k = 0; k < 4096; k++)
+		{
+			if (rd[k] != image[addr + k])
+			{
+				printf("    - Content error at %08x\n", addr + k);
+				return(-1);
+			}
+		}
+	}
+	return(0);
+}
+
+/**
+ * @brief Reset simulated flash, host image and counters
+ *
+ * The flash contains old data (a device already used), so direct writes
+ * need erases. With the FTL, the flash is formatted (all segments erased)
+ * before the counters are cleared, as after a long idle period.
+ *
+ * @param ftl Use the FTL
+ * @return integer Zero on success, other values are errors
+ */
+static int sim_reset(int ftl)
+{
+	const u8 nids[1] = {0};
+	uint i;
+
+	seed = 3;
+	for (i = 0; i < SIM_SIZE; i++)
+	{
+		flash[i] = (u8)rnd();
+		image[i] = ftl ? 0 : flash[i];
+	}
+	q_count = 0;
+	now     = 0;
+	q_end   = 0;
+	gc_tm   = 0;
+	cut     = -1;
+	rd_fail = 0;
+	use_ftl = ftl;
+
+	node.type   = 1;
+	node.chip   = &chip;
+	chip.size   = SIM_SIZE / 1024;
+	volume_init(VOLUME_SPAN, nids, 1, VOLUME_UNIT_SZ);
+	wcache_init(0, WCACHE_WAYS);
+	wcache_map(volume_map);
+	if (ftl)
+	{
+		wcache_backend(ftl_read, ftl_submit);
+		if (ftl_init())
+			return(-1);
+		while (ftl_gc(1))
+			sim_wait();
+		ftl_init();
+	}
+
+	for (i = 0; i < SIM_SECTORS; i++)
+		erase_count[i] = 0;
+	rep.erases     = 0;
+	rep.programmed = 0;
+	rep.sectors    = 0;
+	rep.gc_copies  = 0;
+	now   = 0;
+	q_end = 0;
+	return(0);
+}
+
+/**
+ * @brief Restart the device : cache is lost and the FTL is mounted again
+ *
+ */
+static void sim_restart(void)
+{
+	wcache_init(0, WCACHE_WAYS);
+	wcache_map(volume_map);
+	wcache_backend(ftl_read, ftl_submit);
+	if (ftl_init())
+		printf("    - Mount failed\n");
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                            Trace sources                             -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Load a trace file
+ *
+ * @param filename Name of the file to load
+ * @return integer Zero on success, other values are errors
+ */
+static int load(const char *filename)
+{
+	char line[128];
+	unsigned long lba, count;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == 0)
+	{
+		printf(" * Failed to open %s\n", filename);
+		return(-1);
+	}
+	ops_count = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		if (((line[0] == 'W') || (line[0] == 'T')) &&
+		    (sscanf(line + 1, "%lu %lu", &lba, &count) == 2))
+		{
+			if ((lba + count) > SIM_LBA_MAX)
+			{
+				printf(" * %s: access out of simulated volume\n", filename);
+				fclose(f);
+				return(-1);
+			}
+			op_add(line[0], (u32)lba, (u32)count);
+		}
+		else if ((line[0] == 'S') || (line[0] == 'I'))
+			op_add(line[0], 0, 0);
+	}
+	fclose(f);
+	return(0);
+}
+
+/**
+ * @brief Generate a trace of files copied on a FAT16 volume
+ *
+ * For each file the host update the directory entry, write data clusters
+ * (up to 32 sectors per command), then update both FAT copies and the
+ * directory entry again.
+ */
+static void gen_fat_copy(void)
+{
+	const u32 fat1 = 1, fat2 = 65, root = 129, data = 161;
+	u32 cluster = 0;
+	uint f, s;
+
+	ops_count = 0;
+	for (f = 0; f < 24; f++)
+	{
+		op_add('W', root + (f / 16), 1);
+		for (s = 0; s < 48; s += 32)
+			op_add('W', data + cluster * 4 + s, (48 - s) > 32 ? 32 : (48 - s));
+		op_add('W', fat1 + (cluster / 256), 1);
+		op_add('W', fat2 + (cluster / 256), 1);
+		op_add('W', root + (f / 16), 1);
+		cluster += 12;
+	}
+	op_add('S', 0, 0);
+}
+
+/**
+ * @brief Generate a sequential write of 1MB (128 sectors per command)
+ *
+ */
+static void gen_sequential(void)
+{
+	uint i;
+
+	ops_count = 0;
+	for (i = 0; i < 16; i++)
+		op_add('W', 4096 + i * 128, 128);
+}
+
+/**
+ * @brief Generate random writes (4k and 512 bytes) into a small area
+ *
+ */
+static void gen_random(void)
+{
+	uint i;
+
+	seed = 1;
+	ops_count = 0;
+	for (i = 0; i < 512; i++)
+	{
+		if (rnd() & 1)
+			op_add('W', (rnd() % 16) * 8, 8);
+		else
+			op_add('W', rnd() % 128, 1);
+		if ((i % 64) == 63)
+			op_add('I', 0, 0);
+	}
+}
+
+static void op_add(char type, u32 lba, u32 count)
+{
+	if (ops_count >= MAX_OPS)
+		return;
+	ops[ops_count].type  = type;
+	ops[ops_count].lba   = lba;
+	ops[ops_count].count = count;
+	ops_count++;
+}
+
+static u32 rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return((seed >> 16) & 0x7FFF);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                     Simulated memory (NOR flash)                     -- */
+/* -------------------------------------------------------------------------- */
+
+/* Complete the jobs that are done at the current time */
+static void sim_poll(void)
+{
+	mem_job *job;
+
+	while (q_count && (q_end <= now))
+	{
+		job = queue[q_first];
+		q_first = (q_first + 1) % MAX_QUEUE;
+		q_count--;
+		if (cut == 0)
+			continue;
+		if (cut > 0)
+			cut--;
+		job_exec(job);
+		/* Start the next job (may have been queued by callback) */
+		if (q_count)
+			q_end += job_time(queue[q_first]);
+		job->state = MEM_JOB_DONE;
+		if (job->complete)
+			job->complete(job);
+	}
+}
+
+/* Wait the end of the running job */
+static void sim_wait(void)
+{
+	if (q_count == 0)
+		return;
+	if (q_end > now)
+		now = q_end;
+	sim_poll();
+}
+
+/* Power loss : jobs not yet done are lost */
+static void sim_cut(void)
+{
+	q_count = 0;
+	cut = -1;
+}
+
+static sim_time job_time(mem_job *job)
+{
+	if (job->type == MEM_JOB_ERASE)
+		return(T_ERASE);
+	if (job->type == MEM_JOB_UPDATE)
+		return((sim_time)4096 * T_READ_BYTE + T_ERASE + 16 * T_PROGRAM);
+	return((sim_time)((job->len + 255) / 256) * T_PROGRAM);
+}
+
+/* Apply a job to the flash content (see mem.c for the update planner) */
+static void job_exec(mem_job *job)
+{
+	uint i, p, changed;
+	int erase = 0;
+
+	if (job->type == MEM_JOB_UPDATE)
+	{
+		for (i = 0; i < job->len; i++)
+		{
+			if ((flash[job->addr + i] & job->buffer[i]) != job->buffer[i])
+				erase = 1;
+		}
+	}
+	if ((job->type == MEM_JOB_ERASE) || erase)
+	{
+		for (i = 0; i < 4096; i++)
+			flash[job->addr + i] = 0xFF;
+		erase_count[job->addr / 4096]++;
+		rep.erases++;
+	}
+	if (job->type == MEM_JOB_ERASE)
+		return;
+	/* Only modified pages are programmed */
+	for (p = 0; p < job->len; p += 256)
+	{
+		changed = 0;
+		for (i = p; (i < job->len) && (i < (p + 256)); i++)
+		{
+			if (flash[job->addr + i] != job->buffer[i])
+				changed = 1;
+			flash[job->addr + i] &= job->buffer[i];
+		}
+		if (changed || (job->type != MEM_JOB_UPDATE))
+			rep.programmed += (i - p);
+	}
+}
+
+mem_node *mem_get_node(uint nid)
+{
+	if (nid != 0)
+		return(0);
+	return(&node);
+}
+
+int mem_read(uint nid, u32 addr, uint len, u8 *buffer)
+{
+	uint i;
+
+	if ((nid != 0) || ((addr + len) > SIM_SIZE))
+		return(0);
+	if (rd_fail)
+		return(-1);
+	/* Wait the end of running erase/program */
+	while (q_count)
+		sim_wait();
+	for (i = 0; i < len; i++)
+		buffer[i] = flash[addr + i];
+	now += (sim_time)len * T_READ_BYTE;
+	return((int)len);
+}
+
+int mem_read_start(uint nid, u32 addr, uint len, u8 *buffer)
+{
+	if (mem_read(nid, addr, len, buffer) != (int)len)
+		return(-1);
+	return(0);
+}
+
+int mem_read_wait(uint nid)
+{
+	(void)nid;
+	return(0);
+}
+
+int mem_submit(uint nid, mem_job *job)
+{
+	if ((nid != 0) || ((job->addr + job->len) > SIM_SIZE) || (q_count >= MAX_QUEUE))
+		return(-1);
+	job->result = 0;
+	job->state  = MEM_JOB_PENDING;
+	queue[(q_first + q_count) % MAX_QUEUE] = job;
+	q_count++;
+	if (q_count == 1)
+		q_end = now + job_time(job);
+	return(0);
+}
+
+int mem_program(uint nid, u32 addr, uint len, u8 *buffer)
+{
+	mem_job job;
+
+	if ((nid != 0) || ((addr + len) > SIM_SIZE))
+		return(-1);
+	/* Queued jobs are done first */
+	while (q_count)
+		sim_wait();
+	job.type   = MEM_JOB_PROGRAM;
+	job.addr   = addr;
+	job.len    = len;
+	job.buffer = buffer;
+	job_exec(&job);
+	now += job_time(&job);
+	return(0);
+}
+
+int mem_trim(uint nid, u32 addr, uint len)
+{
+	(void)nid;
+	(void)addr;
+	(void)len;
+	return(0);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                 Dummy functions to avoid missing deps                -- */
+/* -------------------------------------------------------------------------- */
+
+void log_print(uint level, const char *s, ...)
+{
+	(void)level;
+	(void)s;
+}
+
+void *memcpy(void *dst, const void *src, int n)
+{
+	u8 *d = (u8 *)dst;
+	const u8 *s = (const u8 *)src;
+	while (n-- > 0)
+		*d++ = *s++;
+	return(dst);
+}
+
+void *memset(void *dst, int value, int n)
+{
+	u8 *d = (u8 *)dst;
+	while (n-- > 0)
+		*d++ = (u8)value;
+	return(dst);
+}
+
+void memcpy_pma(u8 *dst, const u8 *src, unsigned int len)
+{
+	memcpy(dst, src, (int)len);
+}
+
+void memset_pma(u8 *dst, int value, unsigned int len)
+{
+	memset(dst, value, (int)len);
+}
+/* EOF */
@@ -0,0 +1,425 @@
+/**
+ * @file  tests/ut_libc/main.c
+ * @brief Unit tests and benchmark of the libc memory functions
+ *
+ * The memory functions copy by 32 bits words when possible, with bytes for
+ * the head and tail of buffers. Each function is tested with all the
+ * alignments of source and destination and many lengths, and bytes around
+ * the destination are checked. A benchmark compares the time of the word
+ * functions to the original byte loops (host time, not target cycles).
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include <stdio.h>
+#include <time.h>
+#include "libc.h"
+#include "types.h"
+
+#define MAX_LEN 100
+#define GUARD   8
+#define BUF_SZ  (GUARD + 4 + MAX_LEN + GUARD)
+#define FILL    0xA5
+
+#define BENCH_LEN   512
+#define BENCH_LOOPS 20000
+#define BENCH_RUNS  5
+
+static u8 src_buf[BUF_SZ] __attribute__((aligned(4)));
+static u8 dst_buf[BUF_SZ] __attribute__((aligned(4)));
+static u8 bench_src[BENCH_LEN + 4] __attribute__((aligned(4)));
+static u8 bench_dst[BENCH_LEN + 4] __attribute__((aligned(4)));
+
+static int  t_memcpy(void);
+static int  t_memset(void);
+static int  t_memmove(void);
+static int  t_memcmp(void);
+static int  t_bench(void);
+static int  check_area(const u8 *ref, uint start, uint len, const char *name);
+static double bench_run(int fn, uint doff, uint soff, uint len);
+static void *ref_memcpy(void *dst, const void *src, int n);
+static void *ref_memset(void *dst, int value, int n);
+
+/**
+ * @brief Entry point of the program
+ *
+ * @return integer Execution result returned to OS :p
+ */
+int main(void)
+{
+	printf("--=={ Libc memory functions tests }==--\n");
+
+	if (t_memcpy())
+		return(-1);
+	if (t_memset())
+		return(-1);
+	if (t_memmove())
+		return(-1);
+	if (t_memcmp())
+		return(-1);
+	if (t_bench())
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Test memcpy with all alignments and lengths
+ *
+ * @return integer Zero on success, -1 on error
+ */
+static int t_memcpy(void)
+{
+	uint da, sa, len, i;
+	void *r;
+
+	printf(" * Test memcpy\n");
+
+	for (i = 0; i < BUF_SZ; i++)
+		src_buf[i] = (u8)(i * 7 + 3);
+
+	for (da = 0; da < 4; da++)
+	for (sa = 0; sa < 4; sa++)
+	for (len = 0; len <= MAX_LEN; len++)
+	{
+		for (i = 0; i < BUF_SZ; i++)
+			dst_buf[i] = FILL;
+		r = memcpy(dst_buf + GUARD + da, src_buf + GUARD + sa, (int)len);
+		if (r != dst_buf + GUARD + da)
+		{
+			printf("    - Bad pointer returned\n");
+			return(-1);
+		}
+		if (check_area(src_buf + GUARD + sa, GUARD + da, len, "memcpy"))
+		{
+			printf("    - dst+%d src+%d length %d\n", da, sa, len);
+			return(-1);
+		}
+	}
+	printf("    - All alignments, 0 to %d bytes (ok)\n", MAX_LEN);
+	return(0);
+}
+
+/**
+ * @brief Test memset with all alignments and lengths
+ *
+ * @return integer Zero on success, -1 on error
+ */
+static int t_memset(void)
+{
+	u8  ref[MAX_LEN];
+	uint da, len, i;
+	void *r;
+
+	printf(" * Test memset\n");
+
+	/* Only the low byte of the value is used */
+	for (i = 0; i < MAX_LEN; i++)
+		ref[i] = 0x3C;
+
+	for (da = 0; da < 4; da++)
+	for (len = 0; len <= MAX_LEN; len++)
+	{
+		for (i = 0; i < BUF_SZ; i++)
+			dst_buf[i] = FILL;
+		r = memset(dst_buf + GUARD + da, 0x713C, (int)len);
+		if (r != dst_buf + GUARD + da)
+		{
+			printf("    - Bad pointer returned\n");
+			return(-1);
+		}
+		if (check_area(ref, GUARD + da, len, "memset"))
+		{
+			printf("    - dst+%d length %d\n", da, len);
+			return(-1);
+		}
+	}
+	printf("    - All alignments, 0 to %d bytes (ok)\n", MAX_LEN);
+	return(0);
+}
+
+/**
+ * @brief Test memmove with overlapping buffers (both directions)
+ *
+ * @return integer Zero on success, -1 on error
+ */
+static int t_memmove(void)
+{
+	u8  ref[MAX_LEN];
+	uint sa, len, i;
+	int  shift;
+	void *r;
+
+	printf(" * Test memmove\n");
+
+	for (shift = -20; shift <= 20; shift++)
+	for (sa = 0; sa < 4; sa++)
+	for (len = 0; len <= MAX_LEN - 20; len++)
+	{
+		/* Source and destination into the same buffer */
+		for (i = 0; i < BUF_SZ; i++)
+			dst_buf[i] = (u8)(i * 7 + 3);
+		for (i = 0; i < len; i++)
+			ref[i] = dst_buf[GUARD + 20 + sa + i];
+		for (i = 0; i < BUF_SZ; i++)
+			src_buf[i] = dst_buf[i];
+
+		r = memmove(dst_buf + GUARD + 20 + (int)sa + shift,
+		            dst_buf + GUARD + 20 + sa, (int)len);
+		if (r != dst_buf + GUARD + 20 + (int)sa + shift)
+		{
+			printf("    - Bad pointer returned\n");
+			return(-1);
+		}
+		/* Bytes outside destination must be unchanged (old content) */
+		for (i = 0; i < BUF_SZ; i++)
+		{
+			uint start = (uint)(GUARD + 20 + (int)sa + shift);
+			u8 expected;
+			if ((i >= start) && (i < start + len))
+				expected = ref[i - start];
+			else
+				expected = src_buf[i];
+			if (dst_buf[i] != expected)
+			{
+				printf("    - memmove: shift %d src+%d length %d, "
+				       "byte %d is %.2X, expected %.2X\n",
+				       shift, sa, len, i, dst_buf[i], expected);
+				return(-1);
+			}
+		}
+	}
+	printf("    - Overlaps of -20 to +20 bytes (ok)\n");
+	return(0);
+}
+
+/**
+ * @brief Test memcmp with all alignments, lengths and difference positions
+ *
+ * @return integer Zero on success, -1 on error
+ */
+static int t_memcmp(void)
+{
+	uint da, sa, len, i;
+	u8  *p1, *p2;
+	int  r, sign;
+
+	printf(" * Test memcmp\n");
+
+	for (i = 0; i < BUF_SZ; i++)
+		src_buf[i] = (u8)(i * 7 + 3);
+
+	for (da = 0; da < 4; da++)
+	for (sa = 0; sa < 4; sa++)
+	for (len = 0; len <= MAX_LEN; len++)
+	{
+		p1 = src_buf + GUARD + sa;
+		p2 = dst_buf + GUARD + da;
+		for (i = 0; i < BUF_SZ; i++)
+			dst_buf[i] = FILL;
+		for (i = 0; i < len; i++)
+			p2[i] = p1[i];
+
+		if (memcmp(p1, p2, (int)len) != 0)
+		{
+			printf("    - Equal buffers differ, length %d\n", len);
+			return(-1);
+		}
+		/* Change one byte, and the last one with the opposite sign to
+		 * verify that the first difference is used */
+		for (i = 0; i < len; i++)
+		{
+			p2[i] = (u8)(p1[i] + 0x41);
+			sign  = (p1[i] < p2[i]) ? -1 : 1;
+			if (i + 1 < len)
+				p2[len - 1] = (sign < 0) ? 0x00 : 0xFF;
+			r = memcmp(p1, p2, (int)len);
+			if (((r * sign) <= 0) || ((memcmp(p2, p1, (int)len) * sign) >= 0))
+			{
+				printf("    - dst+%d src+%d length %d, byte %d "
+				       "difference not found (%d)\n",
+				       da, sa, len, i, r);
+				return(-1);
+			}
+			p2[i] = p1[i];
+			p2[len - 1] = p1[len - 1];
+		}
+	}
+	/* Bytes are compared as unsigned */
+	src_buf[0] = 0x80;
+	dst_buf[0] = 0x01;
+	if (memcmp(src_buf, dst_buf, 1) <= 0)
+	{
+		printf("    - Bytes compared as signed values\n");
+		return(-1);
+	}
+	printf("    - All alignments, 0 to %d bytes (ok)\n", MAX_LEN);
+	return(0);
+}
+
+/**
+ * @brief Compare the time of memcpy and memset to the byte loops
+ *
+ * The measure is done on host, this is only a relative result : on the
+ * Cortex-M0+ one byte costs a load and a store (4 cycles) plus the loop,
+ * one block of 16 bytes costs one ldm and one stm (10 cycles) plus the loop.
+ *
+ * @return integer Zero on success, -1 on error
+ */
+static int t_bench(void)
+{
+	const char *names[4] = {
+		"memcpy aligned",
+		"memcpy src+1  ",
+		"memcpy dst+3  ",
+		"memset        "
+	};
+	const uint offsets[4][2] = { {0, 0}, {0, 1}, {3, 0}, {0, 0} };
+	double ref_t, new_t;
+	uint i;
+
+	printf(" * Benchmark (%d bytes, host time)\n", BENCH_LEN);
+
+	for (i = 0; i < sizeof(bench_src); i++)
+		bench_src[i] = (u8)i;
+
+	for (i = 0; i < 4; i++)
+	{
+		ref_t = bench_run((i == 3) ? 2 : 0, offsets[i][0], offsets[i][1], BENCH_LEN);
+		new_t = bench_run((i == 3) ? 3 : 1, offsets[i][0], offsets[i][1], BENCH_LEN);
+		printf("    - %s: bytes %6.1f ns, words %6.1f ns (x%.1f)\n",
+		       names[i], ref_t, new_t, ref_t / new_t);
+		/* Word copy must never be slower than the byte loop */
+		if (new_t >= ref_t)
+		{
+			printf("    - Word function slower than bytes\n");
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                                                                      -- */
+/* --                          Private  functions                          -- */
+/* --                                                                      -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Verify the destination buffer after a copy or a fill
+ *
+ * @param ref   Pointer to the expected data
+ * @param start Offset of the first byte written into dst_buf
+ * @param len   Number of bytes written
+ * @param name  Name of the tested function (for error message)
+ * @return integer Zero if valid, -1 on error
+ */
+static int check_area(const u8 *ref, uint start, uint len, const char *name)
+{
+	uint i;
+
+	for (i = 0; i < BUF_SZ; i++)
+	{
+		if ((i >= start) && (i < start + len))
+		{
+			if (dst_buf[i] == ref[i - start])
+				continue;
+			printf("    - %s: byte %d is %.2X, expected %.2X\n",
+			       name, i - start, dst_buf[i], ref[i - start]);
+			return(-1);
+		}
+		if (dst_buf[i] != FILL)
+		{
+			printf("    - %s: byte %d outside buffer modified\n",
+			       name, (int)i - (int)start);
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+/**
+ * @brief Measure the time of one function (best of some runs)
+ *
+ * @param fn   Function to measure (0:ref_memcpy 1:memcpy 2:ref_memset 3:memset)
+ * @param doff Offset of the destination
+ * @param soff Offset of the source
+ * @param len  Number of bytes of each call
+ * @return double Time of one call, in nanoseconds
+ */
+static double bench_run(int fn, uint doff, uint soff, uint len)
+{
+	struct timespec t0, t1;
+	double t, best = 0;
+	uint run, i;
+
+	for (run = 0; run < BENCH_RUNS; run++)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (i = 0; i < BENCH_LOOPS; i++)
+		{
+			if (fn == 0)
+				ref_memcpy(bench_dst + doff, bench_src + soff, (int)len);
+			else if (fn == 1)
+				memcpy(bench_dst + doff, bench_src + soff, (int)len);
+			else if (fn == 2)
+				ref_memset(bench_dst + doff, (int)i, (int)len);
+			else
+				memset(bench_dst + doff, (int)i, (int)len);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		t  = (double)(t1.tv_sec - t0.tv_sec) * 1e9;
+		t += (double)(t1.tv_nsec - t0.tv_nsec);
+		t /= BENCH_LOOPS;
+		if ((run == 0) || (t < best))
+			best = t;
+	}
+	return(best);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                                                                      -- */
+/* --                         Reference  functions                         -- */
+/* --                                                                      -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Byte copy (previous libc memcpy), reference for benchmark
+ *
+ */
+static void *ref_memcpy(void *dst, const void *src, int n)
+{
+	u8 *s = (u8 *)src;
+	u8 *d = (u8 *)dst;
+
+	while (n)
+	{
+		*d++ = *s++;
+		n--;
+	}
+	return(dst);
+}
+
+/**
+ * @brief Byte fill (previous libc memset), reference for benchmark
+ *
+ */
+static void *ref_memset(void *dst, int value, int n)
+{
+	u8 *d = (u8 *)dst;
+
+	while (n)
+	{
+		*d++ = (u8)value;
+		n--;
+	}
+	return(dst);
+}
+/* EOF */
@@ -0,0 +1,65 @@
+/**
+ * @file  tests/ut_mem/hardware.h
+ * @brief Alternative hardware definition file to compile firmware modules
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef HARDWARE_H
+#define HARDWARE_H
+#include "types.h"
+
+/* Same peripheral addresses as the real chip, decoded by sim_regs.c */
+#define DMA1   0x40020000
+#define DMAMUX 0x40020800
+#define RCC    0x40021000
+#define SPI2   0x40003800
+#define SPI1   0x40013000
+#define GPIOA  0x50000000
+#define GPIOB  0x50000400
+#define USB_R1 0x40009800
+
+#define CM0_NVIC    0xE000E100
+
+#define GPIO_BSRR(x)    (x + 0x18)
+
+#define RCC_AHBENR    (RCC + 0x38)
+#define RCC_APBENR1   (RCC + 0x3C)
+#define RCC_APBENR2   (RCC + 0x40)
+
+#define DMA_ISR(x)      (x + 0x00)
+#define DMA_IFCR(x)     (x + 0x04)
+#define DMA_CCR(x, c)   (x + 0x08 + (20 * ((c) - 1)))
+#define DMA_CNDTR(x, c) (x + 0x0C + (20 * ((c) - 1)))
+#define DMA_CPAR(x, c)  (x + 0x10 + (20 * ((c) - 1)))
+#define DMA_CMAR(x, c)  (x + 0x14 + (20 * ((c) - 1)))
+
+#define DMAMUX_CCR(c)   (DMAMUX + (4 * ((c) - 1)))
+
+/* Clock of the simulated peripherals (see sim.h) */
+u32  hw_get_pclk(void);
+
+/* Register accesses are routed to the simulated peripherals */
+void reg_wr  (u32 addr, u32 value);
+void reg16_wr(u32 addr, u16 value);
+void reg8_wr (u32 addr, u8  value);
+u32  reg_rd  (u32 addr);
+u16  reg16_rd(u32 addr);
+u8   reg8_rd (u32 addr);
+void reg_clr  (u32 addr, u32 value);
+void reg16_clr(u32 addr, u16 value);
+void reg8_clr (u32 addr, u8  value);
+void reg_set  (u32 addr, u32 value);
+void reg16_set(u32 addr, u16 value);
+void reg8_set (u32 addr, u8  value);
+
+#endif
+/* EOF */
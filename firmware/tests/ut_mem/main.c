@@ -0,0 +1,1447 @@
+/**
+ * @file  tests/ut_mem/main.c
+ * @brief Entry point of the mem (and spi dma) unit-test program
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include <stdio.h>
+#include <sys/mman.h>
+#include "hardware.h"
+#include "types.h"
+#include "mem.h"
+#include "spi.h"
+#include "time.h"
+#include "sim.h"
+
+static sim_flash flash1, flash3;
+static u8 buffer[4096 + 16];
+static uint cb_channel;
+static uint cb_count;
+static uint work_posts;
+static u32  sim_ms; /* Current time (see time_now) */
+static mem_job *job_order[4];
+static uint job_count;
+
+/* Declare subtests functions */
+static int t_detect(void);
+static int t_read_cmd(void);
+static int t_read(uint nid, u32 addr, uint len);
+static int t_read_cache(uint nid, u32 addr);
+static int t_read_pma(uint nid, u32 addr, uint len);
+static int t_read_stream(uint nid, u32 addr);
+static int t_read_background(uint nid, u32 addr);
+static int t_write(uint nid, u32 addr);
+static int t_planner(uint nid, u32 addr);
+static int planner_step(uint nid, u32 addr, uint len, uint erases, uint programs);
+static int t_async(uint nid, u32 addr);
+static int t_trim(uint nid, u32 addr);
+static int t_preerase(uint nid, u32 addr);
+static void job_complete(mem_job *job);
+static int t_dma_status(void);
+static int t_budget(void);
+static int t_bus(void);
+static int t_block(void);
+static int t_speed(void);
+static int t_stall(void);
+static int t_timeout(uint nid, u32 addr);
+
+static void pattern(sim_flash *flash, u8 seed);
+static int  check(sim_flash *flash, u32 addr, const u8 *data, uint len);
+
+/**
+ * @brief Entry point of the program
+ *
+ * @return integer Execution result returned to OS :p
+ */
+int main(void)
+{
+	int result = -1;
+
+	printf("--=={ Mem unit-test }==--\n");
+
+	sim_regs_init();
+	sim_flash_init(&flash1, 0xC2, 0x201A, 0x4000000);
+	sim_flash_init(&flash3, 0x9D, 0x6018, 0x1000000);
+	sim_regs_attach(1, &flash1);
+	sim_regs_attach(3, &flash3);
+	pattern(&flash1, 0x11);
+	pattern(&flash3, 0x5A);
+
+	spi_init();
+	mem_init();
+
+	if (t_detect())
+		goto end;
+	if (t_read_cmd())
+		goto end;
+	/* Small reads use polled SPI, large reads use DMA */
+	if (t_read(0, 0x000100, 16))
+		goto end;
+	if (t_read(0, 0x000100, MEM_DMA_THRESHOLD - 1))
+		goto end;
+	if (t_read(0, 0x012345, MEM_DMA_THRESHOLD))
+		goto end;
+	if (t_read(2, 0x7FF001, 40))
+		goto end;
+	if (t_read(2, 0x7FF001, 4095))
+		goto end;
+	if (t_read(2, 0xFFF000, 4096))
+		goto end;
+	/* Above 16MB : 4 bytes address commands */
+	if (t_read(0, 0x1000100, 16))
+		goto end;
+	if (t_read(0, 0x3FFF000, 4096))
+		goto end;
+	if (t_read_cache(0, 0x123456))
+		goto end;
+	/* USB packet memory : no DMA, 32 bits writes */
+	if (t_read_pma(0, 0x010040, 64))
+		goto end;
+	if (t_read_pma(2, 0x7FF001, 62))
+		goto end;
+	if (t_read_stream(0, 0x010200))
+		goto end;
+	if (t_read_background(0, 0x100000))
+		goto end;
+	if (t_write(2, 0x040000))
+		goto end;
+	if (t_write(0, 0x2040000))
+		goto end;
+	if (t_planner(0, 0x080000))
+		goto end;
+	if (t_async(0, 0x0A0000))
+		goto end;
+	if (t_trim(2, 0x0C0000))
+		goto end;
+	if (t_preerase(0, 0x0E0000))
+		goto end;
+	if (t_dma_status())
+		goto end;
+	if (t_budget())
+		goto end;
+	if (t_bus())
+		goto end;
+	if (t_block())
+		goto end;
+	if (t_speed())
+		goto end;
+	if (t_stall())
+		goto end;
+	if (t_timeout(2, 0x0F0000))
+		goto end;
+	if (flash1.n_error || flash3.n_error || sim_st.errors)
+	{
+		printf(" * Protocol errors detected\n");
+		goto end;
+	}
+	result = 0;
+end:
+	sim_flash_free(&flash1);
+	sim_flash_free(&flash3);
+	return(result);
+}
+
+/**
+ * @brief Test that flash chips are detected
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_detect(void)
+{
+	mem_node *node;
+
+	printf(" * Test chip detection\n");
+
+	mem_detect();
+
+	node = mem_get_node(0);
+	if ((node->type != 1) || (node->chip == 0))
+	{
+		printf("    - Flash on node 0 not detected\n");
+		return(-1);
+	}
+	node = mem_get_node(1);
+	if (node->type != 0)
+	{
+		printf("    - Unexpected chip detected on node 1\n");
+		return(-1);
+	}
+	node = mem_get_node(2);
+	if ((node->type != 1) || (node->chip == 0))
+	{
+		printf("    - Flash on node 2 not detected\n");
+		return(-1);
+	}
+	printf("    - node0: %s node2: %s (ok)\n",
+		((mem_flash_chip *)mem_get_node(0)->chip)->name,
+		((mem_flash_chip *)mem_get_node(2)->chip)->name);
+	return(0);
+}
+
+/**
+ * @brief Test the read command selected for detected chips
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_read_cmd(void)
+{
+	mem_node *node;
+	uint i, err;
+
+	printf(" * Test read command selection\n");
+
+	/* Fastest SPI clock (PCLK/2) is below the Read Data limit (50MHz) */
+	for (i = 0; i < 3; i += 2)
+	{
+		node = mem_get_node(i);
+		if ((node->read_cmd != 0x03) || (node->read_dummy != 0))
+		{
+			printf("    - node%d: invalid read command %.2X (%d dummy)\n",
+				i, node->read_cmd, node->read_dummy);
+			return(-1);
+		}
+		spi_set_speed(i + 1, node->read_speed);
+		if (spi_get_speed(i + 1) != (SIM_PCLK * 1000 / 2))
+		{
+			printf("    - node%d: read clock too low (%d kHz)\n", i,
+			       spi_get_speed(i + 1));
+			return(-1);
+		}
+	}
+	printf("    - Read Data at %d MHz, no dummy cycle (ok)\n", SIM_PCLK / 2);
+
+	/* Legacy read at top divider must be rejected by slow chips */
+	err = flash3.n_error;
+	flash3.read_speed = 20;
+	spi_set_speed(3, 32);
+	spi_cs(3, 1);
+	spi_rw(3, 0x03);
+	spi_cs(3, 0);
+	flash3.read_speed = 50;
+	if (flash3.n_error != (err + 1))
+	{
+		printf("    - Flash model does not check Read Data clock\n");
+		return(-1);
+	}
+	flash3.n_error = err;
+	return(0);
+}
+
+/**
+ * @brief Test a read into a user buffer
+ *
+ * @param nid  Memory node to read
+ * @param addr Address of the first byte to read
+ * @param len  Number of bytes to read
+ * @return integer Zero on success, other values are errors
+ */
+static int t_read(uint nid, u32 addr, uint len)
+{
+	sim_flash *flash = (nid == 0) ? &flash1 : &flash3;
+	unsigned long acc, dma;
+	uint i;
+
+	printf(" * Test read %d bytes at %.6lX (node %d)\n", len, addr, nid);
+
+	for (i = 0; i < sizeof(buffer); i++)
+		buffer[i] = 0xA5;
+
+	acc = sim_st.reg_access;
+	dma = sim_st.dma_bytes;
+	if (mem_read(nid, addr, len, buffer) != (int)len)
+	{
+		printf("    - mem_read failed\n");
+		return(-1);
+	}
+	acc = sim_st.reg_access - acc;
+	dma = sim_st.dma_bytes  - dma;
+
+	if (check(flash, addr, buffer, len))
+		return(-1);
+	/* Bytes after the requested length must be untouched */
+	for (i = len; i < sizeof(buffer); i++)
+	{
+		if (buffer[i] != 0xA5)
+		{
+			printf("    - Buffer overrun at offset %d\n", i);
+			return(-1);
+		}
+	}
+	if ((len >= MEM_DMA_THRESHOLD) && (dma != len))
+	{
+		printf("    - DMA not used (%ld bytes moved)\n", dma);
+		return(-1);
+	}
+	if ((len < MEM_DMA_THRESHOLD) && (dma != 0))
+	{
+		printf("    - DMA used for a small transfer\n");
+		return(-1);
+	}
+	printf("    - Data ok, %s, %ld register accesses\n",
+		dma ? "DMA" : "polled", acc);
+	return(0);
+}
+
+/**
+ * @brief Test a read into the node internal cache
+ *
+ * @param nid  Memory node to read
+ * @param addr Address of the first byte to read
+ * @return integer Zero on success, other values are errors
+ */
+static int t_read_cache(uint nid, u32 addr)
+{
+	sim_flash *flash = (nid == 0) ? &flash1 : &flash3;
+	mem_node *node;
+	int len;
+
+	printf(" * Test cache fill at %.6lX (node %d)\n", addr, nid);
+
+	node = mem_get_node(nid);
+	len = mem_read(nid, addr, 16, 0);
+	if (len != 16)
+	{
+		printf("    - mem_read returned %d\n", len);
+		return(-1);
+	}
+	if (node->cache_addr != (addr & 0xFFFFF000))
+	{
+		printf("    - Invalid cache address %.6lX\n", node->cache_addr);
+		return(-1);
+	}
+	if (check(flash, node->cache_addr, node->cache_buffer, 4096))
+		return(-1);
+	printf("    - Cache content ok\n");
+	return(0);
+}
+
+/**
+ * @brief Test a read directly into USB packet memory
+ *
+ * The packet memory is mapped at its real address (USB_R1) to be detected by
+ * mem. Data are read with polled SPI and stored as 32 bits words.
+ *
+ * @param nid  Memory node to read
+ * @param addr Address of the first byte to read
+ * @param len  Number of bytes to read
+ * @return integer Zero on success, other values are errors
+ */
+static int t_read_pma(uint nid, u32 addr, uint len)
+{
+	sim_flash *flash = (nid == 0) ? &flash1 : &flash3;
+	unsigned long dma;
+	u8  *pma;
+	uint i;
+
+	printf(" * Test read %d bytes at %.6lX into PMA (node %d)\n", len, addr, nid);
+
+	pma = mmap((void *)(USB_R1 & ~0xFFFUL), 0x1000, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (pma == MAP_FAILED)
+	{
+		printf("    - PMA can not be mapped, skip\n");
+		return(0);
+	}
+	pma += (USB_R1 & 0xFFF) + 0x180;
+	for (i = 0; i < 128; i++)
+		pma[i] = 0xA5;
+
+	dma = sim_st.dma_bytes;
+	if (mem_read(nid, addr, len, pma) != (int)len)
+	{
+		printf("    - mem_read failed\n");
+		goto err;
+	}
+	if (sim_st.dma_bytes != dma)
+	{
+		printf("    - DMA used to write PMA\n");
+		goto err;
+	}
+	if (check(flash, addr, pma, len))
+		goto err;
+	/* Bytes after the buffer (even into the last word) are untouched */
+	for (i = len; i < 128; i++)
+	{
+		if (pma[i] != 0xA5)
+		{
+			printf("    - Buffer overrun at offset %d\n", i);
+			goto err;
+		}
+	}
+	printf("    - Data ok, polled\n");
+	munmap((void *)(USB_R1 & ~0xFFFUL), 0x1000);
+	return(0);
+err:
+	munmap((void *)(USB_R1 & ~0xFFFUL), 0x1000);
+	return(-1);
+}
+
+/**
+ * @brief Test a sequential read into PMA, one USB packet at a time
+ *
+ * Zero-copy SCSI reads ask one packet (64 bytes) per call : the read must
+ * continue with the chip still selected, without one command per packet.
+ *
+ * @param nid  Memory node to read
+ * @param addr Address of the first packet
+ * @return integer Zero on success, other values are errors
+ */
+static int t_read_stream(uint nid, u32 addr)
+{
+	sim_flash *flash = (nid == 0) ? &flash1 : &flash3;
+	uint cmds, i;
+	u8  *pma;
+
+	printf(" * Test sequential read at %.6lX into PMA (node %d)\n", addr, nid);
+
+	pma = mmap((void *)(USB_R1 & ~0xFFFUL), 0x1000, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (pma == MAP_FAILED)
+	{
+		printf("    - PMA can not be mapped, skip\n");
+		return(0);
+	}
+	pma += (USB_R1 & 0xFFF) + 0x180;
+
+	/* One sector, packet after packet : only the first one send a command */
+	cmds = flash->n_read + flash->n_fast_read;
+	for (i = 0; i < 512; i += 64)
+	{
+		if ((mem_read(nid, addr + i, 64, pma) != 64) ||
+		    check(flash, addr + i, pma, 64))
+			goto err;
+	}
+	cmds = flash->n_read + flash->n_fast_read - cmds;
+	printf("    - 512 bytes read by 64 bytes packets, %d command(s)\n", cmds);
+	if (cmds != 1)
+		goto err;
+
+	/* Not sequential : a new command is needed */
+	cmds = flash->n_read + flash->n_fast_read;
+	if ((mem_read(nid, addr + 4096, 64, pma) != 64) ||
+	    check(flash, addr + 4096, pma, 64))
+		goto err;
+	if ((flash->n_read + flash->n_fast_read) != (cmds + 1))
+	{
+		printf("    - Read not restarted at a new address\n");
+		goto err;
+	}
+
+	/* Any other access closes the open read (chip released) */
+	if ((mem_read(nid, addr + 4096 + 64, 16, buffer) != 16) ||
+	    check(flash, addr + 4096 + 64, buffer, 16))
+		goto err;
+	if (flash->selected)
+	{
+		printf("    - Chip left selected after a read into RAM\n");
+		goto err;
+	}
+
+	/* Transfer stopped (host stall, reset) : the chip is released later */
+	if (mem_read(nid, addr, 64, pma) != 64)
+		goto err;
+	mem_periodic();
+	mem_poll();
+	if (flash->selected == 0)
+	{
+		printf("    - Open read closed before the delay\n");
+		goto err;
+	}
+	sim_ms += 2;
+	work_posts = 0;
+	mem_periodic();
+	if (work_posts == 0)
+	{
+		printf("    - Open read timeout not posted\n");
+		goto err;
+	}
+	mem_poll();
+	if (flash->selected)
+	{
+		printf("    - Chip still selected after the delay\n");
+		goto err;
+	}
+	printf("    - Open read closed after 2 ms without packet\n");
+	munmap((void *)(USB_R1 & ~0xFFFUL), 0x1000);
+	return(0);
+err:
+	munmap((void *)(USB_R1 & ~0xFFFUL), 0x1000);
+	return(-1);
+}
+
+/**
+ * @brief Test a sector write and read back
+ *
+ * @param nid  Memory node to write
+ * @param addr Address of the sector to write (4k aligned)
+ * @return integer Zero on success, other values are errors
+ */
+static int t_write(uint nid, u32 addr)
+{
+	sim_flash *flash = (nid == 0) ? &flash1 : &flash3;
+	uint i;
+
+	printf(" * Test write sector at %.6lX (node %d)\n", addr, nid);
+
+	for (i = 0; i < 4096; i++)
+		buffer[i] = (u8)((i * 7) ^ (i >> 8));
+	if (mem_write(nid, addr, 4096, buffer) != 4096)
+	{
+		printf("    - mem_write failed\n");
+		return(-1);
+	}
+	if (check(flash, addr, buffer, 4096))
+		return(-1);
+	return(t_read(nid, addr, 4096));
+}
+
+/**
+ * @brief Test the write planner (erase and program only when needed)
+ *
+ * @param nid  Memory node to write
+ * @param addr Address of the sector to write (4k aligned)
+ * @return integer Zero on success, other values are errors
+ */
+static int t_planner(uint nid, u32 addr)
+{
+	mem_node *node = mem_get_node(nid);
+	uint i;
+
+	printf(" * Test write planner at %.6lX (node %d)\n", addr, nid);
+
+	/* Sector contains a pattern, new data set some bits : erase needed */
+	for (i = 0; i < 4096; i++)
+		buffer[i] = (u8)((i * 3) ^ 0x5A);
+	if (planner_step(nid, addr, 4096, 1, 16))
+		return(-1);
+	/* Same data again : nothing to do */
+	if (planner_step(nid, addr, 4096, 0, 0))
+		return(-1);
+	/* Only clear bits into two pages : program these pages only */
+	buffer[3 * 256 + 10] &= 0x0F;
+	buffer[9 * 256 + 255] = 0x00;
+	if (planner_step(nid, addr, 4096, 0, 2))
+		return(-1);
+	/* Only clear bits, but current content can not be read : erase */
+	buffer[5 * 256] &= 0xF0;
+	sim_regs_spi_stall_for(0x100000);
+	if (planner_step(nid, addr, 4096, 1, 16))
+		return(-1);
+	/* Erased sector, data into 6 pages : no erase, blank pages skipped */
+	mem_erase(nid, addr, 4096);
+	for (i = 0; i < 4096; i++)
+		buffer[i] = ((i / 256) % 3) ? 0xFF : (u8)i;
+	if (planner_step(nid, addr, 4096, 0, 6))
+		return(-1);
+	/* Short write : end of sector must be erased */
+	for (i = 0; i < 1000; i++)
+		buffer[i] = (u8)(i ^ 0xA5);
+	for (i = 1000; i < 4096; i++)
+		buffer[i] = 0xFF;
+	if (planner_step(nid, addr, 1000, 1, 4))
+		return(-1);
+
+	printf("    - Counters: %d erases, %d skipped, %d pages, %d skipped\n",
+	       node->st_erase, node->st_erase_skip, node->st_page, node->st_page_skip);
+	return(0);
+}
+
+/**
+ * @brief Write a sector and verify the number of erases and programs
+ *
+ * @param nid      Memory node to write
+ * @param addr     Address of the sector
+ * @param len      Number of bytes to write (from global buffer)
+ * @param erases   Number of erase expected
+ * @param programs Number of page program expected
+ * @return integer Zero on success, other values are errors
+ */
+static int planner_step(uint nid, u32 addr, uint len, uint erases, uint programs)
+{
+	sim_flash *flash = (nid == 0) ? &flash1 : &flash3;
+	uint n_erase   = flash->n_erase;
+	uint n_program = flash->n_program;
+
+	if (mem_write(nid, addr, len, buffer) != (int)len)
+	{
+		printf("    - mem_write failed\n");
+		return(-1);
+	}
+	n_erase   = flash->n_erase   - n_erase;
+	n_program = flash->n_program - n_program;
+	printf("    - Write %4d bytes: %d erase, %2d pages programmed\n",
+	       len, n_erase, n_program);
+	if ((n_erase != erases) || (n_program != programs))
+	{
+		printf("    - %d erase and %d programs expected\n", erases, programs);
+		return(-1);
+	}
+	/* Bytes after len are erased */
+	return(check(flash, addr, buffer, 4096));
+}
+
+/**
+ * @brief Test free sectors (trim) : zeros without chip access, used on write
+ *
+ * @param nid  Node to use
+ * @param addr Address of the first sector (4k aligned)
+ * @return integer Zero on success, other values are errors
+ */
+static int t_trim(uint nid, u32 addr)
+{
+	sim_flash *flash = (nid == 0) ? &flash1 : &flash3;
+	uint bytes, i;
+	int  n;
+
+	printf(" * Test free sectors at %.6lX (node %d)\n", addr, nid);
+
+	/* Only the two complete sectors are marked free */
+	n = mem_trim(nid, addr + 100, 3 * 4096);
+	if ((n != 2) || mem_is_free(nid, addr) || !mem_is_free(nid, addr + 0x2FFF) ||
+	    mem_is_free(nid, addr + 0x3000))
+	{
+		printf("    - Bad free sectors (%d marked)\n", n);
+		return(-1);
+	}
+	if (mem_trim(nid, (MEM_FREE_MAP_SZ * 8) * 4096, 4096) != 0)
+	{
+		printf("    - Sector after the bitmap marked free\n");
+		return(-1);
+	}
+
+	/* Free sectors are read as zeros, without access to the chip */
+	bytes = sim_st.spi_bytes;
+	for (i = 0; i < 4096; i++)
+		buffer[i] = 0xA5;
+	if ((mem_read(nid, addr + 0x1800, 3584, buffer) != 3584) ||
+	    (mem_read_start(nid, addr + 0x2E00, 512, buffer + 3584) != 0) ||
+	    (sim_st.spi_bytes != bytes))
+	{
+		printf("    - Chip accessed for free sectors\n");
+		return(-1);
+	}
+	for (i = 0; i < 4096; i++)
+	{
+		if (buffer[i] != 0)
+			goto err_zero;
+	}
+	/* Mixed area : used bytes from flash, then zeros */
+	mem_read(nid, addr + 0x0FF0, 32, buffer);
+	if (check(flash, addr + 0x0FF0, buffer, 16))
+		return(-1);
+	for (i = 16; i < 32; i++)
+	{
+		if (buffer[i] != 0)
+			goto err_zero;
+	}
+	printf("    - Free sectors read as zeros (ok)\n");
+
+	/* A written sector is used again, the next one stay free */
+	for (i = 0; i < 512; i++)
+		buffer[i] = (u8)(i + 3);
+	mem_write(nid, addr + 0x1000, 512, buffer);
+	if (mem_is_free(nid, addr + 0x1000) || !mem_is_free(nid, addr + 0x2000))
+	{
+		printf("    - Bad state after write\n");
+		return(-1);
+	}
+	for (i = 512; i < 4096; i++)
+		buffer[i] = 0xFF;
+	if (check(flash, addr + 0x1000, buffer, 4096))
+		return(-1);
+	return(t_read(nid, addr + 0x1000, 4096));
+
+err_zero:
+	printf("    - Free sector not read as zero at offset %d\n", i);
+	return(-1);
+}
+
+/**
+ * @brief Test a read left running, ended by the next access to the port
+ *
+ * @param nid  Node to use (connected to SPI1)
+ * @param addr Address of the area to test (4k aligned)
+ * @return integer Zero on success, other values are errors
+ */
+static int t_read_background(uint nid, u32 addr)
+{
+	static u8 data2[512];
+	sim_flash *flash = (nid == 0) ? &flash1 : &flash3;
+	u8   rd[16];
+	uint i;
+
+	printf(" * Test read left running at %.6lX (node %d)\n", addr, nid);
+
+	/* Read with DMA, not waited (read-ahead) */
+	for (i = 0; i < 2048; i++)
+		buffer[i] = 0xA5;
+	if (mem_read_start(nid, addr, 2048, buffer) != 0)
+	{
+		printf("    - mem_read_start failed\n");
+		return(-1);
+	}
+	/* Access to the other port does not end it */
+	mem_read(2, 0x001000, 16, rd);
+	if (check(&flash3, 0x001000, rd, 16))
+		return(-1);
+	if (spi_dma_busy(nid + 1) == 0)
+	{
+		printf("    - Read ended by an access to the other port\n");
+		return(-1);
+	}
+	/* Next read of the same port must end the first one */
+	mem_read(nid, addr + 0x3000, 16, rd);
+	if (check(flash, addr + 0x3000, rd, 16) || check(flash, addr, buffer, 2048))
+		return(-1);
+	if (spi_dma_busy(nid + 1))
+		goto err_busy;
+	if (mem_read_wait(nid) != 0)
+		return(-1);
+
+	/* A job of the node must also end a read left running */
+	if (mem_read_start(nid, addr + 0x800, 2048, buffer) != 0)
+		return(-1);
+	for (i = 0; i < 512; i++)
+		data2[i] = (u8)(i + 0x21);
+	mem_write(nid, addr + 0x2000, 512, data2);
+	if (check(flash, addr + 0x2000, data2, 512) || check(flash, addr + 0x800, buffer, 2048))
+		return(-1);
+	if (spi_dma_busy(nid + 1))
+		goto err_busy;
+	if (mem_read_wait(nid) != 0)
+		return(-1);
+	printf("    - Reads ended before next accesses (ok)\n");
+	return(0);
+
+err_busy:
+	printf("    - Read not ended, SPI port still busy\n");
+	return(-1);
+}
+
+/**
+ * @brief Test the pre-erase pool (free sectors erased in background)
+ *
+ * @param nid  Node to use
+ * @param addr Address of the first sector (4k aligned)
+ * @return integer Zero on success, other values are errors
+ */
+static int t_preerase(uint nid, u32 addr)
+{
+	sim_flash *flash = (nid == 0) ? &flash1 : &flash3;
+	mem_node  *node  = mem_get_node(nid);
+	uint erases, reads, polls, i;
+
+	printf(" * Test pre-erase pool at %.6lX (node %d)\n", addr, nid);
+
+	/* Erase all free sectors when idle, then nothing more to do */
+	mem_trim(nid, addr, 3 * 4096);
+	for (polls = 0; mem_preerase(nid) || mem_busy(nid); polls++)
+	{
+		mem_poll();
+		if (polls > 100000)
+		{
+			printf("    - Pre-erase never complete\n");
+			return(-1);
+		}
+	}
+	if ((node->st_pool != 3) || (node->st_pre_erase != 3) || mem_preerase(nid))
+	{
+		printf("    - Pool of %ld sectors (%ld erased)\n",
+		       (long)node->st_pool, (long)node->st_pre_erase);
+		return(-1);
+	}
+	for (i = 0; i < 4096; i++)
+		buffer[i] = 0xFF;
+	if (check(flash, addr, buffer, 4096) || check(flash, addr + 0x2000, buffer, 4096))
+		return(-1);
+	printf("    - 3 free sectors erased in background\n");
+
+	/* Update of a pre-erased sector : no compare, no erase */
+	for (i = 0; i < 4096; i++)
+		buffer[i] = (u8)(i * 5);
+	erases = flash->n_erase;
+	reads  = flash->n_read;
+	mem_write(nid, addr + 0x1000, 4096, buffer);
+	if ((flash->n_erase != erases) || (flash->n_read != reads) ||
+	    (node->st_pool != 2) || (node->st_pool_hit != 1))
+	{
+		printf("    - Pre-erased sector not used (%d erase, %d read)\n",
+		       flash->n_erase - erases, flash->n_read - reads);
+		return(-1);
+	}
+	if (check(flash, addr + 0x1000, buffer, 4096))
+		return(-1);
+
+	/* Sector written while its pre-erase is running : not into pool */
+	mem_trim(nid, addr + 0x3000, 4096);
+	if (mem_preerase(nid) == 0)
+		return(-1);
+	mem_write(nid, addr + 0x3000, 4096, buffer);
+	if ((node->st_pool != 2) || check(flash, addr + 0x3000, buffer, 4096))
+	{
+		printf("    - Sector written during pre-erase added to pool\n");
+		return(-1);
+	}
+	printf("    - Pool %ld, %ld hit, %ld miss (ok)\n", (long)node->st_pool,
+	       (long)node->st_pool_hit, (long)node->st_pool_miss);
+	return(0);
+}
+
+/**
+ * @brief Test asynchronous jobs (erase/program without waiting the chip)
+ *
+ * Two sector updates are queued then processed by mem_poll : each call must
+ * only read the chip status, or start one erase/program. A read during the
+ * erase must wait the end of it (the flash model reject any command except
+ * Read Status while busy).
+ *
+ * @param nid  Node to use
+ * @param addr Address of the first sector (4k aligned)
+ * @return integer Zero on success, other values are errors
+ */
+static int t_async(uint nid, u32 addr)
+{
+	static u8 data2[4096];
+	mem_job  job1, job2;
+	sim_flash *flash = (nid == 0) ? &flash1 : &flash3;
+	u8   rd[16];
+	uint polls, busy_polls, erase_count, i;
+
+	printf(" * Test asynchronous jobs at %.6lX (node %d)\n", addr, nid);
+
+	for (i = 0; i < 4096; i++)
+	{
+		buffer[i] = (u8)(i ^ 0xA5);
+		data2[i]  = (u8)((i * 7) ^ 0x3C);
+	}
+	job1.type = MEM_JOB_UPDATE;
+	job1.addr = addr;
+	job1.len  = 4096;
+	job1.buffer   = buffer;
+	job1.complete = job_complete;
+	job2 = job1;
+	job2.addr   = addr + 4096;
+	job2.buffer = data2;
+
+	work_posts  = 0;
+	job_count   = 0;
+	erase_count = flash->n_erase;
+	if (mem_submit(nid, &job1) || mem_submit(nid, &job2))
+	{
+		printf("    - Submit failed\n");
+		return(-1);
+	}
+	/* Nothing is done until mem_poll (deferred work) */
+	if ((work_posts == 0) || (flash->n_erase != erase_count) ||
+	    (mem_busy(nid) == 0))
+	{
+		printf("    - Job not deferred (posts=%d)\n", work_posts);
+		return(-1);
+	}
+
+	/* First poll compare content then start erase */
+	mem_poll();
+	if ((job1.state != MEM_JOB_BUSY) || (flash->busy == 0))
+	{
+		printf("    - Erase not started (state %ld)\n", (long)job1.state);
+		return(-1);
+	}
+	/* Read while erase is running */
+	mem_read(nid, 0x000100, 16, rd);
+	if (check(flash, 0x000100, rd, 16))
+		return(-1);
+
+	polls = 1;
+	busy_polls = 0;
+	while (mem_busy(nid))
+	{
+		if (flash->busy)
+			busy_polls++;
+		mem_poll();
+		if (++polls > 10000)
+		{
+			printf("    - Jobs never complete\n");
+			return(-1);
+		}
+	}
+	if ((job_count != 2) || (job_order[0] != &job1) || (job_order[1] != &job2))
+	{
+		printf("    - Invalid completion (%d callbacks)\n", job_count);
+		return(-1);
+	}
+	if (job1.result || job2.result ||
+	    (job1.state != MEM_JOB_DONE) || (job2.state != MEM_JOB_DONE))
+	{
+		printf("    - Job failed\n");
+		return(-1);
+	}
+	if (check(flash, addr, buffer, 4096) || check(flash, addr + 4096, data2, 4096))
+		return(-1);
+	printf("    - 2 jobs done in %d polls (%d while chip busy) (ok)\n",
+	       polls, busy_polls);
+
+	/* Synchronous API must still work (same queue) */
+	for (i = 0; i < 4096; i++)
+		buffer[i] = (u8)i;
+	if (mem_write(nid, addr, 4096, buffer) != 4096)
+		return(-1);
+	if (check(flash, addr, buffer, 4096) || mem_busy(nid))
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Completion callback of asynchronous jobs
+ *
+ * @param job Pointer to the completed job
+ */
+static void job_complete(mem_job *job)
+{
+	if (job_count < 4)
+		job_order[job_count] = job;
+	job_count++;
+}
+
+/**
+ * @brief Test DMA status polling and completion callback
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static void t_dma_complete(uint channel)
+{
+	cb_channel = channel;
+	cb_count++;
+}
+
+static int t_dma_status(void)
+{
+	uint status;
+
+	printf(" * Test DMA status and completion callback\n");
+
+	cb_channel = 0;
+	cb_count   = 0;
+	sim_regs_dma_hold(1);
+
+	spi_cs(3, 1);
+	spi_rw(3, 0x0B);
+	spi_rw(3, 0x00);
+	spi_rw(3, 0x10);
+	spi_rw(3, 0x00);
+	spi_rw(3, 0x00); // Dummy
+	if (spi_dma_read(3, buffer, 512, t_dma_complete) != 0)
+	{
+		printf("    - Failed to start DMA\n");
+		return(-1);
+	}
+	status = spi_dma_status(3);
+	if (status != 512)
+	{
+		printf("    - Invalid status during transfer (%d)\n", status);
+		return(-1);
+	}
+	if (spi_dma_read(3, buffer, 512, 0) != -2)
+	{
+		printf("    - Second transfer accepted while busy\n");
+		return(-1);
+	}
+	/* Transfer on the other port must be independent */
+	if (spi_dma_status(1) != 0)
+	{
+		printf("    - SPI1 reported busy\n");
+		return(-1);
+	}
+
+	sim_regs_dma_hold(0);
+	spi_cs(3, 0);
+
+	if ((cb_count != 1) || (cb_channel != 3))
+	{
+		printf("    - Callback not called (count=%d channel=%d)\n", cb_count, cb_channel);
+		return(-1);
+	}
+	if (spi_dma_status(3) != 0)
+	{
+		printf("    - Transfer still active after completion\n");
+		return(-1);
+	}
+	if (check(&flash3, 0x001000, buffer, 512))
+		return(-1);
+	if (spi_dma_wait(3) != 0)
+	{
+		printf("    - Wait on a complete transfer failed\n");
+		return(-1);
+	}
+	printf("    - Status, busy and callback ok\n");
+	return(0);
+}
+
+/**
+ * @brief Compare CPU register accesses of polled and DMA reads
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_budget(void)
+{
+	unsigned long polled, dma, bus;
+	uint i;
+
+	printf(" * Test cycle budget for a 4k read\n");
+
+	spi_set_speed(3, mem_get_node(2)->speed);
+
+	/* Reference : polled read of the same block */
+	polled = sim_st.reg_access;
+	bus    = sim_st.spi_cycles;
+	spi_cs(3, 1);
+	spi_rw(3, 0x0B);
+	spi_rw(3, 0x00);
+	spi_rw(3, 0x00);
+	spi_rw(3, 0x00);
+	spi_rw(3, 0x00); // Dummy
+	for (i = 0; i < 4096; i++)
+		buffer[i] = spi_rw(3, 0x00);
+	spi_cs(3, 0);
+	polled = sim_st.reg_access - polled;
+	bus    = sim_st.spi_cycles - bus;
+
+	dma = sim_st.reg_access;
+	mem_read(2, 0, 4096, buffer);
+	dma = sim_st.reg_access - dma;
+
+	printf("    - SPI bus time %ld cycles\n", bus);
+	printf("    - Polled: %ld register accesses\n", polled);
+	printf("    - DMA   : %ld register accesses\n", dma);
+	/* DMA setup must be a small fixed cost */
+	if (dma > 100)
+	{
+		printf("    - DMA register budget exceeded\n");
+		return(-1);
+	}
+	if (check(&flash3, 0, buffer, 4096))
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Test SPI bus handles (port configured only on ownership change)
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_bus(void)
+{
+	unsigned long acc, cfg, bytes;
+	spi_bus *bus;
+	uint i;
+
+	printf(" * Test SPI bus handles\n");
+
+	bus = spi_bus_get(1);
+	if ((bus == 0) || (bus->port != SPI1) || (spi_bus_get(2) != bus) ||
+	    (spi_bus_get(3) == 0) || (spi_bus_get(3)->port != SPI2) ||
+	    spi_bus_get(0) || spi_bus_get(4))
+	{
+		printf("    - Invalid port for a channel\n");
+		return(-1);
+	}
+
+	/* Channels 1 and 2 share SPI1 with different speeds */
+	spi_set_speed(2, 1);
+	spi_set_speed(1, 32);
+	cfg = sim_st.cfg_access;
+	spi_bus_get(1);
+	spi_bus_get(1);
+	spi_set_speed(1, 32);
+	spi_cs(1, 1);
+	spi_cs(1, 0);
+	if ((sim_st.cfg_access - cfg) != 1)
+	{
+		printf("    - Port configured %ld times for the same channel\n",
+		       sim_st.cfg_access - cfg);
+		return(-1);
+	}
+	spi_bus_get(2);
+	if (((reg16_rd(SPI_CR1(SPI1)) >> 3) & 7) != 5)
+	{
+		printf("    - Speed of channel 2 not restored\n");
+		return(-1);
+	}
+	/* Node 0 take back its port */
+	mem_read(0, 0x020000, 16, buffer);
+
+	/* Small polled reads and status polls on the same node */
+	acc   = sim_st.reg_access;
+	cfg   = sim_st.cfg_access;
+	bytes = sim_st.spi_bytes;
+	for (i = 0; i < 256; i++)
+	{
+		if ((mem_read(0, 0x020000 + (i * 32), 32, buffer) != 32) ||
+		    check(&flash1, 0x020000 + (i * 32), buffer, 32))
+			return(-1);
+		mem_poll();
+	}
+	acc   = sim_st.reg_access - acc;
+	cfg   = sim_st.cfg_access - cfg;
+	bytes = sim_st.spi_bytes  - bytes;
+	printf("    - 256 reads of 32 bytes: %ld register accesses for %ld bytes"
+	       " (%ld.%02ld per byte)\n", acc, bytes, acc / bytes,
+	       ((acc % bytes) * 100) / bytes);
+	printf("    - %ld accesses to SPI control register\n", cfg);
+	if (cfg != 0)
+	{
+		printf("    - Port reconfigured without ownership change\n");
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Test SPI block transfers (FIFO, data packing) and bus utilization
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_block(void)
+{
+	unsigned long cpu[2], bus[2];
+	spi_bus *sb;
+	uint len, off, i, k;
+
+	printf(" * Test SPI block transfers\n");
+
+	/* Odd and even lengths, into unaligned buffers */
+	for (len = 1; len < 12; len++)
+	{
+		for (off = 1; off < 5; off++)
+		{
+			for (i = 0; i < 32; i++)
+				buffer[i] = 0xA5;
+			if ((mem_read(2, 0x1001 + len, len, buffer + off) != (int)len) ||
+			    check(&flash3, 0x1001 + len, buffer + off, len))
+				return(-1);
+			if ((buffer[off - 1] != 0xA5) || (buffer[off + len] != 0xA5))
+			{
+				printf("    - Buffer overrun for %d bytes\n", len);
+				return(-1);
+			}
+		}
+	}
+	printf("    - Lengths 1 to 11, unaligned buffers (ok)\n");
+
+	/* Polled read of 4k : byte per byte, then with a block transfer */
+	spi_set_speed(3, mem_get_node(2)->speed);
+	sb = spi_bus_get(3);
+	for (k = 0; k < 2; k++)
+	{
+		spi_cs(3, 1);
+		spi_rw(3, 0x0B);
+		spi_rw(3, 0x00);
+		spi_rw(3, 0x00);
+		spi_rw(3, 0x00);
+		spi_rw(3, 0x00); // Dummy
+		cpu[k] = sim_st.cpu_cycles;
+		bus[k] = sim_st.spi_cycles;
+		if (k == 0)
+		{
+			for (i = 0; i < 4096; i++)
+				buffer[i] = spi_rw(3, 0x00);
+		}
+		else
+			spi_read_block(sb, buffer, 4096);
+		cpu[k] = sim_st.cpu_cycles - cpu[k];
+		bus[k] = sim_st.spi_cycles - bus[k];
+		spi_cs(3, 0);
+		if (check(&flash3, 0, buffer, 4096))
+			return(-1);
+		printf("    - %s: %ld cycles, bus busy %ld%%\n",
+		       k ? "Block" : "Bytes", cpu[k], (bus[k] * 100) / cpu[k]);
+	}
+	/* The shift register must (almost) never wait the CPU */
+	if ((bus[1] * 100) < (cpu[1] * 90))
+	{
+		printf("    - Bus utilization too low\n");
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Test SPI clock selection and calibration on detect
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_speed(void)
+{
+	const uint speeds[6] = {0, 1, 10, 20, 50, 166};
+	const uint clocks[6] = {250, 1000, 8000, 16000, 32000, 32000};
+	mem_node *node;
+	uint i;
+
+	printf(" * Test SPI clock selection\n");
+
+	/* Fastest divisor of PCLK that does not exceed the chip speed */
+	for (i = 0; i < 6; i++)
+	{
+		spi_set_speed(3, speeds[i]);
+		if (spi_get_speed(3) != clocks[i])
+		{
+			printf("    - %d MHz: clock %d kHz, expected %d kHz\n",
+			       speeds[i], spi_get_speed(3), clocks[i]);
+			return(-1);
+		}
+	}
+	printf("    - 10 MHz chip use %d kHz (ok)\n", clocks[2]);
+
+	/* Board limited to 10 MHz : calibration must find 8 MHz */
+	flash3.board = 10;
+	mem_detect();
+	node = mem_get_node(2);
+	flash3.board = 0;
+	if ((node->read_speed != 8) || (node->speed != 8))
+	{
+		printf("    - Calibration: read at %d MHz, commands at %d MHz\n",
+		       node->read_speed, node->speed);
+		return(-1);
+	}
+	flash3.board = 10;
+	if (t_read(2, 0x7FF001, 40))
+		return(-1);
+	flash3.board = 0;
+	printf("    - Board limited to 10 MHz, calibrated to %d MHz (ok)\n",
+	       node->read_speed);
+
+	/* Without limit, the chip speeds are kept */
+	mem_detect();
+	if ((node->speed != ((mem_flash_chip *)node->chip)->speed) ||
+	    (node->read_speed != ((mem_flash_chip *)node->chip)->read_speed))
+	{
+		printf("    - Calibration limited a valid clock\n");
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Test reads when the SPI port stop (no clock, FIFO never ready)
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_stall(void)
+{
+	printf(" * Test read with a stalled SPI port\n");
+
+	sim_regs_spi_stall(1);
+	if (mem_read(2, 0x1000, 16, buffer) >= 0)
+	{
+		printf("    - Polled read reported success\n");
+		goto err;
+	}
+	if (mem_read_start(2, 0x1000, 16, buffer) != -1)
+	{
+		printf("    - Started read reported success\n");
+		goto err;
+	}
+	sim_regs_spi_stall(0);
+	printf("    - Timeout reported (ok)\n");
+
+	/* Chip released on error, next reads work */
+	if (t_read(2, 0x1000, 16))
+		return(-1);
+	return(0);
+err:
+	sim_regs_spi_stall(0);
+	return(-1);
+}
+
+/**
+ * @brief Test a blocking erase queued behind a job when the chip stop
+ *
+ * @param nid  Memory node to use
+ * @param addr Address of two free sectors (4k aligned)
+ * @return integer Zero on success, other values are errors
+ */
+static int t_timeout(uint nid, u32 addr)
+{
+	sim_flash *flash = (nid == 0) ? &flash1 : &flash3;
+	mem_job job;
+	uint err;
+
+	printf(" * Test blocking erase when the chip does not answer\n");
+
+	job.type     = MEM_JOB_ERASE;
+	job.addr     = addr;
+	job.len      = 4096;
+	job.complete = job_complete;
+	if (mem_submit(nid, &job))
+		return(-1);
+	mem_poll();
+	/* Erase started, then the chip stay busy */
+	err = flash->n_error;
+	flash->busy = 1000000;
+	mem_erase(nid, addr + 4096, 4096);
+	flash->busy = 0;
+	if ((job.state != MEM_JOB_DONE) || (job.result != -1) || mem_busy(nid))
+	{
+		printf("    - Jobs not aborted (state %ld, queue %d)\n",
+		       (long)job.state, mem_busy(nid));
+		return(-1);
+	}
+	/* The erase of the caller must not be sent to the busy chip */
+	if (flash->n_error != err)
+	{
+		printf("    - Command sent while chip busy\n");
+		return(-1);
+	}
+	printf("    - Running job and waited job aborted (ok)\n");
+	return(0);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                          Helper functions                            -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Fill the memory array of a flash model with a known pattern
+ *
+ * @param flash Pointer to the flash model
+ * @param seed  Initial value of the pattern
+ */
+static void pattern(sim_flash *flash, u8 seed)
+{
+	u32 i;
+
+	for (i = 0; i < flash->size; i++)
+		flash->mem[i] = (u8)(seed + i + (i >> 8) + (i >> 16) + (i >> 24));
+}
+
+/**
+ * @brief Compare data with the content of a flash model
+ *
+ * @param flash Pointer to the flash model
+ * @param addr  Address into the flash
+ * @param data  Pointer to data to compare
+ * @param len   Number of bytes to compare
+ * @return integer Zero if identical, -1 if different
+ */
+static int check(sim_flash *flash, u32 addr, const u8 *data, uint len)
+{
+	uint i;
+
+	for (i = 0; i < len; i++)
+	{
+		if (data[i] != flash->mem[addr + i])
+		{
+			printf("    - Data mismatch at %.6lX (%.2X != %.2X)\n",
+				addr + i, data[i], flash->mem[addr + i]);
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+/**
+ * @brief Clock of the simulated peripherals (see hw_get_pclk)
+ *
+ * @return u32 Frequency of PCLK (in Hz)
+ */
+u32 hw_get_pclk(void)
+{
+	return(SIM_PCLK * 1000000);
+}
+
+/**
+ * @brief Simplified copy to USB packet memory (see usb.c)
+ *
+ * The last word is padded with zeros, as with 32 bits PMA accesses.
+ *
+ * @param dst Pointer to the destination into packet memory
+ * @param src Pointer to the source data
+ * @param len Number of bytes to copy
+ */
+void memcpy_to_pma(u8 *dst, const u8 *src, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < ((len + 3) & ~3U); i++)
+		dst[i] = (i < len) ? src[i] : 0;
+}
+
+/**
+ * @brief Simplified fill of USB packet memory (see usb.c)
+ *
+ * @param dst   Pointer to the destination (sram or packet memory)
+ * @param value Value of each byte
+ * @param len   Number of bytes to fill
+ */
+void memset_pma(u8 *dst, int value, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		dst[i] = (u8)value;
+}
+
+/**
+ * @brief Simulated time, advanced by tests (see sim_ms)
+ *
+ * @param timeval Not used
+ * @return u32 Current time (in ms)
+ */
+u32 time_now(tm_t *timeval)
+{
+	(void)timeval;
+	return(sim_ms);
+}
+
+int time_since(u32 ref)
+{
+	return((int)(sim_ms - ref));
+}
+
+/**
+ * @brief Dummy log function used to avoid missing dependancy
+ *
+ * @param s String to display
+ */
+void log_puts(const char *s)
+{
+	printf("    - LOG: %s", s);
+}
+
+/**
+ * @brief Dummy log function used to avoid missing dependancy
+ *
+ * @param level Log level
+ * @param s     Format string (not decoded)
+ */
+void log_print(uint level, const char *s, ...)
+{
+	(void)level;
+	(void)s;
+}
+
+/**
+ * @brief Dummy work functions, jobs are processed by calling mem_poll
+ *
+ */
+int work_register(void (*fn)(void), uint prio)
+{
+	(void)fn;
+	(void)prio;
+	return(0);
+}
+
+void work_post(int id)
+{
+	(void)id;
+	work_posts++;
+}
+/* EOF */
@@ -0,0 +1,80 @@
+/**
+ * @file  tests/ut_mem/sim.h
+ * @brief Headers and definitions for simulated SPI/DMA peripherals and flash
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef SIM_H
+#define SIM_H
+#include "types.h"
+
+#define SIM_CHANNELS 3
+#define SIM_PCLK    64 /* SPI kernel clock (MHz) */
+/* CPU cost of one register access, with surrounding code (PCLK cycles) */
+#define SIM_REG_CYCLES 6
+
+typedef struct sim_flash_s
+{
+	u8   vendor;
+	u16  device;
+	u8  *mem;
+	u32  size;
+	/* Timings limits (MHz) and current SPI clock */
+	uint speed;
+	uint read_speed;
+	uint dummy;
+	uint clock;
+	uint board; /* Max clock of the board wiring, MISO corrupted above */
+	/* Current command state */
+	int  selected;
+	u8   cmd;
+	uint alen;  /* Number of address bytes of the command (3 or 4) */
+	uint count;
+	u32  addr;
+	int  wel;
+	uint busy;
+	/* Statistics and protocol errors */
+	uint n_read;
+	uint n_fast_read;
+	uint n_program;
+	uint n_erase;
+	uint n_error;
+} sim_flash;
+
+typedef struct sim_stats_s
+{
+	unsigned long reg_access; /* Number of CPU register accesses  */
+	unsigned long cfg_access; /* Accesses to SPI control (CR1)    */
+	unsigned long cpu_cycles; /* CPU time (in PCLK cycles)        */
+	unsigned long spi_bytes;  /* Number of bytes clocked on SPI   */
+	unsigned long spi_cycles; /* Bus time (in PCLK cycles)        */
+	unsigned long dma_bytes;  /* Number of bytes moved by DMA     */
+	unsigned long dma_irq;    /* Number of DMA interrupts raised  */
+	unsigned long errors;     /* Invalid use of peripherals       */
+} sim_stats;
+
+/* Register model */
+void sim_regs_init(void);
+void sim_regs_attach(uint channel, sim_flash *flash);
+void sim_regs_dma_hold(int state);
+void sim_regs_spi_stall(int state);
+void sim_regs_spi_stall_for(unsigned long polls);
+extern sim_stats sim_st;
+
+/* SPI flash model */
+void sim_flash_init  (sim_flash *flash, u8 vendor, u16 device, u32 size);
+void sim_flash_free  (sim_flash *flash);
+void sim_flash_select(sim_flash *flash, int state);
+u8   sim_flash_xfer  (sim_flash *flash, u8 out);
+
+#endif
+/* EOF */
@@ -0,0 +1,262 @@
+/**
+ * @file  tests/ut_mem/sim_flash.c
+ * @brief Behavioral model of a SPI NOR flash (used to test mem module)
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "sim.h"
+
+/* Number of status polls before the end of a program or erase */
+#define SIM_BUSY_PROGRAM 4
+#define SIM_BUSY_ERASE  32
+
+static void fl_error(sim_flash *flash, const char *msg);
+
+/**
+ * @brief Initialize a flash model (content is erased)
+ *
+ * @param flash  Pointer to the flash model structure
+ * @param vendor JEDEC manufacturer id
+ * @param device JEDEC device id
+ * @param size   Size of the memory array (in bytes)
+ */
+void sim_flash_init(sim_flash *flash, u8 vendor, u16 device, u32 size)
+{
+	u32 i;
+
+	flash->vendor = vendor;
+	flash->device = device;
+	flash->size   = size;
+	/* Default timings : Read Data up to 50MHz, other commands 104MHz */
+	flash->speed      = 104;
+	flash->read_speed = 50;
+	flash->dummy      = 8;
+	flash->clock      = 0;
+	flash->board      = 0;
+	flash->mem    = (u8 *)malloc(size);
+	for (i = 0; i < size; i++)
+		flash->mem[i] = 0xFF;
+
+	flash->selected = 0;
+	flash->cmd   = 0;
+	flash->count = 0;
+	flash->addr  = 0;
+	flash->wel   = 0;
+	flash->busy  = 0;
+	flash->n_read    = 0;
+	flash->n_fast_read = 0;
+	flash->n_program = 0;
+	flash->n_erase   = 0;
+	flash->n_error   = 0;
+}
+
+/**
+ * @brief Release memory allocated for a flash model
+ *
+ * @param flash Pointer to the flash model structure
+ */
+void sim_flash_free(sim_flash *flash)
+{
+	free(flash->mem);
+	flash->mem = 0;
+}
+
+/**
+ * @brief Update the state of the Chip Select signal
+ *
+ * @param flash Pointer to the flash model structure
+ * @param state New state of the CS signal (1 active, 0 inactive)
+ */
+void sim_flash_select(sim_flash *flash, int state)
+{
+	u32 i;
+
+	if (state)
+	{
+		flash->selected = 1;
+		flash->cmd   = 0;
+		flash->count = 0;
+		return;
+	}
+	if (flash->selected == 0)
+		return;
+	flash->selected = 0;
+
+	/* Commands executed on the rising edge of CS */
+	if (flash->cmd == 0x02)
+	{
+		flash->wel  = 0;
+		flash->busy = SIM_BUSY_PROGRAM;
+	}
+	else if (flash->cmd == 0x20)
+	{
+		if (flash->count != (1 + flash->alen))
+		{
+			fl_error(flash, "erase with incomplete address");
+			return;
+		}
+		flash->addr &= ~0xFFFUL;
+		for (i = 0; i < 4096; i++)
+			flash->mem[(flash->addr + i) % flash->size] = 0xFF;
+		flash->n_erase++;
+		flash->wel  = 0;
+		flash->busy = SIM_BUSY_ERASE;
+	}
+}
+
+/**
+ * @brief Exchange one byte with the flash (full duplex)
+ *
+ * @param flash Pointer to the flash model structure
+ * @param out   Byte sent by the host (MOSI)
+ * @return u8   Byte sent by the flash (MISO)
+ */
+u8 sim_flash_xfer(sim_flash *flash, u8 out)
+{
+	uint pos;
+	u32  a;
+	u8   r = 0xFF;
+
+	if (flash->selected == 0)
+		return(0xFF);
+
+	pos = flash->count++;
+
+	/* First byte is the command opcode */
+	if (pos == 0)
+	{
+		/* 4 bytes address versions of the commands */
+		flash->alen = 3;
+		if ((out == 0x13) || (out == 0x0C) || (out == 0x12) || (out == 0x21))
+		{
+			if (flash->size <= 0x1000000)
+				fl_error(flash, "4 bytes address not supported");
+			flash->alen = 4;
+			out = (out == 0x13) ? 0x03 : (out == 0x0C) ? 0x0B :
+			      (out == 0x12) ? 0x02 : 0x20;
+		}
+		flash->cmd = out;
+		if (flash->busy && (out != 0x05))
+		{
+			fl_error(flash, "command received while busy");
+			flash->cmd = 0xFF;
+		}
+		else if (out == 0x06)
+			flash->wel = 1;
+		else if ((out == 0x02) || (out == 0x20))
+		{
+			if ( ! flash->wel)
+			{
+				fl_error(flash, "program/erase without WEL");
+				flash->cmd = 0xFF;
+			}
+			else if (out == 0x02)
+				flash->n_program++;
+		}
+		else if (out == 0x03)
+		{
+			flash->n_read++;
+			if (flash->clock > flash->read_speed)
+				fl_error(flash, "Read Data clock too high");
+		}
+		else if (out == 0x0B)
+			flash->n_fast_read++;
+		else if ((out != 0x9F) && (out != 0x05))
+		{
+			fl_error(flash, "unsupported command");
+			flash->cmd = 0xFF;
+		}
+		if (flash->clock > flash->speed)
+			fl_error(flash, "clock too high");
+		flash->addr = 0;
+		return(0xFF);
+	}
+
+	switch(flash->cmd)
+	{
+		/* Read JEDEC ID */
+		case 0x9F:
+			if (pos == 1)
+				r = flash->vendor;
+			else if (pos == 2)
+				r = (u8)(flash->device >> 8);
+			else if (pos == 3)
+				r = (u8)(flash->device & 0xFF);
+			break;
+		/* Read Status Register */
+		case 0x05:
+			r = (u8)(flash->wel ? 0x02 : 0x00);
+			if (flash->busy)
+			{
+				flash->busy--;
+				r |= 0x01;
+			}
+			break;
+		/* Read Data */
+		case 0x03:
+			if (pos <= flash->alen)
+				flash->addr = (flash->addr << 8) | out;
+			else
+				r = flash->mem[flash->addr++ % flash->size];
+			break;
+		/* Fast Read : address, dummy cycles then data */
+		case 0x0B:
+			if (pos <= flash->alen)
+				flash->addr = (flash->addr << 8) | out;
+			else if (pos <= (flash->alen + (flash->dummy >> 3)))
+				r = 0xFF; // Bus not driven during dummy cycles
+			else
+				r = flash->mem[flash->addr++ % flash->size];
+			break;
+		/* Page Program (address wrap into the 256 bytes page) */
+		case 0x02:
+			if (pos <= flash->alen)
+				flash->addr = (flash->addr << 8) | out;
+			else
+			{
+				a  = (flash->addr & ~0xFFUL);
+				a |= ((flash->addr + pos - 1 - flash->alen) & 0xFF);
+				flash->mem[a % flash->size] &= out;
+			}
+			break;
+		/* Sector Erase : processed on CS release */
+		case 0x20:
+			if (pos <= flash->alen)
+				flash->addr = (flash->addr << 8) | out;
+			else
+				fl_error(flash, "too many bytes for erase");
+			break;
+	}
+	/* Clock too high for the board : bits are sampled too early */
+	if (flash->board && (flash->clock > flash->board))
+		r ^= 0x40;
+	return(r);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                           Private functions                          -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Report a protocol error detected by the flash model
+ *
+ * @param flash Pointer to the flash model structure
+ * @param msg   Description of the error
+ */
+static void fl_error(sim_flash *flash, const char *msg)
+{
+	printf("    - FLASH model error: %s (cmd %.2X)\n", msg, flash->cmd);
+	flash->n_error++;
+}
+/* EOF */
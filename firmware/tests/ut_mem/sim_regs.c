@@ -0,0 +1,656 @@
+/**
+ * @file  tests/ut_mem/sim_regs.c
+ * @brief Register model of STM32G0 SPI, GPIO (CS) and DMA peripherals
+ *
+ * The model has a simple time base (in PCLK cycles) : each register access
+ * costs SIM_REG_CYCLES to the CPU, and each byte written into the SPI data
+ * register is shifted when the previous one is done. Received bytes can be
+ * read only when shifted, with the 32 bits FIFOs of the real peripheral
+ * (threshold, data packing, overrun). DMA transfers do not use time.
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include <stdio.h>
+#include "hardware.h"
+#include "sim.h"
+
+#define SPI_CR1(x) (x + 0x00)
+#define SPI_CR2(x) (x + 0x04)
+#define SPI_SR(x)  (x + 0x08)
+#define SPI_DR(x)  (x + 0x0C)
+
+#define FIFO_SIZE 4
+/* USB packet memory (mapped by tests), only 32 bits accesses are allowed */
+#define PMA_START USB_R1
+#define PMA_END   (USB_R1 + 0x800)
+/* Bytes sent and not yet read : TX FIFO, shift register and RX FIFO */
+#define QUEUE_SIZE ((FIFO_SIZE * 2) + 1)
+
+/* DMA interrupt handlers (defined into spi module) */
+void DMA1C1_Handler(void);
+void DMA1C2C3_Handler(void);
+
+typedef struct sim_spi_s
+{
+	u32  cr1;
+	u32  cr2;
+	u8   fifo[QUEUE_SIZE];
+	unsigned long start[QUEUE_SIZE]; /* Time when byte start to shift */
+	unsigned long ready[QUEUE_SIZE]; /* Time when byte is received    */
+	uint fifo_count;
+	unsigned long shift_end; /* Time when the shift register is free */
+} sim_spi;
+
+typedef struct sim_dma_s
+{
+	u32  ccr;
+	u32  cndtr;
+	u32  cpar;
+	u32  cmar;
+	u32  pos;
+} sim_dma;
+
+sim_stats sim_st;
+
+static sim_spi    spi[2];
+static sim_dma    dma[8];
+static u32        dma_isr;
+static u32        dmamux[8];
+static u32        nvic_iser;
+static int        cs[SIM_CHANNELS];
+static sim_flash *dev[SIM_CHANNELS];
+static int        dma_active;
+static int        dma_hold;
+static int        spi_stall;
+static unsigned long spi_stall_polls;
+
+static u32  sim_rd(u32 addr, uint size);
+static void sim_wr(u32 addr, u32 value, uint size);
+static u8   spi_xfer(uint port, u8 out);
+static uint spi_rx_level(uint port);
+static uint spi_tx_level(uint port);
+static void spi_remove(uint port, uint index);
+static void dma_run(uint port);
+
+/**
+ * @brief Reset all simulated peripherals
+ *
+ */
+void sim_regs_init(void)
+{
+	uint i;
+
+	for (i = 0; i < 2; i++)
+	{
+		spi[i].cr1 = 0;
+		spi[i].cr2 = 0;
+		spi[i].fifo_count = 0;
+		spi[i].shift_end  = 0;
+	}
+	for (i = 0; i < 8; i++)
+	{
+		dma[i].ccr   = 0;
+		dma[i].cndtr = 0;
+		dma[i].cpar  = 0;
+		dma[i].cmar  = 0;
+		dma[i].pos   = 0;
+		dmamux[i] = 0;
+	}
+	for (i = 0; i < SIM_CHANNELS; i++)
+	{
+		cs[i]  = 0;
+		dev[i] = 0;
+	}
+	dma_isr    = 0;
+	nvic_iser  = 0;
+	dma_active = 0;
+	dma_hold   = 0;
+	spi_stall  = 0;
+	spi_stall_polls = 0;
+
+	sim_st.reg_access = 0;
+	sim_st.cfg_access = 0;
+	sim_st.cpu_cycles = 0;
+	sim_st.spi_bytes  = 0;
+	sim_st.spi_cycles = 0;
+	sim_st.dma_bytes  = 0;
+	sim_st.dma_irq    = 0;
+	sim_st.errors     = 0;
+}
+
+/**
+ * @brief Connect a flash model to one SPI channel
+ *
+ * @param channel SPI channel (1->3) as used by the spi module
+ * @param flash   Pointer to the flash model (or NULL to disconnect)
+ */
+void sim_regs_attach(uint channel, sim_flash *flash)
+{
+	if ((channel < 1) || (channel > SIM_CHANNELS))
+		return;
+	dev[channel - 1] = flash;
+}
+
+/**
+ * @brief Stop or restart the clock of the SPI ports
+ *
+ * When stalled, the status register of the ports report no event (TX FIFO
+ * full, RX FIFO empty) : polled transfers can not progress.
+ *
+ * @param state Non-zero to stall ports, zero to restart them
+ */
+void sim_regs_spi_stall(int state)
+{
+	spi_stall = state;
+}
+
+/**
+ * @brief Stall the SPI ports for a number of status register reads
+ *
+ * Same as sim_regs_spi_stall, but the ports restart by themselves after the
+ * specified number of polls. This allow to make only one transfer fail.
+ *
+ * @param polls Number of status reads to report as stalled
+ */
+void sim_regs_spi_stall_for(unsigned long polls)
+{
+	spi_stall_polls = polls;
+}
+
+/**
+ * @brief Suspend or resume DMA transfers
+ *
+ * When DMA is hold, enabled channels do not move any data. This allow to
+ * observe a transfer "in progress". When released, pending transfers are
+ * processed.
+ *
+ * @param state Non-zero to hold DMA, zero to release
+ */
+void sim_regs_dma_hold(int state)
+{
+	dma_hold = state;
+	if (state == 0)
+	{
+		dma_run(0);
+		dma_run(1);
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                    Firmware register access API                      -- */
+/* -------------------------------------------------------------------------- */
+
+void reg_wr(u32 addr, u32 value)
+{
+	sim_st.reg_access++;
+	sim_st.cpu_cycles += SIM_REG_CYCLES;
+	sim_wr(addr, value, 4);
+}
+
+void reg16_wr(u32 addr, u16 value)
+{
+	sim_st.reg_access++;
+	sim_st.cpu_cycles += SIM_REG_CYCLES;
+	sim_wr(addr, value, 2);
+}
+
+void reg8_wr(u32 addr, u8 value)
+{
+	sim_st.reg_access++;
+	sim_st.cpu_cycles += SIM_REG_CYCLES;
+	sim_wr(addr, value, 1);
+}
+
+u32 reg_rd(u32 addr)
+{
+	sim_st.reg_access++;
+	sim_st.cpu_cycles += SIM_REG_CYCLES;
+	return(sim_rd(addr, 4));
+}
+
+u16 reg16_rd(u32 addr)
+{
+	sim_st.reg_access++;
+	sim_st.cpu_cycles += SIM_REG_CYCLES;
+	return((u16)sim_rd(addr, 2));
+}
+
+u8 reg8_rd(u32 addr)
+{
+	sim_st.reg_access++;
+	sim_st.cpu_cycles += SIM_REG_CYCLES;
+	return((u8)sim_rd(addr, 1));
+}
+
+void reg_clr(u32 addr, u32 value)
+{
+	reg_wr(addr, reg_rd(addr) & ~value);
+}
+
+void reg16_clr(u32 addr, u16 value)
+{
+	reg16_wr(addr, (u16)(reg16_rd(addr) & ~value));
+}
+
+void reg8_clr(u32 addr, u8 value)
+{
+	reg8_wr(addr, (u8)(reg8_rd(addr) & ~value));
+}
+
+void reg_set(u32 addr, u32 value)
+{
+	reg_wr(addr, reg_rd(addr) | value);
+}
+
+void reg16_set(u32 addr, u16 value)
+{
+	reg16_wr(addr, (u16)(reg16_rd(addr) | value));
+}
+
+void reg8_set(u32 addr, u8 value)
+{
+	reg8_wr(addr, (u8)(reg8_rd(addr) | value));
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                      Private model functions                         -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Read a simulated register
+ *
+ * @param addr Address of the register
+ * @param size Size of the access (in bytes)
+ * @return u32 Current value of the register
+ */
+static u32 sim_rd(u32 addr, uint size)
+{
+	uint p, c, n, level;
+	u32  v;
+
+	if ((addr >= PMA_START) && (addr < PMA_END))
+	{
+		if ((size != 4) || (addr & 3))
+		{
+			printf("    - PMA model error: %u bytes read at %lx\n", size, addr);
+			sim_st.errors++;
+		}
+		return(*(volatile unsigned int *)(unsigned long)addr);
+	}
+
+	for (p = 0; p < 2; p++)
+	{
+		u32 base = p ? SPI2 : SPI1;
+		if (addr == SPI_CR1(base))
+		{
+			sim_st.cfg_access++;
+			return(spi[p].cr1);
+		}
+		if (addr == SPI_CR2(base))
+			return(spi[p].cr2);
+		if (addr == SPI_SR(base))
+		{
+			v = 0;
+			if (spi_stall)
+				return(v);
+			if (spi_stall_polls)
+			{
+				spi_stall_polls--;
+				return(v);
+			}
+			level = spi_rx_level(p);
+			/* RXNE depends on FRXTH : 8 or 16 bits received */
+			if (level >= ((spi[p].cr2 & (1 << 12)) ? 1U : 2U))
+				v |= (1 << 0);
+			/* TXE when TX FIFO is half empty or less */
+			if (spi_tx_level(p) <= (FIFO_SIZE / 2))
+				v |= (1 << 1);
+			v |= ((level > 3) ? 3 : level) << 9; // FRLVL
+			v |= ((spi_tx_level(p) > 3) ? 3 : spi_tx_level(p)) << 11; // FTLVL
+			return(v);
+		}
+		if (addr == SPI_DR(base))
+		{
+			/* Data packing : 16 bits access read two bytes */
+			n = (size > 1) ? 2 : 1;
+			if ((dma_active == 0) && (spi_rx_level(p) < n))
+			{
+				printf("    - SPI model error: read of empty RX FIFO\n");
+				sim_st.errors++;
+				return(0);
+			}
+			v = 0;
+			for (c = 0; (c < n) && spi[p].fifo_count; c++)
+			{
+				v |= (u32)spi[p].fifo[0] << (c * 8);
+				spi_remove(p, 0);
+			}
+			return(v);
+		}
+	}
+	if (addr == DMA_ISR(DMA1))
+		return(dma_isr);
+	for (c = 1; c <= 7; c++)
+	{
+		if (addr == DMA_CCR(DMA1, c))
+			return(dma[c].ccr);
+		if (addr == DMA_CNDTR(DMA1, c))
+			return(dma[c].cndtr);
+		if (addr == DMA_CPAR(DMA1, c))
+			return(dma[c].cpar);
+		if (addr == DMA_CMAR(DMA1, c))
+			return(dma[c].cmar);
+		if (addr == DMAMUX_CCR(c))
+			return(dmamux[c]);
+	}
+	if (addr == CM0_NVIC)
+		return(nvic_iser);
+	return(0);
+}
+
+/**
+ * @brief Write a simulated register
+ *
+ * @param addr  Address of the register
+ * @param value Value to write
+ * @param size  Size of the access (in bytes)
+ */
+static void sim_wr(u32 addr, u32 value, uint size)
+{
+	unsigned long start;
+	uint p, c, n;
+
+	if ((addr >= PMA_START) && (addr < PMA_END))
+	{
+		if ((size != 4) || (addr & 3))
+		{
+			printf("    - PMA model error: %u bytes write at %lx\n", size, addr);
+			sim_st.errors++;
+		}
+		*(volatile unsigned int *)(unsigned long)addr = (unsigned int)value;
+		return;
+	}
+
+	/* Chip Select signals (active low) */
+	if (addr == GPIO_BSRR(GPIOA))
+	{
+		if (value & (1 << 20))
+			cs[0] = 1;
+		if (value & (1 << 4))
+			cs[0] = 0;
+	}
+	else if (addr == GPIO_BSRR(GPIOB))
+	{
+		if (value & (1 << 17))
+			cs[1] = 1;
+		if (value & (1 << 1))
+			cs[1] = 0;
+		if (value & (1 << 25))
+			cs[2] = 1;
+		if (value & (1 << 9))
+			cs[2] = 0;
+	}
+	if ((addr == GPIO_BSRR(GPIOA)) || (addr == GPIO_BSRR(GPIOB)))
+	{
+		for (c = 0; c < SIM_CHANNELS; c++)
+			if (dev[c])
+				sim_flash_select(dev[c], cs[c]);
+		return;
+	}
+
+	for (p = 0; p < 2; p++)
+	{
+		u32 base = p ? SPI2 : SPI1;
+		if (addr == SPI_CR1(base))
+		{
+			sim_st.cfg_access++;
+			spi[p].cr1 = value;
+		}
+		else if (addr == SPI_CR2(base))
+		{
+			spi[p].cr2 = value;
+			dma_run(p);
+		}
+		else if (addr == SPI_DR(base))
+		{
+			/* Data packing : 16 bits access write two bytes */
+			n = (size > 1) ? 2 : 1;
+			for (c = 0; c < n; c++)
+			{
+				if ((dma_active == 0) && (spi_tx_level(p) >= FIFO_SIZE))
+				{
+					printf("    - SPI model error: TX FIFO overflow\n");
+					sim_st.errors++;
+				}
+				if (spi[p].fifo_count == QUEUE_SIZE)
+				{
+					printf("    - SPI model error: RX overrun\n");
+					sim_st.errors++;
+					(void)spi_xfer(p, (u8)(value >> (c * 8)));
+					continue;
+				}
+				start = sim_st.cpu_cycles;
+				if (start < spi[p].shift_end)
+					start = spi[p].shift_end;
+				spi[p].shift_end = start + 8UL * (2UL << ((spi[p].cr1 >> 3) & 7));
+				spi[p].start[spi[p].fifo_count] = start;
+				spi[p].ready[spi[p].fifo_count] = spi[p].shift_end;
+				spi[p].fifo[spi[p].fifo_count++] = spi_xfer(p, (u8)(value >> (c * 8)));
+			}
+		}
+		else
+			continue;
+		return;
+	}
+
+	if (addr == DMA_IFCR(DMA1))
+	{
+		dma_isr &= ~value;
+		return;
+	}
+	for (c = 1; c <= 7; c++)
+	{
+		if (addr == DMA_CCR(DMA1, c))
+		{
+			/* Restart memory pointer when channel is enabled */
+			if ((value & 1) && ((dma[c].ccr & 1) == 0))
+				dma[c].pos = 0;
+			dma[c].ccr = value;
+			dma_run((c - 1) >> 1);
+		}
+		else if (addr == DMA_CNDTR(DMA1, c))
+			dma[c].cndtr = (value & 0xFFFF);
+		else if (addr == DMA_CPAR(DMA1, c))
+			dma[c].cpar = value;
+		else if (addr == DMA_CMAR(DMA1, c))
+			dma[c].cmar = value;
+		else if (addr == DMAMUX_CCR(c))
+			dmamux[c] = value;
+		else
+			continue;
+		return;
+	}
+	if (addr == CM0_NVIC)
+		nvic_iser |= value;
+}
+
+/**
+ * @brief Clock one byte on a SPI port
+ *
+ * @param port Index of the SPI port (0 for SPI1, 1 for SPI2)
+ * @param out  Byte to send
+ * @return u8  Received byte
+ */
+static u8 spi_xfer(uint port, u8 out)
+{
+	uint c, first, last;
+	u8   r = 0xFF;
+
+	if ((spi[port].cr1 & (1 << 6)) == 0)
+	{
+		printf("    - SPI model error: port %d used while disabled\n", port + 1);
+		sim_st.errors++;
+	}
+	sim_st.spi_bytes++;
+	sim_st.spi_cycles += 8UL * (2UL << ((spi[port].cr1 >> 3) & 7));
+
+	first = port ? 2 : 0;
+	last  = port ? 2 : 1;
+	for (c = first; c <= last; c++)
+	{
+		if ((cs[c] == 0) || (dev[c] == 0))
+			continue;
+		dev[c]->clock = SIM_PCLK / (2U << ((spi[port].cr1 >> 3) & 7));
+		r = sim_flash_xfer(dev[c], out);
+	}
+	return(r);
+}
+
+/**
+ * @brief Get the number of received bytes into the RX FIFO of a port
+ *
+ * Bytes received while the RX FIFO was full are lost (overrun error).
+ *
+ * @param port Index of the SPI port (0 for SPI1, 1 for SPI2)
+ * @return uint Number of bytes that can be read
+ */
+static uint spi_rx_level(uint port)
+{
+	uint i, n = 0;
+
+	for (i = 0; i < spi[port].fifo_count; i++)
+	{
+		if (spi[port].ready[i] <= sim_st.cpu_cycles)
+			n++;
+	}
+	if ((n > FIFO_SIZE) && (dma_active == 0))
+	{
+		printf("    - SPI model error: RX overrun\n");
+		sim_st.errors++;
+		/* Byte received with a full FIFO is lost */
+		spi_remove(port, FIFO_SIZE);
+		n--;
+	}
+	return(n);
+}
+
+/**
+ * @brief Get the number of bytes into the TX FIFO of a port (not shifted)
+ *
+ * @param port Index of the SPI port (0 for SPI1, 1 for SPI2)
+ * @return uint Number of bytes waiting to be sent
+ */
+static uint spi_tx_level(uint port)
+{
+	uint i, n = 0;
+
+	for (i = 0; i < spi[port].fifo_count; i++)
+	{
+		if (spi[port].start[i] > sim_st.cpu_cycles)
+			n++;
+	}
+	return(n);
+}
+
+/**
+ * @brief Remove one byte from the queue of a port
+ *
+ * @param port  Index of the SPI port (0 for SPI1, 1 for SPI2)
+ * @param index Position of the byte into the queue
+ */
+static void spi_remove(uint port, uint index)
+{
+	sim_spi *sp = &spi[port];
+	uint i;
+
+	for (i = index + 1; i < sp->fifo_count; i++)
+	{
+		sp->fifo[i - 1]  = sp->fifo[i];
+		sp->start[i - 1] = sp->start[i];
+		sp->ready[i - 1] = sp->ready[i];
+	}
+	sp->fifo_count--;
+}
+
+/**
+ * @brief Process pending DMA requests of one SPI port
+ *
+ * DMA transfers are instantaneous for the model : when both SPI request and
+ * channel are enabled, all bytes are moved at once.
+ *
+ * @param port Index of the SPI port (0 for SPI1, 1 for SPI2)
+ */
+static void dma_run(uint port)
+{
+	sim_dma *rx, *tx;
+	int irq = 0;
+	uint crx;
+	u32  base;
+	u8   b;
+
+	if ((port > 1) || dma_active || dma_hold)
+		return;
+	base = port ? SPI2 : SPI1;
+	crx  = (port << 1) + 1;
+	rx   = &dma[crx];
+	tx   = &dma[crx + 1];
+
+	/* TX request must be enabled and routed to the TX channel */
+	if ( ((spi[port].cr2 & (1 << 1)) == 0) || ((tx->ccr & 1) == 0) )
+		return;
+	if (dmamux[crx + 1] != (17 + (port << 1)))
+		return;
+	dma_active = 1;
+
+	while (tx->cndtr)
+	{
+		b = *(u8 *)(tx->cmar + tx->pos);
+		if (tx->ccr & (1 << 7))
+			tx->pos++;
+		sim_wr(SPI_DR(base), b, 1);
+		sim_st.dma_bytes++;
+		tx->cndtr--;
+		if (tx->cndtr == 0)
+			dma_isr |= (3UL << (crx * 4));
+
+		/* RX channel moves the received byte to memory */
+		if ((spi[port].cr2 & (1 << 0)) && (rx->ccr & 1) &&
+		    (dmamux[crx] == (16 + (port << 1))) && rx->cndtr)
+		{
+			*(u8 *)(rx->cmar + rx->pos) = (u8)sim_rd(SPI_DR(base), 1);
+			if (rx->ccr & (1 << 7))
+				rx->pos++;
+			rx->cndtr--;
+			if (rx->cndtr == 0)
+			{
+				dma_isr |= (3UL << ((crx - 1) * 4));
+				if (rx->ccr & (1 << 1))
+					irq = 1;
+			}
+		}
+	}
+	dma_active = 0;
+
+	if (irq == 0)
+		return;
+	if ((port == 0) && (nvic_iser & (1 << 9)))
+	{
+		sim_st.dma_irq++;
+		DMA1C1_Handler();
+	}
+	else if ((port == 1) && (nvic_iser & (1 << 10)))
+	{
+		sim_st.dma_irq++;
+		DMA1C2C3_Handler();
+	}
+}
+/* EOF */
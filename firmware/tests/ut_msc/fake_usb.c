@@ -0,0 +1,372 @@
+/**
+ * @file  tests/ut_msc/fake_usb.c
+ * @brief Simulated USB core (device side) and bulk host with bus timings
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include <stdio.h>
+#include "fake_usb.h"
+#include "time.h"
+#include "usb.h"
+#include "work.h"
+
+sim_time    sim_now;
+fake_timing timing;
+fake_host   host;
+fake_usb_stats fake_stats;
+
+static usb_if_drv *if_drv;
+static usb_ep_def  ep_defs[8];
+/* IN packets queued (copy of data, as into PMA), two when double-buffered */
+static u8       tx_data[2][64] __attribute__((aligned(4)));
+static uint     tx_len[2];
+static sim_time tx_start[2];
+static uint     tx_first;
+static uint     tx_pending;
+static uint     tx_slots;
+static sim_time tx_end;
+/* State of the OUT endpoint (host can send only when valid) */
+static int      rx_valid;
+/* PendSV exception : pending flag and active state */
+static int      pendsv_pending;
+static int      pendsv_active;
+
+static void host_receive(const u8 *data, uint len);
+static void irq_exit(void);
+/* Handler of the deferred work queue (see work.c) */
+void PendSV_Handler(void);
+
+/**
+ * @brief Reset the simulated USB core and host
+ *
+ */
+void fake_usb_init(void)
+{
+	uint i;
+
+	sim_now = 0;
+	if_drv  = 0;
+	for (i = 0; i < 8; i++)
+	{
+		ep_defs[i].release     = 0;
+		ep_defs[i].rx          = 0;
+		ep_defs[i].tx_complete = 0;
+	}
+	tx_pending = 0;
+	tx_first   = 0;
+	fake_stats.pkt_copy   = 0;
+	fake_stats.pkt_direct = 0;
+	fake_stats.pkt_refused = 0;
+	fake_stats.refuse      = 0;
+	tx_slots   = 1;
+	rx_valid   = 0;
+	pendsv_pending = 0;
+	pendsv_active  = 0;
+
+	/* Default timings : Full-Speed bus, 20 bytes of protocol per packet */
+	timing.byte_ns = 667;
+	timing.pkt_ovh = 20;
+	timing.loop_ns = 5000;
+	timing.app_ns  = 0;
+}
+
+/**
+ * @brief Simulate the end of enumeration (SET_CONFIGURATION)
+ *
+ */
+void fake_usb_enable(void)
+{
+	if (if_drv && if_drv->enable)
+		if_drv->enable(1);
+}
+
+/**
+ * @brief Host send a packet on the bulk OUT endpoint (EP2)
+ *
+ * @param data Pointer to the packet (must be 32 bits aligned, as PMA)
+ * @param len  Length of the packet
+ */
+void fake_usb_out(const u8 *data, uint len)
+{
+	/* Endpoint NAK the packet until firmware set it valid */
+	while (rx_valid == 0)
+		fake_usb_loop();
+
+	sim_advance((sim_time)(len + timing.pkt_ovh) * timing.byte_ns);
+	if (ep_defs[2].rx)
+		rx_valid = ep_defs[2].rx((u8 *)data, len);
+	irq_exit();
+}
+
+/**
+ * @brief Host clear the halt of a stalled endpoint (CLEAR_FEATURE)
+ *
+ * The data phase ends, packets still queued into the IN endpoint are lost.
+ * The host can then read the CSW.
+ *
+ * @param ep Endpoint id (1 -> 7)
+ */
+void fake_usb_clear_halt(u8 ep)
+{
+	host.stall    = 0;
+	host.expected = host.received;
+	if (ep == 1)
+		tx_pending = 0;
+	if (ep_defs[ep].release)
+		ep_defs[ep].release(ep);
+	irq_exit();
+}
+
+/**
+ * @brief Run one iteration of the firmware main loop
+ *
+ */
+void fake_usb_loop(void)
+{
+	if (if_drv && if_drv->periodic)
+		if_drv->periodic();
+	/* Work posted by main loop : PendSV is taken immediately */
+	irq_exit();
+	/* Other main loop stuff, and app_periodic */
+	sim_advance(timing.loop_ns + timing.app_ns);
+}
+
+/**
+ * @brief Advance simulation time and process bus events (interrupts)
+ *
+ * The firmware code that consume time (main loop, LUN accesses) call this
+ * function. When an IN packet ends during this period, the endpoint callback
+ * is called like the USB interrupt would do. With a double-buffered endpoint
+ * the second packet starts as soon as the first ends.
+ *
+ * @param ns Duration (in ns)
+ */
+void sim_advance(sim_time ns)
+{
+	sim_time end = sim_now + ns;
+	uint slot;
+
+	while (tx_pending && (tx_end <= end))
+	{
+		sim_now = tx_end;
+		slot = tx_first;
+		tx_first ^= (tx_slots - 1);
+		tx_pending--;
+		/* Next packet already queued : start it now */
+		if (tx_pending)
+		{
+			if (tx_start[tx_first] < sim_now)
+				tx_start[tx_first] = sim_now;
+			tx_end = tx_start[tx_first] +
+			         (sim_time)(tx_len[tx_first] + timing.pkt_ovh) * timing.byte_ns;
+		}
+		host_receive(tx_data[slot], tx_len[slot]);
+		if (ep_defs[1].tx_complete)
+			ep_defs[1].tx_complete();
+		irq_exit();
+	}
+	sim_now = end;
+}
+
+/**
+ * @brief Simulate the end of an interrupt handler
+ *
+ * When the handler has pended PendSV (see work_post) the exception is taken
+ * now, unless PendSV is already active : an interrupt during PendSV returns
+ * to it and the exception will be taken again when it ends.
+ */
+static void irq_exit(void)
+{
+	if (pendsv_active)
+		return;
+	pendsv_active = 1;
+	while (pendsv_pending)
+	{
+		pendsv_pending = 0;
+		PendSV_Handler();
+	}
+	pendsv_active = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                    Fake system control block                         -- */
+/* -------------------------------------------------------------------------- */
+
+u32 reg_rd(u32 reg)
+{
+	(void)reg;
+	return(0);
+}
+
+void reg_wr(u32 addr, u32 value)
+{
+	/* ICSR : PENDSVSET */
+	if ((addr == SCB_ICSR) && (value & (1 << 28)))
+		pendsv_pending = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                        Fake USB core API                             -- */
+/* -------------------------------------------------------------------------- */
+
+int usb_send(const u8 ep, const u8 *data, unsigned int len)
+{
+	uint i, slot;
+
+	if (ep != 1)
+		return(0);
+	/* Endpoint busy (as USB interrupt still running) : packet refused, it
+	 * must be sent again after a completion */
+	if (fake_stats.refuse && tx_pending)
+	{
+		fake_stats.refuse--;
+		fake_stats.pkt_refused++;
+		return(-1);
+	}
+	if (tx_pending >= tx_slots)
+	{
+		printf("    - USB model error: send while no buffer is free\n");
+		host.stall = -1;
+		return(-1);
+	}
+	if (len > 64)
+	{
+		printf("    - USB model error: packet too large (%d)\n", len);
+		host.stall = -1;
+		len = 64;
+	}
+	slot = (tx_first + tx_pending) & (tx_slots - 1);
+	/* Data pointer is null when data are already into PMA */
+	if (data)
+	{
+		for (i = 0; i < len; i++)
+			tx_data[slot][i] = data[i];
+		fake_stats.pkt_copy++;
+	}
+	else
+		fake_stats.pkt_direct++;
+	tx_len[slot]   = len;
+	tx_start[slot] = sim_now;
+	if (tx_pending == 0)
+		tx_end = sim_now + (sim_time)(len + timing.pkt_ovh) * timing.byte_ns;
+	tx_pending++;
+	return(0);
+}
+
+void usb_ep_configure(u8 ep, u8 type, usb_ep_def *def)
+{
+	if ((ep < 1) || (ep > 7))
+		return;
+	ep_defs[ep] = *def;
+	if (def->rx)
+		rx_valid = 1;
+	if ((ep == 1) && (type & USB_EP_DBL_BUF))
+		tx_slots = 2;
+}
+
+int usb_ep_tx_free(u8 ep)
+{
+	if (ep != 1)
+		return(0);
+	return((int)(tx_slots - tx_pending));
+}
+
+u8 *usb_ep_tx_buffer(u8 ep)
+{
+	if (usb_ep_tx_free(ep) == 0)
+		return(0);
+	return(tx_data[(tx_first + tx_pending) & (tx_slots - 1)]);
+}
+
+/**
+ * @brief Test if a pointer is into the simulated packet memory
+ *
+ * @param p Pointer to test
+ * @return boolean True if the pointer is into one of the PMA buffers
+ */
+int fake_usb_is_pma(const void *p)
+{
+	const u8 *b = (const u8 *)p;
+	return((b >= &tx_data[0][0]) && (b < &tx_data[2][0]));
+}
+
+void usb_ep_set_state(u8 ep, u8 state)
+{
+	if (ep == 2)
+		rx_valid = (state == USB_EP_VALID);
+	if (state == USB_EP_STALL)
+	{
+		printf("    - Endpoint %.2X stalled\n", ep);
+		host.stall = 1;
+	}
+}
+
+int usb_if_register(uint num, usb_if_drv *new_if)
+{
+	(void)num;
+	if_drv = new_if;
+	return(0);
+}
+
+void memcpy_from_pma(u8 *dst, const u8 *src, unsigned int len)
+{
+	/* Received packets are into host buffers (no PMA) */
+	for ( ; len > 0; len--)
+		*dst++ = *src++;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                          Host side                                   -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Process an IN packet received by host
+ *
+ * @param data Pointer to packet content
+ * @param len  Length of the packet
+ */
+static void host_receive(const u8 *data, uint len)
+{
+	uint i;
+
+	/* Data phase */
+	if (host.received < host.expected)
+	{
+		for (i = 0; i < len; i++)
+			host.data[host.received + i] = data[i];
+		host.received += len;
+		/* Save end time of each complete sector */
+		if (((host.received & 511) == 0) && (host.sectors < HOST_MAX_SECTORS))
+			host.t_sector[host.sectors++] = sim_now;
+		/* Short packet ends data phase */
+		if (len < 64)
+			host.expected = host.received;
+		return;
+	}
+	/* Status phase */
+	for (i = 0; (i < len) && (i < sizeof(host.csw)); i++)
+		host.csw[i] = data[i];
+	host.csw_len = len;
+	host.t_csw   = sim_now;
+}
+/**
+ * @brief Current time in ticks (1ms), from the simulation time
+ *
+ * @param timeval Not used
+ * @return u32 Number of ms elapsed since start of simulation
+ */
+u32 time_now(tm_t *timeval)
+{
+	(void)timeval;
+	return((u32)(sim_now / 1000000));
+}
+/* EOF */
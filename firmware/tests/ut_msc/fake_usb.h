@@ -0,0 +1,67 @@
+/**
+ * @file  tests/ut_msc/fake_usb.h
+ * @brief Headers and definitions for the simulated USB core and host
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef FAKE_USB_H
+#define FAKE_USB_H
+#include "types.h"
+
+#define HOST_MAX_SECTORS 1024
+
+typedef unsigned long long sim_time; /* Simulation time (in ns) */
+
+typedef struct fake_timing_s
+{
+	uint byte_ns;  /* Time to transfer one byte on the bus (FS: 12Mbps)  */
+	uint pkt_ovh;  /* Protocol overhead of one packet (in bytes)         */
+	uint loop_ns;  /* Duration of one main loop iteration (out of MSC)   */
+	uint app_ns;   /* Duration of app_periodic (slow custom app)         */
+} fake_timing;
+
+typedef struct fake_host_s
+{
+	u8   *data;     /* Buffer for received data (Data IN phase) */
+	uint  expected; /* Length of data phase requested into CBW  */
+	uint  received;
+	u8    csw[16];
+	uint  csw_len;  /* Zero until CSW has been received         */
+	sim_time t_csw; /* Time when CSW has been received          */
+	int   stall;
+	uint  sectors;
+	sim_time t_sector[HOST_MAX_SECTORS]; /* End time of each sector */
+} fake_host;
+
+typedef struct fake_usb_stats_s
+{
+	uint pkt_copy;   /* IN packets copied from a buffer by usb_send()   */
+	uint pkt_direct; /* IN packets already into PMA (usb_send(ep, 0))  */
+	uint pkt_refused;/* IN packets refused by usb_send() (see refuse)   */
+	uint refuse;     /* Number of next packets to refuse (EP busy)      */
+} fake_usb_stats;
+
+extern sim_time    sim_now;
+extern fake_timing timing;
+extern fake_host   host;
+extern fake_usb_stats fake_stats;
+
+void fake_usb_init(void);
+void fake_usb_enable(void);
+void fake_usb_out(const u8 *data, uint len);
+void fake_usb_loop(void);
+void sim_advance(sim_time ns);
+int  fake_usb_is_pma(const void *p);
+void fake_usb_clear_halt(u8 ep);
+
+#endif
+/* EOF */
@@ -0,0 +1,30 @@
+/**
+ * @file  tests/ut_msc/hardware.h
+ * @brief Alternative hardware definition file to compile firmware modules
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef HARDWARE_H
+#define HARDWARE_H
+#include "types.h"
+
+/* Only used by macros of usb.h, USB core is simulated (see fake_usb.c) */
+#define USB    0x40005C00
+#define USB_R1 0x40009800
+/* Only used by work.c, system control block is simulated (see fake_usb.c) */
+#define CM0_SCB 0xE000ED00
+
+u32  reg_rd(u32 reg);
+void reg_wr(u32 addr, u32 value);
+
+#endif
+/* EOF */
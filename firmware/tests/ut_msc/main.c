@@ -0,0 +1,1390 @@
+/**
+ * @file  tests/ut_msc/main.c
+ * @brief Benchmark of the MSC data path (usb_msc + scsi) on a fake bus
+ *
+ * Most tests use LUN 0, a multi-LUN test interleaves commands to several
+ * LUNs and verifies that data and sense are kept separated.
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "types.h"
+#include "fake_usb.h"
+#include "scsi.h"
+#include "usb_msc.h"
+#include "work.h"
+
+/* Time needed by the LUN to read one sector (4k cache hit + SPI at 32MHz) */
+#define LUN_RD_NS 140000
+/* Time needed by the LUN to copy one sector into its 4k write buffer */
+#define LUN_WR_NS 20000
+
+static u8  rx_buffer[HOST_MAX_SECTORS * 512];
+static u8  ref_buffer[HOST_MAX_SECTORS * 512];
+static uint lun_pma_err;
+static u32  lun_rd_fail = 0xFFFFFFFF; /* Address that LUN fails to read */
+static u8  out_buffer[64 * 512] __attribute__((aligned(4)));
+static u32 cbw_buffer[8];
+static u32 tag;
+static u8  cbw_lun;    /* LUN addressed by the next CBW            */
+static u8  csw_expect; /* Status expected into the next CSW        */
+/* Small RAM disks used as LUN 1 and LUN 2 (see t_multi_lun) */
+#define DISK_SECTORS 64
+static u8  disk[2][DISK_SECTORS * 512];
+static sim_time cmd_latency; /* Time between end of CBW and CSW reception */
+/* Medium model for writes : a 4k sector is erased and programmed when full */
+static int      media_async; /* Erase/program run in background          */
+static sim_time media_erase; /* Duration of one sector erase (ns)         */
+static sim_time media_prog;  /* Duration of one page (256 bytes) program  */
+static sim_time media_end;   /* End of the running erase/program          */
+static uint     media_fill;  /* Number of sectors into the write buffer   */
+static uint     media_busy;  /* Writes retried because medium was busy    */
+static uint     lun_wr_err;
+static uint     unmap_count; /* Number of ranges given to lun_unmap   */
+static u32      unmap_bytes; /* Total length of these ranges          */
+
+/* Upper limits (in us) of the latency histogram buckets */
+#define LAT_BUCKETS 8
+static const uint lat_limit[LAT_BUCKETS] = {50, 100, 200, 500, 1000, 2000, 5000, 0};
+
+static int  lun_rd(u32 addr, u32 len, u8 *data);
+static int  lun_wr(u32 addr, u32 len, u8 *data);
+static int  lun_flush(void);
+static int  lun_unmap(u32 addr, u32 len);
+static int  disk_rd(u32 addr, u32 len, u8 *data);
+static int  disk_wr(u32 addr, u32 len, u8 *data);
+static int  run_cmd(const u8 *cb, uint cb_len, uint data_len, sim_time *duration);
+static int  run_out(const u8 *cb, uint cb_len, const u8 *data, uint data_len,
+                    sim_time *duration);
+static void cbw_send(const u8 *cb, uint cb_len, uint data_len, u8 flags);
+static int  csw_wait(sim_time start, sim_time *duration);
+static int  t_inquiry(void);
+static int  t_read(u32 lba, uint count, uint host_len, int bench);
+static int  t_direct(lun *unit, u32 lba, uint count, uint host_len);
+static int  t_read_error(lun *unit, int direct);
+static int  t_latency(uint app_ns, sim_time *lat_max);
+static int  t_lock(void);
+static int  t_multi_lun(void);
+static int  t_cdb_rw(void);
+static int  t_sync(void);
+static int  t_unmap(void);
+static int  t_sense(u8 pos, u8 key, u8 asc);
+static int  t_write(uint count, int async, sim_time *duration, sim_time *idle);
+static int  t_write_media(uint erase_us, uint prog_us);
+static u8   pattern(u32 addr);
+
+/**
+ * @brief Entry point of the program
+ *
+ * @return integer Execution result returned to OS :p
+ */
+int main(int argc, char **argv)
+{
+	lun *unit;
+	sim_time lat_ref, lat_slow;
+	uint erase_us = 45000, prog_us = 700;
+
+	printf("--=={ MSC benchmark }==--\n");
+
+	fake_usb_init();
+	scsi_init();
+	usb_msc_init();
+	fake_usb_enable();
+
+	unit = scsi_lun_get(0);
+	unit->state    = 1;
+	unit->capacity = 131072;
+	unit->rd       = lun_rd;
+	unit->wr       = lun_wr;
+	unit->flush    = lun_flush;
+	unit->writable = 1;
+
+	if (t_inquiry())
+		return(-1);
+	if (t_read(0, 1, 512, 0))
+		return(-1);
+	if (t_read(100, 4, 4 * 512, 0))
+		return(-1);
+	/* Host request less data than the command transfer length */
+	if (t_read(200, 4, 1024, 0))
+		return(-1);
+	if (t_read(1000, 128, 128 * 512, 1))
+		return(-1);
+
+	/* Zero-copy : LUN read directly into the IN endpoint buffers */
+	if (t_direct(unit, 100, 4, 4 * 512))
+		return(-1);
+	if (t_direct(unit, 200, 4, 1000))
+		return(-1);
+	/* LUN read errors are reported to host (CSW and sense) */
+	if (t_read_error(unit, 0))
+		return(-1);
+	if (t_read_error(unit, 1))
+		return(-1);
+	unit->perm |= SCSI_PERM_RD_DIRECT;
+	if (t_read(1000, 128, 128 * 512, 1))
+		return(-1);
+
+	/* Command latency must not depend on the main loop (app_periodic) */
+	if (t_latency(0, &lat_ref))
+		return(-1);
+	if (t_latency(2000000, &lat_slow))
+		return(-1);
+	if (lat_slow > lat_ref + (lat_ref / 10))
+	{
+		printf("    - Latency depends on app_periodic (%.1f us > %.1f us)\n",
+		       (double)lat_slow / 1000.0, (double)lat_ref / 1000.0);
+		return(-1);
+	}
+
+	if (t_lock())
+		return(-1);
+	if (t_multi_lun())
+		return(-1);
+	if (t_cdb_rw())
+		return(-1);
+	if (t_sync())
+		return(-1);
+	if (t_unmap())
+		return(-1);
+
+	/* Writes : bus must not be blocked by erase/program (timings in us) */
+	if (argc == 3)
+	{
+		erase_us = (uint)strtoul(argv[1], 0, 0);
+		prog_us  = (uint)strtoul(argv[2], 0, 0);
+	}
+	if (t_write_media(erase_us, prog_us))
+		return(-1);
+	if ((argc != 3) && t_write_media(20000, 300))
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Test a small command (INQUIRY) with Data IN phase
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_inquiry(void)
+{
+	const u8 cb[6] = {0x12, 0x00, 0x00, 0x00, 36, 0x00};
+
+	printf(" * Test INQUIRY\n");
+	if (run_cmd(cb, 6, 36, 0))
+		return(-1);
+	if ((host.received != 36) || (rx_buffer[8] != 'A'))
+	{
+		printf("    - Invalid response (%d bytes)\n", host.received);
+		return(-1);
+	}
+	printf("    - Response received (ok)\n");
+	return(0);
+}
+
+/**
+ * @brief Test (and measure) a READ(10) command
+ *
+ * @param lba      Address of the first sector to read
+ * @param count    Number of sectors to read
+ * @param host_len Length of data expected by host (into CBW)
+ * @param bench    Set to non-zero to report throughput and check it
+ * @return integer Zero on success, other values are errors
+ */
+static int t_read(u32 lba, uint count, uint host_len, int bench)
+{
+	u8 cb[10] = {0x28, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	sim_time duration, d, d_max, d_sum, bus;
+	double mbps;
+	uint i, n;
+
+	printf(" * Test READ(10) of %d sectors at %d (host expect %d bytes)\n",
+	       count, lba, host_len);
+
+	cb[2] = (u8)(lba >> 24);
+	cb[3] = (u8)(lba >> 16);
+	cb[4] = (u8)(lba >>  8);
+	cb[5] = (u8)(lba >>  0);
+	cb[7] = (u8)(count >> 8);
+	cb[8] = (u8)(count >> 0);
+
+	if (run_cmd(cb, 10, host_len, &duration))
+		return(-1);
+
+	n = (host_len < (count * 512)) ? host_len : (count * 512);
+	if (host.received != n)
+	{
+		printf("    - Received %d bytes, %d expected\n", host.received, n);
+		return(-1);
+	}
+	for (i = 0; i < n; i++)
+	{
+		if (rx_buffer[i] != pattern((lba * 512) + i))
+		{
+			printf("    - Data mismatch at offset %d\n", i);
+			return(-1);
+		}
+	}
+	printf("    - Data ok\n");
+
+	if (bench == 0)
+		return(0);
+
+	/* Per-sector latency : time between the end of two sectors */
+	d_sum = 0;
+	d_max = 0;
+	for (i = 1; i < host.sectors; i++)
+	{
+		d = host.t_sector[i] - host.t_sector[i - 1];
+		d_sum += d;
+		if (d > d_max)
+			d_max = d;
+	}
+	mbps = ((double)n / 1000000.0) / ((double)duration / 1000000000.0);
+	/* Time needed by the bus itself for one sector (8 packets) */
+	bus = 8ULL * (64 + timing.pkt_ovh) * timing.byte_ns;
+
+	printf("    - Throughput %.3f MB/s (%d bytes in %.3f ms)\n",
+	       mbps, n, (double)duration / 1000000.0);
+	printf("    - First sector after %.1f us\n",
+	       (double)host.t_sector[0] / 1000.0);
+	printf("    - Sector latency avg %.1f us, max %.1f us (bus %.1f us, lun %.1f us)\n",
+	       (double)d_sum / (double)(host.sectors - 1) / 1000.0,
+	       (double)d_max / 1000.0, (double)bus / 1000.0, LUN_RD_NS / 1000.0);
+
+	/* With the read pipeline, LUN accesses are hidden behind the bus */
+	if ((d_sum / (host.sectors - 1)) > (bus + (bus / 20)))
+	{
+		printf("    - Sector latency is not bus limited\n");
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Compare the data sent with and without zero-copy Data IN
+ *
+ * The same READ(10) command is sent twice : first the LUN read into a SCSI
+ * buffer copied to the endpoint, then the LUN read directly into endpoint
+ * buffers. Bytes received by host must be identical.
+ *
+ * @param unit     Pointer to the LUN under test
+ * @param lba      Address of the first sector to read
+ * @param count    Number of sectors to read
+ * @param host_len Length of data expected by host (into CBW)
+ * @return integer Zero on success, other values are errors
+ */
+static int t_direct(lun *unit, u32 lba, uint count, uint host_len)
+{
+	u8 cb[10] = {0x28, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	uint i, n, packets;
+
+	printf(" * Test zero-copy READ(10) of %d sectors at %d (host expect %d bytes)\n",
+	       count, lba, host_len);
+
+	cb[2] = (u8)(lba >> 24);
+	cb[3] = (u8)(lba >> 16);
+	cb[4] = (u8)(lba >>  8);
+	cb[5] = (u8)(lba >>  0);
+	cb[7] = (u8)(count >> 8);
+	cb[8] = (u8)(count >> 0);
+	n = (host_len < (count * 512)) ? host_len : (count * 512);
+	packets = (n + 63) / 64;
+
+	/* Reference : data copied from SCSI buffer, some packets refused by
+	 * the endpoint (busy) must be sent again */
+	unit->perm &= ~(uint)SCSI_PERM_RD_DIRECT;
+	fake_stats.pkt_direct  = 0;
+	fake_stats.pkt_refused = 0;
+	fake_stats.refuse      = 2;
+	if (run_cmd(cb, 10, host_len, 0))
+		return(-1);
+	if ((host.received != n) || (fake_stats.pkt_direct != 0) ||
+	    (fake_stats.pkt_refused != 2))
+	{
+		printf("    - Received %d bytes, %d packets refused\n",
+		       host.received, fake_stats.pkt_refused);
+		return(-1);
+	}
+	for (i = 0; i < n; i++)
+		ref_buffer[i] = rx_buffer[i];
+
+	/* Zero-copy */
+	unit->perm |= SCSI_PERM_RD_DIRECT;
+	fake_stats.pkt_copy    = 0;
+	fake_stats.pkt_direct  = 0;
+	fake_stats.pkt_refused = 0;
+	fake_stats.refuse      = 2;
+	lun_pma_err = 0;
+	for (i = 0; i < n; i++)
+		rx_buffer[i] = 0;
+	if (run_cmd(cb, 10, host_len, 0))
+		return(-1);
+	if ((host.received != n) || (fake_stats.pkt_refused != 2))
+	{
+		printf("    - Received %d bytes, %d expected (%d packets refused)\n",
+		       host.received, n, fake_stats.pkt_refused);
+		return(-1);
+	}
+	for (i = 0; i < n; i++)
+	{
+		if (rx_buffer[i] != ref_buffer[i])
+		{
+			printf("    - Wire data differ at offset %d\n", i);
+			return(-1);
+		}
+	}
+	/* All data packets from PMA, only CSW copied */
+	if ((fake_stats.pkt_direct != packets) || (fake_stats.pkt_copy != 1) ||
+	    lun_pma_err)
+	{
+		printf("    - %d packets direct, %d copied, %d invalid PMA writes\n",
+		       fake_stats.pkt_direct, fake_stats.pkt_copy, lun_pma_err);
+		return(-1);
+	}
+	printf("    - %d bytes identical, %d packets without copy, retry of refused packets (ok)\n",
+	       n, packets);
+	return(0);
+}
+
+/**
+ * @brief Test a READ(10) when the LUN fails to read one sector
+ *
+ * Data of the failed sector must not be sent : the IN endpoint is stalled,
+ * then the CSW reports a failure and the sense is MEDIUM ERROR.
+ *
+ * @param unit   Pointer to the LUN under test
+ * @param direct Set to non-zero to use zero-copy Data IN
+ * @return integer Zero on success, other values are errors
+ */
+static int t_read_error(lun *unit, int direct)
+{
+	const u8 cb[10] = {0x28, 0, 0, 0, 0x01, 0x00, 0, 0, 4, 0};
+
+	printf(" * Test READ(10) with a read error on sector 2 (%s)\n",
+	       direct ? "zero-copy" : "buffered");
+
+	if (direct)
+		unit->perm |= SCSI_PERM_RD_DIRECT;
+	else
+		unit->perm &= ~(uint)SCSI_PERM_RD_DIRECT;
+	lun_rd_fail = (0x100 + 2) * 512 + 100;
+
+	host.data     = rx_buffer;
+	host.expected = 4 * 512;
+	cbw_send(cb, 10, 4 * 512, 0x80);
+	if (csw_wait(sim_now, 0) == 0)
+	{
+		printf("    - Command not failed\n");
+		goto err;
+	}
+	if (host.stall != 1)
+		goto err;
+	if (host.received > (2 * 512))
+	{
+		printf("    - Data of the failed sector sent (%d bytes)\n", host.received);
+		goto err;
+	}
+	/* Host clear the halt then read the CSW */
+	csw_expect = 1;
+	fake_usb_clear_halt(1);
+	if (csw_wait(sim_now, 0))
+		goto err;
+	csw_expect  = 0;
+	lun_rd_fail = 0xFFFFFFFF;
+	if (t_sense(0, 0x03, 0x11))
+		return(-1);
+	printf("    - Command failed, MEDIUM ERROR (ok)\n");
+	/* Next commands are not affected */
+	return(t_read(0x100, 4, 4 * 512, 0));
+err:
+	csw_expect  = 0;
+	lun_rd_fail = 0xFFFFFFFF;
+	return(-1);
+}
+
+/**
+ * @brief Measure CBW to CSW latency of small commands
+ *
+ * A sequence of TEST UNIT READY, INQUIRY and READ(10) of one sector is sent
+ * with a main loop that spend a configurable time into app_periodic. The
+ * latency of each command (from end of CBW to reception of CSW) is reported
+ * as an histogram.
+ *
+ * @param app_ns  Time spent into app_periodic on each main loop cycle
+ * @param lat_max Pointer to a variable to store the maximum latency
+ * @return integer Zero on success, other values are errors
+ */
+static int t_latency(uint app_ns, sim_time *lat_max)
+{
+	const u8 cb_tur[6]   = {0x00, 0, 0, 0, 0, 0};
+	const u8 cb_inq[6]   = {0x12, 0, 0, 0, 36, 0};
+	const u8 cb_rd[10]   = {0x28, 0, 0, 0, 0, 8, 0, 0, 1, 0};
+	uint hist[LAT_BUCKETS];
+	sim_time sum, max;
+	uint i, n, b;
+	int  result;
+
+	printf(" * Test command latency with app_periodic of %d us\n",
+	       app_ns / 1000);
+
+	timing.app_ns = app_ns;
+	for (b = 0; b < LAT_BUCKETS; b++)
+		hist[b] = 0;
+	sum = 0;
+	max = 0;
+	for (n = 0; n < 96; n++)
+	{
+		if ((n % 3) == 0)
+			result = run_cmd(cb_tur, 6, 0, 0);
+		else if ((n % 3) == 1)
+			result = run_cmd(cb_inq, 6, 36, 0);
+		else
+			result = run_cmd(cb_rd, 10, 512, 0);
+		if (result)
+			return(-1);
+		for (b = 0; b < (LAT_BUCKETS - 1); b++)
+		{
+			if (cmd_latency < (sim_time)lat_limit[b] * 1000)
+				break;
+		}
+		hist[b]++;
+		sum += cmd_latency;
+		if (cmd_latency > max)
+			max = cmd_latency;
+	}
+	timing.app_ns = 0;
+
+	for (b = 0, i = 0; b < LAT_BUCKETS; b++)
+	{
+		if (lat_limit[b])
+			printf("    - < %4d us : %d\n", lat_limit[b], hist[b]);
+		else
+			printf("    - >= %3d ms : %d\n", i / 1000, hist[b]);
+		i = lat_limit[b];
+	}
+	printf("    - Latency avg %.1f us, max %.1f us\n",
+	       (double)sum / (double)n / 1000.0, (double)max / 1000.0);
+	*lat_max = max;
+	return(0);
+}
+
+/**
+ * @brief Test a command received while the main loop use the memories
+ *
+ * The SCSI state machine (deferred work) must not run while the lock is
+ * held (see work_lock), the command is processed when it is released.
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_lock(void)
+{
+	const u8 cb[10] = {0x28, 0, 0, 0, 0, 50, 0, 0, 1, 0};
+	uint i;
+
+	printf(" * Test READ(10) received while main loop hold the lock\n");
+
+	host.data     = rx_buffer;
+	host.expected = 512;
+	work_lock();
+	cbw_send(cb, 10, 512, 0x80);
+	for (i = 0; i < 100; i++)
+		fake_usb_loop();
+	work_unlock();
+	if (host.received || host.csw_len)
+	{
+		printf("    - Command processed while locked\n");
+		return(-1);
+	}
+	if (csw_wait(sim_now, 0))
+		return(-1);
+	for (i = 0; i < 512; i++)
+	{
+		if (rx_buffer[i] != pattern((50 * 512) + i))
+		{
+			printf("    - Data mismatch at offset %d\n", i);
+			return(-1);
+		}
+	}
+	printf("    - Command delayed until unlock (ok)\n");
+	return(0);
+}
+
+/**
+ * @brief Compare blocking and background erase/program during writes
+ *
+ * The same WRITE(10) is processed with a medium that block the firmware
+ * during erase/program (as polling status into the data path) then with a
+ * medium that work in background. In the second case, the OUT endpoint is
+ * NAK only when the medium is busy and the next sector buffer is full : the
+ * host transfer overlap the erase/program of the previous sector.
+ *
+ * @param erase_us Duration of a sector (4k) erase
+ * @param prog_us  Duration of a page (256 bytes) program
+ * @return integer Zero on success, other values are errors
+ */
+static int t_write_media(uint erase_us, uint prog_us)
+{
+	sim_time d_block, d_async, idle_block, idle_async;
+
+	printf(" * Test WRITE(10) with erase %d us and program %d us\n",
+	       erase_us, prog_us);
+	media_erase = (sim_time)erase_us * 1000;
+	media_prog  = (sim_time)prog_us  * 1000;
+
+	if (t_write(64, 0, &d_block, &idle_block))
+		return(-1);
+	if (t_write(64, 1, &d_async, &idle_async))
+		return(-1);
+	printf("    - Bus idle time recovered: %.1f ms (%.1f%% faster)\n",
+	       (double)(idle_block - idle_async) / 1000000.0,
+	       (double)(d_block - d_async) * 100.0 / (double)d_block);
+	if (d_async >= d_block)
+	{
+		printf("    - Background erase/program is not faster\n");
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Write sectors then synchronize cache
+ *
+ * @param count    Number of sectors to write (multiple of 8)
+ * @param async    Set to non-zero for background erase/program
+ * @param duration Pointer to a variable to store total duration
+ * @param idle     Pointer to a variable to store time without data transfer
+ * @return integer Zero on success, other values are errors
+ */
+static int t_write(uint count, int async, sim_time *duration, sim_time *idle)
+{
+	u8 cb_wr[10]   = {0x2A, 0, 0, 0, 0x01, 0x00, 0, 0, 0, 0};
+	u8 cb_sync[10] = {0x35, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	sim_time start, bus;
+	uint i;
+
+	media_async = async;
+	media_end   = 0;
+	media_fill  = 0;
+	media_busy  = 0;
+	lun_wr_err  = 0;
+	for (i = 0; i < (count * 512); i++)
+		out_buffer[i] = pattern(0x20000 + i);
+	cb_wr[7] = (u8)(count >> 8);
+	cb_wr[8] = (u8)(count);
+
+	start = sim_now;
+	if (run_out(cb_wr, 10, out_buffer, count * 512, 0))
+		return(-1);
+	/* Written data are safe only when SYNCHRONIZE CACHE is complete */
+	if (run_cmd(cb_sync, 10, 0, 0))
+		return(-1);
+	if (sim_now < media_end)
+	{
+		printf("    - Cache synchronized before end of program\n");
+		return(-1);
+	}
+	if (lun_wr_err)
+	{
+		printf("    - %d sectors written with invalid data\n", lun_wr_err);
+		return(-1);
+	}
+	/* Time without packet on the bus (NAK) until cache is synchronized */
+	bus  = (sim_time)(count * 8) * (64 + timing.pkt_ovh) * timing.byte_ns;
+	*duration = sim_now - start;
+	*idle     = *duration - bus;
+	printf("    - %s: %.1f ms, bus idle %.1f ms, %d retries (medium busy)\n",
+	       async ? "Background" : "Blocking  ",
+	       (double)*duration / 1000000.0, (double)*idle / 1000000.0,
+	       media_busy);
+	return(0);
+}
+
+/**
+ * @brief Interleave commands to many LUNs
+ *
+ * LUN 1 and LUN 2 are two RAM disks that use the same functions, they find
+ * their own disk with scsi_lun_current(). Writes to these LUNs are mixed with
+ * reads of LUN 0, then each LUN must have its own data and its own sense.
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_multi_lun(void)
+{
+	u8 cb_wr[10] = {0x2A, 0, 0, 0, 0, 0, 0, 0, 8, 0};
+	u8 cb_rd[10] = {0x28, 0, 0, 0, 0, 0, 0, 0, 8, 0};
+	u8 cb_ready[6] = {0x00, 0, 0, 0, 0, 0};
+	lun *unit;
+	uint i, k, n;
+
+	printf(" * Test multi-LUN interleaving\n");
+
+	scsi_lun_set_count(3);
+	if (scsi_lun_count() != 3)
+		return(-1);
+	for (n = 1; n < 3; n++)
+	{
+		unit = scsi_lun_get(n);
+		unit->state    = 1;
+		unit->capacity = DISK_SECTORS;
+		unit->writable = 1;
+		unit->rd       = disk_rd;
+		unit->wr       = disk_wr;
+		unit->priv     = disk[n - 1];
+	}
+
+	for (k = 0; k < (DISK_SECTORS / 8); k++)
+	{
+		cb_wr[5] = (u8)(k * 8);
+		cb_rd[5] = (u8)(k * 8);
+		/* Write 8 sectors to LUN 1 and LUN 2 (different data) */
+		for (n = 1; n < 3; n++)
+		{
+			for (i = 0; i < (8 * 512); i++)
+				out_buffer[i] = pattern((k * 8 * 512) + i) ^ (u8)(n << 4);
+			cbw_lun = (u8)n;
+			if (run_out(cb_wr, 10, out_buffer, 8 * 512, 0))
+				goto err;
+			/* A READ of LUN 0 between writes */
+			cbw_lun = 0;
+			cb_rd[5] = (u8)(100 + k);
+			if (run_cmd(cb_rd, 10, 8 * 512, 0))
+				goto err;
+			cb_rd[5] = (u8)(k * 8);
+			for (i = 0; i < (8 * 512); i++)
+			{
+				if (rx_buffer[i] != pattern(((100 + k) * 512) + i))
+				{
+					printf("    - LUN 0 bad data after write to LUN %d\n", n);
+					goto err;
+				}
+			}
+		}
+		/* Read back LUN 1 */
+		cbw_lun = 1;
+		if (run_cmd(cb_rd, 10, 8 * 512, 0))
+			goto err;
+		for (i = 0; i < (8 * 512); i++)
+		{
+			if (rx_buffer[i] != (pattern((k * 8 * 512) + i) ^ 0x10))
+			{
+				printf("    - LUN 1 bad data at sector %d\n", (k * 8) + (i / 512));
+				goto err;
+			}
+		}
+	}
+	for (i = 0; i < sizeof(disk[0]); i++)
+	{
+		if ((disk[0][i] != (pattern(i) ^ 0x10)) ||
+		    (disk[1][i] != (pattern(i) ^ 0x20)))
+		{
+			printf("    - Data of LUN 1 and LUN 2 mixed at %x\n", i);
+			goto err;
+		}
+	}
+	printf("    - %d sectors written to LUN 1 and 2, data ok\n", DISK_SECTORS);
+
+	/* Errors on a LUN must not change the sense of others */
+	scsi_lun_get(2)->state = 0;
+	cbw_lun = 2;
+	csw_expect = 1;
+	if (run_cmd(cb_ready, 6, 0, 0))
+		goto err;
+	/* Block after the end of LUN 1 */
+	cb_rd[5] = DISK_SECTORS;
+	cb_rd[8] = 1;
+	cbw_lun = 1;
+	if (run_cmd(cb_rd, 10, 0, 0))
+		goto err;
+	/* LUN 3 is not registered */
+	cbw_lun = 3;
+	if (run_cmd(cb_ready, 6, 0, 0))
+		goto err;
+	csw_expect = 0;
+	if (t_sense(0, 0x00, 0x00) || t_sense(1, 0x05, 0x21) ||
+	    t_sense(2, 0x02, 0x3A) || t_sense(3, 0x05, 0x25))
+		goto err;
+	printf("    - Sense data kept per LUN (ok)\n");
+
+	cbw_lun = 0;
+	csw_expect = 0;
+	scsi_lun_set_count(1);
+	return(0);
+err:
+	cbw_lun = 0;
+	csw_expect = 0;
+	scsi_lun_set_count(1);
+	return(-1);
+}
+
+/**
+ * @brief Conformance of READ/WRITE with 12 and 16 bytes CDB
+ *
+ * These commands use the same engine as READ(10)/WRITE(10) with a 32 bits
+ * transfer length (and a 64 bits LBA for CDB-16). A READ of zero blocks
+ * completes without data, even at the end of the medium.
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_cdb_rw(void)
+{
+	u8 rd10[10] = {0x28, 0, 0,0,0,0, 0, 0,0, 0};
+	u8 rd12[12] = {0xA8, 0, 0,0,0x03,0xE8, 0,0,0,128, 0, 0};
+	u8 rd16[16] = {0x88, 0, 0,0,0,0, 0,0,0x07,0xD0, 0,0,0,64, 0, 0};
+	u8 wr12[12] = {0xAA, 0, 0,0,0x01,0x00, 0,0,0,8, 0, 0};
+	u8 wr16[16] = {0x8A, 0, 0,0,0,0, 0,0,0x01,0x08, 0,0,0,8, 0, 0};
+	u8 sync[10] = {0x35, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	u32 lba;
+	uint i;
+
+	printf(" * Test READ/WRITE with 12 and 16 bytes CDB\n");
+
+	/* READ(12) of 128 sectors at 1000, READ(16) of 64 sectors at 2000 */
+	if (run_cmd(rd12, 12, 128 * 512, 0))
+		return(-1);
+	for (i = 0; i < (128 * 512); i++)
+	{
+		if (rx_buffer[i] != pattern((1000 * 512) + i))
+			goto err_data;
+	}
+	if (run_cmd(rd16, 16, 64 * 512, 0))
+		return(-1);
+	for (i = 0; i < (64 * 512); i++)
+	{
+		if (rx_buffer[i] != pattern((2000 * 512) + i))
+			goto err_data;
+	}
+	printf("    - READ(12) and READ(16) data ok\n");
+
+	/* WRITE(12) and WRITE(16) of 8 sectors each at 0x100 then 0x108 */
+	media_async = 0;
+	media_fill  = 0;
+	lun_wr_err  = 0;
+	for (i = 0; i < (16 * 512); i++)
+		out_buffer[i] = pattern(0x20000 + i);
+	if (run_out(wr12, 12, out_buffer, 8 * 512, 0) ||
+	    run_out(wr16, 16, out_buffer + (8 * 512), 8 * 512, 0) ||
+	    run_cmd(sync, 10, 0, 0))
+		return(-1);
+	if (lun_wr_err)
+	{
+		printf("    - %d sectors written with invalid data\n", lun_wr_err);
+		return(-1);
+	}
+	printf("    - WRITE(12) and WRITE(16) data ok\n");
+
+	/* LBA with upper 32 bits set */
+	csw_expect = 1;
+	rd16[5] = 0x01;
+	if (run_cmd(rd16, 16, 0, 0))
+		goto err;
+	csw_expect = 0;
+	if (t_sense(0, 0x05, 0x21))
+		return(-1);
+	/* Transfer length of 65536 blocks must not be truncated to 16 bits */
+	lba = scsi_lun_get(0)->capacity - 0x8000;
+	rd12[2] = (u8)(lba >> 24); rd12[3] = (u8)(lba >> 16);
+	rd12[4] = (u8)(lba >>  8); rd12[5] = (u8)(lba);
+	rd12[6] = 0; rd12[7] = 0x01; rd12[8] = 0; rd12[9] = 0;
+	csw_expect = 1;
+	if (run_cmd(rd12, 12, 0, 0))
+		goto err;
+	csw_expect = 0;
+	if (t_sense(0, 0x05, 0x21))
+		return(-1);
+	printf("    - 64 bits LBA and 32 bits length range checked (ok)\n");
+
+	/* Transfer length of zero at the end of medium : success, no data */
+	lba = scsi_lun_get(0)->capacity;
+	rd10[2] = (u8)(lba >> 24); rd10[3] = (u8)(lba >> 16);
+	rd10[4] = (u8)(lba >>  8); rd10[5] = (u8)(lba);
+	rd12[6] = 0; rd12[7] = 0; rd12[8] = 0; rd12[9] = 0;
+	rd16[5] = 0;
+	rd16[6] = (u8)(lba >> 24); rd16[7] = (u8)(lba >> 16);
+	rd16[8] = (u8)(lba >>  8); rd16[9] = (u8)(lba);
+	rd16[12] = 0; rd16[13] = 0;
+	if (run_cmd(rd10, 10, 0, 0) || host.received ||
+	    run_cmd(rd12, 12, 0, 0) || host.received ||
+	    run_cmd(rd16, 16, 0, 0) || host.received)
+	{
+		printf("    - Read of zero blocks failed or returned data\n");
+		return(-1);
+	}
+	printf("    - READ(10/12/16) of zero blocks (ok)\n");
+	return(0);
+
+err_data:
+	printf("    - Data mismatch at offset %d\n", i);
+	return(-1);
+err:
+	csw_expect = 0;
+	return(-1);
+}
+
+/**
+ * @brief Write-back cache semantics : WCE, SYNCHRONIZE CACHE and FUA
+ *
+ * The fake LUN program its 4k buffer in background when full. A WRITE
+ * completes while the medium is still busy, SYNCHRONIZE CACHE (without
+ * IMMED) and a WRITE with FUA complete only when data are into medium.
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_sync(void)
+{
+	u8 sense[6]  = {0x1A, 0, 0x08, 0, 64, 0};
+	u8 wr[10]    = {0x2A, 0, 0, 0, 0x01, 0x00, 0, 0, 8, 0};
+	u8 sync[16]  = {0x91, 0, 0,0,0,0,0,0,0,0, 0,0,0,0, 0, 0};
+	lun *unit = scsi_lun_get(0);
+	uint i;
+
+	printf(" * Test write-back cache (WCE, SYNCHRONIZE CACHE, FUA)\n");
+
+	/* WCE is reported only for a LUN with a flush function */
+	if (run_cmd(sense, 6, 64, 0))
+		return(-1);
+	if ((rx_buffer[4] != 0x08) || !(rx_buffer[6] & 0x04) || !(rx_buffer[2] & 0x10))
+	{
+		printf("    - WCE or DPOFUA not set\n");
+		return(-1);
+	}
+	unit->flush = 0;
+	if (run_cmd(sense, 6, 64, 0))
+		return(-1);
+	unit->flush = lun_flush;
+	if (rx_buffer[6] & 0x04)
+	{
+		printf("    - WCE set for a LUN without flush\n");
+		return(-1);
+	}
+	printf("    - MODE SENSE report WCE and DPOFUA (ok)\n");
+
+	media_async = 1;
+	media_erase = 20000000;
+	media_prog  = 300000;
+	media_end   = 0;
+	media_fill  = 0;
+	lun_wr_err  = 0;
+	for (i = 0; i < (8 * 512); i++)
+		out_buffer[i] = pattern(0x20000 + i);
+
+	/* Write-back : status before end of program, IMMED does not wait */
+	if (run_out(wr, 10, out_buffer, 8 * 512, 0))
+		return(-1);
+	if (sim_now >= media_end)
+		goto err_early;
+	sync[1] = 0x02;
+	if (run_cmd(sync, 16, 0, 0))
+		return(-1);
+	if (sim_now >= media_end)
+		goto err_early;
+	sync[1] = 0x00;
+	if (run_cmd(sync, 16, 0, 0))
+		return(-1);
+	if (sim_now < media_end)
+		goto err_late;
+	printf("    - SYNCHRONIZE CACHE(16) wait data, IMMED does not (ok)\n");
+
+	/* Force Unit Access : status only when data are into medium */
+	wr[1] = 0x08;
+	if (run_out(wr, 10, out_buffer, 8 * 512, 0))
+		return(-1);
+	if (sim_now < media_end)
+		goto err_late;
+	if (lun_wr_err)
+		return(-1);
+	printf("    - WRITE(10) with FUA wait data (ok)\n");
+	return(0);
+
+err_early:
+	printf("    - Command waited the end of program\n");
+	return(-1);
+err_late:
+	printf("    - Command completed before end of program\n");
+	return(-1);
+}
+
+/**
+ * @brief Test UNMAP and the pages used by host to detect it
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_unmap(void)
+{
+	u8 vpd[6]   = {0x12, 0x01, 0x00, 0, 64, 0};
+	u8 cap16[16] = {0x9E, 0x10, 0,0,0,0,0,0,0,0, 0,0,0,32, 0, 0};
+	u8 unmap[10] = {0x42, 0, 0, 0, 0, 0, 0, 0, 40, 0};
+	u8 *p = out_buffer;
+	lun *unit = scsi_lun_get(0);
+	uint i;
+
+	printf(" * Test UNMAP (Block Limits and Provisioning pages)\n");
+
+	/* Without unmap function, command is rejected */
+	csw_expect = 1;
+	if (run_out(unmap, 10, out_buffer, 0, 0))
+		goto err;
+	csw_expect = 0;
+	if (t_sense(0, 0x05, 0x20))
+		return(-1);
+
+	unit->unmap = lun_unmap;
+	if (run_cmd(vpd, 6, 64, 0))
+		return(-1);
+	if ((rx_buffer[3] != 5) || (rx_buffer[7] != 0xB0) || (rx_buffer[8] != 0xB2))
+		goto err_page;
+	vpd[2] = 0xB0;
+	if (run_cmd(vpd, 6, 64, 0))
+		return(-1);
+	if ((rx_buffer[1] != 0xB0) || (rx_buffer[27] != SCSI_UNMAP_DESC_MAX) ||
+	    (rx_buffer[31] != 8))
+		goto err_page;
+	vpd[2] = 0xB2;
+	if (run_cmd(vpd, 6, 64, 0))
+		return(-1);
+	/* LBPU without LBPRZ (free sectors are not persistent) */
+	if ((rx_buffer[1] != 0xB2) || (rx_buffer[5] != 0x80))
+		goto err_page;
+	if (run_cmd(cap16, 16, 32, 0))
+		return(-1);
+	if ((rx_buffer[5] != 0x01) || (rx_buffer[6] != 0xFF) || (rx_buffer[7] != 0xFF) ||
+	    (rx_buffer[13] != 3) || ((rx_buffer[14] & 0xC0) != 0x80))
+		goto err_page;
+	printf("    - VPD 0xB0, 0xB2 and READ CAPACITY(16) report UNMAP (ok)\n");
+
+	/* Two descriptors : 16 blocks at 0x100 and 8 blocks at 0x2000 */
+	for (i = 0; i < 40; i++)
+		p[i] = 0;
+	p[1] = 38; p[3] = 32;
+	p[8 + 6]  = 0x01; p[8 + 11]  = 16;
+	p[24 + 6] = 0x20; p[24 + 11] = 8;
+	unmap_count = 0;
+	unmap_bytes = 0;
+	if (run_out(unmap, 10, out_buffer, 40, 0))
+		return(-1);
+	if ((unmap_count != 2) || (unmap_bytes != (24 * 512)))
+	{
+		printf("    - %d ranges, %d bytes unmapped\n", unmap_count, unmap_bytes);
+		return(-1);
+	}
+	/* Descriptor after the end of the medium : nothing is unmapped */
+	p[24 + 4] = 0x00; p[24 + 5] = 0x02; p[24 + 6] = 0x00;
+	unmap_count = 0;
+	csw_expect = 1;
+	if (run_out(unmap, 10, out_buffer, 40, 0))
+		goto err;
+	csw_expect = 0;
+	if (t_sense(0, 0x05, 0x21))
+		return(-1);
+	if (unmap_count)
+	{
+		printf("    - %d ranges unmapped by a rejected list\n", unmap_count);
+		return(-1);
+	}
+	printf("    - Block descriptors decoded, range checked (ok)\n");
+	unit->unmap = 0;
+	return(0);
+
+err_page:
+	printf("    - Invalid page content\n");
+	return(-1);
+err:
+	csw_expect = 0;
+	return(-1);
+}
+
+/**
+ * @brief Send a REQUEST SENSE and verify the sense key and code
+ *
+ * @param pos Identifier of the LUN
+ * @param key Expected sense key
+ * @param asc Expected additional sense code
+ * @return integer Zero on success, other values are errors
+ */
+static int t_sense(u8 pos, u8 key, u8 asc)
+{
+	const u8 cb[6] = {0x03, 0, 0, 0, 18, 0};
+
+	cbw_lun = pos;
+	if (run_cmd(cb, 6, 18, 0))
+		return(-1);
+	if ((rx_buffer[2] != key) || (rx_buffer[12] != asc))
+	{
+		printf("    - LUN %d sense %x/%x, %x/%x expected\n",
+		       pos, rx_buffer[2], rx_buffer[12], key, asc);
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Send a CBW and run the firmware until CSW is received
+ *
+ * @param cb       Pointer to the command block
+ * @param cb_len   Length of the command block
+ * @param data_len Length of the Data IN phase
+ * @param duration Pointer to a variable to store command duration (or NULL)
+ * @return integer Zero on success, other values are errors
+ */
+static int run_cmd(const u8 *cb, uint cb_len, uint data_len, sim_time *duration)
+{
+	sim_time start;
+
+	host.data     = rx_buffer;
+	host.expected = data_len;
+
+	start = sim_now;
+	cbw_send(cb, cb_len, data_len, 0x80);
+	return(csw_wait(start, duration));
+}
+
+/**
+ * @brief Send a CBW with a Data OUT phase and wait for CSW
+ *
+ * The data are sent by 64 bytes packets, each packet wait until the OUT
+ * endpoint is valid (firmware NAK it while buffers are full or medium busy).
+ *
+ * @param cb       Pointer to the command block
+ * @param cb_len   Length of the command block
+ * @param data     Pointer to the data to send (32 bits aligned)
+ * @param data_len Length of the Data OUT phase
+ * @param duration Pointer to a variable to store command duration (or NULL)
+ * @return integer Zero on success, other values are errors
+ */
+static int run_out(const u8 *cb, uint cb_len, const u8 *data, uint data_len,
+                   sim_time *duration)
+{
+	sim_time start;
+	uint pos, len;
+
+	host.data     = rx_buffer;
+	host.expected = 0;
+
+	start = sim_now;
+	cbw_send(cb, cb_len, data_len, 0x00);
+	for (pos = 0; (pos < data_len) && (host.stall == 0); pos += len)
+	{
+		len = data_len - pos;
+		if (len > 64)
+			len = 64;
+		fake_usb_out(data + pos, len);
+		if ((sim_now - start) > 10000000000ULL)
+		{
+			printf("    - Timeout, data not accepted\n");
+			return(-1);
+		}
+	}
+	return(csw_wait(start, duration));
+}
+
+/**
+ * @brief Build and send a CBW
+ *
+ * @param cb       Pointer to the command block
+ * @param cb_len   Length of the command block
+ * @param data_len Length of the data phase
+ * @param flags    Direction of data phase (0x80 for Data IN)
+ */
+static void cbw_send(const u8 *cb, uint cb_len, uint data_len, u8 flags)
+{
+	u8  *cbw = (u8 *)cbw_buffer;
+	uint i;
+
+	tag++;
+	for (i = 0; i < 32; i++)
+		cbw[i] = 0;
+	/* Signature */
+	cbw[0] = 0x55; cbw[1] = 0x53; cbw[2] = 0x42; cbw[3] = 0x43;
+	/* Tag */
+	cbw[4] = (u8)(tag); cbw[5] = (u8)(tag >> 8);
+	/* Data transfer length */
+	cbw[8]  = (u8)(data_len >>  0);
+	cbw[9]  = (u8)(data_len >>  8);
+	cbw[10] = (u8)(data_len >> 16);
+	cbw[11] = (u8)(data_len >> 24);
+	cbw[12] = flags;
+	cbw[13] = cbw_lun;
+	cbw[14] = (u8)cb_len;
+	for (i = 0; i < cb_len; i++)
+		cbw[15 + i] = cb[i];
+
+	host.received = 0;
+	host.csw_len  = 0;
+	host.stall    = 0;
+	host.sectors  = 0;
+
+	fake_usb_out(cbw, 31);
+	cmd_latency = sim_now;
+	host.t_sector[0] = 0;
+}
+
+/**
+ * @brief Run the firmware until CSW is received, and check it
+ *
+ * @param start    Time when the command has been started
+ * @param duration Pointer to a variable to store command duration (or NULL)
+ * @return integer Zero on success, other values are errors
+ */
+static int csw_wait(sim_time start, sim_time *duration)
+{
+	uint i;
+
+	/* Run main loop until CSW received (or timeout of 10s) */
+	while ((host.csw_len == 0) && (host.stall == 0))
+	{
+		fake_usb_loop();
+		if ((sim_now - start) > 10000000000ULL)
+		{
+			printf("    - Timeout, no CSW received\n");
+			return(-1);
+		}
+	}
+	if (host.stall)
+		return(-1);
+	if (host.csw_len != 13)
+	{
+		printf("    - Invalid CSW length %d\n", host.csw_len);
+		return(-1);
+	}
+	if ((host.csw[0] != 0x55) || (host.csw[4] != (u8)tag))
+	{
+		printf("    - Invalid CSW signature or tag\n");
+		return(-1);
+	}
+	if (host.csw[12] != csw_expect)
+	{
+		printf("    - CSW status %d (%d expected)\n", host.csw[12], csw_expect);
+		return(-1);
+	}
+	cmd_latency = host.t_csw - cmd_latency;
+	/* Convert sector end times relative to the CBW */
+	for (i = 0; i < host.sectors; i++)
+		host.t_sector[i] -= start;
+	if (duration)
+		*duration = sim_now - start;
+	return(0);
+}
+
+/**
+ * @brief Fake LUN write function (4k buffer, erase and program when full)
+ *
+ * @param addr Address of the sector to write
+ * @param len  Number of bytes to write
+ * @param data Pointer to the data
+ * @return integer Zero on success, 1 when medium is busy (retry)
+ */
+static int lun_wr(u32 addr, u32 len, u8 *data)
+{
+	u32 i;
+
+	/* Last sector of the buffer : sector must be written to medium */
+	if (media_fill == 7)
+	{
+		if (media_async)
+		{
+			/* Previous sector not yet written, buffer not available */
+			if (sim_now < media_end)
+			{
+				media_busy++;
+				return(1);
+			}
+			media_end = sim_now + media_erase + (16 * media_prog);
+		}
+		else
+			sim_advance(media_erase + (16 * media_prog));
+	}
+	media_fill = (media_fill + 1) & 7;
+
+	for (i = 0; i < len; i++)
+	{
+		if (data[i] != pattern(addr + i))
+		{
+			lun_wr_err++;
+			break;
+		}
+	}
+	sim_advance(LUN_WR_NS);
+	return(0);
+}
+
+/**
+ * @brief Fake LUN flush function, wait end of background program
+ *
+ * @return integer Zero when medium is idle, 1 while busy
+ */
+static int lun_flush(void)
+{
+	if (media_async && (sim_now < media_end))
+		return(1);
+	return(0);
+}
+
+/**
+ * @brief Fake LUN unmap function, count the unmapped ranges
+ *
+ * @param addr Address of the first unused byte
+ * @param len  Number of unused bytes
+ * @return integer Always zero
+ */
+static int lun_unmap(u32 addr, u32 len)
+{
+	(void)addr;
+	unmap_count++;
+	unmap_bytes += len;
+	return(0);
+}
+
+/**
+ * @brief Fake LUN read function (pattern with a fixed access time)
+ *
+ * @param addr Address of the first byte to read
+ * @param len  Number of bytes to read
+ * @param data Pointer to a buffer where data are stored
+ * @return integer Number of bytes read
+ */
+static int lun_rd(u32 addr, u32 len, u8 *data)
+{
+	u32 i, v;
+
+	if ((lun_rd_fail >= addr) && (lun_rd_fail < (addr + len)))
+		return(-1);
+	/* Packet memory must be written with aligned 32 bits words */
+	if (fake_usb_is_pma(data))
+	{
+		if (((unsigned long)data & 3) || (len & 3))
+			lun_pma_err++;
+		for (i = 0; i < len; i += 4)
+		{
+			v  = (u32)pattern(addr + i + 0) <<  0;
+			v |= (u32)pattern(addr + i + 1) <<  8;
+			v |= (u32)pattern(addr + i + 2) << 16;
+			v |= (u32)pattern(addr + i + 3) << 24;
+			*(u32 *)(data + i) = v;
+		}
+	}
+	else
+	{
+		for (i = 0; i < len; i++)
+			data[i] = pattern(addr + i);
+	}
+	/* The USB interrupt may occur while the LUN is accessed */
+	sim_advance((LUN_RD_NS * len) / 512);
+	return((int)len);
+}
+
+/**
+ * @brief Fake LUN read function of the RAM disks
+ *
+ * @param addr Address of the first byte to read
+ * @param len  Number of bytes to read
+ * @param data Pointer to a buffer where data are stored
+ * @return integer Number of bytes read
+ */
+static int disk_rd(u32 addr, u32 len, u8 *data)
+{
+	u8 *d = (u8 *)scsi_lun_current()->priv;
+	u32 i;
+
+	if (fake_usb_is_pma(data))
+		lun_pma_err++;
+	for (i = 0; i < len; i++)
+		data[i] = d[addr + i];
+	return((int)len);
+}
+
+/**
+ * @brief Fake LUN write function of the RAM disks
+ *
+ * @param addr Address of the first byte to write
+ * @param len  Number of bytes to write
+ * @param data Pointer to the data
+ * @return integer Zero on success
+ */
+static int disk_wr(u32 addr, u32 len, u8 *data)
+{
+	u8 *d = (u8 *)scsi_lun_current()->priv;
+	u32 i;
+
+	for (i = 0; i < len; i++)
+		d[addr + i] = data[i];
+	return(0);
+}
+
+/**
+ * @brief Get the value of the test pattern at one address
+ *
+ * @param addr Byte address
+ * @return u8  Value of the pattern
+ */
+static u8 pattern(u32 addr)
+{
+	return((u8)((addr >> 9) ^ (addr * 13)));
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                 Dummy functions to avoid missing deps                -- */
+/* -------------------------------------------------------------------------- */
+
+void log_puts(const char *s)
+{
+	(void)s;
+}
+
+void log_print(uint level, const char *s, ...)
+{
+	(void)level;
+	(void)s;
+}
+
+int cmd10_read_buffer(lun *unit, scsi_context *ctx)
+{
+	(void)unit;
+	(void)ctx;
+	return(-1);
+}
+
+int cmd10_write_buffer(lun *unit, scsi_context *ctx)
+{
+	(void)unit;
+	(void)ctx;
+	return(-1);
+}
+
+void *memcpy(void *dst, const void *src, int n)
+{
+	u8 *d = (u8 *)dst;
+	const u8 *s = (const u8 *)src;
+	while (n-- > 0)
+		*d++ = *s++;
+	return(dst);
+}
+
+void *memset(void *dst, int value, int n)
+{
+	u8 *d = (u8 *)dst;
+	while (n-- > 0)
+		*d++ = (u8)value;
+	return(dst);
+}
+
+unsigned long htonl(unsigned long v)
+{
+	return(((v & 0xFF) << 24) | ((v & 0xFF00) << 8) |
+	       ((v >> 8) & 0xFF00) | ((v >> 24) & 0xFF));
+}
+
+unsigned short htons(unsigned short v)
+{
+	return((unsigned short)(((v & 0xFF) << 8) | (v >> 8)));
+}
+/* EOF */
@@ -0,0 +1,465 @@
+/**
+ * @file  tests/ut_rahead/main.c
+ * @brief Unit tests and host timing model for the sequential read-ahead
+ *
+ * Some tests verify the read-ahead behavior (stream detection, lines read
+ * in background, random reads, invalidation, read errors) then some host read traces are
+ * replayed with and without read-ahead into a model of the USB and SPI
+ * timings. The simulated throughput of each trace is reported.
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include <stdio.h>
+#include "types.h"
+#include "rahead.h"
+
+#define SIM_SIZE (4 * 1024 * 1024)
+
+/* USB full speed : one bulk packet of 64 bytes, CBW and CSW of a command
+ * (with host turnaround), the SCSI and LUN layers for one chunk */
+#define T_USB_PACKET 52600
+#define T_USB_CMD    250000
+#define T_LUN        12000
+/* Flash read by CPU into packet memory (polled SPI, bytes packed to words) */
+#define T_PIO_CMD    4000
+#define T_PIO_BYTE   800
+/* Flash read by DMA into RAM (SPI at 32MHz), copy of one word to packet */
+#define T_DMA_SETUP  2000
+#define T_DMA_CMD    2000
+#define T_DMA_BYTE   250
+#define T_COPY_WORD  60
+
+typedef unsigned long long ns_t;
+
+static u8   flash[SIM_SIZE];
+static ns_t sim_now;      /* CPU time                                */
+static ns_t sim_dma;      /* End of the DMA read running             */
+static ns_t sim_usb;      /* End of the last packet sent             */
+static ns_t sim_ep[2];    /* End of the packet into each EP buffer   */
+static u32  sim_packets;  /* Number of packets sent (EP buffer index) */
+static u32  sim_seed;     /* Random sequence, same for each run      */
+static int  sim_fail;     /* When set, background reads fail         */
+
+static int  t_stream(void);
+static int  t_random(void);
+static int  t_invalidate(void);
+static int  t_error(void);
+static int  t_traces(void);
+static int  trace_run(int id, int ra, ns_t *ns);
+static int  lun_cmd(u32 lba, u32 count, int ra);
+static int  sim_start(u32 addr, uint len, u8 *data);
+static int  sim_wait(void);
+static void sim_reset(void);
+static u32  sim_rand(void);
+
+/**
+ * @brief Entry point of the program
+ *
+ * @return integer Execution result returned to OS :p
+ */
+int main(void)
+{
+	printf("--=={ Read-ahead tests }==--\n");
+
+	if (t_stream())
+		return(-1);
+	if (t_random())
+		return(-1);
+	if (t_invalidate())
+		return(-1);
+	if (t_error())
+		return(-1);
+	if (t_traces())
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Test a sequential read (stream detected, next lines prefetched)
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_stream(void)
+{
+	rahead_stats *st;
+
+	printf(" * Test sequential read of 64k\n");
+
+	sim_reset();
+	rahead_init(sim_start, sim_wait);
+	st = rahead_get_stats();
+
+	/* One command of 4k is not a stream */
+	if (lun_cmd(100, 8, 1))
+		return(-1);
+	if (st->hits || st->loads)
+	{
+		printf("    - Read-ahead started too early\n");
+		return(-1);
+	}
+	if (lun_cmd(108, 120, 1))
+		return(-1);
+	printf("    - %d hits, %d lines loaded, %d prefetched, %d waits\n",
+	       st->hits, st->loads, st->prefetch, st->waits);
+	/* Only the first line is read on demand, then all the next ones are
+	 * read in background (one line ahead) */
+	if ((st->loads != 1) ||
+	    (st->hits != ((128 * 512 - RAHEAD_TRIGGER) / 64) - 1) ||
+	    (st->prefetch != ((128 * 512 - RAHEAD_TRIGGER) / RAHEAD_LINE_SZ)))
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Test random reads of 4k (no read-ahead, no useless flash read)
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_random(void)
+{
+	rahead_stats *st;
+	uint i;
+
+	printf(" * Test random reads of 4k\n");
+
+	sim_reset();
+	rahead_init(sim_start, sim_wait);
+	st = rahead_get_stats();
+
+	for (i = 0; i < 256; i++)
+	{
+		if (lun_cmd((sim_rand() % (SIM_SIZE / 4096)) * 8, 8, 1))
+			return(-1);
+	}
+	printf("    - %d hits, %d lines loaded, %d prefetched\n",
+	       st->hits, st->loads, st->prefetch);
+	if (st->hits || st->loads || st->prefetch)
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Test that modified memory is read again (write during a stream)
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_invalidate(void)
+{
+	rahead_stats *st;
+
+	printf(" * Test invalidation (write during a stream)\n");
+
+	sim_reset();
+	rahead_init(sim_start, sim_wait);
+	st = rahead_get_stats();
+
+	/* Start a stream, next line is read in background */
+	if (lun_cmd(0, 16, 1) || (st->prefetch == 0))
+		return(-1);
+	/* Write of the next sectors (already into a line) */
+	flash[16 * 512] ^= 0xFF;
+	flash[20 * 512 + 7] ^= 0xFF;
+	rahead_invalidate();
+	/* Stream continues, lun_cmd verify data against flash */
+	if (lun_cmd(16, 16, 1))
+	{
+		printf("    - Old data read after write\n");
+		return(-1);
+	}
+	printf("    - %d hits, %d lines loaded, %d prefetched\n",
+	       st->hits, st->loads, st->prefetch);
+	return(0);
+}
+
+/**
+ * @brief Test that lines of failed background reads are never used
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_error(void)
+{
+	rahead_stats *st;
+
+	printf(" * Test background read errors (DMA timeout)\n");
+
+	sim_reset();
+	rahead_init(sim_start, sim_wait);
+	st = rahead_get_stats();
+
+	/* Lines receive bad data, lun_cmd verify data against flash */
+	sim_fail = 1;
+	if (lun_cmd(0, 32, 1))
+	{
+		printf("    - Data of a failed read used\n");
+		return(-1);
+	}
+	if (st->hits)
+		return(-1);
+	/* Stream continues when reads work again */
+	sim_fail = 0;
+	if (lun_cmd(32, 32, 1) || (st->hits == 0))
+		return(-1);
+	printf("    - %d hits, %d lines loaded, %d prefetched\n",
+	       st->hits, st->loads, st->prefetch);
+	return(0);
+}
+
+/**
+ * @brief Replay host read traces with and without read-ahead
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_traces(void)
+{
+	const char *names[4] = {
+		"File of 4M, commands of 64k",
+		"File of 1M, commands of 4k",
+		"Random reads of 4k",
+		"FAT sector then file of 32k",
+	};
+	ns_t ns[2];
+	u32  kbs[2];
+	int  id;
+
+	printf(" * Test host traces (throughput without and with read-ahead)\n");
+
+	for (id = 0; id < 4; id++)
+	{
+		if (trace_run(id, 0, &ns[0]) || trace_run(id, 1, &ns[1]))
+			return(-1);
+		/* Bytes per ms is kB/s (with 1000 bytes kB) */
+		kbs[0] = (u32)(((ns_t)sim_packets * 64 * 1000000) / ns[0]);
+		kbs[1] = (u32)(((ns_t)sim_packets * 64 * 1000000) / ns[1]);
+		printf("    - %-28s: %4d kB/s -> %4d kB/s (%+d%%)\n", names[id],
+		       kbs[0], kbs[1], (int)(kbs[1] * 100 / kbs[0]) - 100);
+		/* Read-ahead must never slow down, and speed up sequential reads */
+		if (ns[1] > ns[0])
+			return(-1);
+		if ((id < 2) && ((ns[1] * 110) > (ns[0] * 100)))
+		{
+			printf("    - Read-ahead does not improve sequential reads\n");
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+/**
+ * @brief Replay one host trace
+ *
+ * @param id Identifier of the trace
+ * @param ra When set, read-ahead is used
+ * @param ns Pointer to a variable where the duration (ns) is stored
+ * @return integer Zero on success, other values are errors
+ */
+static int trace_run(int id, int ra, ns_t *ns)
+{
+	u32 i;
+
+	sim_reset();
+	rahead_init(sim_start, sim_wait);
+
+	for (i = 0; i < 64; i++)
+	{
+		switch (id)
+		{
+			case 0:
+				if (lun_cmd(i * 128, 128, ra))
+					return(-1);
+				break;
+			case 1:
+				if (lun_cmd(i * 32, 8, ra)      || lun_cmd(i * 32 +  8, 8, ra) ||
+				    lun_cmd(i * 32 + 16, 8, ra) || lun_cmd(i * 32 + 24, 8, ra))
+					return(-1);
+				break;
+			case 2:
+				if (lun_cmd((sim_rand() % (SIM_SIZE / 4096)) * 8, 8, ra))
+					return(-1);
+				break;
+			case 3:
+				if (lun_cmd(1 + (i % 4), 1, ra) ||
+				    lun_cmd(1024 + i * 72, 64, ra))
+					return(-1);
+				break;
+		}
+	}
+	/* End of the last packet */
+	*ns = (sim_now > sim_usb) ? sim_now : sim_usb;
+	return(0);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                 Simulated LUN, USB and flash memory                  -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Process a READ command like SCSI layer and default_lun_rd
+ *
+ * Data are read by chunks of 64 bytes, each time an endpoint buffer is free
+ * (double buffered) and sent while the next one is read.
+ *
+ * @param lba   Address of the first sector
+ * @param count Number of sectors to read
+ * @param ra    When set, the read-ahead is used
+ * @return integer Zero on success, other values are errors
+ */
+static int lun_cmd(u32 lba, u32 count, int ra)
+{
+	u8  packet[64] __attribute__((aligned(4)));
+	u32 addr, end;
+	uint ep, i;
+	int n;
+
+	/* CSW of previous command then CBW of this one */
+	if (sim_now < sim_usb)
+		sim_now = sim_usb;
+	sim_now += T_USB_CMD;
+
+	end = (lba + count) * 512;
+	for (addr = lba * 512; addr < end; addr += 64)
+	{
+		ep = (sim_packets & 1);
+		if (sim_now < sim_ep[ep])
+			sim_now = sim_ep[ep];
+		sim_now += T_LUN;
+
+		n = 0;
+		if (ra)
+		{
+			rahead_access(addr, 64);
+			n = rahead_read(addr, 64, packet);
+			if (n > 0)
+				sim_now += (ns_t)(n / 4) * T_COPY_WORD;
+		}
+		if (n == 0)
+		{
+			/* Read running into background is ended first (see mem) */
+			if (sim_now < sim_dma)
+				sim_now = sim_dma;
+			for (i = 0; i < 64; i++)
+				packet[i] = flash[addr + i];
+			sim_now += T_PIO_CMD + 64 * T_PIO_BYTE;
+		}
+		else if (n != 64)
+		{
+			printf("    - Bad length %d at 0x%x\n", n, addr);
+			return(-1);
+		}
+		for (i = 0; i < 64; i++)
+		{
+			if (packet[i] != flash[addr + i])
+			{
+				printf("    - Bad data at 0x%x\n", addr + i);
+				return(-1);
+			}
+		}
+		/* Packet sent when USB is free */
+		sim_usb = ((sim_now > sim_usb) ? sim_now : sim_usb) + T_USB_PACKET;
+		sim_ep[ep] = sim_usb;
+		sim_packets++;
+	}
+	return(0);
+}
+
+/**
+ * @brief Start a read into background (like volume_read_start)
+ *
+ * Data are copied now, only the time of DMA is simulated.
+ *
+ * @param addr Address of the first byte to read
+ * @param len  Number of bytes to read
+ * @param data Pointer to a buffer to store data
+ * @return integer Zero if started, other values are errors
+ */
+static int sim_start(u32 addr, uint len, u8 *data)
+{
+	uint i;
+
+	if ((addr + len) > SIM_SIZE)
+		return(-1);
+	(void)sim_wait();
+	for (i = 0; i < len; i++)
+		data[i] = (u8)(flash[addr + i] ^ (sim_fail ? 0x55 : 0));
+	sim_now += T_DMA_SETUP;
+	sim_dma  = sim_now + T_DMA_CMD + (ns_t)len * T_DMA_BYTE;
+	return(0);
+}
+
+/**
+ * @brief Wait the end of the background read (like volume_read_wait)
+ *
+ * @return integer Zero on success, -1 when reads fail (see sim_fail)
+ */
+static int sim_wait(void)
+{
+	if (sim_now < sim_dma)
+		sim_now = sim_dma;
+	return(sim_fail ? -1 : 0);
+}
+
+/**
+ * @brief Fill flash with a pattern and reset time
+ *
+ */
+static void sim_reset(void)
+{
+	u32 i;
+
+	for (i = 0; i < SIM_SIZE; i++)
+		flash[i] = (u8)((i >> 9) + (i * 13));
+	sim_now = 0;
+	sim_dma = 0;
+	sim_usb = 0;
+	sim_ep[0] = 0;
+	sim_ep[1] = 0;
+	sim_packets = 0;
+	sim_seed = 0x1234567;
+	sim_fail = 0;
+}
+
+/**
+ * @brief Pseudo random numbers (sequence restarted by sim_reset)
+ *
+ * @return u32 Random value
+ */
+static u32 sim_rand(void)
+{
+	sim_seed = (sim_seed * 1103515245) + 12345;
+	return(sim_seed >> 8);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                 Dummy functions to avoid missing deps                -- */
+/* -------------------------------------------------------------------------- */
+
+void *memcpy(void *dst, const void *src, int n)
+{
+	u8 *d = (u8 *)dst;
+	const u8 *s = (const u8 *)src;
+	while (n-- > 0)
+		*d++ = *s++;
+	return(dst);
+}
+
+void *memset(void *dst, int value, int n)
+{
+	u8 *d = (u8 *)dst;
+	while (n-- > 0)
+		*d++ = (u8)value;
+	return(dst);
+}
+
+void memcpy_pma(u8 *dst, const u8 *src, unsigned int len)
+{
+	memcpy(dst, src, (int)len);
+}
+/* EOF */
@@ -0,0 +1,391 @@
+/**
+ * @file  tests/ut_rcache/main.c
+ * @brief Unit tests and host read traces for the sector read cache
+ *
+ * Some tests verify the cache behavior (hits and misses counters, sectors
+ * read by chunks, invalidation, sequential reads) then a trace that looks
+ * like a FAT volume mount followed by directory listings and file reads is
+ * replayed with and without cache. The number of bytes read from flash and
+ * the simulated read time are reported.
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include <stdio.h>
+#include "types.h"
+#include "rcache.h"
+
+#define SIM_SIZE (1024 * 1024)
+
+/* Flash read timings (SPI at 32MHz) and RAM copy of one byte */
+#define T_READ_CMD  2000 /* Command, address and dummy bytes */
+#define T_READ_BYTE 250  /* Read one byte                    */
+#define T_COPY_BYTE 16   /* Copy one byte from cache         */
+
+/* FAT volume used by traces (LBA of each area) */
+#define FAT_LBA   1
+#define FAT_COUNT 4
+#define DIR_LBA   33
+#define DIR_COUNT 4
+#define DATA_LBA  64
+
+static u8  flash[SIM_SIZE];
+static u32 rd_bytes;
+static u32 rd_count;
+static unsigned long long sim_ns;
+
+static int  t_hit_miss(void);
+static int  t_chunks(void);
+static int  t_invalidate(void);
+static int  t_sequential(void);
+static int  t_trace(void);
+static int  lun_read(u32 lba, u32 count, int cached);
+static int  sim_rd(u32 addr, uint len, u8 *data);
+static void sim_reset(void);
+
+/**
+ * @brief Entry point of the program
+ *
+ * @return integer Execution result returned to OS :p
+ */
+int main(void)
+{
+	printf("--=={ Read cache tests }==--\n");
+
+	if (t_hit_miss())
+		return(-1);
+	if (t_chunks())
+		return(-1);
+	if (t_invalidate())
+		return(-1);
+	if (t_sequential())
+		return(-1);
+	if (t_trace())
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Test hit and miss counters with sectors read again
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_hit_miss(void)
+{
+	rcache_stats *st;
+	uint i;
+
+	printf(" * Test hits and misses (same sectors read twice)\n");
+
+	sim_reset();
+	rcache_init(sim_rd);
+	st = rcache_get_stats();
+
+	/* Non consecutive sectors (no sequential read), same count into each
+	 * set : one sector out of two of 16 aligned sectors */
+	for (i = 0; i < (RCACHE_SETS * RCACHE_WAYS); i++)
+		if (lun_read(i * 2, 1, 1))
+			return(-1);
+	for (i = 0; i < (RCACHE_SETS * RCACHE_WAYS); i++)
+		if (lun_read(i * 2, 1, 1))
+			return(-1);
+	printf("    - %d hits, %d misses, %d sectors loaded\n",
+	       st->hits, st->misses, st->fills);
+	if ((st->hits != (RCACHE_SETS * RCACHE_WAYS)) ||
+	    (st->misses != (RCACHE_SETS * RCACHE_WAYS)) ||
+	    (rd_count != (RCACHE_SETS * RCACHE_WAYS)))
+	{
+		printf("    - Second read must be served from cache\n");
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Test a sector read by chunks of 64 bytes (USB packets)
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_chunks(void)
+{
+	rcache_stats *st;
+	u32 packet[16];
+	uint pass, i, j;
+
+	printf(" * Test sector read by chunks of 64 bytes\n");
+
+	sim_reset();
+	rcache_init(sim_rd);
+	st = rcache_get_stats();
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (i = 0; i < 512; i += 64)
+		{
+			if (rcache_read(7 * 512 + i, 64, (u8 *)packet) != 64)
+			{
+				printf("    - Chunk %d not read from cache\n", i / 64);
+				return(-1);
+			}
+			for (j = 0; j < 64; j++)
+			{
+				if (((u8 *)packet)[j] != flash[7 * 512 + i + j])
+				{
+					printf("    - Bad data at offset %d\n", i + j);
+					return(-1);
+				}
+			}
+		}
+	}
+	printf("    - %d hits, %d misses, %d bytes read from flash\n",
+	       st->hits, st->misses, rd_bytes);
+	if ((st->hits != 1) || (st->misses != 1) || (rd_bytes != 512))
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Test that modified sectors are read again from memory
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_invalidate(void)
+{
+	rcache_stats *st;
+	u8 data[512];
+
+	printf(" * Test invalidation (write and unmap)\n");
+
+	sim_reset();
+	rcache_init(sim_rd);
+	st = rcache_get_stats();
+
+	lun_read(10, 1, 1);
+	lun_read(20, 1, 1);
+	lun_read(21, 1, 1);
+	lun_read(30, 1, 1);
+
+	/* Write of sector 10 (an unaligned area is dropped too) */
+	flash[10 * 512] ^= 0xFF;
+	if (rcache_invalidate(10 * 512 + 100, 8) != 1)
+	{
+		printf("    - Modified sector not dropped\n");
+		return(-1);
+	}
+	rcache_read(10 * 512, 512, data);
+	if (data[0] != flash[10 * 512])
+	{
+		printf("    - Old data read after write\n");
+		return(-1);
+	}
+	/* Unmap of sectors 20 and 21, sector 30 stay into cache */
+	if (rcache_invalidate(20 * 512, 2 * 512) != 2)
+	{
+		printf("    - Unmapped sectors not dropped\n");
+		return(-1);
+	}
+	if ((rcache_read(30 * 512, 512, data) != 512) || (st->hits != 1))
+	{
+		printf("    - Sector outside of area dropped\n");
+		return(-1);
+	}
+	printf("    - %d entries dropped, %d hits, %d sectors loaded\n",
+	       st->invalid, st->hits, st->fills);
+	return(0);
+}
+
+/**
+ * @brief Test that long sequential reads keep hot sectors into cache
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_sequential(void)
+{
+	rcache_stats *st;
+	uint i;
+
+	printf(" * Test sequential read (hot sectors kept)\n");
+
+	sim_reset();
+	rcache_init(sim_rd);
+	st = rcache_get_stats();
+
+	/* Fill all entries with hot sectors */
+	for (i = 0; i < (RCACHE_SETS * RCACHE_WAYS); i++)
+	{
+		lun_read(1024 + i * 2, 1, 1);
+		lun_read(1024 + i * 2, 1, 1);
+	}
+	/* Read a file of 256 sectors */
+	lun_read(DATA_LBA, 256, 1);
+	rd_count = 0;
+	for (i = 0; i < (RCACHE_SETS * RCACHE_WAYS); i++)
+		lun_read(1024 + i * 2, 1, 1);
+	printf("    - %d sectors not cached, %d hot sectors lost\n", st->bypass, rd_count);
+	/* Sectors of file are not cached, hot ones only get a second chance */
+	if (rd_count || (st->bypass != 256))
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Replay a mount and directory listings trace, with and without cache
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_trace(void)
+{
+	unsigned long long ns[2];
+	rcache_stats *st;
+	u32 bytes[2];
+	uint cached, i, f;
+
+	printf(" * Test trace \"FAT mount, 50 listings and file reads\"\n");
+
+	for (cached = 0; cached < 2; cached++)
+	{
+		sim_reset();
+		rcache_init(sim_rd);
+		/* Mount : boot sector, start of FAT, root directory */
+		lun_read(0, 1, cached);
+		lun_read(0, 1, cached);
+		lun_read(FAT_LBA, 1, cached);
+		lun_read(DIR_LBA, DIR_COUNT, cached);
+		for (i = 0; i < 50; i++)
+		{
+			/* Directory listing then read of one file (FAT sector to find
+			 * its clusters, then data) */
+			lun_read(DIR_LBA, DIR_COUNT, cached);
+			f = (i * 7) % FAT_COUNT;
+			lun_read(FAT_LBA + f, 1, cached);
+			lun_read(DATA_LBA + (i * 36), 32, cached);
+			lun_read(0, 1, cached);
+		}
+		bytes[cached] = rd_bytes;
+		ns[cached] = sim_ns;
+	}
+	st = rcache_get_stats();
+	printf("    - No cache : %6d kB read from flash, %.1f ms\n",
+	       bytes[0] / 1024, (double)ns[0] / 1000000.0);
+	printf("    - %d sectors: %6d kB read from flash, %.1f ms (%d hits, %d misses)\n",
+	       RCACHE_SETS * RCACHE_WAYS, bytes[1] / 1024, (double)ns[1] / 1000000.0,
+	       st->hits, st->misses);
+	/* Most of metadata sectors must be read from RAM */
+	if ((bytes[1] >= bytes[0]) || ((st->hits * 5) < (50 * (DIR_COUNT + 2) * 4)))
+	{
+		printf("    - Read cache does not reduce flash reads enough\n");
+		return(-1);
+	}
+	return(0);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                    Simulated LUN and flash memory                    -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Read sectors like default_lun_rd (cache first, then flash)
+ *
+ * @param lba    Address of the first sector
+ * @param count  Number of sectors to read
+ * @param cached When set, the read cache is used
+ * @return integer Zero on success, other values are errors
+ */
+static int lun_read(u32 lba, u32 count, int cached)
+{
+	u8  data[512] __attribute__((aligned(4)));
+	u32 i;
+	int n;
+
+	for (i = 0; i < count; i++)
+	{
+		n = 0;
+		if (cached)
+		{
+			n = rcache_read((lba + i) * 512, 512, data);
+			if (n > 0)
+				sim_ns += (unsigned long long)n * T_COPY_BYTE;
+		}
+		if (n == 0)
+			n = sim_rd((lba + i) * 512, 512, data);
+		if ((n != 512) || (data[0] != flash[(lba + i) * 512]) ||
+		    (data[511] != flash[(lba + i) * 512 + 511]))
+		{
+			printf("    - Bad data for sector %d\n", lba + i);
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+/**
+ * @brief Read flash memory (with time and bytes accounting)
+ *
+ * @param addr Address to read
+ * @param len  Number of bytes to read
+ * @param data Pointer to a buffer to store data
+ * @return integer Number of readed bytes
+ */
+static int sim_rd(u32 addr, uint len, u8 *data)
+{
+	uint i;
+
+	if ((addr + len) > SIM_SIZE)
+		return(0);
+	for (i = 0; i < len; i++)
+		data[i] = flash[addr + i];
+	rd_bytes += len;
+	rd_count++;
+	sim_ns += T_READ_CMD + (unsigned long long)len * T_READ_BYTE;
+	return((int)len);
+}
+
+/**
+ * @brief Fill flash with a pattern and reset counters
+ *
+ */
+static void sim_reset(void)
+{
+	u32 i;
+
+	for (i = 0; i < SIM_SIZE; i++)
+		flash[i] = (u8)((i >> 9) + (i * 13));
+	rd_bytes = 0;
+	rd_count = 0;
+	sim_ns   = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                 Dummy functions to avoid missing deps                -- */
+/* -------------------------------------------------------------------------- */
+
+void *memcpy(void *dst, const void *src, int n)
+{
+	u8 *d = (u8 *)dst;
+	const u8 *s = (const u8 *)src;
+	while (n-- > 0)
+		*d++ = *s++;
+	return(dst);
+}
+
+void *memset(void *dst, int value, int n)
+{
+	u8 *d = (u8 *)dst;
+	while (n-- > 0)
+		*d++ = (u8)value;
+	return(dst);
+}
+
+void memcpy_pma(u8 *dst, const u8 *src, unsigned int len)
+{
+	memcpy(dst, src, (int)len);
+}
+/* EOF */
@@ -0,0 +1,36 @@
+/**
+ * @file  tests/ut_usb/hardware.h
+ * @brief Alternative hardware definition file to compile the USB core
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef HARDWARE_H
+#define HARDWARE_H
+#include "types.h"
+
+/* Packet memory is an array of the simulator (binary linked with -no-pie) */
+extern u8 sim_pma[2048];
+
+/* Same peripheral addresses as the real chip, decoded by sim_usb.c */
+#define RCC    0x40021000
+#define USB    0x40005C00
+#define USB_R1 ((u32)(unsigned long)sim_pma)
+
+#define RCC_APBENR1   (RCC + 0x3C)
+
+u32  reg_rd (u32 reg);
+void reg_wr (u32 reg, u32 value);
+void reg_set(u32 reg, u32 value);
+void reg_clr(u32 reg, u32 value);
+
+#endif
+/* EOF */
@@ -0,0 +1,557 @@
+/**
+ * @file  tests/ut_usb/main.c
+ * @brief Unit-test and packet benchmark of the USB core bulk IN endpoints
+ *        and packet memory copies
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include <stdio.h>
+#include "hardware.h"
+#include "sim_usb.h"
+#include "usb.h"
+
+#define BENCH_PACKETS 1024
+/* Packet memory copies : buffer offset into PMA, lengths tested */
+#define PMA_BUF  0x200
+#define PMA_LEN  140
+
+static int  t_configure(void);
+static int  t_queue(void);
+static int  t_stall(void);
+static int  t_pma_to(void);
+static int  t_pma_from(void);
+static int  t_pma_set(void);
+static int  t_bench(void);
+static int  bench(int dbl, uint fill_ns, double *mbps);
+static void drv_init(u8 type, uint total, uint fill_ns);
+static uint drv_fill(void);
+static int  drv_tx(void);
+static void host_rx(const u8 *data, uint len);
+
+/* Test class driver */
+static uint drv_sent, drv_total, drv_fill_ns;
+/* Host side */
+static uint host_pkt, host_err;
+
+/**
+ * @brief Entry point of the program
+ *
+ * @return integer Execution result returned to OS :p
+ */
+int main(void)
+{
+	printf("--=={ USB core bulk IN endpoints }==--\n");
+
+	if (t_configure())
+		return(-1);
+	if (t_queue())
+		return(-1);
+	if (t_stall())
+		return(-1);
+	if (t_pma_to())
+		return(-1);
+	if (t_pma_from())
+		return(-1);
+	if (t_pma_set())
+		return(-1);
+	if (t_bench())
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Test the configuration of a double-buffered endpoint
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_configure(void)
+{
+	u32 r, d0, d1;
+
+	printf(" * Test double-buffered endpoint configuration\n");
+	drv_init(USB_EP_BULK | USB_EP_DBL_BUF, 0, 0);
+
+	r  = sim_chep(1);
+	d0 = *(u32 *)(sim_pma + 8);
+	d1 = *(u32 *)(sim_pma + 12);
+	printf("    - CHEP1R %.8X, buffers %.4X %.4X\n", r, d0 & 0xFFFF, d1 & 0xFFFF);
+	if ((r & 0x0F) != 1)
+	{
+		printf("    - Invalid endpoint address\n");
+		return(-1);
+	}
+	if (((r & (1 << 8)) == 0) || (((r >> 4) & 3) != USB_EP_VALID) ||
+	    (((r >> 12) & 3) != 0) || (r & ((1 << 14) | (1 << 6))))
+	{
+		printf("    - Invalid endpoint state\n");
+		return(-1);
+	}
+	if (((d0 & 0xFFFF) == (d1 & 0xFFFF)) || (d0 & 0xFFFF) == 0 || (d1 & 0xFFFF) == 0)
+	{
+		printf("    - Invalid buffers\n");
+		return(-1);
+	}
+	if (usb_ep_tx_free(1) != 2)
+	{
+		printf("    - Endpoint should have 2 free buffers\n");
+		return(-1);
+	}
+
+	/* Same endpoint, single buffer */
+	drv_init(USB_EP_BULK, 0, 0);
+	r = sim_chep(1);
+	if ((r & (1 << 8)) || (((r >> 4) & 3) != USB_EP_NAK) ||
+	    (usb_ep_tx_free(1) != 1))
+	{
+		printf("    - Invalid single-buffer state %.8X\n", r);
+		return(-1);
+	}
+	printf("    - Configuration ok\n");
+	return(0);
+}
+
+/**
+ * @brief Test the queue of packets (two buffers) of a double-buffered EP
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_queue(void)
+{
+	u8  pkt[64];
+	u32 r;
+	uint i;
+
+	printf(" * Test double-buffered endpoint queue\n");
+	drv_init(USB_EP_BULK | USB_EP_DBL_BUF, 3, 0);
+
+	/* Fill both buffers, the third packet must wait */
+	drv_fill();
+	if ((drv_sent != 2) || (usb_ep_tx_free(1) != 0))
+	{
+		printf("    - %d packets queued, %d free\n", drv_sent, usb_ep_tx_free(1));
+		return(-1);
+	}
+	/* Nothing received before the first IN token */
+	if (host_pkt != 0)
+		return(-1);
+	/* No free buffer : packet refused, USB interrupt mask is unchanged */
+	for (i = 0; i < 64; i++)
+		pkt[i] = 0;
+	reg_wr(0xE000E180, (1 << 8)); /* USB */
+	if ((usb_send(1, pkt, 64) != -1) || (reg_rd(0xE000E100) & (1 << 8)))
+	{
+		printf("    - Packet accepted or USB interrupt enabled\n");
+		return(-1);
+	}
+	reg_wr(0xE000E100, (1 << 8)); /* USB */
+
+	/* First packet : the completion refill the freed buffer */
+	sim_usb_bus(1, 1);
+	if ((host_pkt != 1) || (drv_sent != 3))
+	{
+		printf("    - Refill failed (%d received, %d sent)\n", host_pkt, drv_sent);
+		return(-1);
+	}
+	/* Run until the endpoint is idle */
+	sim_usb_bus(1, 0);
+	r = sim_chep(1);
+	if ((host_pkt != 3) || host_err || (usb_ep_tx_free(1) != 2))
+	{
+		printf("    - %d packets received, %d errors\n", host_pkt, host_err);
+		return(-1);
+	}
+	/* Idle : DTOG_TX equal SW_BUF, endpoint answer NAK */
+	if (((r >> 6) & 1) != ((r >> 14) & 1))
+	{
+		printf("    - Endpoint not idle (%.8X)\n", r);
+		return(-1);
+	}
+	printf("    - %d packets received in order, send refused when full (ok)\n",
+	       host_pkt);
+	return(0);
+}
+
+/**
+ * @brief Test that a STALL and clear feature restart a clean ping-pong
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_stall(void)
+{
+	u32 r;
+
+	printf(" * Test double-buffered endpoint stall and clear\n");
+	drv_init(USB_EP_BULK | USB_EP_DBL_BUF, 4, 0);
+
+	/* One packet sent, one is pending when the endpoint is stalled */
+	drv_fill();
+	sim_usb_bus(1, 1);
+	usb_ep_set_state(0x81, USB_EP_STALL);
+	if ((((sim_chep(1) >> 4) & 3) != USB_EP_STALL) || sim_usb_bus(1, 0))
+	{
+		printf("    - Endpoint not stalled\n");
+		return(-1);
+	}
+	/* Clear feature : both buffers free, data toggle reset */
+	usb_ep_set_state(0x81, USB_EP_VALID);
+	r = sim_chep(1);
+	if ((((r >> 4) & 3) != USB_EP_VALID) || (r & ((1 << 14) | (1 << 6))) ||
+	    (usb_ep_tx_free(1) != 2) || sim_usb_bus(1, 0))
+	{
+		printf("    - Invalid state after clear (%.8X)\n", r);
+		return(-1);
+	}
+	printf("    - Endpoint restarted (ok)\n");
+	return(0);
+}
+
+/**
+ * @brief Test the copy to packet memory with all source alignments
+ *
+ * The simulated PMA is accessed with reg_rd/reg_wr, only 32 bits accesses
+ * are valid : each word must be written once, the last one padded.
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_pma_to(void)
+{
+	u8   src[PMA_LEN + 8] __attribute__((aligned(4)));
+	uint sa, len, i, words;
+	u8   expected;
+
+	printf(" * Test copy to packet memory\n");
+	for (i = 0; i < sizeof(src); i++)
+		src[i] = (u8)(i * 7 + 1);
+
+	for (sa = 0; sa < 4; sa++)
+	for (len = 0; len <= PMA_LEN; len++)
+	{
+		sim_usb_init();
+		for (i = 0; i < sizeof(sim_pma); i++)
+			sim_pma[i] = 0xA5;
+
+		memcpy_to_pma(sim_pma + PMA_BUF, src + sa, len);
+
+		words = (len + 3) / 4;
+		if (sim_st.errors || (sim_st.pma_words != words))
+		{
+			printf("    - src+%d length %d: %lu words written, %d "
+			       "expected\n", sa, len, sim_st.pma_words, words);
+			return(-1);
+		}
+		for (i = 0; i < sizeof(sim_pma); i++)
+		{
+			if ((i < PMA_BUF) || (i >= PMA_BUF + (words * 4)))
+				expected = 0xA5;
+			else if (i < PMA_BUF + len)
+				expected = src[sa + i - PMA_BUF];
+			else
+				continue; /* Padding of the last word */
+			if (sim_pma[i] != expected)
+			{
+				printf("    - src+%d length %d: PMA %.4X is %.2X, "
+				       "expected %.2X\n", sa, len, i, sim_pma[i], expected);
+				return(-1);
+			}
+		}
+	}
+	printf("    - All source alignments, 0 to %d bytes (ok)\n", PMA_LEN);
+	return(0);
+}
+
+/**
+ * @brief Test the fill of packet memory with all destination alignments
+ *
+ * Only "len" bytes must be modified : the bytes of the first and last words
+ * that are outside of the area must keep their value.
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_pma_set(void)
+{
+	uint da, len, i;
+	u8   expected;
+
+	printf(" * Test fill of packet memory\n");
+
+	for (da = 0; da < 4; da++)
+	for (len = 0; len <= PMA_LEN; len++)
+	{
+		sim_usb_init();
+		for (i = 0; i < sizeof(sim_pma); i++)
+			sim_pma[i] = 0xA5;
+
+		memset_pma(sim_pma + PMA_BUF + da, 0, len);
+
+		if (sim_st.errors)
+			return(-1);
+		for (i = 0; i < sizeof(sim_pma); i++)
+		{
+			if ((i >= PMA_BUF + da) && (i < PMA_BUF + da + len))
+				expected = 0x00;
+			else
+				expected = 0xA5;
+			if (sim_pma[i] != expected)
+			{
+				printf("    - dst+%d length %d: PMA %.4X is %.2X, "
+				       "expected %.2X\n", da, len, i, sim_pma[i], expected);
+				return(-1);
+			}
+		}
+	}
+	printf("    - All destination alignments, 0 to %d bytes (ok)\n", PMA_LEN);
+	return(0);
+}
+
+/**
+ * @brief Test the copy from packet memory with all destination alignments
+ *
+ * Only "len" bytes must be written into the destination, even when the
+ * last word is not complete.
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_pma_from(void)
+{
+	u8   dst[PMA_LEN + 8] __attribute__((aligned(4)));
+	uint da, len, i, words;
+	u8   expected;
+
+	printf(" * Test copy from packet memory\n");
+
+	for (da = 0; da < 4; da++)
+	for (len = 0; len <= PMA_LEN; len++)
+	{
+		sim_usb_init();
+		for (i = 0; i < sizeof(sim_pma); i++)
+			sim_pma[i] = (u8)(i * 5 + 3);
+		for (i = 0; i < sizeof(dst); i++)
+			dst[i] = 0xA5;
+
+		memcpy_from_pma(dst + da, sim_pma + PMA_BUF, len);
+
+		words = (len + 3) / 4;
+		if (sim_st.errors || (sim_st.pma_words != words))
+		{
+			printf("    - dst+%d length %d: %lu words read, %d "
+			       "expected\n", da, len, sim_st.pma_words, words);
+			return(-1);
+		}
+		for (i = 0; i < sizeof(dst); i++)
+		{
+			if ((i >= da) && (i < da + len))
+				expected = sim_pma[PMA_BUF + i - da];
+			else
+				expected = 0xA5;
+			if (dst[i] != expected)
+			{
+				printf("    - dst+%d length %d: byte %d is %.2X, "
+				       "expected %.2X\n", da, len, i, dst[i], expected);
+				return(-1);
+			}
+		}
+	}
+	printf("    - All destination alignments, 0 to %d bytes, no overrun (ok)\n", PMA_LEN);
+	return(0);
+}
+
+/**
+ * @brief Compare the throughput of single and double-buffered endpoints
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_bench(void)
+{
+	const uint fill[2] = {2000, 20000};
+	double single, dbl;
+	uint i;
+
+	for (i = 0; i < 2; i++)
+	{
+		printf(" * Benchmark %d packets, %d us to prepare each one\n",
+		       BENCH_PACKETS, fill[i] / 1000);
+		if (bench(0, fill[i], &single) || bench(1, fill[i], &dbl))
+			return(-1);
+		if (dbl <= single)
+		{
+			printf("    - Double-buffer should be faster\n");
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+/**
+ * @brief Measure the throughput of a bulk IN transfer
+ *
+ * @param dbl     Set to non-zero to use a double-buffered endpoint
+ * @param fill_ns Time needed by the class driver to prepare a packet
+ * @param mbps    Pointer to a variable where the throughput is stored
+ * @return integer Zero on success, other values are errors
+ */
+static int bench(int dbl, uint fill_ns, double *mbps)
+{
+	sim_time duration, bus;
+
+	drv_init(USB_EP_BULK | (dbl ? USB_EP_DBL_BUF : 0), BENCH_PACKETS, fill_ns);
+	drv_fill();
+	sim_usb_bus(1, 0);
+
+	if ((host_pkt != BENCH_PACKETS) || host_err || sim_st.errors)
+	{
+		printf("    - %d packets received, %d errors\n", host_pkt, host_err);
+		return(-1);
+	}
+	duration = sim_st.end - sim_st.start;
+	bus = (sim_time)(64 + sim_tm.pkt_ovh) * sim_tm.byte_ns;
+	*mbps = ((double)sim_st.bytes / 1000000.0) / ((double)duration / 1000000000.0);
+	printf("    - %s: %.3f MB/s, %lu NAK, %.2f us gap/packet (bus %.1f us)\n",
+	       dbl ? "double" : "single", *mbps, sim_st.naks,
+	       (double)(duration - sim_st.busy) / (double)BENCH_PACKETS / 1000.0,
+	       (double)bus / 1000.0);
+
+	/* With two buffers, the preparation is hidden behind the bus */
+	if (dbl && (sim_st.naks > (BENCH_PACKETS + (BENCH_PACKETS / 2))))
+	{
+		printf("    - Too many NAK for double-buffer\n");
+		return(-1);
+	}
+	return(0);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                                                                      -- */
+/* --                        Test class driver                             -- */
+/* --                                                                      -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Reset simulation and configure the class IN endpoint (EP1)
+ *
+ * @param type    Endpoint type and flags for usb_ep_configure()
+ * @param total   Number of packets to send
+ * @param fill_ns Time needed to prepare one packet
+ */
+static void drv_init(u8 type, uint total, uint fill_ns)
+{
+	usb_ep_def ep_def;
+
+	sim_usb_init();
+	sim_usb_host(host_rx);
+	usb_init();
+	usb_start();
+
+	ep_def.release     = 0;
+	ep_def.rx          = 0;
+	ep_def.tx_complete = drv_tx;
+	usb_ep_configure(1, type, &ep_def);
+
+	drv_sent    = 0;
+	drv_total   = total;
+	drv_fill_ns = fill_ns;
+	host_pkt    = 0;
+	host_err    = 0;
+}
+
+/**
+ * @brief Queue packets as long as the endpoint has a free buffer
+ *
+ * @return integer Number of packets queued
+ */
+static uint drv_fill(void)
+{
+	u8 pkt[64];
+	uint i, count = 0;
+
+	while ((drv_sent < drv_total) && (usb_ep_tx_free(1) > 0))
+	{
+		sim_cpu(drv_fill_ns);
+		for (i = 0; i < 64; i++)
+			pkt[i] = (u8)((drv_sent * 3) + i);
+		usb_send(1, pkt, 64);
+		drv_sent++;
+		count++;
+	}
+	return(count);
+}
+
+/**
+ * @brief Endpoint IN completion callback (called by USB interrupt)
+ *
+ */
+static int drv_tx(void)
+{
+	return(drv_fill() ? 1 : 0);
+}
+
+/**
+ * @brief Process an IN packet received by host
+ *
+ * @param data Pointer to packet content
+ * @param len  Length of the packet
+ */
+static void host_rx(const u8 *data, uint len)
+{
+	uint i;
+
+	if (len != 64)
+		host_err++;
+	for (i = 0; i < len; i++)
+	{
+		if (data[i] != (u8)((host_pkt * 3) + i))
+		{
+			host_err++;
+			break;
+		}
+	}
+	host_pkt++;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                                Stubs                                 -- */
+/* -------------------------------------------------------------------------- */
+
+void (*app_reset)(void);
+
+void *memcpy(void *dst, const void *src, int n)
+{
+	u8 *d = (u8 *)dst;
+	const u8 *s = (const u8 *)src;
+	while (n-- > 0)
+		*d++ = *s++;
+	return(dst);
+}
+
+void *memset(void *dst, int value, int n)
+{
+	u8 *d = (u8 *)dst;
+	while (n-- > 0)
+		*d++ = (u8)value;
+	return(dst);
+}
+
+void uart_puts(char *s)
+{
+	(void)s;
+}
+
+void uart_putdec(const u32 v)
+{
+	(void)v;
+}
+
+void uart_puthex(const u32 c, const uint len)
+{
+	(void)c;
+	(void)len;
+}
+/* EOF */
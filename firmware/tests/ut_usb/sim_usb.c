@@ -0,0 +1,346 @@
+/**
+ * @file  tests/ut_usb/sim_usb.c
+ * @brief Simulated USB peripheral (registers, PMA) and bulk IN host
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include <stdio.h>
+#include "hardware.h"
+#include "sim_usb.h"
+#include "usb.h"
+
+void USB_Handler(void);
+
+u8 sim_pma[2048] __attribute__((aligned(4)));
+sim_timing    sim_tm;
+sim_usb_stats sim_st;
+
+/* Endpoint registers (CHEPnR) */
+static u32      chep[8];
+static sim_time ready_at[8];
+/* Other registers, only saved */
+static u32      cntr, daddr, bcdr, apbenr1;
+static u32      nvic_en;
+/* Time seen by CPU and by bus */
+static sim_time cpu_now;
+static sim_time bus_now;
+static void   (*host_rx)(const u8 *data, uint len);
+
+static int  ep_ready(uint ep, u32 *desc);
+static u32 *pma_word(u32 addr);
+static void chep_write(uint ep, u32 v);
+
+/**
+ * @brief Reset the simulated peripheral and host
+ *
+ */
+void sim_usb_init(void)
+{
+	uint i;
+
+	for (i = 0; i < sizeof(sim_pma); i++)
+		sim_pma[i] = 0;
+	for (i = 0; i < 8; i++)
+	{
+		chep[i]     = 0;
+		ready_at[i] = 0;
+	}
+	sim_st.packets = 0;
+	sim_st.bytes   = 0;
+	sim_st.naks    = 0;
+	sim_st.errors  = 0;
+	sim_st.pma_words = 0;
+	sim_st.busy    = 0;
+	sim_st.start   = 0;
+	sim_st.end     = 0;
+	cntr    = 0;
+	daddr   = 0;
+	bcdr    = 0;
+	apbenr1 = 0;
+	nvic_en = 0;
+	cpu_now = 0;
+	bus_now = 0;
+	host_rx = 0;
+
+	/* Default timings : Full-Speed bus, 64MHz Cortex-M0+ */
+	sim_tm.byte_ns  = 667;
+	sim_tm.pkt_ovh  = 20;
+	sim_tm.retry_ns = 2000;
+	sim_tm.irq_ns   = 500;
+	sim_tm.reg_ns   = 50;
+}
+
+/**
+ * @brief Consume CPU time (code executed by firmware or test driver)
+ *
+ * @param ns Duration (in ns)
+ */
+void sim_cpu(sim_time ns)
+{
+	cpu_now += ns;
+}
+
+/**
+ * @brief Get the current value of an endpoint register
+ *
+ * @param ep Endpoint number
+ */
+u32 sim_chep(uint ep)
+{
+	return(chep[ep & 7]);
+}
+
+/**
+ * @brief Register a function called by host for each received IN packet
+ *
+ * @param rx Pointer to the host receive function
+ */
+void sim_usb_host(void (*rx)(const u8 *data, uint len))
+{
+	host_rx = rx;
+}
+
+/**
+ * @brief Run the host and the bus until an IN endpoint is idle
+ *
+ * The host poll the endpoint with IN tokens. When the endpoint is not ready
+ * the token is NAKed and retried later (see retry_ns). At the end of each
+ * packet the USB interrupt is raised (if enabled into NVIC) and handled by
+ * the USB core : the time used by the interrupt handler is counted on the CPU
+ * side, the bus continue as soon as a buffer is available.
+ *
+ * @param ep    Endpoint number
+ * @param count Maximum number of packets to receive (0 for no limit)
+ * @return integer Number of packets received
+ */
+uint sim_usb_bus(uint ep, uint count)
+{
+	uint n = 0;
+	u32  desc, len, addr, i;
+	u8   pkt[1024];
+	sim_time start, naks;
+
+	if (bus_now < cpu_now)
+		bus_now = cpu_now;
+
+	while ((count == 0) || (n < count))
+	{
+		if ( ! ep_ready(ep, &desc))
+			break;
+
+		/* Endpoint became ready after bus : count NAKed tokens */
+		start = bus_now;
+		if (ready_at[ep] > start)
+		{
+			naks = (ready_at[ep] - start + sim_tm.retry_ns - 1) / sim_tm.retry_ns;
+			start += naks * sim_tm.retry_ns;
+			sim_st.naks += (unsigned long)naks;
+		}
+
+		/* Copy packet from PMA, as the peripheral would do */
+		len  = (desc >> 16) & 0x3FF;
+		addr = (desc & 0xFFFF);
+		if ((addr + len) > sizeof(sim_pma))
+		{
+			printf("    - PMA error: buffer at %.4X len %d\n", addr, len);
+			sim_st.errors++;
+			break;
+		}
+		for (i = 0; i < len; i++)
+			pkt[i] = sim_pma[addr + i];
+
+		if (sim_st.packets == 0)
+			sim_st.start = start;
+		bus_now = start + (sim_time)(len + sim_tm.pkt_ovh) * sim_tm.byte_ns;
+		sim_st.busy += (sim_time)(len + sim_tm.pkt_ovh) * sim_tm.byte_ns;
+		sim_st.end   = bus_now;
+		sim_st.packets++;
+		sim_st.bytes += len;
+		n++;
+		if (host_rx)
+			host_rx(pkt, len);
+
+		/* Transaction complete : update endpoint */
+		chep[ep] ^= (1 << 6);  // Toggle DTOG_TX
+		if ((chep[ep] & (1 << 8)) == 0)
+			chep[ep] = (chep[ep] & ~(u32)(3 << 4)) | (2 << 4); // STAT_TX NAK
+		chep[ep] |= (1 << 7);  // VTTX
+
+		/* USB interrupt */
+		if ((nvic_en & (1 << 8)) && (cntr & (1 << 15)))
+		{
+			if (cpu_now < bus_now)
+				cpu_now = bus_now;
+			cpu_now += sim_tm.irq_ns;
+			ready_at[ep] = 0;
+			USB_Handler();
+		}
+		/* Buffer released before the end of transaction */
+		if (ready_at[ep] < bus_now)
+			ready_at[ep] = bus_now;
+	}
+	return(n);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                                                                      -- */
+/* --                          Register model                              -- */
+/* --                                                                      -- */
+/* -------------------------------------------------------------------------- */
+
+u32 reg_rd(u32 reg)
+{
+	u32 v = 0;
+	uint i;
+
+	cpu_now += sim_tm.reg_ns;
+
+	if ((reg >= USB_RAM) && (reg < (USB_RAM + sizeof(sim_pma))))
+		return(*pma_word(reg));
+	if ((reg >= USB) && (reg < (USB + 0x20)))
+		return(chep[(reg - USB) >> 2]);
+	if (reg == USB_ISTR)
+	{
+		/* CTR is set while an endpoint has a VTxX flag */
+		for (i = 0; i < 8; i++)
+		{
+			if (chep[i] & (1 << 15))
+				return((1 << 15) | (1 << 4) | i);
+			if (chep[i] & (1 << 7))
+				return((1 << 15) | i);
+		}
+		return(0);
+	}
+	if (reg == USB_CNTR)
+		v = cntr;
+	else if (reg == USB_DADDR)
+		v = daddr;
+	else if (reg == USB_BCDR)
+		v = bcdr;
+	else if (reg == RCC_APBENR1)
+		v = apbenr1;
+	else if ((reg == 0xE000E100) || (reg == 0xE000E180))
+		v = nvic_en;
+	return(v);
+}
+
+void reg_wr(u32 reg, u32 value)
+{
+	cpu_now += sim_tm.reg_ns;
+
+	if ((reg >= USB_RAM) && (reg < (USB_RAM + sizeof(sim_pma))))
+		*pma_word(reg) = value;
+	else if ((reg >= USB) && (reg < (USB + 0x20)))
+		chep_write((reg - USB) >> 2, value);
+	else if (reg == USB_CNTR)
+		cntr = value;
+	else if (reg == USB_DADDR)
+		daddr = value;
+	else if (reg == USB_BCDR)
+		bcdr = value;
+	else if (reg == RCC_APBENR1)
+		apbenr1 = value;
+	else if (reg == 0xE000E100)
+		nvic_en |= value;
+	else if (reg == 0xE000E180)
+		nvic_en &= ~value;
+	/* ISTR : CTR is read-only, other events are not simulated */
+}
+
+void reg_set(u32 reg, u32 value)
+{
+	reg_wr(reg, reg_rd(reg) | value);
+}
+
+void reg_clr(u32 reg, u32 value)
+{
+	reg_wr(reg, reg_rd(reg) & ~value);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                                                                      -- */
+/* --                          Private  functions                          -- */
+/* --                                                                      -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Test if an IN endpoint can answer a token with data
+ *
+ * @param ep   Endpoint number
+ * @param desc Pointer to a variable where the buffer descriptor is stored
+ * @return boolean True if a data packet can be sent
+ */
+static int ep_ready(uint ep, u32 *desc)
+{
+	u32 r = chep[ep];
+	uint dtog;
+
+	if (((r >> 4) & 3) != USB_EP_VALID)
+		return(0);
+	dtog = (r >> 6) & 1;
+	/* Double-buffered : hardware own buffer DTOG_TX if SW_BUF differs */
+	if (r & (1 << 8))
+	{
+		if (dtog == ((r >> 14) & 1))
+			return(0);
+		*desc = *(u32 *)(sim_pma + (ep * 8) + (dtog * 4));
+	}
+	else
+		*desc = *(u32 *)(sim_pma + (ep * 8));
+	return(1);
+}
+
+/**
+ * @brief Get a word of packet memory accessed by firmware
+ *
+ * The packet memory only supports 32 bits accesses : an unaligned address
+ * is an error (the word that contains it is used).
+ *
+ * @param addr Address of the word into packet memory
+ * @return u32* Pointer to the word into sim_pma
+ */
+static u32 *pma_word(u32 addr)
+{
+	if (addr & 3)
+	{
+		printf("    - PMA error: unaligned access at %.4X\n",
+		       addr - USB_RAM);
+		sim_st.errors++;
+	}
+	sim_st.pma_words++;
+	return((u32 *)(sim_pma + ((addr - USB_RAM) & ~3U)));
+}
+
+/**
+ * @brief Write an endpoint register with the hardware bits semantic
+ *
+ * @param ep Endpoint number
+ * @param v  Value written by firmware
+ */
+static void chep_write(uint ep, u32 v)
+{
+	u32 desc;
+	int prev;
+
+	prev = ep_ready(ep, &desc);
+
+	/* EA, EP_KIND and UTYPE are read/write */
+	chep[ep] = (chep[ep] & ~(u32)0x070F) | (v & 0x070F);
+	/* VTRX and VTTX are cleared by writing 0 */
+	chep[ep] &= (v | ~(u32)0x8080);
+	/* DTOGx and STATx are toggled by writing 1 */
+	chep[ep] ^= (v & 0x7070);
+
+	if ((prev == 0) && ep_ready(ep, &desc))
+		ready_at[ep] = cpu_now;
+}
+/* EOF */
@@ -0,0 +1,53 @@
+/**
+ * @file  tests/ut_usb/sim_usb.h
+ * @brief Headers and definitions for the simulated USB peripheral and host
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#ifndef SIM_USB_H
+#define SIM_USB_H
+#include "types.h"
+
+typedef unsigned long long sim_time; /* Simulation time (in ns) */
+
+typedef struct sim_timing_s
+{
+	uint byte_ns;  /* Time to transfer one byte on the bus (FS: 12Mbps)  */
+	uint pkt_ovh;  /* Protocol overhead of one packet (in bytes)         */
+	uint retry_ns; /* Delay before host retry an IN token after a NAK    */
+	uint irq_ns;   /* Interrupt latency (entry of USB_Handler)           */
+	uint reg_ns;   /* Duration of one peripheral register access         */
+} sim_timing;
+
+typedef struct sim_usb_stats_s
+{
+	unsigned long packets;  /* Number of IN packets received by host     */
+	unsigned long bytes;    /* Number of bytes received by host          */
+	unsigned long naks;     /* Number of IN tokens answered by NAK       */
+	unsigned long errors;   /* Invalid data or use of the peripheral     */
+	unsigned long pma_words;/* Accesses to PMA with reg_rd or reg_wr     */
+	sim_time      busy;     /* Time used by data packets on the bus      */
+	sim_time      start;    /* Time of the first IN packet               */
+	sim_time      end;      /* End time of the last IN packet            */
+} sim_usb_stats;
+
+extern sim_timing    sim_tm;
+extern sim_usb_stats sim_st;
+
+void sim_usb_init(void);
+void sim_cpu(sim_time ns);
+u32  sim_chep(uint ep);
+uint sim_usb_bus(uint ep, uint count);
+void sim_usb_host(void (*rx)(const u8 *data, uint len));
+
+#endif
+/* EOF */
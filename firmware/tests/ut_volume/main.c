@@ -0,0 +1,584 @@
+/**
+ * @file  tests/ut_volume/main.c
+ * @brief Simulate a volume made of many flash nodes (mapping and time)
+ *
+ * The memory layer is replaced by a timed model of the board : nodes 0 and 1
+ * share the first SPI port, node 2 use the second one. A read started on a
+ * port runs (DMA) while the caller continue, and an erase/program job keeps
+ * its node busy without blocking others. The tests verify the address
+ * mapping (spanned and striped, with chips of different sizes), then
+ * measure the bandwidth of sequential reads and writes (through the write
+ * cache) for several sets of nodes. The reads are direct volume_read of
+ * many units : the LUN does not read this way (see volume_read), only the
+ * write bandwidth applies to host commands.
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include <stdio.h>
+#include "types.h"
+#include "mem.h"
+#include "volume.h"
+#include "wcache.h"
+
+#define MB (1024 * 1024)
+#define SIM_NODE_SZ (2 * MB)
+#define SIM_RD_REQ  (16 * 1024)
+#define SIM_RD_SIZE (64 * SIM_RD_REQ)
+#define SIM_WR_SIZE (512 * 1024)
+#define SIM_WR_CMD  64 /* Sectors per WRITE command */
+
+/* Flash timings (typical values of MX25L51245G, SPI at 32MHz) */
+#define T_CMD         2000     /* Command, address and DMA setup  */
+#define T_READ_BYTE   250      /* Read one byte                   */
+#define T_ERASE       45000000 /* Erase one 4k sector             */
+#define T_PROGRAM     750000   /* Program one 256B page           */
+/* Time to receive one sector from host (Full-Speed bulk) */
+#define T_HOST_SECTOR 450000
+
+typedef unsigned long long sim_time;
+
+static u8  flash[MEM_NODE_COUNT][SIM_NODE_SZ];
+static u8  buffer[SIM_RD_REQ] __attribute__((aligned(4)));
+static u8  sector[512] __attribute__((aligned(4)));
+static mem_node       nodes[MEM_NODE_COUNT];
+static mem_flash_chip chips[MEM_NODE_COUNT];
+static mem_job  *jobs[MEM_NODE_COUNT];
+static sim_time  job_end[MEM_NODE_COUNT];
+static u8        rd_pending[MEM_NODE_COUNT];
+static sim_time  rd_end[MEM_NODE_COUNT];
+static sim_time  now;
+static uint      trim_count[MEM_NODE_COUNT];
+
+static int  t_map(void);
+static int  t_read(const u8 *nids, uint count, sim_time *dur);
+static int  t_write(const u8 *nids, uint count, sim_time *dur);
+static int  bandwidth(const char *name, int (*test)(const u8 *, uint, sim_time *));
+static int  sim_idle(void);
+static void sim_reset(void);
+static void fill(u32 size, u8 seed);
+static u8   pattern(u32 addr, u8 seed);
+static uint port(uint nid);
+
+/**
+ * @brief Entry point of the program
+ *
+ * @param argc Number of arguments
+ * @param argv Array of arguments
+ * @return integer Execution result returned to OS :p
+ */
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	printf("--=={ Volume simulation }==--\n");
+
+	if (t_map())
+		return(-1);
+	if (bandwidth("Sequential read", t_read))
+		return(-1);
+	if (bandwidth("Sequential write", t_write))
+		return(-1);
+
+	return(0);
+}
+
+/**
+ * @brief Verify the mapping of volume addresses to nodes
+ *
+ * @return integer Zero on success, -1 on error
+ */
+static int t_map(void)
+{
+	const u8 nids[3] = {0, 1, 2};
+	const u8 pair[2] = {0, 2};
+	const volume_extent *ext;
+	u32  maddr;
+	uint nid, n;
+
+	printf(" * Test address mapping\n");
+	sim_reset();
+	/* Chips of 2MB, 2MB and 1MB */
+	chips[2].size = 1024;
+
+	/* Spanned : nodes one after the other */
+	if (volume_init(VOLUME_SPAN, nids, 3, 4096) || (volume_size() != (5 * MB)))
+		goto err_size;
+	printf("    - Spanned 2M+2M+1M : size %d kB\n", volume_size() / 1024);
+	n = volume_map((2 * MB) + 5, &nid, &maddr);
+	if ((nid != 1) || (maddr != 5) || (n != 4091))
+		goto err_map;
+	n = volume_map((4 * MB) + 8192, &nid, &maddr);
+	if ((nid != 2) || (maddr != 8192) || (n != 4096))
+		goto err_map;
+	n = volume_map((5 * MB), &nid, &maddr);
+	if (nid != MEM_NODE_COUNT)
+		goto err_map;
+
+	/* Striped : all nodes up to 1MB, then the end of nodes 0 and 1 */
+	if (volume_init(VOLUME_STRIPE, nids, 3, 4096) || (volume_size() != (5 * MB)))
+		goto err_size;
+	ext = volume_get_extent(1);
+	if ((ext == 0) || (ext->start != (3 * MB)) || (ext->count != 2) ||
+	    (volume_get_extent(2) != 0))
+		goto err_extent;
+	printf("    - Striped 2M+2M+1M : size %d kB (3M on 3 nodes, 2M on 2)\n", volume_size() / 1024);
+	n = volume_map(4096, &nid, &maddr);
+	if ((nid != 1) || (maddr != 0) || (n != 4096))
+		goto err_map;
+	n = volume_map(8192 + 10, &nid, &maddr);
+	if ((nid != 2) || (maddr != 10) || (n != 4086))
+		goto err_map;
+	n = volume_map(12288 + 100, &nid, &maddr);
+	if ((nid != 0) || (maddr != 4196) || (n != 3996))
+		goto err_map;
+	n = volume_map((3 * MB) + 4096, &nid, &maddr);
+	if ((nid != 1) || (maddr != MB))
+		goto err_map;
+	n = volume_map((3 * MB) + 8192 + 7, &nid, &maddr);
+	if ((nid != 0) || (maddr != (MB + 4096 + 7)))
+		goto err_map;
+	/* Back into the first extent */
+	n = volume_map((3 * MB) - 1, &nid, &maddr);
+	if ((nid != 2) || (maddr != (MB - 1)) || (n != 1))
+		goto err_map;
+	/* Trim : only complete sectors, each one given to its node */
+	n = (uint)volume_trim(4096 + 100, 3 * 4096);
+	if ((n != 2) || (trim_count[0] != 1) || trim_count[1] || (trim_count[2] != 1))
+		goto err_trim;
+	printf("    - Trim 12k at 4196 : 2 sectors (nodes 2 and 0)\n");
+
+	chips[2].size = 2048;
+	if (volume_init(VOLUME_STRIPE, pair, 2, 8192) || (volume_size() != (4 * MB)))
+		goto err_size;
+	printf("    - Striped 2M+2M, unit 8k : size %d kB\n", volume_size() / 1024);
+	n = volume_map(12288, &nid, &maddr);
+	if ((nid != 2) || (maddr != 4096) || (n != 4096))
+		goto err_map;
+	n = volume_map(16384 + 5, &nid, &maddr);
+	if ((nid != 0) || (maddr != 8197) || (n != 8187))
+		goto err_map;
+
+	/* Invalid configurations, volume falls back to node 0 */
+	if ((volume_init(VOLUME_STRIPE, nids, 3, 2048) == 0) ||
+	    (volume_init(VOLUME_STRIPE, nids, 3, 6000) == 0) ||
+	    (volume_init(VOLUME_STRIPE, nids, 0, 4096) == 0) ||
+	    (volume_init(2, nids, 3, 4096) == 0))
+		goto err_invalid;
+	nodes[1].type = 0;
+	if (volume_init(VOLUME_SPAN, nids, 3, 4096) == 0)
+		goto err_invalid;
+	n = volume_map(0x12345, &nid, &maddr);
+	if ((nid != 0) || (maddr != 0x12345) || (volume_size() != 0))
+		goto err_map;
+	printf("    - Invalid units, modes and nodes rejected\n");
+
+	sim_reset();
+	return(0);
+
+err_size:
+	printf("    - Bad volume size %d\n", volume_size());
+	return(-1);
+err_extent:
+	printf("    - Bad extents table\n");
+	return(-1);
+err_map:
+	printf("    - Bad mapping : node %d address %x (%d bytes)\n", nid, maddr, n);
+	return(-1);
+err_invalid:
+	printf("    - Invalid configuration accepted\n");
+	return(-1);
+err_trim:
+	printf("    - Bad trim : %d sectors (%d %d %d)\n", n,
+	       trim_count[0], trim_count[1], trim_count[2]);
+	return(-1);
+}
+
+/**
+ * @brief Run a bandwidth test with many sets of nodes
+ *
+ * The volume striped over nodes of two SPI ports must be (almost) twice
+ * faster than one node.
+ *
+ * @param name Name of the test (for messages)
+ * @param test Pointer to the test function
+ * @return integer Zero on success, -1 on error
+ */
+static int bandwidth(const char *name, int (*test)(const u8 *, uint, sim_time *))
+{
+	static const u8 sets[4][3] = { {0}, {0, 1}, {0, 2}, {0, 1, 2} };
+	static const uint count[4] = { 1, 2, 2, 3 };
+	sim_time dur[4];
+	uint i;
+
+	printf(" * Test %s\n", name);
+	for (i = 0; i < 4; i++)
+	{
+		if (test(sets[i], count[i], &dur[i]))
+			return(-1);
+		printf("    - %d node(s) %s : %4llu.%llu ms (x%llu.%02llu)\n",
+		       count[i], (count[i] == 2) && (sets[i][1] == 1) ? "same port " : "          ",
+		       dur[i] / 1000000, (dur[i] / 100000) % 10,
+		       dur[0] / dur[i], ((dur[0] * 100) / dur[i]) % 100);
+	}
+	/* Nodes 0 and 2 use different ports, expect at least x1.8 */
+	if ((dur[2] * 18) > (dur[0] * 10))
+	{
+		printf("    - Striping does not run nodes together\n");
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Read sequentially the beginning of a volume
+ *
+ * @param nids  Pointer to an array of node identifiers
+ * @param count Number of nodes
+ * @param dur   Pointer to a variable to store the duration (ns)
+ * @return integer Zero on success, -1 on error
+ */
+static int t_read(const u8 *nids, uint count, sim_time *dur)
+{
+	sim_time start;
+	u32  addr;
+	uint i;
+
+	sim_reset();
+	if (volume_init(VOLUME_STRIPE, nids, count, VOLUME_UNIT_SZ))
+		return(-1);
+	fill(SIM_RD_SIZE, 0x5A);
+
+	start = now;
+	for (addr = 0; addr < SIM_RD_SIZE; addr += SIM_RD_REQ)
+	{
+		if (volume_read(addr, SIM_RD_REQ, buffer) != SIM_RD_REQ)
+		{
+			printf("    - Read error at %x\n", addr);
+			return(-1);
+		}
+		for (i = 0; i < SIM_RD_REQ; i++)
+		{
+			if (buffer[i] != pattern(addr + i, 0x5A))
+			{
+				printf("    - Bad data at %x\n", addr + i);
+				return(-1);
+			}
+		}
+	}
+	*dur = now - start;
+	return(0);
+}
+
+/**
+ * @brief Write sequentially the beginning of a volume through the cache
+ *
+ * Host sends WRITE commands of 32k, one sector each T_HOST_SECTOR. When the
+ * cache is busy, the sector is delayed (NAK) until the end of a flash job.
+ *
+ * @param nids  Pointer to an array of node identifiers
+ * @param count Number of nodes
+ * @param dur   Pointer to a variable to store the duration (ns)
+ * @return integer Zero on success, -1 on error
+ */
+static int t_write(const u8 *nids, uint count, sim_time *dur)
+{
+	sim_time start;
+	u32  addr, cmd;
+	uint i, nid;
+	u32  maddr;
+	int  result;
+
+	sim_reset();
+	if (volume_init(VOLUME_STRIPE, nids, count, VOLUME_UNIT_SZ))
+		return(-1);
+	fill(SIM_WR_SIZE, 0x00);
+	wcache_init(0, WCACHE_WAYS);
+	wcache_map(volume_map);
+
+	start = now;
+	for (cmd = 0; cmd < SIM_WR_SIZE; cmd += (SIM_WR_CMD * 512))
+	{
+		wcache_prepare(cmd, SIM_WR_CMD * 512);
+		for (addr = cmd; addr < (cmd + (SIM_WR_CMD * 512)); addr += 512)
+		{
+			for (i = 0; i < 512; i++)
+				sector[i] = pattern(addr + i, 0xA5);
+			now += T_HOST_SECTOR;
+			mem_poll();
+			while ((result = wcache_write(addr, sector)) == WCACHE_BUSY)
+			{
+				if (sim_idle())
+					goto err_stuck;
+			}
+			if (result)
+				goto err_write;
+		}
+		/* End of command (see default_lun_wr_complete) */
+		wcache_prepare(0, 0);
+		if (wcache_flush(WCACHE_FLUSH_FULL) < 0)
+			goto err_write;
+	}
+	/* Synchronize cache */
+	while ((result = wcache_flush(WCACHE_FLUSH_ALL)) == WCACHE_BUSY)
+	{
+		if (sim_idle())
+			goto err_stuck;
+	}
+	if (result)
+		goto err_write;
+	*dur = now - start;
+
+	for (addr = 0; addr < SIM_WR_SIZE; addr++)
+	{
+		volume_map(addr, &nid, &maddr);
+		if (flash[nid][maddr] != pattern(addr, 0xA5))
+		{
+			printf("    - Bad data at %x\n", addr);
+			return(-1);
+		}
+	}
+	return(0);
+
+err_stuck:
+	printf("    - Cache busy without flash activity at %x\n", addr);
+	return(-1);
+err_write:
+	printf("    - Write error at %x (%d)\n", addr, result);
+	return(-1);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                          Private  functions                          -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Move time to the end of the next flash job
+ *
+ * @return integer Zero on success, -1 if no job is running
+ */
+static int sim_idle(void)
+{
+	sim_time next = 0;
+	uint i;
+
+	for (i = 0; i < MEM_NODE_COUNT; i++)
+	{
+		if (jobs[i] && ((next == 0) || (job_end[i] < next)))
+			next = job_end[i];
+	}
+	if (next == 0)
+		return(-1);
+	if (next > now)
+		now = next;
+	mem_poll();
+	return(0);
+}
+
+static void sim_reset(void)
+{
+	uint i;
+
+	for (i = 0; i < MEM_NODE_COUNT; i++)
+	{
+		chips[i].size  = SIM_NODE_SZ / 1024;
+		nodes[i].type  = 1;
+		nodes[i].chip  = &chips[i];
+		jobs[i]        = 0;
+		rd_pending[i]  = 0;
+	}
+	now = 0;
+}
+
+/**
+ * @brief Write a known pattern at the beginning of the volume
+ *
+ * @param size Number of bytes to write
+ * @param seed Value used to make the pattern
+ */
+static void fill(u32 size, u8 seed)
+{
+	u32  addr, maddr;
+	uint nid;
+
+	for (addr = 0; addr < size; addr++)
+	{
+		volume_map(addr, &nid, &maddr);
+		flash[nid][maddr] = pattern(addr, seed);
+	}
+}
+
+static u8 pattern(u32 addr, u8 seed)
+{
+	return((u8)((addr >> 9) ^ addr ^ seed));
+}
+
+/* Nodes 0 and 1 are connected to SPI1, node 2 to SPI2 */
+static uint port(uint nid)
+{
+	return((nid < 2) ? 0 : 1);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                 Simulated memory (NOR flash on 2 SPI)                -- */
+/* -------------------------------------------------------------------------- */
+
+mem_node *mem_get_node(uint nid)
+{
+	if (nid >= MEM_NODE_COUNT)
+		return(0);
+	return(&nodes[nid]);
+}
+
+int mem_read_start(uint nid, u32 addr, uint len, u8 *buffer)
+{
+	uint i;
+
+	if ((nid >= MEM_NODE_COUNT) || ((addr + len) > SIM_NODE_SZ))
+		return(-1);
+	/* DMA of this port already used */
+	for (i = 0; i < MEM_NODE_COUNT; i++)
+	{
+		if (rd_pending[i] && (port(i) == port(nid)))
+			return(-2);
+	}
+	/* Wait end of a running erase/program */
+	while (jobs[nid])
+		sim_idle();
+
+	for (i = 0; i < len; i++)
+		buffer[i] = flash[nid][addr + i];
+	now += T_CMD;
+	if (len < MEM_DMA_THRESHOLD)
+	{
+		now += (sim_time)len * T_READ_BYTE;
+		return((int)len);
+	}
+	rd_pending[nid] = 1;
+	rd_end[nid] = now + ((sim_time)len * T_READ_BYTE);
+	return((int)len);
+}
+
+int mem_read_wait(uint nid)
+{
+	if ((nid >= MEM_NODE_COUNT) || (rd_pending[nid] == 0))
+		return(0);
+	if (rd_end[nid] > now)
+		now = rd_end[nid];
+	rd_pending[nid] = 0;
+	return(0);
+}
+
+int mem_read(uint nid, u32 addr, uint len, u8 *buffer)
+{
+	int result;
+	uint i;
+
+	for (i = 0; i < MEM_NODE_COUNT; i++)
+	{
+		if (port(i) == port(nid))
+			mem_read_wait(i);
+	}
+	result = mem_read_start(nid, addr, len, buffer);
+	mem_read_wait(nid);
+	return(result);
+}
+
+/* Each job is one sector rewrite : erase then program of 16 pages */
+int mem_submit(uint nid, mem_job *job)
+{
+	mem_job *last;
+
+	if ((nid >= MEM_NODE_COUNT) || ((job->addr + job->len) > SIM_NODE_SZ))
+		return(-1);
+	job->next   = 0;
+	job->result = 0;
+	if (jobs[nid] == 0)
+	{
+		jobs[nid] = job;
+		job->state = MEM_JOB_BUSY;
+		job_end[nid] = now + T_ERASE + (16 * T_PROGRAM);
+		return(0);
+	}
+	job->state = MEM_JOB_PENDING;
+	for (last = jobs[nid]; last->next; last = last->next)
+		;
+	last->next = job;
+	return(0);
+}
+
+/* Count the complete sectors declared free */
+int mem_trim(uint nid, u32 addr, uint len)
+{
+	if ((nid >= MEM_NODE_COUNT) || (addr & (MEM_SECTOR_SZ - 1)) || (len < MEM_SECTOR_SZ))
+		return(0);
+	trim_count[nid]++;
+	return(1);
+}
+
+int mem_busy(uint nid)
+{
+	return(jobs[nid] != 0);
+}
+
+void mem_poll(void)
+{
+	mem_job *job;
+	uint i, j;
+
+	for (i = 0; i < MEM_NODE_COUNT; i++)
+	{
+		while (jobs[i] && (job_end[i] <= now))
+		{
+			job = jobs[i];
+			for (j = 0; j < job->len; j++)
+				flash[i][job->addr + j] = job->buffer[j];
+			/* Next job starts when the previous one ends */
+			jobs[i] = job->next;
+			if (jobs[i])
+			{
+				jobs[i]->state = MEM_JOB_BUSY;
+				job_end[i] += T_ERASE + (16 * T_PROGRAM);
+			}
+			job->state = MEM_JOB_DONE;
+			if (job->complete)
+				job->complete(job);
+		}
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                 Dummy functions to avoid missing deps                -- */
+/* -------------------------------------------------------------------------- */
+
+void *memcpy(void *dst, const void *src, int n)
+{
+	u8 *d = (u8 *)dst;
+	const u8 *s = (const u8 *)src;
+	while (n-- > 0)
+		*d++ = *s++;
+	return(dst);
+}
+
+void *memset(void *dst, int value, int n)
+{
+	u8 *d = (u8 *)dst;
+	while (n-- > 0)
+		*d++ = (u8)value;
+	return(dst);
+}
+
+void memcpy_pma(u8 *dst, const u8 *src, unsigned int len)
+{
+	memcpy(dst, src, (int)len);
+}
+/* EOF */
@@ -0,0 +1,650 @@
+/**
+ * @file  tests/ut_wcache/main.c
+ * @brief Replay LBA write traces through the write cache (erases and time)
+ *
+ * Without argument, some traces are generated (FAT file copy, sequential and
+ * random writes) and the results are checked. Trace files can also be given
+ * on command line, one command per line :
+ *   W <lba> <count>  WRITE(10) of <count> sectors
+ *   S                SYNCHRONIZE CACHE
+ *   I                Host idle (cache flushed by timeout)
+ *   # ...            Comment
+ *
+ * Each trace is replayed with the previous single line policy (flush when a
+ * write leave the line and at end of each command) and with the write-back
+ * cache, and the number of flash erases and the simulated time are reported.
+ * Some tests also verify (with counters) that lines fully covered by a write
+ * are not loaded from flash.
+ *
+ * @author Saint-Genest Gwenael <gwen@cowlab.fr>
+ * @copyright Agilack (c) 2023
+ *
+ * @page License
+ * Cowstick-UMS firmware is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3 as published by the Free Software Foundation. You should have
+ * received a copy of the GNU Lesser General Public License along with this
+ * program, see LICENSE.md file for more details.
+ * This program is distributed WITHOUT ANY WARRANTY.
+ */
+#include <stdio.h>
+#include "types.h"
+#include "mem.h"
+#include "wcache.h"
+
+#define SIM_SIZE    (8 * 1024 * 1024)
+#define SIM_SECTORS (SIM_SIZE / 4096)
+#define MAX_OPS     8192
+
+/* Flash timings (typical values of MX25L51245G, SPI at 32MHz) */
+#define T_READ_BYTE   250      /* Read one byte           */
+#define T_ERASE       45000000 /* Erase one 4k sector     */
+#define T_PROGRAM     750000   /* Program one 256B page   */
+/* Time to receive one sector from host (Full-Speed bulk) */
+#define T_HOST_SECTOR 450000
+
+typedef struct trace_op_s
+{
+	char type;
+	u32  lba;
+	u32  count;
+} trace_op;
+
+typedef struct sim_report_s
+{
+	unsigned long erases;
+	unsigned long erase_max; /* Max erases of one flash sector */
+	unsigned long programs;
+	unsigned long rd_bytes;
+	unsigned long sectors;   /* Sectors written by host        */
+	unsigned long long ns;
+} sim_report;
+
+static u8  flash[SIM_SIZE];
+static u8  image[SIM_SIZE];
+static u16 erase_count[SIM_SECTORS];
+static u8  sector[512] __attribute__((aligned(4)));
+static trace_op ops[MAX_OPS];
+static uint ops_count;
+static sim_report rep;
+static u32 seed;
+
+static int  replay(uint ways, int legacy, sim_report *report);
+static void sim_reset(void);
+static int  t_full_line(void);
+static int  t_partial_line(void);
+static int  t_interrupted(void);
+static int  t_discard(void);
+static int  write_cmd(u32 lba, u32 count, uint seq);
+static int  verify(void);
+static int  run_trace(const char *name, int check);
+static int  load(const char *filename);
+static void gen_fat_copy(void);
+static void gen_sequential(void);
+static void gen_random(void);
+static void op_add(char type, u32 lba, u32 count);
+static u32  rnd(void);
+
+/**
+ * @brief Entry point of the program
+ *
+ * @param argc Number of arguments
+ * @param argv Array of arguments (trace files)
+ * @return integer Execution result returned to OS :p
+ */
+int main(int argc, char **argv)
+{
+	int i;
+
+	printf("--=={ Write cache trace replay }==--\n");
+
+	/* Replay trace files given on command line */
+	if (argc > 1)
+	{
+		for (i = 1; i < argc; i++)
+		{
+			if (load(argv[i]))
+				return(-1);
+			if (run_trace(argv[i], 0))
+				return(-1);
+		}
+		return(0);
+	}
+
+	if (t_full_line())
+		return(-1);
+	if (t_partial_line())
+		return(-1);
+	if (t_discard())
+		return(-1);
+	if (t_interrupted())
+		return(-1);
+
+	gen_fat_copy();
+	if (run_trace("FAT copy (24 files of 24k)", 1))
+		return(-1);
+	gen_sequential();
+	if (run_trace("Sequential write (1MB)", 0))
+		return(-1);
+	gen_random();
+	if (run_trace("Random writes (4k and 512B)", 0))
+		return(-1);
+	return(0);
+}
+
+/**
+ * @brief Replay the current trace with both policies and report results
+ *
+ * @param name  Name of the trace
+ * @param check When set, the write cache must reduce erases of hot sectors
+ * @return integer Zero on success, other values are errors
+ */
+static int run_trace(const char *name, int check)
+{
+	sim_report ref, wc;
+
+	printf(" * Test trace \"%s\" (%d commands)\n", name, ops_count);
+
+	if (replay(1, 1, &ref))
+		return(-1);
+	if (replay(WCACHE_WAYS, 0, &wc))
+		return(-1);
+
+	printf("    - Single line : %5lu erases (max %lu per sector), %5lu kB read, %.1f ms, %.1f kB/s\n",
+	       ref.erases, ref.erase_max, ref.rd_bytes / 1024, (double)ref.ns / 1000000.0,
+	       (double)ref.sectors * 512.0 / ((double)ref.ns / 1000000.0));
+	printf("    - %d ways cache: %5lu erases (max %lu per sector), %5lu kB read, %.1f ms, %.1f kB/s\n",
+	       WCACHE_WAYS, wc.erases, wc.erase_max, wc.rd_bytes / 1024, (double)wc.ns / 1000000.0,
+	       (double)wc.sectors * 512.0 / ((double)wc.ns / 1000000.0));
+
+	/* Cache must never add erases */
+	if (wc.erases > ref.erases)
+	{
+		printf("    - Write cache increase the number of erases\n");
+		return(-1);
+	}
+	/* Metadata sectors (FAT, directories) must be merged into cache */
+	if (check && ((wc.erases >= ref.erases) ||
+	              ((wc.erase_max * 4) > ref.erase_max)))
+	{
+		printf("    - Write cache does not reduce erases enough\n");
+		return(-1);
+	}
+	return(0);
+}
+
+/**
+ * @brief Replay the current trace
+ *
+ * @param ways   Number of cache lines to use
+ * @param legacy Flush the whole cache at the end of each command
+ * @param report Pointer to a structure to store results
+ * @return integer Zero on success, other values are errors
+ */
+static int replay(uint ways, int legacy, sim_report *report)
+{
+	u8  rd[512];
+	uint i, k;
+	u32 addr;
+	int n;
+
+	sim_reset();
+	wcache_init(0, ways);
+
+	for (i = 0; i < ops_count; i++)
+	{
+		if (ops[i].type == 'W')
+		{
+			/* Previous firmware did not know the transaction length */
+			if (legacy == 0)
+				wcache_prepare(ops[i].lba * 512, ops[i].count * 512);
+			if (write_cmd(ops[i].lba, ops[i].count, i))
+				return(-1);
+			/* End of command (see default_lun_wr_complete) */
+			wcache_prepare(0, 0);
+			wcache_flush(legacy ? WCACHE_FLUSH_ALL : WCACHE_FLUSH_FULL);
+
+			/* Host read back the first sector (cache or flash) */
+			addr = ops[i].lba * 512;
+			n = wcache_read(addr, 512, rd);
+			if (n < 512)
+				mem_read(0, addr + (u32)n, 512 - (uint)n, rd + n);
+			for (k = 0; k < 512; k++)
+			{
+				if (rd[k] != image[addr + k])
+				{
+					printf("    - Read back error at %08x\n", addr + k);
+					return(-1);
+				}
+			}
+		}
+		else
+			wcache_flush(WCACHE_FLUSH_ALL);
+	}
+	/* End of trace, idle timeout */
+	wcache_flush(WCACHE_FLUSH_ALL);
+
+	if (verify())
+		return(-1);
+	rep.erase_max = 0;
+	for (i = 0; i < SIM_SECTORS; i++)
+	{
+		if (erase_count[i] > rep.erase_max)
+			rep.erase_max = erase_count[i];
+	}
+	*report = rep;
+	return(0);
+}
+
+/**
+ * @brief Test that lines fully covered by a write are not loaded
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_full_line(void)
+{
+	wcache_stats *st = wcache_get_stats();
+
+	printf(" * Test aligned write of 8 full lines\n");
+
+	sim_reset();
+	wcache_init(0, WCACHE_WAYS);
+	wcache_prepare(1024 * 512, 64 * 512);
+	if (write_cmd(1024, 64, 1))
+		return(-1);
+	wcache_prepare(0, 0);
+	wcache_flush(WCACHE_FLUSH_FULL);
+
+	printf("    - %d lines loaded, %d not loaded, %lu bytes read from flash\n",
+	       st->fills, st->fill_skip, rep.rd_bytes);
+	if ((st->fills != 0) || (st->fill_skip != 8) || (rep.rd_bytes != 0) ||
+	    (rep.erases != 8))
+		return(-1);
+	return(verify());
+}
+
+/**
+ * @brief Test that lines partially covered by a write are loaded
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_partial_line(void)
+{
+	wcache_stats *st = wcache_get_stats();
+
+	printf(" * Test unaligned write (first and last lines partial)\n");
+
+	sim_reset();
+	/* Flash already contains data */
+	wcache_init(0, WCACHE_WAYS);
+	if (write_cmd(2048, 32, 1))
+		return(-1);
+	wcache_flush(WCACHE_FLUSH_ALL);
+	wcache_init(0, WCACHE_WAYS);
+	rep.rd_bytes = 0;
+	wcache_prepare(2051 * 512, 24 * 512);
+	if (write_cmd(2051, 24, 2))
+		return(-1);
+	wcache_prepare(0, 0);
+	wcache_flush(WCACHE_FLUSH_ALL);
+
+	printf("    - %d lines loaded, %d not loaded, %lu bytes read from flash\n",
+	       st->fills, st->fill_skip, rep.rd_bytes);
+	if ((st->fills != 2) || (st->fill_skip != 2))
+		return(-1);
+	return(verify());
+}
+
+/**
+ * @brief Test a transaction interrupted before the end of a line
+ *
+ * The line is not loaded, when it is flushed the sectors not written must be
+ * read from flash to keep their content.
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_interrupted(void)
+{
+	wcache_stats *st = wcache_get_stats();
+	u8  rd[4096];
+	int n;
+
+	printf(" * Test write interrupted inside a line\n");
+
+	sim_reset();
+	/* Flash already contains data */
+	wcache_init(0, WCACHE_WAYS);
+	if (write_cmd(4096, 16, 1))
+		return(-1);
+	wcache_flush(WCACHE_FLUSH_ALL);
+	wcache_init(0, WCACHE_WAYS);
+	rep.rd_bytes = 0;
+	/* Host announce 16 sectors but only 3 are received */
+	wcache_prepare(4096 * 512, 16 * 512);
+	if (write_cmd(4096, 3, 2))
+		return(-1);
+	wcache_prepare(0, 0);
+
+	/* Sector not written must be read from flash */
+	n = wcache_read(4099 * 512, 512, rd);
+	if (n != 0)
+	{
+		printf("    - Sector not written read from cache\n");
+		return(-1);
+	}
+	n = wcache_read(4096 * 512, 4096, rd);
+	if (n != (3 * 512))
+	{
+		printf("    - Read %d bytes from cache, %d expected\n", n, 3 * 512);
+		return(-1);
+	}
+
+	wcache_flush(WCACHE_FLUSH_ALL);
+	printf("    - %d lines not loaded, %d sectors read before flush\n",
+	       st->fill_skip, st->late_rd);
+	if ((st->fill_skip != 1) || (st->late_rd != 5))
+		return(-1);
+	return(verify());
+}
+
+/**
+ * @brief Test that lines of a discarded area (UNMAP) are not written
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int t_discard(void)
+{
+	uint i;
+	int  n;
+
+	printf(" * Test discard of cached lines\n");
+
+	sim_reset();
+	wcache_init(0, WCACHE_WAYS);
+	/* Two partial lines, only the first one is fully covered by discard */
+	if (write_cmd(8, 5, 1) || write_cmd(16, 4, 1))
+		return(-1);
+	n = wcache_discard(8 * 512, 8 * 512);
+	for (i = (8 * 512); i < (16 * 512); i++)
+		image[i] = 0xFF;
+	wcache_flush(WCACHE_FLUSH_ALL);
+	printf("    - %d line dropped, %d erase\n", n, rep.erases);
+	if ((n != 1) || (rep.erases != 1))
+		return(-1);
+	if (wcache_read(8 * 512, 512, sector) != 0)
+	{
+		printf("    - Discarded sector still into cache\n");
+		return(-1);
+	}
+	return(verify());
+}
+
+/**
+ * @brief Write sectors into cache, as the default LUN for a WRITE command
+ *
+ * @param lba   Address of the first sector
+ * @param count Number of sectors
+ * @param seq   Sequence number of the command (used for data pattern)
+ * @return integer Zero on success, other values are errors
+ */
+static int write_cmd(u32 lba, u32 count, uint seq)
+{
+	u32 addr;
+	uint j, k;
+
+	for (j = 0; j < count; j++)
+	{
+		addr = (lba + j) * 512;
+		for (k = 0; k < 512; k++)
+		{
+			sector[k] = (u8)(seq + (addr >> 9) * 7 + k);
+			image[addr + k] = sector[k];
+		}
+		rep.ns += T_HOST_SECTOR;
+		if (wcache_write(addr, sector))
+		{
+			printf("    - Write error at %08x\n", addr);
+			return(-1);
+		}
+		rep.sectors++;
+	}
+	return(0);
+}
+
+/**
+ * @brief Verify that flash content is the image written by host
+ *
+ * @return integer Zero on success, other values are errors
+ */
+static int verify(void)
+{
+	uint i;
+
+	for (i = 0; i < SIM_SIZE; i++)
+	{
+		if (flash[i] != image[i])
+		{
+			printf("    - Flash content error at %08x\n", i);
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+/**
+ * @brief Reset simulated flash, host image and counters
+ *
+ */
+static void sim_reset(void)
+{
+	uint i;
+
+	for (i = 0; i < SIM_SIZE; i++)
+	{
+		flash[i] = 0xFF;
+		image[i] = 0xFF;
+	}
+	for (i = 0; i < SIM_SECTORS; i++)
+		erase_count[i] = 0;
+	rep.erases   = 0;
+	rep.programs = 0;
+	rep.rd_bytes = 0;
+	rep.sectors  = 0;
+	rep.ns       = 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                            Trace sources                             -- */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * @brief Load a trace file
+ *
+ * @param filename Name of the file to load
+ * @return integer Zero on success, other values are errors
+ */
+static int load(const char *filename)
+{
+	char line[128];
+	unsigned long lba, count;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (f == 0)
+	{
+		printf(" * Failed to open %s\n", filename);
+		return(-1);
+	}
+	ops_count = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		if ((line[0] == 'W') &&
+		    (sscanf(line + 1, "%lu %lu", &lba, &count) == 2))
+		{
+			if ((lba + count) > (SIM_SIZE / 512))
+			{
+				printf(" * %s: write out of simulated flash\n", filename);
+				fclose(f);
+				return(-1);
+			}
+			op_add('W', (u32)lba, (u32)count);
+		}
+		else if ((line[0] == 'S') || (line[0] == 'I'))
+			op_add(line[0], 0, 0);
+	}
+	fclose(f);
+	return(0);
+}
+
+/**
+ * @brief Generate a trace of files copied on a FAT16 volume
+ *
+ * For each file the host update the directory entry, write data clusters
+ * (up to 32 sectors per command), then update both FAT copies and the
+ * directory entry again.
+ */
+static void gen_fat_copy(void)
+{
+	const u32 fat1 = 1, fat2 = 65, root = 129, data = 161;
+	u32 cluster = 0;
+	uint f, s;
+
+	ops_count = 0;
+	for (f = 0; f < 24; f++)
+	{
+		op_add('W', root + (f / 16), 1);
+		for (s = 0; s < 48; s += 32)
+			op_add('W', data + cluster * 4 + s, (48 - s) > 32 ? 32 : (48 - s));
+		op_add('W', fat1 + (cluster / 256), 1);
+		op_add('W', fat2 + (cluster / 256), 1);
+		op_add('W', root + (f / 16), 1);
+		cluster += 12;
+	}
+	op_add('S', 0, 0);
+}
+
+/**
+ * @brief Generate a sequential write of 1MB (128 sectors per command)
+ *
+ */
+static void gen_sequential(void)
+{
+	uint i;
+
+	ops_count = 0;
+	for (i = 0; i < 16; i++)
+		op_add('W', 4096 + i * 128, 128);
+}
+
+/**
+ * @brief Generate random writes (4k and 512 bytes) into a small area
+ *
+ */
+static void gen_random(void)
+{
+	uint i;
+
+	seed = 1;
+	ops_count = 0;
+	for (i = 0; i < 512; i++)
+	{
+		if (rnd() & 1)
+			op_add('W', (rnd() % 16) * 8, 8);
+		else
+			op_add('W', rnd() % 128, 1);
+		if ((i % 64) == 63)
+			op_add('I', 0, 0);
+	}
+}
+
+static void op_add(char type, u32 lba, u32 count)
+{
+	if (ops_count >= MAX_OPS)
+		return;
+	ops[ops_count].type  = type;
+	ops[ops_count].lba   = lba;
+	ops[ops_count].count = count;
+	ops_count++;
+}
+
+static u32 rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return((seed >> 16) & 0x7FFF);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                     Simulated memory (NOR flash)                     -- */
+/* -------------------------------------------------------------------------- */
+
+int mem_read(uint nid, u32 addr, uint len, u8 *buffer)
+{
+	uint i;
+
+	(void)nid;
+	for (i = 0; i < len; i++)
+		buffer[i] = flash[addr + i];
+	rep.rd_bytes += len;
+	rep.ns += (unsigned long long)len * T_READ_BYTE;
+	return((int)len);
+}
+
+int mem_write(uint nid, u32 addr, uint len, u8 *buffer)
+{
+	uint i;
+
+	(void)nid;
+	/* An aligned write erase the sector first (worst case of mem.c) */
+	if ((addr & 0xFFF) == 0)
+	{
+		for (i = 0; i < 4096; i++)
+			flash[addr + i] = 0xFF;
+		erase_count[addr / 4096]++;
+		rep.erases++;
+		rep.ns += T_ERASE;
+	}
+	/* Program can only clear bits */
+	for (i = 0; i < len; i++)
+		flash[addr + i] &= buffer[i];
+	rep.programs += (len + 255) / 256;
+	rep.ns += (unsigned long long)((len + 255) / 256) * T_PROGRAM;
+	return((int)len);
+}
+
+/* Jobs are processed immediately : erase/program time is not overlapped */
+int mem_submit(uint nid, mem_job *job)
+{
+	mem_write(nid, job->addr, job->len, job->buffer);
+	job->result = 0;
+	job->state  = MEM_JOB_DONE;
+	if (job->complete)
+		job->complete(job);
+	return(0);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --                 Dummy functions to avoid missing deps                -- */
+/* -------------------------------------------------------------------------- */
+
+void *memcpy(void *dst, const void *src, int n)
+{
+	u8 *d = (u8 *)dst;
+	const u8 *s = (const u8 *)src;
+	while (n-- > 0)
+		*d++ = *s++;
+	return(dst);
+}
+
+void *memset(void *dst, int value, int n)
+{
+	u8 *d = (u8 *)dst;
+	while (n-- > 0)
+		*d++ = (u8)value;
+	return(dst);
+}
+
+void memcpy_pma(u8 *dst, const u8 *src, unsigned int len)
+{
+	memcpy(dst, src, (int)len);
+}
+/* EOF */